@@ -0,0 +1,1244 @@
+/*
+ * Blob detection benchmarks
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "binlog.h"
+#include "blobwatch.h"
+#include "clock.h"
+#include "flicker.h"
+#include "leds.h"
+#include "rle.h"
+#include "sensors.h"
+#include "synth.h"
+
+#define MAX_THREAD_COUNTS	8
+#define MAX_BLOB_COUNTS		16
+#define MAX_SENSOR_COUNTS	8
+
+#define max(x, y) ((x) > (y) ? (x) : (y))
+
+/* Synthetic frames are stamped as if captured at 60 Hz */
+#define BENCH_FRAME_NS		(1000000000ULL / 60)
+
+/* Blob counts of the association benchmark */
+static const int assoc_blob_counts[] = {
+	10, 20, 50, 100, 200, 500, 1000, 2000,
+};
+
+struct bench_options {
+	struct synth_options synth;
+	int num_frames;
+	int num_warmup;
+	int max_blobs;
+	int roi_interval;
+	int threshold;
+	int hysteresis;
+	bool adaptive;
+	/* number of blinking LEDs to identify, 0 to disable */
+	int flicker;
+	/* every drop_interval-th frame is rendered but not processed */
+	int drop_interval;
+	/* detect on runs, and time the other consumers of runs and pixels */
+	bool rle;
+	int threads[MAX_THREAD_COUNTS];
+	int num_thread_counts;
+	/* online CPUs, thread counts above it cannot show scaling */
+	int num_cpus;
+	int blobs[MAX_BLOB_COUNTS];
+	int num_blob_counts;
+	/* sensor counts of the multi-sensor benchmark, 0 to disable */
+	int sensors[MAX_SENSOR_COUNTS];
+	int num_sensor_counts;
+	/* BLOBWATCH_SCANNER_AUTO runs all supported variants */
+	enum blobwatch_scanner scanner;
+	bool all_scanners;
+	enum blobwatch_labeling labeling;
+	bool all_labelings;
+	enum blobwatch_predictor predictor;
+	/* accumulate moments, -1 runs with and without */
+	int moments;
+	/* report the blobs of every frame, with printf or to a binary log */
+	bool printf_report;
+	const char *log_path;
+	bool json;
+};
+
+/* blob checksum and throughput of one benchmark run */
+struct bench_result {
+	uint64_t checksum;
+	double fps;
+};
+
+struct bench_stats {
+	double mean;
+	double p50;
+	double p99;
+	double max;
+};
+
+static const char *scanner_names[] = {
+	[BLOBWATCH_SCANNER_AUTO] = "auto",
+	[BLOBWATCH_SCANNER_SCALAR] = "scalar",
+	[BLOBWATCH_SCANNER_SSE2] = "sse2",
+	[BLOBWATCH_SCANNER_AVX2] = "avx2",
+};
+
+static const char *labeling_names[] = {
+	[BLOBWATCH_LABELING_UNION_FIND] = "union-find",
+	[BLOBWATCH_LABELING_OVERLAP] = "overlap",
+};
+
+static const char *predictor_names[] = {
+	[BLOBWATCH_PREDICTOR_KALMAN] = "kalman",
+	[BLOBWATCH_PREDICTOR_DIFFERENCE] = "difference",
+};
+
+/*
+ * Sorts the samples in place and computes mean, median, 99th percentile and
+ * maximum, in microseconds.
+ */
+static void bench_stats(uint64_t *samples, int n, struct bench_stats *st)
+{
+	double sum = 0;
+	int i;
+
+	memset(st, 0, sizeof(*st));
+	if (n == 0)
+		return;
+
+	clock_sort_ns(samples, n);
+	for (i = 0; i < n; i++)
+		sum += samples[i];
+
+	st->mean = sum / n * 1e-3;
+	st->p50 = clock_percentile_ns(samples, n, 500) * 1e-3;
+	st->p99 = clock_percentile_ns(samples, n, 990) * 1e-3;
+	st->max = samples[n - 1] * 1e-3;
+}
+
+/*
+ * FNV-1a hash over the geometry of all observed blobs, to check that
+ * different configurations produce the same output.
+ */
+static uint64_t bench_hash(uint64_t h, const struct blobservation *ob)
+{
+	int i;
+
+	for (i = 0; i < ob->num_blobs; i++) {
+		const struct blob *b = &ob->blobs[i];
+		uint32_t v[] = { b->x, b->y, b->width, b->height, b->area };
+		const uint8_t *p = (const uint8_t *)v;
+		size_t j;
+
+		for (j = 0; j < sizeof(v); j++)
+			h = (h ^ p[j]) * 0x100000001b3ULL;
+	}
+
+	return h;
+}
+
+/*
+ * Prints the blobs of a frame the way the live view does without a log.
+ */
+static void report_printf(const struct blobservation *ob)
+{
+	int i;
+
+	if (ob->num_blobs == 0)
+		return;
+
+	printf("Blobs: %d\n", ob->num_blobs);
+	for (i = 0; i < ob->num_blobs; i++)
+		printf("Blob[%d]: %d,%d\n", i, ob->blobs[i].x, ob->blobs[i].y);
+}
+
+static void print_stats_json(const char *name, const struct bench_stats *st)
+{
+	printf("\"%s\":{\"mean_us\":%.2f,\"p50_us\":%.2f,\"p99_us\":%.2f,"
+	       "\"max_us\":%.2f}", name, st->mean, st->p50, st->p99, st->max);
+}
+
+static void print_stats(const char *name, const struct bench_stats *st)
+{
+	printf("  %-8s mean %8.1f  p50 %8.1f  p99 %8.1f  max %8.1f us\n",
+	       name, st->mean, st->p50, st->p99, st->max);
+}
+
+/*
+ * Identification results of the blink pattern decoder, checked against the
+ * LEDs the synthetic blobs blink like.
+ */
+struct bench_flicker {
+	uint64_t tracked;
+	uint64_t identified;
+	uint64_t wrong;
+};
+
+static void bench_flicker_account(struct bench_flicker *bf, struct synth *s,
+				  const struct leds *leds,
+				  const struct blobservation *ob)
+{
+	int i;
+
+	for (i = 0; i < ob->num_blobs; i++) {
+		const struct blob *b = &ob->blobs[i];
+		int nearest;
+
+		if (b->track_index < 0)
+			continue;
+		bf->tracked++;
+		if (b->led_id < 0)
+			continue;
+		bf->identified++;
+
+		nearest = synth_nearest_blob(s, b->cx, b->cy);
+		if (nearest < 0 || nearest % leds->num != b->led_id)
+			bf->wrong++;
+	}
+}
+
+static void bench_flicker_print(struct blobwatch *bw,
+				const struct bench_flicker *bf)
+{
+	struct flicker_stats st;
+
+	blobwatch_get_flicker_stats(bw, &st);
+	printf("  flicker: %.1f%% of tracked blobs identified, %llu wrong, "
+	       "%llu locks after %.1f frames, %llu lost\n",
+	       bf->tracked ? 100.0 * bf->identified / bf->tracked : 0.0,
+	       (unsigned long long)bf->wrong, (unsigned long long)st.locks,
+	       st.locks ? (double)st.lock_frames / st.locks : 0.0,
+	       (unsigned long long)st.unlocks);
+}
+
+/*
+ * Time per frame spent by the consumers of a frame besides the detector, on
+ * the raw pixels and on the encoded runs: copying the frame for the display,
+ * updating the display's canvas, and packing the frame for recording.
+ */
+struct bench_rle {
+	struct rle_frame *copy;
+	struct rle_frame *drawn;
+	uint8_t *raw;
+	uint8_t *canvas;
+	uint8_t *pack;
+	size_t pack_size;
+	uint64_t frames;
+	uint64_t complete;
+	uint64_t runs;
+	uint64_t footprint;
+	uint64_t packed;
+	uint64_t raw_ns[3];
+	uint64_t rle_ns[3];
+};
+
+enum {
+	BENCH_RLE_COPY,
+	BENCH_RLE_DRAW,
+	BENCH_RLE_PACK,
+};
+
+static const char *bench_rle_names[] = {
+	[BENCH_RLE_COPY] = "copy",
+	[BENCH_RLE_DRAW] = "draw",
+	[BENCH_RLE_PACK] = "record",
+};
+
+static int bench_rle_init(struct bench_rle *br, int width, int height)
+{
+	size_t size = (size_t)width * height;
+
+	memset(br, 0, sizeof(*br));
+	br->copy = rle_frame_new(width, height, 0, 0);
+	br->drawn = rle_frame_new(width, height, 0, 0);
+	br->raw = calloc(1, size);
+	br->canvas = calloc(1, size);
+	if (!br->copy || !br->drawn || !br->raw || !br->canvas)
+		return -ENOMEM;
+	br->pack_size = rle_pack_max(br->copy);
+	br->pack = malloc(br->pack_size > size ? br->pack_size : size);
+
+	return br->pack ? 0 : -ENOMEM;
+}
+
+static void bench_rle_free(struct bench_rle *br)
+{
+	free(br->pack);
+	free(br->canvas);
+	free(br->raw);
+	rle_frame_free(br->drawn);
+	rle_frame_free(br->copy);
+}
+
+/*
+ * Runs the consumers on frame and on its runs rf, if it was encoded
+ * completely. The display canvas only has the runs of the last frame cleared
+ * before drawing the new ones.
+ */
+static void bench_rle_account(struct bench_rle *br, const uint8_t *frame,
+			      const struct rle_frame *rf, int width,
+			      int height)
+{
+	size_t size = (size_t)width * height;
+	uint64_t t[4];
+
+	br->frames++;
+
+	t[0] = clock_now_ns();
+	memcpy(br->raw, frame, size);
+	t[1] = clock_now_ns();
+	memcpy(br->canvas, br->raw, size);
+	t[2] = clock_now_ns();
+	memcpy(br->pack, frame, size);
+	t[3] = clock_now_ns();
+	br->raw_ns[BENCH_RLE_COPY] += t[1] - t[0];
+	br->raw_ns[BENCH_RLE_DRAW] += t[2] - t[1];
+	br->raw_ns[BENCH_RLE_PACK] += t[3] - t[2];
+
+	/* Back to the runs drawn last on the canvas */
+	rle_decode(br->drawn, br->canvas);
+	if (!rf)
+		return;
+
+	t[0] = clock_now_ns();
+	rle_copy(br->copy, rf);
+	t[1] = clock_now_ns();
+	rle_clear(br->drawn, br->canvas);
+	rle_draw(br->copy, br->canvas);
+	t[2] = clock_now_ns();
+	br->packed += rle_pack(br->copy, br->pack, br->pack_size);
+	t[3] = clock_now_ns();
+	br->rle_ns[BENCH_RLE_COPY] += t[1] - t[0];
+	br->rle_ns[BENCH_RLE_DRAW] += t[2] - t[1];
+	br->rle_ns[BENCH_RLE_PACK] += t[3] - t[2];
+
+	rle_copy(br->drawn, br->copy);
+	br->complete++;
+	br->runs += rf->num_runs;
+	br->footprint += rle_footprint(rf);
+}
+
+static void bench_rle_print(const struct bench_rle *br, int width, int height,
+			    bool json)
+{
+	double n = br->complete ? br->complete : 1;
+	int i;
+
+	if (json) {
+		printf(",\"rle_complete_frames\":%llu,\"rle_runs\":%.1f,"
+		       "\"rle_bytes\":%.0f,\"rle_packed_bytes\":%.0f",
+		       (unsigned long long)br->complete, br->runs / n,
+		       br->footprint / n, br->packed / n);
+		for (i = 0; i < 3; i++)
+			printf(",\"%s_raw_us\":%.2f,\"%s_rle_us\":%.2f",
+			       bench_rle_names[i], br->raw_ns[i] * 1e-3 /
+			       (br->frames ? br->frames : 1),
+			       bench_rle_names[i], br->rle_ns[i] * 1e-3 / n);
+		return;
+	}
+
+	printf("  runs: %llu of %llu frames encoded, %.1f runs, %.1f KB "
+	       "(%.2f%% of %.1f KB), %.1f KB packed per frame\n",
+	       (unsigned long long)br->complete,
+	       (unsigned long long)br->frames, br->runs / n,
+	       br->footprint / n / 1024,
+	       100.0 * br->footprint / n / ((double)width * height),
+	       (double)width * height / 1024, br->packed / n / 1024);
+	for (i = 0; i < 3; i++)
+		printf("  %-8s raw %8.1f us  runs %8.1f us\n",
+		       bench_rle_names[i], br->raw_ns[i] * 1e-3 /
+		       (br->frames ? br->frames : 1),
+		       br->rle_ns[i] * 1e-3 / n);
+}
+
+/*
+ * Benchmarks one configuration and stores the checksum of its blobs and its
+ * throughput.
+ *
+ * Returns 0 on success or a negative error code.
+ */
+static int bench_run(const struct bench_options *opts,
+		     enum blobwatch_scanner scanner, int num_threads,
+		     bool moments, struct bench_result *res)
+{
+	struct synth_options so_leds = opts->synth;
+	const struct synth_options *so = &so_leds;
+	struct bench_stats detect, track, total, report;
+	struct bench_flicker bf = { 0 };
+	struct bench_rle br = { 0 };
+	struct leds *leds = NULL;
+	uint64_t *t_detect, *t_track, *t_total, *t_report;
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	uint64_t sum_total = 0, num_blobs = 0, dropped_blobs = 0;
+	uint64_t dropped_labels = 0;
+	uint64_t scanned_pixels = 0, lost_tracks = 0;
+	/* blobs with a track, continued blobs and their prediction errors */
+	uint64_t tracked = 0, continued = 0;
+	double prediction_error = 0;
+	float max_error = 0;
+	/* frames with more or fewer blobs than connected shapes */
+	uint64_t wrong_count = 0;
+	int components;
+	double scanned;
+	struct blobwatch *bw = NULL;
+	struct synth *s = NULL;
+	uint8_t *frame = NULL;
+	double fps, mbps;
+	int ret = -ENOMEM;
+	int i, j, n = 0, skipped = 0;
+
+	if (opts->flicker) {
+		leds = leds_new(opts->flicker, LEDS_PATTERN_BITS);
+		if (!leds) {
+			fprintf(stderr, "no %d blink patterns of %d bits\n",
+				opts->flicker, LEDS_PATTERN_BITS);
+			return -EINVAL;
+		}
+		so_leds.leds = leds;
+	}
+
+	t_detect = calloc(opts->num_frames, sizeof(uint64_t));
+	t_track = calloc(opts->num_frames, sizeof(uint64_t));
+	t_total = calloc(opts->num_frames, sizeof(uint64_t));
+	t_report = calloc(opts->num_frames, sizeof(uint64_t));
+	frame = malloc(so->width * so->height);
+	s = synth_new(so);
+	bw = blobwatch_new(so->width, so->height, opts->max_blobs);
+	if (!t_detect || !t_track || !t_total || !t_report || !frame || !s ||
+	    !bw)
+		goto out;
+
+	ret = blobwatch_set_scanner(bw, scanner);
+	if (ret < 0)
+		goto out;
+	ret = blobwatch_set_labeling(bw, opts->labeling);
+	if (ret < 0)
+		goto out;
+	ret = blobwatch_set_predictor(bw, opts->predictor);
+	if (ret < 0)
+		goto out;
+	ret = blobwatch_set_threads(bw, num_threads);
+	if (ret < 0)
+		goto out;
+	ret = blobwatch_set_roi(bw, opts->roi_interval);
+	if (ret < 0)
+		goto out;
+	blobwatch_set_moments(bw, moments);
+	ret = blobwatch_set_threshold(bw, opts->threshold);
+	if (ret < 0)
+		goto out;
+	ret = blobwatch_set_hysteresis(bw, opts->hysteresis);
+	if (ret < 0)
+		goto out;
+	blobwatch_set_adaptive(bw, opts->adaptive);
+	ret = blobwatch_set_flicker(bw, leds != NULL);
+	if (ret < 0)
+		goto out;
+	components = synth_components(s);
+	if (opts->rle) {
+		ret = blobwatch_set_rle(bw, true);
+		if (ret == 0)
+			ret = bench_rle_init(&br, so->width, so->height);
+		if (ret < 0)
+			goto out;
+	}
+
+	for (i = 0; i < opts->num_warmup + opts->num_frames; i++) {
+		struct blobwatch_timings t;
+		struct blobservation *ob;
+
+		synth_render(s, frame);
+		if (opts->drop_interval && i % opts->drop_interval ==
+		    opts->drop_interval - 1) {
+			skipped++;
+			continue;
+		}
+		blobwatch_process(bw, frame, so->width, so->height, skipped,
+				  (i + 1) * BENCH_FRAME_NS, leds, &ob);
+		skipped = 0;
+		if (ob && leds)
+			bench_flicker_account(&bf, s, leds, ob);
+		if (i < opts->num_warmup)
+			continue;
+
+		if (opts->rle)
+			bench_rle_account(&br, frame, blobwatch_get_rle(bw),
+					  so->width, so->height);
+
+		blobwatch_get_timings(bw, &t);
+		t_detect[n] = t.detected - t.start;
+		t_track[n] = t.tracked - t.detected;
+		t_total[n] = t.tracked - t.start;
+		sum_total += t_total[n];
+		n++;
+
+		if (ob && (opts->printf_report || opts->log_path)) {
+			uint64_t start = clock_now_ns();
+
+			if (opts->log_path)
+				binlog_observation(i, ob);
+			else
+				report_printf(ob);
+			t_report[n - 1] = clock_now_ns() - start;
+		}
+
+		if (ob) {
+			num_blobs += ob->num_blobs;
+			dropped_blobs += ob->dropped_blobs;
+			dropped_labels += ob->dropped_labels;
+			scanned_pixels += ob->scanned_pixels;
+			lost_tracks += ob->lost_tracks;
+			prediction_error += ob->prediction_error;
+			if (ob->max_prediction_error > max_error)
+				max_error = ob->max_prediction_error;
+			for (j = 0; j < ob->num_blobs; j++) {
+				tracked += ob->blobs[j].track_index >= 0;
+				continued += ob->blobs[j].age > 0;
+			}
+			hash = bench_hash(hash, ob);
+			if (components >= 0 && ob->num_blobs != components)
+				wrong_count++;
+		}
+	}
+
+	bench_stats(t_detect, n, &detect);
+	bench_stats(t_track, n, &track);
+	bench_stats(t_total, n, &total);
+	bench_stats(t_report, n, &report);
+	fps = sum_total ? n * 1e9 / sum_total : 0;
+	mbps = fps * so->width * so->height * 1e-6;
+	scanned = n ? 100.0 * scanned_pixels / ((double)n * so->width *
+						so->height) : 0.0;
+
+	if (opts->json) {
+		printf("{\"scanner\":\"%s\",\"labeling\":\"%s\","
+		       "\"threads\":%d,\"cpus\":%d,\"moments\":%s,"
+		       "\"frames\":%d,"
+		       "\"width\":%d,\"height\":%d,\"blobs\":%d,"
+		       "\"radius\":%.1f,\"falloff\":%.2f,\"noise\":%d,"
+		       "\"motion\":%.1f,\"jitter\":%.1f,\"seed\":%u,"
+		       "\"predictor\":\"%s\",",
+		       scanner_names[blobwatch_get_scanner(bw)],
+		       labeling_names[blobwatch_get_labeling(bw)], num_threads,
+		       opts->num_cpus, moments ? "true" : "false", n,
+		       so->width, so->height, so->num_blobs, so->radius,
+		       so->falloff, so->noise, so->motion, so->jitter, so->seed,
+		       predictor_names[blobwatch_get_predictor(bw)]);
+		if (components >= 0)
+			printf("\"components\":%d,\"wrong_frames\":%llu,",
+			       components, (unsigned long long)wrong_count);
+		print_stats_json("detect", &detect);
+		putchar(',');
+		print_stats_json("track", &track);
+		putchar(',');
+		print_stats_json("total", &total);
+		putchar(',');
+		print_stats_json("report", &report);
+		if (opts->rle)
+			bench_rle_print(&br, so->width, so->height, true);
+		printf(",\"fps\":%.1f,\"mbps\":%.1f,\"blobs_per_frame\":%.2f,"
+		       "\"dropped_blobs\":%llu,\"dropped_labels\":%llu,"
+		       "\"threshold\":%d,\"roi\":%d,"
+		       "\"scanned_pct\":%.2f,\"lost_tracks\":%llu,"
+		       "\"lost_pct\":%.3f,\"prediction_error\":%.3f,"
+		       "\"max_prediction_error\":%.2f,"
+		       "\"checksum\":\"%016llx\"}\n",
+		       fps, mbps, n ? (double)num_blobs / n : 0.0,
+		       (unsigned long long)dropped_blobs,
+		       (unsigned long long)dropped_labels,
+		       blobwatch_get_threshold(bw), opts->roi_interval,
+		       scanned, (unsigned long long)lost_tracks,
+		       tracked ? 100.0 * lost_tracks / tracked : 0.0,
+		       continued ? prediction_error / continued : 0.0,
+		       max_error, (unsigned long long)hash);
+	} else {
+		printf("%s %s, %d thread%s%s: %.1f frames/s, %.1f MB/s, "
+		       "%.2f blobs/frame, checksum %016llx\n",
+		       scanner_names[blobwatch_get_scanner(bw)],
+		       labeling_names[blobwatch_get_labeling(bw)], num_threads,
+		       num_threads == 1 ? "" : "s",
+		       moments ? "" : ", no moments", fps, mbps,
+		       n ? (double)num_blobs / n : 0.0,
+		       (unsigned long long)hash);
+		if (dropped_blobs)
+			printf("  %llu blobs dropped, budget is %d per frame\n",
+			       (unsigned long long)dropped_blobs,
+			       blobwatch_get_max_blobs(bw));
+		if (dropped_labels)
+			printf("  %llu labels over capacity, "
+			       "up to as many blobs lost\n",
+			       (unsigned long long)dropped_labels);
+		if (components >= 0)
+			printf("  %d connected shapes, blob count wrong in "
+			       "%llu of %d frames\n",
+			       components, (unsigned long long)wrong_count, n);
+		if (opts->adaptive || opts->hysteresis)
+			printf("  threshold 0x%02x, hysteresis 0x%02x%s\n",
+			       blobwatch_get_threshold(bw), opts->hysteresis,
+			       opts->adaptive ? ", adaptive" : "");
+		if (opts->roi_interval)
+			printf("  %.1f%% of pixels scanned, %llu tracks lost\n",
+			       scanned, (unsigned long long)lost_tracks);
+		printf("  %s tracking: %.3f%% of tracks lost per frame, "
+		       "prediction error mean %.2f max %.2f px\n",
+		       predictor_names[blobwatch_get_predictor(bw)],
+		       tracked ? 100.0 * lost_tracks / tracked : 0.0,
+		       continued ? prediction_error / continued : 0.0,
+		       max_error);
+		print_stats("detect", &detect);
+		print_stats("track", &track);
+		print_stats("total", &total);
+		if (opts->printf_report || opts->log_path)
+			print_stats(opts->log_path ? "binlog" : "printf",
+				    &report);
+		if (leds)
+			bench_flicker_print(bw, &bf);
+		if (opts->rle)
+			bench_rle_print(&br, so->width, so->height, false);
+	}
+	fflush(stdout);
+	res->checksum = hash;
+	res->fps = fps;
+
+out:
+	bench_rle_free(&br);
+	blobwatch_free(bw);
+	synth_free(s);
+	free(frame);
+	free(t_report);
+	free(t_total);
+	free(t_track);
+	free(t_detect);
+	leds_free(leds);
+
+	return ret;
+}
+
+/*
+ * Processes frames of num_sensors synthetic sensors, each with its own
+ * detector and blobs, on a thread pool shared by all detectors, and reports
+ * the aggregate throughput. At most as many sensors as threads and online
+ * CPUs run at once, which bounds the scaling over the first sensor count.
+ *
+ * Returns the aggregate frames per second, or a negative error code.
+ */
+static double bench_sensors(const struct bench_options *opts, int num_sensors,
+			    int num_threads, double base_fps)
+{
+	const struct synth_options *so = &opts->synth;
+	struct blobservation **obs;
+	struct sensor_group *sg;
+	uint64_t *hashes;
+	struct synth **synths;
+	uint8_t **frames;
+	uint64_t elapsed = 0;
+	double fps = -ENOMEM;
+	int i, j;
+
+	synths = calloc(num_sensors, sizeof(*synths));
+	frames = calloc(num_sensors, sizeof(*frames));
+	obs = calloc(num_sensors, sizeof(*obs));
+	hashes = calloc(num_sensors, sizeof(*hashes));
+	sg = sensor_group_new(num_sensors, so->width, so->height,
+			      opts->max_blobs, num_threads);
+	if (!synths || !frames || !obs || !hashes || !sg)
+		goto out;
+
+	for (j = 0; j < num_sensors; j++) {
+		struct synth_options o = *so;
+		struct blobwatch *bw = sensor_group_detector(sg, j);
+
+		/* Every sensor sees different blobs */
+		o.seed = so->seed + j;
+		hashes[j] = 0xcbf29ce484222325ULL;
+		synths[j] = synth_new(&o);
+		frames[j] = malloc(so->width * so->height);
+		if (!synths[j] || !frames[j])
+			goto out;
+
+		blobwatch_set_scanner(bw, opts->scanner);
+		blobwatch_set_labeling(bw, opts->labeling);
+		blobwatch_set_predictor(bw, opts->predictor);
+		blobwatch_set_roi(bw, opts->roi_interval);
+		blobwatch_set_moments(bw, opts->moments != 0);
+		if (blobwatch_set_threshold(bw, opts->threshold) < 0 ||
+		    blobwatch_set_hysteresis(bw, opts->hysteresis) < 0) {
+			fps = -EINVAL;
+			goto out;
+		}
+		blobwatch_set_adaptive(bw, opts->adaptive);
+	}
+
+	/* Only the rounds of detection are timed, not rendering */
+	for (i = 0; i < opts->num_warmup + opts->num_frames; i++) {
+		uint64_t start;
+
+		for (j = 0; j < num_sensors; j++)
+			synth_render(synths[j], frames[j]);
+
+		start = clock_now_ns();
+		sensor_group_process(sg, frames, NULL, NULL, obs);
+		if (i < opts->num_warmup)
+			continue;
+		elapsed += clock_now_ns() - start;
+
+		for (j = 0; j < num_sensors; j++) {
+			if (obs[j])
+				hashes[j] = bench_hash(hashes[j], obs[j]);
+		}
+	}
+	fps = elapsed ? (double)opts->num_frames * num_sensors * 1e9 /
+			elapsed : 0.0;
+
+	printf("%d sensor%s, %d thread%s: %.1f frames/s total, %.1f per sensor",
+	       num_sensors, num_sensors == 1 ? "" : "s", num_threads,
+	       num_threads == 1 ? "" : "s", fps, fps / num_sensors);
+	if (base_fps > 0)
+		printf(", %.2fx on %d CPU%s", fps / base_fps, opts->num_cpus,
+		       opts->num_cpus == 1 ? "" : "s");
+	putchar('\n');
+	for (j = 0; j < num_sensors; j++) {
+		struct sensor_stats st;
+
+		sensor_group_get_stats(sg, j, &st);
+		printf("  sensor %d: %.2f blobs/frame, mean %.1f max %.1f us, "
+		       "checksum %016llx\n",
+		       j, st.frames ? (double)st.blobs / st.frames : 0.0,
+		       st.frames ? st.busy_ns * 1e-3 / st.frames : 0.0,
+		       st.max_ns * 1e-3, (unsigned long long)hashes[j]);
+	}
+	fflush(stdout);
+
+out:
+	sensor_group_free(sg);
+	for (j = 0; synths && frames && j < num_sensors; j++) {
+		synth_free(synths[j]);
+		free(frames[j]);
+	}
+	free(hashes);
+	free(obs);
+	free(frames);
+	free(synths);
+
+	return fps;
+}
+
+/*
+ * Parses a comma separated list of at most max positive numbers.
+ */
+static int parse_list(int *list, int *num, int max, char *arg)
+{
+	char *tok;
+
+	*num = 0;
+	for (tok = strtok(arg, ","); tok; tok = strtok(NULL, ",")) {
+		if (*num == max)
+			return -EINVAL;
+		list[*num] = atoi(tok);
+		if (list[(*num)++] < 1)
+			return -EINVAL;
+	}
+
+	return *num ? 0 : -EINVAL;
+}
+
+/*
+ * Sets up the blob association benchmark: a sweep over blob counts with
+ * small blobs, so that even the largest count fits into the frame.
+ */
+static void setup_assoc(struct bench_options *opts)
+{
+	int i;
+
+	opts->num_blob_counts = sizeof(assoc_blob_counts) /
+				sizeof(assoc_blob_counts[0]);
+	for (i = 0; i < opts->num_blob_counts; i++)
+		opts->blobs[i] = assoc_blob_counts[i];
+	opts->synth.radius = 3;
+	opts->num_frames = 200;
+}
+
+static int parse_scanner(struct bench_options *opts, const char *arg)
+{
+	int i;
+
+	if (strcmp(arg, "all") == 0) {
+		opts->all_scanners = true;
+		return 0;
+	}
+
+	for (i = 0; i < sizeof(scanner_names) / sizeof(scanner_names[0]); i++) {
+		if (strcmp(arg, scanner_names[i]) == 0) {
+			opts->scanner = i;
+			return 0;
+		}
+	}
+
+	return -EINVAL;
+}
+
+static int parse_labeling(struct bench_options *opts, const char *arg)
+{
+	int i;
+
+	if (strcmp(arg, "all") == 0) {
+		opts->all_labelings = true;
+		return 0;
+	}
+
+	for (i = 0; i < sizeof(labeling_names) / sizeof(labeling_names[0]);
+	     i++) {
+		if (strcmp(arg, labeling_names[i]) == 0) {
+			opts->labeling = i;
+			return 0;
+		}
+	}
+
+	return -EINVAL;
+}
+
+static int parse_predictor(struct bench_options *opts, const char *arg)
+{
+	int i;
+
+	for (i = 0; i < sizeof(predictor_names) / sizeof(predictor_names[0]);
+	     i++) {
+		if (strcmp(arg, predictor_names[i]) == 0) {
+			opts->predictor = i;
+			return 0;
+		}
+	}
+
+	return -EINVAL;
+}
+
+/*
+ * Sets up the connected component benchmark: still shapes on a grid that the
+ * detector should report as exactly one blob each, large enough for strokes
+ * of more than two pixels.
+ */
+static int setup_shapes(struct bench_options *opts, const char *arg)
+{
+	if (strcmp(arg, "u") == 0)
+		opts->synth.shape = SYNTH_SHAPE_U;
+	else if (strcmp(arg, "smear") == 0)
+		opts->synth.shape = SYNTH_SHAPE_SMEAR;
+	else if (strcmp(arg, "mixed") == 0)
+		opts->synth.shape = SYNTH_SHAPE_MIXED;
+	else
+		return -EINVAL;
+
+	opts->synth.radius = 12;
+	opts->synth.motion = 0;
+	opts->blobs[0] = 200;
+	opts->num_blob_counts = 1;
+
+	return 0;
+}
+
+static int parse_moments(struct bench_options *opts, const char *arg)
+{
+	if (strcmp(arg, "on") == 0)
+		opts->moments = 1;
+	else if (strcmp(arg, "off") == 0)
+		opts->moments = 0;
+	else if (strcmp(arg, "both") == 0)
+		opts->moments = -1;
+	else
+		return -EINVAL;
+
+	return 0;
+}
+
+/*
+ * Runs one configuration with and/or without moment accumulation, and stores
+ * the results in res[moments]. Results of modes not run are 0.
+ */
+static int bench_moments(const struct bench_options *opts,
+			 enum blobwatch_scanner scanner, int num_threads,
+			 struct bench_result res[2])
+{
+	int ret;
+
+	memset(res, 0, 2 * sizeof(*res));
+	if (opts->moments != 0) {
+		ret = bench_run(opts, scanner, num_threads, true, &res[1]);
+		if (ret < 0)
+			return ret;
+	}
+	if (opts->moments != 1)
+		return bench_run(opts, scanner, num_threads, false, &res[0]);
+
+	return 0;
+}
+
+/*
+ * Prints the throughput of every thread count relative to the first one, for
+ * each scanner and moment mode that ran.
+ */
+static void bench_print_scaling(const struct bench_options *o,
+				struct bench_result
+				results[][MAX_THREAD_COUNTS][2])
+{
+	int i, j, m;
+
+	printf("thread scaling over %d thread%s, %d CPU%s online:\n",
+	       o->threads[0], o->threads[0] == 1 ? "" : "s", o->num_cpus,
+	       o->num_cpus == 1 ? "" : "s");
+	for (i = BLOBWATCH_SCANNER_AUTO; i <= BLOBWATCH_SCANNER_AVX2; i++) {
+		for (m = 1; m >= 0; m--) {
+			double base = results[i][0][m].fps;
+
+			if (base <= 0)
+				continue;
+			printf("  %-6s %-10s", scanner_names[i],
+			       m ? "moments" : "no moments");
+			for (j = 0; j < o->num_thread_counts; j++)
+				printf("  %d: %.2fx", o->threads[j],
+				       results[i][j][m].fps / base);
+			putchar('\n');
+		}
+	}
+	fflush(stdout);
+}
+
+/*
+ * Runs all thread counts and scanners of one labeling configuration. With
+ * all scanners, the SIMD run finders must find exactly the blobs the scalar
+ * one finds. With several thread counts, the scaling is summarized.
+ *
+ * Returns 0 on success, -EIO if a scanner's output differs, or another
+ * negative error code.
+ */
+static int bench_labeling(const struct bench_options *o)
+{
+	struct bench_result results[BLOBWATCH_SCANNER_AVX2 + 1]
+				   [MAX_THREAD_COUNTS][2];
+	bool differs = false;
+	int i, j;
+
+	memset(results, 0, sizeof(results));
+	for (j = 0; j < o->num_thread_counts; j++) {
+		struct bench_result *scalar;
+
+		if (!o->all_scanners) {
+			if (bench_moments(o, o->scanner, o->threads[j],
+					  results[o->scanner][j]) < 0)
+				return -1;
+			continue;
+		}
+
+		scalar = results[BLOBWATCH_SCANNER_SCALAR][j];
+		for (i = BLOBWATCH_SCANNER_SCALAR;
+		     i <= BLOBWATCH_SCANNER_AVX2; i++) {
+			struct bench_result *res = results[i][j];
+			int ret = bench_moments(o, i, o->threads[j], res);
+
+			if (ret == -ENOTSUP)
+				continue; /* not supported by this CPU */
+			if (ret < 0)
+				return ret;
+			if (i != BLOBWATCH_SCANNER_SCALAR &&
+			    (res[0].checksum != scalar[0].checksum ||
+			     res[1].checksum != scalar[1].checksum)) {
+				fprintf(stderr, "%s, %d thread%s: blobs "
+					"differ from scalar\n",
+					scanner_names[i], o->threads[j],
+					o->threads[j] == 1 ? "" : "s");
+				differs = true;
+			}
+		}
+	}
+
+	if (o->num_thread_counts > 1 && !o->json)
+		bench_print_scaling(o, results);
+
+	return differs ? -EIO : 0;
+}
+
+/*
+ * Prints the aggregate throughput of every sensor and thread count, and its
+ * scaling over the first sensor count.
+ */
+static void bench_print_sensor_scaling(const struct bench_options *o,
+				       double fps[][MAX_SENSOR_COUNTS])
+{
+	int i, j;
+
+	printf("sensor scaling, frames/s total and over %d sensor%s, "
+	       "%d CPU%s online:\n", o->sensors[0],
+	       o->sensors[0] == 1 ? "" : "s", o->num_cpus,
+	       o->num_cpus == 1 ? "" : "s");
+	printf("  threads");
+	for (i = 0; i < o->num_sensor_counts; i++)
+		printf("  %*d sensor%s", o->sensors[i] == 1 ? 8 : 7,
+		       o->sensors[i], o->sensors[i] == 1 ? "" : "s");
+	putchar('\n');
+	for (j = 0; j < o->num_thread_counts; j++) {
+		printf("  %7d", o->threads[j]);
+		for (i = 0; i < o->num_sensor_counts; i++)
+			printf("  %8.1f %5.2fx", fps[j][i],
+			       fps[j][0] > 0 ? fps[j][i] / fps[j][0] : 0.0);
+		putchar('\n');
+	}
+	fflush(stdout);
+}
+
+static void bench_usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s bench [options]\n"
+		"  --frames N       measured frames (1000)\n"
+		"  --warmup N       unmeasured frames before that (50)\n"
+		"  --size WxH       frame size (1280x960)\n"
+		"  --blobs N[,N...] number of blobs (20)\n"
+		"  --radius R       blob radius in pixels (4)\n"
+		"  --falloff F      intensity falloff exp(-F (d/r)^2) (1)\n"
+		"  --peak N         peak blob intensity (255)\n"
+		"  --noise N        background noise amplitude (16)\n"
+		"  --motion M       blob speed in pixels/frame (2)\n"
+		"  --jitter J       draw blobs up to J pixels off their path (0)\n"
+		"  --seed N         random seed (1)\n"
+		"  --max-blobs N    blob budget per frame (256, or twice the number\n"
+		"                   of blobs if larger)\n"
+		"  --roi N          scan windows around predicted blobs, and the\n"
+		"                   full frame every N frames (off)\n"
+		"  -j N[,N...]      detection thread counts (1)\n"
+		"  --scanner NAME   auto, scalar, sse2, avx2 or all (auto); all\n"
+		"                   fails unless every scanner matches scalar\n"
+		"  --labeling NAME  union-find, overlap or all (union-find)\n"
+		"  --predictor NAME kalman or difference (kalman)\n"
+		"  --shapes NAME    200 still u, smear or mixed shapes of radius\n"
+		"                   12 and count frames with a wrong number of\n"
+		"                   blobs, before other options\n"
+		"  --threshold N    pixel threshold (0x9f)\n"
+		"  --hysteresis N   grow blobs down to this low threshold (off)\n"
+		"  --adaptive       pick the threshold from a frame histogram\n"
+		"  --moments MODE   accumulate centroid moments: on, off or\n"
+		"                   both (on)\n"
+		"  --flicker N      blink the blobs like N LEDs and identify them\n"
+		"                   by their patterns (off)\n"
+		"  --dim R          radius of dim blink frames relative to bright\n"
+		"                   ones (0.75)\n"
+		"  --drop N         skip processing every Nth frame (off)\n"
+		"  --rle            detect on runs of thresholded pixels, and\n"
+		"                   time copying, drawing and recording frames\n"
+		"                   as runs and as raw pixels\n"
+		"  --sensors N[,N...] process N sensors with their own detectors\n"
+		"                   on one shared pool of -j threads\n"
+		"  --assoc          sweep 10 to 2000 blobs to benchmark blob\n"
+		"                   association, before other options\n"
+		"  --printf         print the blobs of every frame to stdout\n"
+		"  --log FILE       log the blobs of every frame to a binary log\n"
+		"  --json           print one JSON object per configuration\n",
+		name);
+}
+
+/*
+ * Entry point of the "bench" subcommand.
+ *
+ * Returns 0 on success, or 1 on error.
+ */
+int bench_main(int argc, char **argv)
+{
+	struct bench_options opts = {
+		.synth = {
+			.width = 1280,
+			.height = 960,
+			.num_blobs = 20,
+			.radius = 4,
+			.falloff = 1,
+			.peak = 255,
+			.noise = 16,
+			.motion = 2,
+			.dim = 0.75,
+			.seed = 1,
+		},
+		.num_frames = 1000,
+		.num_warmup = 50,
+		.threads = { 1 },
+		.num_thread_counts = 1,
+		.blobs = { 20 },
+		.num_blob_counts = 1,
+		.scanner = BLOBWATCH_SCANNER_AUTO,
+		.moments = 1,
+		.threshold = 0x9f,
+	};
+	double sensor_fps[MAX_THREAD_COUNTS][MAX_SENSOR_COUNTS] = { { 0 } };
+	int i, j, k, l;
+
+	for (i = 1; i < argc; i++) {
+		const char *arg = argv[i];
+		char *val = i + 1 < argc ? argv[i + 1] : NULL;
+		int ret = 0;
+
+		if (strcmp(arg, "--json") == 0) {
+			opts.json = true;
+			continue;
+		}
+		if (strcmp(arg, "--printf") == 0) {
+			opts.printf_report = true;
+			continue;
+		}
+		if (strcmp(arg, "--adaptive") == 0) {
+			opts.adaptive = true;
+			continue;
+		}
+		if (strcmp(arg, "--rle") == 0) {
+			opts.rle = true;
+			continue;
+		}
+		if (strcmp(arg, "--assoc") == 0) {
+			setup_assoc(&opts);
+			continue;
+		}
+		if (!val) {
+			bench_usage(argv[0]);
+			return 1;
+		}
+		i++;
+
+		if (strcmp(arg, "--frames") == 0)
+			opts.num_frames = atoi(val);
+		else if (strcmp(arg, "--warmup") == 0)
+			opts.num_warmup = atoi(val);
+		else if (strcmp(arg, "--size") == 0)
+			ret = sscanf(val, "%dx%d", &opts.synth.width,
+				     &opts.synth.height) == 2 ? 0 : -EINVAL;
+		else if (strcmp(arg, "--blobs") == 0)
+			ret = parse_list(opts.blobs, &opts.num_blob_counts,
+					 MAX_BLOB_COUNTS, val);
+		else if (strcmp(arg, "--radius") == 0)
+			opts.synth.radius = atof(val);
+		else if (strcmp(arg, "--falloff") == 0)
+			opts.synth.falloff = atof(val);
+		else if (strcmp(arg, "--peak") == 0)
+			opts.synth.peak = atoi(val);
+		else if (strcmp(arg, "--noise") == 0)
+			opts.synth.noise = atoi(val);
+		else if (strcmp(arg, "--motion") == 0)
+			opts.synth.motion = atof(val);
+		else if (strcmp(arg, "--jitter") == 0)
+			opts.synth.jitter = atof(val);
+		else if (strcmp(arg, "--seed") == 0)
+			opts.synth.seed = strtoul(val, NULL, 0);
+		else if (strcmp(arg, "--max-blobs") == 0)
+			opts.max_blobs = atoi(val);
+		else if (strcmp(arg, "--log") == 0)
+			opts.log_path = val;
+		else if (strcmp(arg, "--threshold") == 0)
+			opts.threshold = strtol(val, NULL, 0);
+		else if (strcmp(arg, "--hysteresis") == 0)
+			opts.hysteresis = strtol(val, NULL, 0);
+		else if (strcmp(arg, "--roi") == 0)
+			opts.roi_interval = atoi(val);
+		else if (strcmp(arg, "--flicker") == 0)
+			opts.flicker = atoi(val);
+		else if (strcmp(arg, "--dim") == 0)
+			opts.synth.dim = atof(val);
+		else if (strcmp(arg, "--drop") == 0)
+			opts.drop_interval = atoi(val);
+		else if (strcmp(arg, "-j") == 0)
+			ret = parse_list(opts.threads, &opts.num_thread_counts,
+					 MAX_THREAD_COUNTS, val);
+		else if (strcmp(arg, "--scanner") == 0)
+			ret = parse_scanner(&opts, val);
+		else if (strcmp(arg, "--labeling") == 0)
+			ret = parse_labeling(&opts, val);
+		else if (strcmp(arg, "--predictor") == 0)
+			ret = parse_predictor(&opts, val);
+		else if (strcmp(arg, "--shapes") == 0)
+			ret = setup_shapes(&opts, val);
+		else if (strcmp(arg, "--moments") == 0)
+			ret = parse_moments(&opts, val);
+		else if (strcmp(arg, "--sensors") == 0)
+			ret = parse_list(opts.sensors, &opts.num_sensor_counts,
+					 MAX_SENSOR_COUNTS, val);
+		else
+			ret = -EINVAL;
+
+		if (ret < 0) {
+			bench_usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (opts.num_frames < 1 || opts.synth.width < 1 ||
+	    opts.synth.height < 1 || opts.synth.radius <= 0) {
+		bench_usage(argv[0]);
+		return 1;
+	}
+
+	/*
+	 * Thread sweeps only measure scaling up to the online CPU count, more
+	 * threads just time-slice. Say so, so such numbers are not mistaken
+	 * for parallel speedups.
+	 */
+	opts.num_cpus = max(sysconf(_SC_NPROCESSORS_ONLN), 1);
+	for (j = 0; j < opts.num_thread_counts; j++) {
+		if (opts.threads[j] > opts.num_cpus) {
+			fprintf(stderr, "warning: %d CPU%s online, thread "
+				"counts above do not show scaling\n",
+				opts.num_cpus, opts.num_cpus == 1 ? "" : "s");
+			break;
+		}
+	}
+
+	if (opts.log_path && binlog_open(opts.log_path) < 0) {
+		fprintf(stderr, "could not create %s\n", opts.log_path);
+		return 1;
+	}
+
+	for (k = 0; k < opts.num_blob_counts; k++) {
+		struct bench_options o = opts;
+
+		/* Leave room for noise blobs unless a budget was given */
+		o.synth.num_blobs = opts.blobs[k];
+		if (!opts.max_blobs)
+			o.max_blobs = max(2 * o.synth.num_blobs,
+					  BLOBWATCH_DEFAULT_MAX_BLOBS);
+
+		/* Scaling is relative to the first sensor count */
+		for (j = 0; j < opts.num_thread_counts; j++) {
+			for (i = 0; i < opts.num_sensor_counts; i++) {
+				sensor_fps[j][i] =
+					bench_sensors(&o, opts.sensors[i],
+						      opts.threads[j],
+						      sensor_fps[j][0]);
+				if (sensor_fps[j][i] < 0)
+					goto err;
+			}
+		}
+		if (opts.num_sensor_counts) {
+			bench_print_sensor_scaling(&opts, sensor_fps);
+			continue;
+		}
+
+		for (l = BLOBWATCH_LABELING_UNION_FIND;
+		     l <= BLOBWATCH_LABELING_OVERLAP; l++) {
+			if (!opts.all_labelings && l != opts.labeling)
+				continue;
+			o.labeling = l;
+
+			if (bench_labeling(&o) < 0)
+				goto err;
+		}
+	}
+
+	binlog_close();
+	return 0;
+
+err:
+	binlog_close();
+	return 1;
+}
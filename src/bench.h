@@ -0,0 +1,10 @@
+/*
+ * Blob detection benchmarks
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ */
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+int bench_main(int argc, char **argv);
+
+#endif /* __BENCH_H__ */
@@ -0,0 +1,391 @@
+/*
+ * Asynchronous binary logging
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "binlog.h"
+#include "blobwatch.h"
+#include "clock.h"
+
+/* Per-thread ring size in bytes, a power of two */
+#define BINLOG_RING_SIZE	(256 * 1024)
+/* Interval at which the drain thread empties the rings */
+#define BINLOG_DRAIN_NS		10000000ULL
+
+#define BINLOG_ALIGN(size)	(((size) + 7) & ~7)
+
+/*
+ * Single producer, single consumer byte ring. Only the owning thread writes
+ * records and advances head, only the drain thread advances tail. Records
+ * that don't fit are counted and dropped, the writer never waits.
+ */
+struct binlog_ring {
+	struct binlog_ring *next;
+	uint32_t thread;
+	uint64_t head;
+	uint64_t tail;
+	uint64_t dropped;
+	uint64_t reported;
+	uint8_t buf[BINLOG_RING_SIZE];
+};
+
+struct binlog {
+	FILE *file;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	struct binlog_ring *rings;
+	uint32_t num_rings;
+	unsigned int generation;
+	bool running;
+};
+
+struct binlog_file_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+};
+
+static struct binlog *active;
+static unsigned int generation;
+
+/* The calling thread's ring, valid while its generation is current */
+static __thread struct binlog_ring *thread_ring;
+static __thread unsigned int thread_generation;
+
+static void ring_copy_in(struct binlog_ring *r, uint64_t pos, const void *src,
+			 size_t size)
+{
+	size_t offset = pos & (BINLOG_RING_SIZE - 1);
+	size_t first = BINLOG_RING_SIZE - offset;
+
+	if (first >= size) {
+		memcpy(r->buf + offset, src, size);
+	} else {
+		memcpy(r->buf + offset, src, first);
+		memcpy(r->buf, (const uint8_t *)src + first, size - first);
+	}
+}
+
+/*
+ * Writes everything queued in the ring to the file.
+ */
+static void drain_ring(struct binlog *log, struct binlog_ring *r)
+{
+	uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	uint64_t tail = r->tail;
+	uint64_t dropped;
+
+	while (tail < head) {
+		size_t offset = tail & (BINLOG_RING_SIZE - 1);
+		size_t size = BINLOG_RING_SIZE - offset;
+
+		if (size > head - tail)
+			size = head - tail;
+		fwrite(r->buf + offset, 1, size, log->file);
+		tail += size;
+	}
+	__atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+
+	dropped = __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+	if (dropped != r->reported) {
+		struct binlog_header h = {
+			.timestamp = clock_now_ns(),
+			.type = BINLOG_DROPPED,
+			.size = sizeof(struct binlog_dropped),
+			.thread = r->thread,
+		};
+		struct binlog_dropped d = { .records = dropped - r->reported };
+
+		fwrite(&h, sizeof(h), 1, log->file);
+		fwrite(&d, sizeof(d), 1, log->file);
+		r->reported = dropped;
+	}
+}
+
+static void drain(struct binlog *log)
+{
+	struct binlog_ring *r;
+
+	pthread_mutex_lock(&log->lock);
+	for (r = log->rings; r; r = r->next)
+		drain_ring(log, r);
+	pthread_mutex_unlock(&log->lock);
+
+	fflush(log->file);
+}
+
+static void *drain_thread(void *arg)
+{
+	struct binlog *log = arg;
+	uint64_t next = clock_now_ns();
+
+	while (__atomic_load_n(&log->running, __ATOMIC_ACQUIRE)) {
+		next += BINLOG_DRAIN_NS;
+		clock_sleep_until_ns(next);
+		drain(log);
+	}
+
+	return NULL;
+}
+
+/*
+ * Starts logging to a new file at path, drained by a background thread.
+ *
+ * Returns 0 on success or a negative error code.
+ */
+int binlog_open(const char *path)
+{
+	struct binlog_file_header fh = {
+		.magic = BINLOG_MAGIC,
+		.version = BINLOG_VERSION,
+	};
+	struct binlog *log;
+	int ret;
+
+	if (active)
+		return -EBUSY;
+
+	log = calloc(1, sizeof(*log));
+	if (!log)
+		return -ENOMEM;
+
+	log->file = fopen(path, "wb");
+	if (!log->file) {
+		ret = -errno;
+		free(log);
+		return ret;
+	}
+	fwrite(&fh, sizeof(fh), 1, log->file);
+
+	pthread_mutex_init(&log->lock, NULL);
+	log->generation = ++generation;
+	log->running = true;
+
+	ret = pthread_create(&log->thread, NULL, drain_thread, log);
+	if (ret) {
+		pthread_mutex_destroy(&log->lock);
+		fclose(log->file);
+		free(log);
+		return -ret;
+	}
+
+	__atomic_store_n(&active, log, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+/*
+ * Stops the drain thread, writes out what is left and closes the file.
+ * Threads must not write records while or after the log is closed.
+ */
+void binlog_close(void)
+{
+	struct binlog *log = active;
+	struct binlog_ring *r, *next;
+
+	if (!log)
+		return;
+
+	__atomic_store_n(&active, NULL, __ATOMIC_RELEASE);
+	__atomic_store_n(&log->running, false, __ATOMIC_RELEASE);
+	pthread_join(log->thread, NULL);
+
+	drain(log);
+	fclose(log->file);
+
+	for (r = log->rings; r; r = next) {
+		next = r->next;
+		free(r);
+	}
+	pthread_mutex_destroy(&log->lock);
+	free(log);
+}
+
+bool binlog_enabled(void)
+{
+	return __atomic_load_n(&active, __ATOMIC_ACQUIRE) != NULL;
+}
+
+/*
+ * Allocates a ring for the calling thread on its first record.
+ */
+static struct binlog_ring *get_ring(struct binlog *log)
+{
+	struct binlog_ring *r;
+
+	if (thread_ring && thread_generation == log->generation)
+		return thread_ring;
+
+	r = calloc(1, sizeof(*r));
+	if (!r)
+		return NULL;
+
+	pthread_mutex_lock(&log->lock);
+	r->thread = log->num_rings++;
+	r->next = log->rings;
+	log->rings = r;
+	pthread_mutex_unlock(&log->lock);
+
+	thread_ring = r;
+	thread_generation = log->generation;
+
+	return r;
+}
+
+/*
+ * Queues a record in the calling thread's ring, if logging is enabled.
+ * Never blocks, apart from allocating the ring on a thread's first record.
+ */
+void binlog_write(enum binlog_type type, const void *payload, uint16_t size)
+{
+	struct binlog *log = __atomic_load_n(&active, __ATOMIC_ACQUIRE);
+	struct binlog_header h;
+	struct binlog_ring *r;
+	uint64_t head, tail;
+	size_t total;
+
+	if (!log)
+		return;
+
+	r = get_ring(log);
+	if (!r)
+		return;
+
+	total = sizeof(h) + BINLOG_ALIGN(size);
+	head = r->head;
+	tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+	if (head + total - tail > BINLOG_RING_SIZE) {
+		__atomic_add_fetch(&r->dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	h.timestamp = clock_now_ns();
+	h.type = type;
+	h.size = size;
+	h.thread = r->thread;
+
+	ring_copy_in(r, head, &h, sizeof(h));
+	ring_copy_in(r, head + sizeof(h), payload, size);
+	__atomic_store_n(&r->head, head + total, __ATOMIC_RELEASE);
+}
+
+/*
+ * Logs a frame record followed by one record per blob.
+ */
+void binlog_observation(uint32_t sequence, const struct blobservation *ob)
+{
+	struct binlog_frame fr = {
+		.sequence = sequence,
+		.num_blobs = ob->num_blobs,
+		.dropped_blobs = ob->dropped_blobs,
+	};
+	int i;
+
+	binlog_write(BINLOG_FRAME, &fr, sizeof(fr));
+
+	for (i = 0; i < ob->num_blobs; i++) {
+		const struct blob *b = &ob->blobs[i];
+		struct binlog_blob rec = {
+			.index = i,
+			.track_index = b->track_index,
+			.x = b->x,
+			.y = b->y,
+			.cx = b->cx,
+			.cy = b->cy,
+			.led_id = b->led_id,
+		};
+
+		binlog_write(BINLOG_BLOB, &rec, sizeof(rec));
+	}
+}
+
+/*
+ * Decodes a log file and prints its records as text.
+ *
+ * Returns 0 on success or a negative error code.
+ */
+int binlog_dump(const char *path, FILE *out)
+{
+	struct binlog_file_header fh;
+	struct binlog_header h;
+	uint64_t first = 0;
+	uint8_t payload[BINLOG_ALIGN(UINT16_MAX)];
+	FILE *f;
+	int ret = 0;
+
+	f = fopen(path, "rb");
+	if (!f)
+		return -errno;
+
+	if (fread(&fh, sizeof(fh), 1, f) != 1 ||
+	    memcmp(fh.magic, BINLOG_MAGIC, sizeof(BINLOG_MAGIC)) != 0 ||
+	    fh.version != BINLOG_VERSION) {
+		fclose(f);
+		return -EINVAL;
+	}
+
+	while (fread(&h, sizeof(h), 1, f) == 1) {
+		size_t size = BINLOG_ALIGN(h.size);
+		double t;
+
+		if (fread(payload, 1, size, f) != size) {
+			fprintf(stderr, "%s: truncated record\n", path);
+			ret = -EIO;
+			break;
+		}
+
+		/*
+		 * Rings of different threads are drained one after another, so
+		 * records can precede the first one and get negative times.
+		 */
+		if (!first)
+			first = h.timestamp;
+		t = (int64_t)(h.timestamp - first) * 1e-9;
+
+		switch (h.type) {
+		case BINLOG_DROPPED: {
+			struct binlog_dropped *d = (void *)payload;
+
+			fprintf(out, "%12.6f [%u] %llu records dropped\n", t,
+				h.thread, (unsigned long long)d->records);
+			break;
+		}
+		case BINLOG_FRAME: {
+			struct binlog_frame *fr = (void *)payload;
+
+			fprintf(out, "%12.6f [%u] Frame %u: %u blobs, %u dropped\n",
+				t, h.thread, fr->sequence, fr->num_blobs,
+				fr->dropped_blobs);
+			break;
+		}
+		case BINLOG_BLOB: {
+			struct binlog_blob *b = (void *)payload;
+
+			fprintf(out, "%12.6f [%u] Blob[%u]: %u,%u (%.2f,%.2f) track %d led %d\n",
+				t, h.thread, b->index, b->x, b->y, b->cx, b->cy,
+				b->track_index, b->led_id);
+			break;
+		}
+		case BINLOG_INCONSISTENCY: {
+			struct binlog_inconsistency *in = (void *)payload;
+
+			fprintf(out, "%12.6f [%u] Inconsistency! %u != %u\n", t,
+				h.thread, in->tracked, in->index);
+			break;
+		}
+		default:
+			fprintf(out, "%12.6f [%u] unknown record type %u, %u bytes\n",
+				t, h.thread, h.type, h.size);
+			break;
+		}
+	}
+
+	fclose(f);
+
+	return ret;
+}
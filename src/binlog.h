@@ -0,0 +1,70 @@
+/*
+ * Asynchronous binary logging
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ */
+#ifndef __BINLOG_H__
+#define __BINLOG_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define BINLOG_MAGIC		"RIFTLOG"
+#define BINLOG_VERSION		3
+
+enum binlog_type {
+	/* written by the drain thread when a ring overflowed */
+	BINLOG_DROPPED,
+	BINLOG_FRAME,
+	BINLOG_BLOB,
+	BINLOG_INCONSISTENCY,
+};
+
+/*
+ * Every record starts with this header, followed by size bytes of payload
+ * and padding to a multiple of 8 bytes. Timestamps are monotonic nanoseconds.
+ */
+struct binlog_header {
+	uint64_t timestamp;
+	uint16_t type;
+	uint16_t size;
+	uint32_t thread;
+};
+
+struct binlog_dropped {
+	uint64_t records;
+};
+
+struct binlog_frame {
+	uint32_t sequence;
+	uint32_t dropped_blobs;
+	uint16_t num_blobs;
+	uint8_t reserved[2];
+};
+
+struct binlog_blob {
+	uint16_t index;
+	int16_t track_index;
+	uint16_t x;
+	uint16_t y;
+	float cx;
+	float cy;
+	int8_t led_id;
+	uint8_t reserved[3];
+};
+
+struct binlog_inconsistency {
+	uint16_t tracked;
+	uint16_t index;
+};
+
+struct blobservation;
+
+int binlog_open(const char *path);
+void binlog_close(void);
+bool binlog_enabled(void);
+void binlog_write(enum binlog_type type, const void *payload, uint16_t size);
+void binlog_observation(uint32_t sequence, const struct blobservation *ob);
+int binlog_dump(const char *path, FILE *out);
+
+#endif /* __BINLOG_H__ */
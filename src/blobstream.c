@@ -0,0 +1,412 @@
+/*
+ * Shared memory stream of blob observations
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "blobstream.h"
+#include "clock.h"
+
+/* Frames kept in the ring, so that slow readers can still catch up */
+#define BLOBSTREAM_NUM_SLOTS	8
+#define BLOBSTREAM_ALIGN	64
+
+/*
+ * Start of the shared memory object, followed by the frame slots, each
+ * aligned to a cache line.
+ */
+struct blobstream_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t num_slots;
+	uint32_t max_blobs;
+	uint32_t blob_size;
+	uint32_t slot_size;
+	uint32_t reserved;
+	/* number of frames published so far */
+	uint64_t head;
+};
+
+struct blobstream {
+	char *name;
+	struct blobstream_header *header;
+	size_t size;
+};
+
+struct blobstream_reader {
+	const struct blobstream_header *header;
+	size_t size;
+	uint64_t last;
+};
+
+static size_t slot_size(int max_blobs)
+{
+	size_t size = sizeof(struct blobstream_frame) +
+		      max_blobs * sizeof(struct blob);
+
+	return (size + BLOBSTREAM_ALIGN - 1) & ~(size_t)(BLOBSTREAM_ALIGN - 1);
+}
+
+static size_t header_size(void)
+{
+	return (sizeof(struct blobstream_header) + BLOBSTREAM_ALIGN - 1) &
+	       ~(size_t)(BLOBSTREAM_ALIGN - 1);
+}
+
+static inline struct blobstream_frame *
+get_slot(const struct blobstream_header *h, uint64_t index)
+{
+	return (struct blobstream_frame *)((char *)h + header_size() +
+		(index % h->num_slots) * h->slot_size);
+}
+
+/*
+ * Creates the shared memory object name with room for max_blobs per frame,
+ * replacing a stale one left behind by a previous writer.
+ *
+ * Returns the newly allocated stream, or NULL on error.
+ */
+struct blobstream *blobstream_create(const char *name, int max_blobs)
+{
+	struct blobstream *bs;
+	size_t size;
+	void *p;
+	int fd;
+
+	if (max_blobs < 1)
+		return NULL;
+
+	size = header_size() + BLOBSTREAM_NUM_SLOTS * slot_size(max_blobs);
+
+	bs = calloc(1, sizeof(*bs));
+	if (!bs)
+		return NULL;
+	bs->name = strdup(name);
+	if (!bs->name)
+		goto err;
+
+	shm_unlink(name);
+	fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+	if (fd < 0)
+		goto err;
+	if (ftruncate(fd, size) < 0) {
+		close(fd);
+		shm_unlink(name);
+		goto err;
+	}
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		shm_unlink(name);
+		goto err;
+	}
+
+	bs->header = p;
+	bs->size = size;
+	bs->header->version = BLOBSTREAM_VERSION;
+	bs->header->num_slots = BLOBSTREAM_NUM_SLOTS;
+	bs->header->max_blobs = max_blobs;
+	bs->header->blob_size = sizeof(struct blob);
+	bs->header->slot_size = slot_size(max_blobs);
+	/* Readers check the magic last */
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(bs->header->magic, BLOBSTREAM_MAGIC, sizeof(BLOBSTREAM_MAGIC));
+
+	return bs;
+
+err:
+	free(bs->name);
+	free(bs);
+	return NULL;
+}
+
+/*
+ * Unmaps and removes the shared memory object. Readers that still have it
+ * mapped keep seeing the last frames.
+ */
+void blobstream_destroy(struct blobstream *bs)
+{
+	if (!bs)
+		return;
+
+	munmap(bs->header, bs->size);
+	shm_unlink(bs->name);
+	free(bs->name);
+	free(bs);
+}
+
+/*
+ * Copies an observation into the next slot of the ring, under the slot's
+ * seqlock, and makes it the newest frame. Never waits for readers.
+ */
+void blobstream_publish(struct blobstream *bs, uint32_t sequence,
+			uint64_t timestamp, const struct blobservation *ob)
+{
+	struct blobstream_header *h = bs->header;
+	uint64_t index = h->head;
+	struct blobstream_frame *f = get_slot(h, index);
+	uint32_t seq = f->seq;
+	int num_blobs = ob->num_blobs;
+
+	if (num_blobs > (int)h->max_blobs)
+		num_blobs = h->max_blobs;
+
+	__atomic_store_n(&f->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	f->sequence = sequence;
+	f->index = index;
+	f->timestamp = timestamp;
+	f->num_blobs = num_blobs;
+	f->dropped_blobs = ob->dropped_blobs + ob->num_blobs - num_blobs;
+	memcpy(f->blobs, ob->blobs, num_blobs * sizeof(struct blob));
+	f->published = clock_now_ns();
+
+	__atomic_store_n(&f->seq, seq + 2, __ATOMIC_RELEASE);
+	__atomic_store_n(&h->head, index + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Maps the shared memory object name read-only.
+ *
+ * Returns the newly allocated reader, or NULL if there is no valid stream.
+ */
+struct blobstream_reader *blobstream_open(const char *name)
+{
+	const struct blobstream_header *h;
+	struct blobstream_reader *r;
+	struct stat st;
+	void *p;
+	int fd;
+
+	fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t)header_size()) {
+		close(fd);
+		return NULL;
+	}
+	p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return NULL;
+
+	h = p;
+	if (memcmp(h->magic, BLOBSTREAM_MAGIC, sizeof(BLOBSTREAM_MAGIC)) != 0)
+		goto err;
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (h->version != BLOBSTREAM_VERSION ||
+	    h->blob_size != sizeof(struct blob) ||
+	    h->slot_size != slot_size(h->max_blobs) ||
+	    header_size() + (size_t)h->num_slots * h->slot_size >
+	    (size_t)st.st_size)
+		goto err;
+
+	r = calloc(1, sizeof(*r));
+	if (!r)
+		goto err;
+	r->header = h;
+	r->size = st.st_size;
+	r->last = __atomic_load_n(&h->head, __ATOMIC_ACQUIRE);
+
+	return r;
+
+err:
+	munmap(p, st.st_size);
+	return NULL;
+}
+
+void blobstream_close(struct blobstream_reader *r)
+{
+	if (!r)
+		return;
+
+	munmap((void *)r->header, r->size);
+	free(r);
+}
+
+int blobstream_max_blobs(struct blobstream_reader *r)
+{
+	return r->header->max_blobs;
+}
+
+/*
+ * Returns the newest frame published since the last call, in place in shared
+ * memory, or NULL if there is none. Intermediate frames are skipped. The
+ * frame can be overwritten at any time: after reading it, check with
+ * blobstream_frame_valid() and the returned seq whether it was.
+ */
+const struct blobstream_frame *blobstream_next(struct blobstream_reader *r,
+					       uint32_t *seq)
+{
+	uint64_t head = __atomic_load_n(&r->header->head, __ATOMIC_ACQUIRE);
+	const struct blobstream_frame *f;
+
+	if (head == r->last)
+		return NULL;
+
+	f = get_slot(r->header, head - 1);
+	*seq = __atomic_load_n(&f->seq, __ATOMIC_ACQUIRE);
+	/* Already being overwritten by a newer frame, try again */
+	if (*seq & 1)
+		return NULL;
+
+	r->last = head;
+	return f;
+}
+
+/*
+ * Returns whether the frame was left alone by the writer since
+ * blobstream_next() returned it with seq.
+ */
+bool blobstream_frame_valid(const struct blobstream_frame *f, uint32_t seq)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&f->seq, __ATOMIC_RELAXED) == seq;
+}
+
+/*
+ * Reader process of the latency test: polls the stream until n frames
+ * arrived, then prints the publish to consumption latency.
+ */
+static int latency_reader(const char *name, int n, int num_blobs)
+{
+	struct blobstream_reader *r = blobstream_open(name);
+	uint64_t *lat = calloc(n, sizeof(uint64_t));
+	uint64_t expected = 0, skipped = 0, invalid = 0;
+	int i = 0;
+
+	if (!r || !lat) {
+		fprintf(stderr, "could not open blob stream %s\n", name);
+		free(lat);
+		blobstream_close(r);
+		return 1;
+	}
+
+	while (i < n) {
+		const struct blobstream_frame *f;
+		uint64_t now, index;
+		uint32_t seq;
+
+		f = blobstream_next(r, &seq);
+		if (!f) {
+			/* Keep polling, but let the writer run on a busy CPU */
+			sched_yield();
+			continue;
+		}
+		now = clock_now_ns();
+
+		/* Consume the frame in place, then check it was not torn */
+		index = f->index;
+		if (f->num_blobs != num_blobs ||
+		    (num_blobs && f->blobs[num_blobs - 1].area != (uint32_t)index)) {
+			if (blobstream_frame_valid(f, seq))
+				fprintf(stderr, "frame %llu corrupt\n",
+					(unsigned long long)index);
+			invalid++;
+			continue;
+		}
+		if (!blobstream_frame_valid(f, seq)) {
+			invalid++;
+			continue;
+		}
+
+		if (i > 0)
+			skipped += index - expected;
+		expected = index + 1;
+		lat[i++] = now - f->published;
+	}
+
+	clock_sort_ns(lat, n);
+	printf("publish to consume over %d frames: p50 %.2f  p99 %.2f  max %.2f us\n",
+	       n, clock_percentile_ns(lat, n, 500) * 1e-3,
+	       clock_percentile_ns(lat, n, 990) * 1e-3, lat[n - 1] * 1e-3);
+	printf("%llu frames skipped, %llu torn reads discarded\n",
+	       (unsigned long long)skipped, (unsigned long long)invalid);
+
+	fflush(stdout);
+	free(lat);
+	blobstream_close(r);
+	return 0;
+}
+
+/*
+ * Entry point of the "shmtest" subcommand: publishes synthetic observations
+ * at a given rate and measures in a separate reader process how long they
+ * take to arrive.
+ *
+ * Returns 0 on success, or 1 on error.
+ */
+int blobstream_latency_test(int argc, char **argv)
+{
+	const char *name = "/rift-blobs-test";
+	int num_frames = 1000, num_blobs = 40, rate = 60;
+	struct blobservation ob = { 0 };
+	struct blobstream *bs;
+	uint64_t next;
+	int i, status;
+	pid_t pid;
+
+	for (i = 1; i + 1 < argc; i += 2) {
+		if (strcmp(argv[i], "--frames") == 0)
+			num_frames = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "--blobs") == 0)
+			num_blobs = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "--rate") == 0)
+			rate = atoi(argv[i + 1]);
+		else
+			break;
+	}
+	if (i < argc || num_frames < 1 || num_blobs < 1 || rate < 1) {
+		fprintf(stderr, "usage: %s [--frames N] [--blobs N] [--rate Hz]\n",
+			argv[0]);
+		return 1;
+	}
+
+	bs = blobstream_create(name, num_blobs);
+	ob.blobs = calloc(num_blobs, sizeof(struct blob));
+	if (!bs || !ob.blobs) {
+		fprintf(stderr, "could not create blob stream %s\n", name);
+		blobstream_destroy(bs);
+		free(ob.blobs);
+		return 1;
+	}
+	ob.num_blobs = num_blobs;
+
+	pid = fork();
+	if (pid == 0)
+		_exit(latency_reader(name, num_frames, num_blobs));
+	if (pid < 0) {
+		blobstream_destroy(bs);
+		free(ob.blobs);
+		return 1;
+	}
+
+	/* Give the reader time to map the stream */
+	next = clock_now_ns() + 100000000ULL;
+	for (i = 0; waitpid(pid, &status, WNOHANG) == 0; i++) {
+		clock_sleep_until_ns(next);
+		next += 1000000000ULL / rate;
+
+		/* The reader checks the last blob for torn frames */
+		ob.blobs[num_blobs - 1].area = i;
+		blobstream_publish(bs, i, clock_now_ns(), &ob);
+	}
+
+	blobstream_destroy(bs);
+	free(ob.blobs);
+
+	return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
@@ -0,0 +1,53 @@
+/*
+ * Shared memory stream of blob observations
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ */
+#ifndef __BLOBSTREAM_H__
+#define __BLOBSTREAM_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "blobwatch.h"
+
+#define BLOBSTREAM_MAGIC	"RIFTBLB"
+#define BLOBSTREAM_VERSION	1
+#define BLOBSTREAM_DEFAULT_NAME	"/rift-blobs"
+
+/*
+ * One observation in the ring. seq is a seqlock counter: odd while the
+ * writer updates the frame, incremented again when it is done.
+ */
+struct blobstream_frame {
+	uint32_t seq;
+	uint32_t sequence;
+	/* publish count, increases by one per frame */
+	uint64_t index;
+	/* capture timestamp, and monotonic time of publishing in ns */
+	uint64_t timestamp;
+	uint64_t published;
+	int32_t num_blobs;
+	int32_t dropped_blobs;
+	struct blob blobs[];
+};
+
+struct blobstream;
+struct blobstream_reader;
+
+/* Writer */
+struct blobstream *blobstream_create(const char *name, int max_blobs);
+void blobstream_destroy(struct blobstream *bs);
+void blobstream_publish(struct blobstream *bs, uint32_t sequence,
+			uint64_t timestamp, const struct blobservation *ob);
+
+/* Reader */
+struct blobstream_reader *blobstream_open(const char *name);
+void blobstream_close(struct blobstream_reader *r);
+int blobstream_max_blobs(struct blobstream_reader *r);
+const struct blobstream_frame *blobstream_next(struct blobstream_reader *r,
+					       uint32_t *seq);
+bool blobstream_frame_valid(const struct blobstream_frame *f, uint32_t seq);
+
+int blobstream_latency_test(int argc, char **argv);
+
+#endif /* __BLOBSTREAM_H__ */
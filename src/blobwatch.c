@@ -3,15 +3,27 @@
  * Copyright 2014-2015 Philipp Zabel
  * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
  */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <math.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+#include "binlog.h"
 #include "blobwatch.h"
+#include "clock.h"
+#include "flicker.h"
+#include "rle.h"
+#include "threadpool.h"
 //#include "debug.h"
-//#include "flicker.h"
 
 struct leds;
 
@@ -19,6 +31,17 @@ struct leds;
 
 #define THRESHOLD 0x9f
 
+/*
+ * The adaptive threshold is computed from a histogram over every
+ * HISTOGRAM_ROW_STEP-th row, starting at a different row each frame, and
+ * every HISTOGRAM_COL_STEP-th pixel. It is kept between ADAPTIVE_MIN and
+ * ADAPTIVE_MAX.
+ */
+#define HISTOGRAM_ROW_STEP	16
+#define HISTOGRAM_COL_STEP	2
+#define ADAPTIVE_MIN		0x40
+#define ADAPTIVE_MAX		0xf0
+
 #define NUM_FRAMES_HISTORY	2
 
 #define abs(x) ((x) >= 0 ? (x) : -(x))
@@ -26,240 +49,2148 @@ struct leds;
 #define max(x, y) ((x) > (y) ? (x) : (y))
 
 /*
- * Blob detector internal state
+ * Run finders return the position of the first pixel at or after x whose value
+ * is above (find_bright) or not above (find_dark) the threshold, or width if
+ * there is none.
+ */
+typedef int (*run_finder)(const uint8_t *line, int x, int width,
+			  uint8_t threshold);
+
+struct blobwatch;
+struct extent_line;
+struct rle_frame;
+struct roi_span;
+
+/*
+ * Scanline detectors, specialized for hysteresis and moment accumulation.
+ */
+typedef int (*scanline_func)(struct blobwatch *bw, uint8_t *line,
+			     const struct roi_span *spans, int num_spans,
+			     int height, int y, struct extent_line *el,
+			     struct extent_line *prev_el, int index,
+			     int max_labels, struct extent *done, int *parent,
+			     const struct rle_frame *rle);
+
+/*
+ * Previous blobs are binned by their predicted position into square grid cells
+ * of 1 << GRID_SHIFT pixels, and each blob keeps at most MAX_CANDIDATES
+ * nearest predecessors for the assignment.
+ */
+#define GRID_SHIFT		5
+#define MAX_CANDIDATES		4
+
+/*
+ * Blobs are labeled with up to LABELS_PER_BLOB labels per blob of the budget,
+ * plus one line of extents, because fragments of a blob are labeled
+ * separately until they meet. Only whole blobs count against the budget.
+ */
+#define LABELS_PER_BLOB		4
+
+/*
+ * Scan windows extend ROI_MARGIN pixels beyond a blob's predicted bounding
+ * box, grown by its velocity. Window rows are budgeted at ROI_MAX_ROWS per
+ * blob on average, more fall back to a full scan.
+ */
+#define ROI_MARGIN		8
+#define ROI_MAX_ROWS		64
+
+/*
+ * Noise model of the track filter: variance of a measured blob center in
+ * pixels squared, variance of the random acceleration in pixels squared per
+ * frame to the fourth, and initial velocity variance of new blobs, wide
+ * enough that the first match sets the velocity almost entirely.
+ */
+#define FILTER_MEASUREMENT_VAR	1.0f
+#define FILTER_ACCEL_VAR	0.05f
+#define FILTER_INITIAL_VEL_VAR	100.0f
+
+/*
+ * Predictions are extrapolated over at most this many frame intervals, after
+ * longer gaps tracks are unlikely to continue anyway.
+ */
+#define MAX_FRAME_STEPS		30
+
+#define ARENA_ALIGN		64
+#define ARENA_SIZE(size)	(((size) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+struct blobwatch;
+
+/*
+ * Possible association of a blob with a previous blob, weighted by the squared
+ * distance between the blob and the predicted position of its predecessor.
+ */
+struct track_candidate {
+	uint32_t cost;
+	uint16_t blob;
+	uint16_t prev;
+};
+
+/*
+ * Predicted bounding box center and centroid of a blob of the last
+ * observation in the current frame.
+ */
+struct blob_prediction {
+	int x;
+	int y;
+	float cx;
+	float cy;
+};
+
+/*
+ * Range of pixels [start, end) of a scanline to search for blobs.
+ */
+struct roi_span {
+	uint16_t start;
+	uint16_t end;
+};
+
+struct roi_window {
+	int x0, x1;
+	int y0, y1;
+};
+
+/*
+ * Horizontal strip of the frame, processed by a single worker thread.
+ * Blob indices are local to the strip until it is stitched to the strip
+ * above. The first extent line is kept for stitching, the other two are
+ * alternately used for the current and previous scanline. With union-find
+ * labeling, done holds the accumulated properties of each label and parent
+ * its equivalence table.
+ */
+struct blobwatch_strip {
+	struct blobwatch *bw;
+	uint8_t *lines;
+	int width;
+	int height;
+	int y0;
+	int y1;
+	int num_blobs;
+	int max_labels;
+	struct extent_line el[3];
+	struct extent_line *last_el;
+	struct extent *done;
+	struct extent **link;
+	int *map;
+	int *parent;
+	/* encoded rows of the strip, or NULL to scan the pixels */
+	const struct rle_frame *rle;
+};
+
+/*
+ * Blob detector internal state. The blob arrays of the observation history and
+ * the global label tables are allocated together with this structure, sized
+ * by the blob budget.
  */
 struct blobwatch {
 	int width;
 	int height;
+	int max_blobs;
+	/* capacity of the label tables done and parent */
+	int max_labels;
+	int max_extents;
 	int last_observation;
 	struct blobservation history[NUM_FRAMES_HISTORY];
-	struct extent_line el[960];
+	struct extent *done;
+	int *parent;
+	enum blobwatch_labeling labeling;
+	enum blobwatch_predictor predictor;
+	/* timestamp of the last frame and estimated frame interval */
+	uint64_t last_timestamp;
+	uint64_t frame_interval;
+	int grid_width;
+	int grid_height;
+	int *grid_start;
+	uint16_t *grid_blobs;
+	int *grid_cell;
+	uint8_t *prev_matched;
+	struct track_candidate *candidates;
+	struct blob_prediction *predicted;
+	/* region of interest scanning, see blobwatch_set_roi() */
+	int roi_interval;
+	int roi_age;
+	bool roi_lost;
+	bool roi_active;
+	struct roi_window *roi_windows;
+	int *roi_start;
+	int *roi_num;
+	struct roi_span *roi_spans;
+	int max_roi_spans;
+	struct roi_span full_span;
+	struct threadpool *tp;
+	bool own_tp;
+	struct blobwatch_strip *strips;
+	int num_strips;
+	struct blobwatch_timings timings;
 	bool debug;
-	//struct flicker *fl;
+	bool moments;
+	/* configured thresholds, see blobwatch_set_threshold() */
+	uint8_t threshold;
+	uint8_t hysteresis;
+	bool adaptive;
+	uint8_t adaptive_threshold;
+	int histogram_phase;
+	uint32_t histogram[256];
+	/* thresholds and scanline detector used for the current frame */
+	uint8_t high;
+	uint8_t low;
+	scanline_func process_scanline;
+	enum blobwatch_scanner scanner;
+	run_finder find_bright;
+	run_finder find_dark;
+	/* blink pattern decoder, see blobwatch_set_flicker() */
+	struct flicker *fl;
+	/* thresholded runs of the frame, see blobwatch_set_rle() */
+	struct rle_frame *rle;
+	bool rle_active;
+};
+
+/*
+ * Carves the next size bytes out of a preallocated arena.
+ */
+static inline void *arena_take(char **arena, size_t size)
+{
+	void *p = *arena;
+
+	*arena += ARENA_SIZE(size);
+	return p;
+}
+
+static int find_bright_scalar(const uint8_t *line, int x, int width,
+			      uint8_t threshold)
+{
+	while (x < width && line[x] <= threshold)
+		x++;
+	return x;
+}
+
+static int find_dark_scalar(const uint8_t *line, int x, int width,
+			    uint8_t threshold)
+{
+	while (x < width && line[x] > threshold)
+		x++;
+	return x;
+}
+
+#ifdef HAVE_X86_SIMD
+/*
+ * There is no unsigned byte comparison in SSE2 or AVX2, so both the pixel
+ * values and the threshold are biased by 0x80 and compared as signed bytes.
+ * Frames are mostly black, so the bright finders test 64 pixels per iteration
+ * before looking for the exact position.
+ */
+__attribute__((target("sse2")))
+static inline int bright_mask_sse2(const uint8_t *p, __m128i thr)
+{
+	const __m128i bias = _mm_set1_epi8((char)0x80);
+	__m128i v = _mm_loadu_si128((const __m128i *)p);
+
+	return _mm_movemask_epi8(_mm_cmpgt_epi8(_mm_xor_si128(v, bias), thr));
+}
+
+__attribute__((target("sse2")))
+static int find_bright_sse2(const uint8_t *line, int x, int width,
+			    uint8_t threshold)
+{
+	const __m128i thr = _mm_set1_epi8((char)(threshold ^ 0x80));
+
+	for (; x + 64 <= width; x += 64) {
+		int m0 = bright_mask_sse2(line + x, thr);
+		int m1 = bright_mask_sse2(line + x + 16, thr);
+		int m2 = bright_mask_sse2(line + x + 32, thr);
+		int m3 = bright_mask_sse2(line + x + 48, thr);
+
+		if (!(m0 | m1 | m2 | m3))
+			continue;
+		if (m0)
+			return x + __builtin_ctz(m0);
+		if (m1)
+			return x + 16 + __builtin_ctz(m1);
+		if (m2)
+			return x + 32 + __builtin_ctz(m2);
+		return x + 48 + __builtin_ctz(m3);
+	}
+
+	for (; x + 16 <= width; x += 16) {
+		int m = bright_mask_sse2(line + x, thr);
+
+		if (m)
+			return x + __builtin_ctz(m);
+	}
+
+	return find_bright_scalar(line, x, width, threshold);
+}
+
+__attribute__((target("sse2")))
+static int find_dark_sse2(const uint8_t *line, int x, int width,
+			  uint8_t threshold)
+{
+	const __m128i thr = _mm_set1_epi8((char)(threshold ^ 0x80));
+
+	for (; x + 16 <= width; x += 16) {
+		int m = ~bright_mask_sse2(line + x, thr) & 0xffff;
+
+		if (m)
+			return x + __builtin_ctz(m);
+	}
+
+	return find_dark_scalar(line, x, width, threshold);
+}
+
+__attribute__((target("avx2")))
+static inline unsigned int bright_mask_avx2(const uint8_t *p, __m256i thr)
+{
+	const __m256i bias = _mm256_set1_epi8((char)0x80);
+	__m256i v = _mm256_loadu_si256((const __m256i *)p);
+
+	return _mm256_movemask_epi8(_mm256_cmpgt_epi8(_mm256_xor_si256(v, bias),
+						      thr));
+}
+
+__attribute__((target("avx2")))
+static int find_bright_avx2(const uint8_t *line, int x, int width,
+			    uint8_t threshold)
+{
+	const __m256i thr = _mm256_set1_epi8((char)(threshold ^ 0x80));
+
+	for (; x + 64 <= width; x += 64) {
+		unsigned int m0 = bright_mask_avx2(line + x, thr);
+		unsigned int m1 = bright_mask_avx2(line + x + 32, thr);
+
+		if (!(m0 | m1))
+			continue;
+		if (m0)
+			return x + __builtin_ctz(m0);
+		return x + 32 + __builtin_ctz(m1);
+	}
+
+	for (; x + 32 <= width; x += 32) {
+		unsigned int m = bright_mask_avx2(line + x, thr);
+
+		if (m)
+			return x + __builtin_ctz(m);
+	}
+
+	return find_bright_scalar(line, x, width, threshold);
+}
+
+__attribute__((target("avx2")))
+static int find_dark_avx2(const uint8_t *line, int x, int width,
+			  uint8_t threshold)
+{
+	const __m256i thr = _mm256_set1_epi8((char)(threshold ^ 0x80));
+
+	for (; x + 32 <= width; x += 32) {
+		unsigned int m = ~bright_mask_avx2(line + x, thr);
+
+		if (m)
+			return x + __builtin_ctz(m);
+	}
+
+	return find_dark_scalar(line, x, width, threshold);
+}
+#endif /* HAVE_X86_SIMD */
+
+/*
+ * Selects the run finder implementation. BLOBWATCH_SCANNER_AUTO picks the
+ * fastest one supported by the CPU.
+ *
+ * Returns 0 on success or -ENOTSUP if the requested variant is not supported.
+ */
+int blobwatch_set_scanner(struct blobwatch *bw, enum blobwatch_scanner scanner)
+{
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+
+	if (scanner == BLOBWATCH_SCANNER_AUTO) {
+		if (__builtin_cpu_supports("avx2"))
+			scanner = BLOBWATCH_SCANNER_AVX2;
+		else if (__builtin_cpu_supports("sse2"))
+			scanner = BLOBWATCH_SCANNER_SSE2;
+		else
+			scanner = BLOBWATCH_SCANNER_SCALAR;
+	}
+
+	switch (scanner) {
+	case BLOBWATCH_SCANNER_AVX2:
+		if (!__builtin_cpu_supports("avx2"))
+			return -ENOTSUP;
+		bw->find_bright = find_bright_avx2;
+		bw->find_dark = find_dark_avx2;
+		break;
+	case BLOBWATCH_SCANNER_SSE2:
+		if (!__builtin_cpu_supports("sse2"))
+			return -ENOTSUP;
+		bw->find_bright = find_bright_sse2;
+		bw->find_dark = find_dark_sse2;
+		break;
+	case BLOBWATCH_SCANNER_SCALAR:
+		bw->find_bright = find_bright_scalar;
+		bw->find_dark = find_dark_scalar;
+		break;
+	default:
+		return -ENOTSUP;
+	}
+#else
+	if (scanner != BLOBWATCH_SCANNER_AUTO &&
+	    scanner != BLOBWATCH_SCANNER_SCALAR)
+		return -ENOTSUP;
+	scanner = BLOBWATCH_SCANNER_SCALAR;
+	bw->find_bright = find_bright_scalar;
+	bw->find_dark = find_dark_scalar;
+#endif
+
+	bw->scanner = scanner;
+	return 0;
+}
+
+/*
+ * Returns the run finder implementation in use.
+ */
+enum blobwatch_scanner blobwatch_get_scanner(struct blobwatch *bw)
+{
+	return bw->scanner;
+}
+
+/*
+ * Allocates and initializes blobwatch structure. All storage is sized from the
+ * frame dimensions and the blob budget max_blobs, the maximum number of blobs
+ * reported per frame. If max_blobs is 0, BLOBWATCH_DEFAULT_MAX_BLOBS is used.
+ *
+ * Returns the newly allocated blobwatch structure.
+ */
+struct blobwatch *blobwatch_new(int width, int height, int max_blobs)
+{
+	struct blobwatch *bw;
+	int grid_width, grid_height;
+	int max_extents, max_labels;
+	size_t size;
+	char *arena;
+	int i;
+
+	if (max_blobs == 0)
+		max_blobs = BLOBWATCH_DEFAULT_MAX_BLOBS;
+	if (width < 1 || width > UINT16_MAX || height < 1 ||
+	    height > UINT16_MAX || max_blobs < 1 ||
+	    max_blobs > BLOBWATCH_MAX_BLOBS)
+		return NULL;
+
+	grid_width = (width + (1 << GRID_SHIFT) - 1) >> GRID_SHIFT;
+	grid_height = (height + (1 << GRID_SHIFT) - 1) >> GRID_SHIFT;
+	/* Extents are at least three pixels wide and separated by a gap */
+	max_extents = (width + 1) / 4 + 1;
+	/* Strip-local labels, one line more, are stored in uint16_t indices */
+	max_labels = min(LABELS_PER_BLOB * max_blobs + max_extents,
+			 UINT16_MAX - max_extents);
+
+	size = ARENA_SIZE(sizeof(*bw)) +
+	       NUM_FRAMES_HISTORY * ARENA_SIZE(max_blobs * sizeof(struct blob)) +
+	       NUM_FRAMES_HISTORY * ARENA_SIZE(max_blobs * sizeof(uint16_t)) +
+	       ARENA_SIZE(max_labels * sizeof(struct extent)) +
+	       ARENA_SIZE(max_labels * sizeof(int)) +
+	       ARENA_SIZE((grid_width * grid_height + 1) * sizeof(int)) +
+	       ARENA_SIZE(max_blobs * sizeof(uint16_t)) +
+	       ARENA_SIZE(max_blobs * sizeof(int)) +
+	       ARENA_SIZE(max_blobs * sizeof(uint8_t)) +
+	       ARENA_SIZE(max_blobs * MAX_CANDIDATES *
+			  sizeof(struct track_candidate)) +
+	       ARENA_SIZE(max_blobs * sizeof(struct blob_prediction));
+
+	arena = calloc(1, size);
+	if (!arena)
+		return NULL;
+
+	bw = arena_take(&arena, sizeof(*bw));
+	for (i = 0; i < NUM_FRAMES_HISTORY; i++) {
+		bw->history[i].blobs = arena_take(&arena, max_blobs *
+						  sizeof(struct blob));
+		bw->history[i].tracked = arena_take(&arena, max_blobs *
+						    sizeof(uint16_t));
+	}
+	bw->done = arena_take(&arena, max_labels * sizeof(struct extent));
+	bw->parent = arena_take(&arena, max_labels * sizeof(int));
+	bw->grid_start = arena_take(&arena, (grid_width * grid_height + 1) *
+				    sizeof(int));
+	bw->grid_blobs = arena_take(&arena, max_blobs * sizeof(uint16_t));
+	bw->grid_cell = arena_take(&arena, max_blobs * sizeof(int));
+	bw->prev_matched = arena_take(&arena, max_blobs * sizeof(uint8_t));
+	bw->candidates = arena_take(&arena, max_blobs * MAX_CANDIDATES *
+				    sizeof(struct track_candidate));
+	bw->predicted = arena_take(&arena, max_blobs *
+				   sizeof(struct blob_prediction));
+
+	bw->width = width;
+	bw->grid_width = grid_width;
+	bw->grid_height = grid_height;
+	bw->height = height;
+	bw->max_blobs = max_blobs;
+	bw->max_labels = max_labels;
+	bw->max_extents = max_extents;
+	bw->last_observation = -1;
+	bw->debug = true;
+	bw->moments = true;
+	bw->threshold = THRESHOLD;
+	bw->adaptive_threshold = THRESHOLD;
+	blobwatch_set_scanner(bw, BLOBWATCH_SCANNER_AUTO);
+	if (blobwatch_set_threads(bw, 1) < 0) {
+		free(bw);
+		return NULL;
+	}
+
+	return bw;
+}
+
+/*
+ * Stops the worker threads and frees the blobwatch structure.
+ */
+void blobwatch_free(struct blobwatch *bw)
+{
+	if (!bw)
+		return;
+
+	if (bw->own_tp)
+		threadpool_free(bw->tp);
+	flicker_free(bw->fl);
+	rle_frame_free(bw->rle);
+	free(bw->roi_windows);
+	free(bw->strips);
+	free(bw);
+}
+
+/*
+ * Returns the maximum number of blobs reported per frame.
+ */
+int blobwatch_get_max_blobs(struct blobwatch *bw)
+{
+	return bw->max_blobs;
+}
+
+/*
+ * Enables scanning only windows around the predicted positions of the blobs
+ * seen in the previous frame. The full frame is still scanned every interval
+ * frames, and right after a track was lost, to pick up new blobs.
+ * An interval of 0 or 1 scans every frame completely.
+ *
+ * Returns 0 on success or a negative error code.
+ */
+int blobwatch_set_roi(struct blobwatch *bw, int interval)
+{
+	size_t size;
+	char *arena;
+
+	if (interval < 0)
+		return -EINVAL;
+
+	if (interval > 1 && !bw->roi_windows) {
+		bw->max_roi_spans = bw->max_blobs * ROI_MAX_ROWS;
+		size = ARENA_SIZE(bw->max_blobs * sizeof(struct roi_window)) +
+		       ARENA_SIZE((bw->height + 1) * sizeof(int)) +
+		       ARENA_SIZE(bw->height * sizeof(int)) +
+		       ARENA_SIZE(bw->max_roi_spans * sizeof(struct roi_span));
+
+		arena = calloc(1, size);
+		if (!arena)
+			return -ENOMEM;
+
+		bw->roi_windows = arena_take(&arena, bw->max_blobs *
+					     sizeof(struct roi_window));
+		bw->roi_start = arena_take(&arena, (bw->height + 1) *
+					   sizeof(int));
+		bw->roi_num = arena_take(&arena, bw->height * sizeof(int));
+		bw->roi_spans = arena_take(&arena, bw->max_roi_spans *
+					   sizeof(struct roi_span));
+	}
+
+	bw->roi_interval = interval > 1 ? interval : 0;
+	bw->roi_age = 0;
+	bw->roi_lost = false;
+
+	return 0;
+}
+
+/*
+ * Returns the full frame scan interval, or 0 if every frame is fully scanned.
+ */
+int blobwatch_get_roi(struct blobwatch *bw)
+{
+	return bw->roi_interval;
+}
+
+/*
+ * Sets the threshold that pixels of a blob must exceed. With hysteresis, only
+ * blobs that have at least one pixel above it are reported, so it must stay
+ * above the low threshold.
+ *
+ * Returns 0 on success or a negative error code.
+ */
+int blobwatch_set_threshold(struct blobwatch *bw, int threshold)
+{
+	if (threshold < 0 || threshold > 254 ||
+	    (bw->hysteresis && threshold <= bw->hysteresis))
+		return -EINVAL;
+
+	bw->threshold = threshold;
+	bw->adaptive_threshold = threshold;
+
+	return 0;
+}
+
+/*
+ * Returns the threshold used for the last frame, which differs from the
+ * configured threshold in adaptive mode.
+ */
+int blobwatch_get_threshold(struct blobwatch *bw)
+{
+	return bw->high ? bw->high : bw->threshold;
+}
+
+/*
+ * Enables hysteresis segmentation: blobs are grown down to pixels above the
+ * low threshold, but only those with a pixel above the threshold are kept.
+ * In adaptive mode the low threshold is scaled with the threshold.
+ * A low threshold of 0 disables hysteresis.
+ *
+ * Returns 0 on success or a negative error code.
+ */
+int blobwatch_set_hysteresis(struct blobwatch *bw, int low)
+{
+	if (low < 0 || (low && low >= bw->threshold))
+		return -EINVAL;
+
+	bw->hysteresis = low;
+
+	return 0;
+}
+
+/*
+ * Enables choosing the threshold from a histogram of the previous frame,
+ * starting from the configured threshold.
+ */
+void blobwatch_set_adaptive(struct blobwatch *bw, bool enable)
+{
+	bw->adaptive = enable;
+	bw->adaptive_threshold = bw->threshold;
+}
+
+/*
+ * Enables or disables accumulation of intensity weighted moments while
+ * scanning. Without them, blob centroids fall back to the bounding box center.
+ */
+void blobwatch_set_moments(struct blobwatch *bw, bool enable)
+{
+	bw->moments = enable;
+}
+
+bool blobwatch_get_moments(struct blobwatch *bw)
+{
+	return bw->moments;
+}
+
+/*
+ * Selects how runs of bright pixels are grouped into blobs, see
+ * enum blobwatch_labeling.
+ *
+ * Returns 0 on success or a negative error code.
+ */
+int blobwatch_set_labeling(struct blobwatch *bw,
+			   enum blobwatch_labeling labeling)
+{
+	if (labeling != BLOBWATCH_LABELING_UNION_FIND &&
+	    labeling != BLOBWATCH_LABELING_OVERLAP)
+		return -EINVAL;
+
+	bw->labeling = labeling;
+
+	return 0;
+}
+
+enum blobwatch_labeling blobwatch_get_labeling(struct blobwatch *bw)
+{
+	return bw->labeling;
+}
+
+/*
+ * Selects how the blob positions in the next frame are predicted, see
+ * enum blobwatch_predictor.
+ *
+ * Returns 0 on success or a negative error code.
+ */
+int blobwatch_set_predictor(struct blobwatch *bw,
+			    enum blobwatch_predictor predictor)
+{
+	if (predictor != BLOBWATCH_PREDICTOR_KALMAN &&
+	    predictor != BLOBWATCH_PREDICTOR_DIFFERENCE)
+		return -EINVAL;
+
+	bw->predictor = predictor;
+
+	return 0;
+}
+
+enum blobwatch_predictor blobwatch_get_predictor(struct blobwatch *bw)
+{
+	return bw->predictor;
+}
+
+/*
+ * Enables or disables identification of tracked blobs by the blink patterns
+ * of the LEDs passed to blobwatch_process(). Identified blobs have their
+ * led_id set.
+ *
+ * Returns 0 on success or a negative error code.
+ */
+int blobwatch_set_flicker(struct blobwatch *bw, bool enable)
+{
+	if (!enable) {
+		flicker_free(bw->fl);
+		bw->fl = NULL;
+		return 0;
+	}
+
+	if (!bw->fl) {
+		bw->fl = flicker_new(bw->max_blobs);
+		if (!bw->fl)
+			return -ENOMEM;
+	}
+
+	return 0;
+}
+
+/*
+ * Returns the blink pattern identification counts, all zero if flicker
+ * decoding is disabled.
+ */
+void blobwatch_get_flicker_stats(struct blobwatch *bw,
+				 struct flicker_stats *stats)
+{
+	if (bw->fl)
+		flicker_get_stats(bw->fl, stats);
+	else
+		memset(stats, 0, sizeof(*stats));
+}
+
+/*
+ * Enables encoding each fully scanned frame into runs of pixels above the low
+ * threshold, which the scanline detector then consumes instead of the pixels,
+ * and which are left for other consumers, see blobwatch_get_rle(). Every
+ * strip encodes its own rows. Strips whose runs do not fit scan their pixels
+ * instead.
+ *
+ * Returns 0 on success or a negative error code.
+ */
+int blobwatch_set_rle(struct blobwatch *bw, bool enable)
+{
+	if (!enable) {
+		rle_frame_free(bw->rle);
+		bw->rle = NULL;
+		bw->rle_active = false;
+		return 0;
+	}
+
+	if (!bw->rle) {
+		bw->rle = rle_frame_new(bw->width, bw->height, 0, 0);
+		if (!bw->rle)
+			return -ENOMEM;
+	}
+
+	return 0;
+}
+
+/*
+ * Returns the runs of the last frame, valid until the next call of
+ * blobwatch_process(), or NULL if the frame was not encoded completely, or
+ * only scanned in windows.
+ */
+const struct rle_frame *blobwatch_get_rle(struct blobwatch *bw)
+{
+	return bw->rle_active && bw->rle->complete ? bw->rle : NULL;
+}
+
+/*
+ * Allocates num_strips strips, and switches to the thread pool tp. The
+ * per-strip scratch storage is allocated in one block here.
+ */
+static int setup_strips(struct blobwatch *bw, int num_strips,
+			struct threadpool *tp, bool own_tp)
+{
+	struct blobwatch_strip *strips;
+	/*
+	 * Blobs continued from the strip above are numbered locally, too, so
+	 * each strip can hold up to one line of extents more labels.
+	 */
+	int max_local = bw->max_labels + bw->max_extents;
+	size_t strip_size;
+	char *arena;
+	int i, j;
+
+	strip_size = ARENA_SIZE(max_local * sizeof(struct extent)) +
+		     ARENA_SIZE(max_local * sizeof(struct extent *)) +
+		     2 * ARENA_SIZE(max_local * sizeof(int)) +
+		     3 * ARENA_SIZE(bw->max_extents * sizeof(struct extent));
+
+	arena = calloc(1, ARENA_SIZE(num_strips * sizeof(*strips)) +
+			  num_strips * strip_size);
+	if (!arena) {
+		if (own_tp)
+			threadpool_free(tp);
+		return -ENOMEM;
+	}
+
+	strips = arena_take(&arena, num_strips * sizeof(*strips));
+	for (i = 0; i < num_strips; i++) {
+		struct blobwatch_strip *s = &strips[i];
+
+		s->bw = bw;
+		s->max_labels = max_local;
+		s->done = arena_take(&arena, max_local * sizeof(struct extent));
+		s->link = arena_take(&arena, max_local *
+				     sizeof(struct extent *));
+		s->map = arena_take(&arena, max_local * sizeof(int));
+		s->parent = arena_take(&arena, max_local * sizeof(int));
+		for (j = 0; j < 3; j++)
+			s->el[j].extents = arena_take(&arena, bw->max_extents *
+						      sizeof(struct extent));
+	}
+
+	if (bw->own_tp)
+		threadpool_free(bw->tp);
+	free(bw->strips);
+	bw->tp = tp;
+	bw->own_tp = own_tp;
+	bw->strips = strips;
+	bw->num_strips = num_strips;
+
+	return 0;
+}
+
+/*
+ * Splits blob detection into num_threads horizontal strips that are processed
+ * concurrently, with num_threads - 1 persistent worker threads helping the
+ * calling thread. The result is the same as with a single thread.
+ *
+ * Returns 0 on success or a negative error code.
+ */
+int blobwatch_set_threads(struct blobwatch *bw, int num_threads)
+{
+	struct threadpool *tp = NULL;
+
+	if (num_threads < 1 || num_threads > bw->height)
+		return -EINVAL;
+
+	if (num_threads > 1) {
+		tp = threadpool_new(num_threads - 1);
+		if (!tp)
+			return -ENOMEM;
+	}
+
+	return setup_strips(bw, num_threads, tp, true);
+}
+
+/*
+ * Splits blob detection into num_strips horizontal strips that are processed
+ * on the thread pool tp, which can be shared with other detectors and must
+ * outlive this one.
+ *
+ * Returns 0 on success or a negative error code.
+ */
+int blobwatch_set_threadpool(struct blobwatch *bw, struct threadpool *tp,
+			     int num_strips)
+{
+	if (num_strips < 1 || num_strips > bw->height)
+		return -EINVAL;
+
+	return setup_strips(bw, num_strips, tp, false);
+}
+
+/*
+ * Returns the number of strips processed concurrently.
+ */
+int blobwatch_get_threads(struct blobwatch *bw)
+{
+	return bw->num_strips;
+}
+
+/*
+ * Records the last extent e of a finished blob, which ended above line y, into
+ * the array done at index e->index.
+ */
+static inline void finish_blob(struct extent *e, int y, struct extent *done)
+{
+	done += e->index;
+	*done = *e;
+	done->bottom = y;
+}
+
+/*
+ * Starts the track filter of a new blob at its measured center, at rest but
+ * with a wide velocity variance.
+ */
+static inline void filter_init(struct blob_filter *f, float x, float y)
+{
+	f->x = x;
+	f->y = y;
+	f->vx = 0;
+	f->vy = 0;
+	f->pxx = FILTER_MEASUREMENT_VAR;
+	f->pvv = FILTER_INITIAL_VEL_VAR;
+	f->pxv = 0;
+}
+
+/*
+ * Advances the filter state by dt frames of constant velocity.
+ */
+static void filter_predict(struct blob_filter *f, float dt)
+{
+	float q = FILTER_ACCEL_VAR;
+
+	f->x += f->vx * dt;
+	f->y += f->vy * dt;
+	f->pxx += dt * (2 * f->pxv + dt * f->pvv) + q * dt * dt * dt * dt / 4;
+	f->pxv += dt * f->pvv + q * dt * dt * dt / 2;
+	f->pvv += q * dt * dt;
+}
+
+/*
+ * Corrects the predicted state with the measured center x, y.
+ */
+static void filter_update(struct blob_filter *f, float x, float y)
+{
+	float s = f->pxx + FILTER_MEASUREMENT_VAR;
+	float kx = f->pxx / s;
+	float kv = f->pxv / s;
+	float dx = x - f->x;
+	float dy = y - f->y;
+
+	f->x += kx * dx;
+	f->y += kx * dy;
+	f->vx += kv * dx;
+	f->vy += kv * dy;
+	f->pvv -= kv * f->pxv;
+	f->pxx -= kx * f->pxx;
+	f->pxv -= kx * f->pxv;
+}
+
+/*
+ * Stores blob information collected in the finished extent e into blob b.
+ */
+static inline void store_blob(struct extent *e, struct blob *b)
+{
+	int y = e->bottom;
+
+	b->x = (e->left + e->right) / 2;
+	b->y = (e->top + y) / 2;
+	b->vx = 0;
+	b->vy = 0;
+	b->width = e->right - e->left + 1;
+	b->height = y - e->top + 1;
+	b->area = e->area;
+	b->peak = e->m.peak;
+	if (e->m.sw) {
+		double sw = e->m.sw;
+		double cx = e->m.sx / sw;
+		double cy = e->m.sy / sw;
+
+		b->cx = cx;
+		b->cy = cy;
+		b->cxx = e->m.sxx / sw - cx * cx;
+		b->cyy = e->m.syy / sw - cy * cy;
+		b->cxy = e->m.sxy / sw - cx * cy;
+	} else {
+		b->cx = b->x;
+		b->cy = b->y;
+		b->cxx = 0;
+		b->cyy = 0;
+		b->cxy = 0;
+	}
+	b->age = 0;
+	b->track_index = -1;
+	b->pattern = 0;
+	b->led_id = -1;
+	filter_init(&b->filter, b->cx, b->cy);
+}
+
+/*
+ * Computes the intensity weighted sums over the run of pixels px from start to
+ * end, inclusive, in scanline y. The row sums are accumulated per pixel, the
+ * y terms are derived from them.
+ */
+static inline void run_moments(const uint8_t *px, int start, int end, int y,
+			       struct blob_moments *m)
+{
+	uint64_t s1 = 0, s2 = 0;
+	uint32_t s0 = 0;
+	uint8_t peak = 0;
+	int x;
+
+	for (x = start; x <= end; x++) {
+		uint32_t w = px[x - start];
+
+		s0 += w;
+		s1 += w * x;
+		s2 += (uint64_t)(w * x) * x;
+		peak = max(peak, px[x - start]);
+	}
+
+	m->sw = s0;
+	m->sx = s1;
+	m->sy = (uint64_t)s0 * y;
+	m->sxx = s2;
+	m->syy = (uint64_t)s0 * y * y;
+	m->sxy = s1 * y;
+	m->peak = peak;
+}
+
+static inline void add_moments(struct blob_moments *m,
+			       const struct blob_moments *p)
+{
+	m->sw += p->sw;
+	m->sx += p->sx;
+	m->sy += p->sy;
+	m->sxx += p->sxx;
+	m->syy += p->syy;
+	m->sxy += p->sxy;
+	m->peak = max(m->peak, p->peak);
+}
+
+/*
+ * Returns the label that the equivalence class of label l is merged into, the
+ * smallest one of the class. Labels at or over the capacity max_labels are
+ * never merged. Paths are halved on the way up.
+ */
+static inline int find_label(int *parent, int l, int max_labels)
+{
+	if (l >= max_labels)
+		return l;
+
+	while (parent[l] != l) {
+		parent[l] = parent[parent[l]];
+		l = parent[l];
+	}
+
+	return l;
+}
+
+/*
+ * Merges the properties accumulated for label p into those of label e.
+ */
+static inline void merge_label(struct extent *e, const struct extent *p)
+{
+	e->top = min(e->top, p->top);
+	e->left = min(e->left, p->left);
+	e->right = max(e->right, p->right);
+	e->bottom = max(e->bottom, p->bottom);
+	e->area += p->area;
+	add_moments(&e->m, &p->m);
+	e->seeded |= p->seeded;
+}
+
+/*
+ * Joins the equivalence classes of labels a and b, keeping the smaller label,
+ * so that blobs stay numbered in the order in which they were found.
+ * A label over the capacity joins the other class without its properties.
+ *
+ * Returns the label the joined class is merged into.
+ */
+static inline int union_labels(int *parent, struct extent *done, int a, int b,
+			       int max_labels)
+{
+	a = find_label(parent, a, max_labels);
+	b = find_label(parent, b, max_labels);
+	if (a == b)
+		return a;
+	if (a > b) {
+		int t = a;
+
+		a = b;
+		b = t;
+	}
+	if (b >= max_labels)
+		return a;
+
+	parent[b] = a;
+	merge_label(&done[a], &done[b]);
+
+	return a;
+}
+
+/*
+ * Position of process_scanline() in the extents of the current and the
+ * previous scanline.
+ */
+struct scan_state {
+	struct extent *extent;
+	struct extent *le;
+	struct extent *le_end;
+	int e;
+	int index;
 };
 
-/* temporary global */
-//bool rift_flicker;
+/*
+ * Stores the run of pixels px from start to end, inclusive, of scanline y
+ * as the next extent and connects it to the extents of the previous scanline,
+ * see process_scanline().
+ *
+ * Returns true if the extent line is full.
+ */
+static inline __attribute__((always_inline))
+bool scan_run(struct blobwatch *bw, struct scan_state *st, const uint8_t *px,
+	      int start, int end, int y, int max_labels, struct extent *done,
+	      int *parent, const bool union_find, const bool hysteresis,
+	      const bool moments)
+{
+	struct extent *extent = st->extent;
+	struct extent *le = st->le;
+	struct extent *le_end = st->le_end;
+	int len = end - start + 1;
+	int center = (start + end) / 2;
+
+	extent->start = start;
+	extent->end = end;
+	extent->area = len;
+	if (moments)
+		run_moments(px, start, end, y, &extent->m);
+	else
+		memset(&extent->m, 0, sizeof(extent->m));
+	/* Runs grown down to the low threshold need a seed */
+	if (hysteresis)
+		extent->seeded = bw->find_bright(px, 0, len, bw->high) < len;
+	else
+		extent->seeded = 1;
+
+	if (union_find) {
+		struct extent *p;
+		int label = -1;
+
+		/* Extents left of this one miss the next, too */
+		while (le < le_end && le->end + 1 < start)
+			le++;
+
+		for (p = le; p < le_end && p->start <= end + 1; p++) {
+			label = label < 0 ?
+				find_label(parent, p->index, max_labels) :
+				union_labels(parent, done, label, p->index,
+					     max_labels);
+		}
+
+		if (label < 0) {
+			label = min(st->index, max_labels);
+			st->index++;
+			if (label < max_labels) {
+				struct extent *d = &done[label];
+
+				parent[label] = label;
+				d->top = y;
+				d->left = start;
+				d->right = end;
+				d->bottom = y;
+				d->area = extent->area;
+				d->m = extent->m;
+				d->seeded = extent->seeded;
+			}
+		} else if (label < max_labels) {
+			struct extent *d = &done[label];
+
+			d->left = min(d->left, start);
+			d->right = max(d->right, end);
+			d->bottom = y;
+			d->area += extent->area;
+			add_moments(&d->m, &extent->m);
+			d->seeded |= extent->seeded;
+		}
+		extent->index = label;
+	} else {
+		/*
+		 * Previous extents without significant overlap are the
+		 * bottom of finished blobs. Store them into an array.
+		 */
+		while (le < le_end && le->end < center) {
+			if (le->index < max_labels)
+				finish_blob(le, y, done);
+			le++;
+		}
+
+		/*
+		 * A previous extent with significant overlap is
+		 * considered to be part of the same blob.
+		 */
+		if (le < le_end && le->start <= center && le->end > center) {
+			extent->top = le->top;
+			extent->left = min(extent->start, le->left);
+			extent->right = max(extent->end, le->right);
+			extent->area += le->area;
+			add_moments(&extent->m, &le->m);
+			extent->seeded |= le->seeded;
+			extent->index = le->index;
+			le++;
+		} else {
+			/*
+			 * If this extent is not part of a previous
+			 * blob, increment the blob index.
+			 */
+			extent->top = y;
+			extent->left = extent->start;
+			extent->right = extent->end;
+			extent->index = min(st->index, max_labels);
+			st->index++;
+		}
+	}
+
+	st->le = le;
+	st->extent++;
+
+	return ++st->e == bw->max_extents;
+}
+
+/*
+ * Collects contiguous ranges of pixels with values larger than the low
+ * threshold within the given spans of a scanline and stores them in extents.
+ * Extents are marked with the same index as overlapping extents of the previous
+ * scanline, and properties of the formed blobs, optionally including their
+ * intensity weighted moments, are accumulated. The last
+ * extents of finished blobs are stored in the done array.
+ * New blobs beyond the label capacity max_labels are marked with index
+ * max_labels, their extents are tracked but never stored.
+ * With union-find labeling, an extent takes the label of every 8-connected
+ * extent of the previous scanline, joining their labels in the parent table.
+ * The properties of each label are accumulated in done[label] directly, with
+ * bottom set to the last line, and there is no need to finish blobs.
+ * Runs of bright pixels are taken from the encoded frame rle if there is one,
+ * which spans the whole line, or else located with the run finders selected
+ * at blobwatch_new() time. Without hysteresis, the low threshold equals the
+ * threshold and every run counts as seeded.
+ * This is instantiated for each combination of the constant labeling,
+ * hysteresis and moments flags, so that the scan loop does not test the mode
+ * per run.
+ *
+ * Returns the number of blobs (labels) started so far, including those over
+ * capacity.
+ */
+static inline __attribute__((always_inline))
+int process_scanline(struct blobwatch *bw,
+		     uint8_t *line, const struct roi_span *spans,
+		     int num_spans, int height, int y,
+		     struct extent_line *el, struct extent_line *prev_el,
+		     int index, int max_labels, struct extent *done,
+		     int *parent, const struct rle_frame *rle,
+		     const bool union_find, const bool hysteresis,
+		     const bool moments)
+{
+	uint8_t low = bw->low;
+	struct scan_state st = {
+		.extent = el->extents,
+		.le = prev_el ? prev_el->extents : NULL,
+		.le_end = prev_el ? prev_el->extents + prev_el->num : NULL,
+		.index = index,
+	};
+	struct extent *extent;
+	bool full = false;
+	int x, i;
+
+	if (rle) {
+		const struct rle_run *r = rle->runs + rle->rows[y].first;
+
+		for (i = 0; i < rle->rows[y].num && !full; i++) {
+			/* Filter out single pixel and two-pixel extents */
+			if (r[i].end < r[i].start + 2)
+				continue;
+
+			full = scan_run(bw, &st, rle->pixels + r[i].offset,
+					r[i].start, r[i].end, y, max_labels,
+					done, parent, union_find, hysteresis,
+					moments);
+		}
+	}
+
+	for (i = 0; !rle && i < num_spans && !full; i++) {
+		int width = spans[i].end;
+
+		for (x = spans[i].start; x < width && !full; x++) {
+			int start, end;
+
+			/* Skip until pixel value exceeds threshold */
+			x = bw->find_bright(line, x, width, low);
+			if (x == width)
+				break;
+
+			start = x++;
+
+			/* Skip until pixel value falls below threshold */
+			x = bw->find_dark(line, x, width, low);
+
+			end = x - 1;
+			/* Filter out single pixel and two-pixel extents */
+			if (end < start + 2)
+				continue;
+
+			full = scan_run(bw, &st, line + start, start, end, y,
+					max_labels, done, parent, union_find,
+					hysteresis, moments);
+		}
+	}
+
+	el->num = st.e;
+
+	if (union_find)
+		return st.index;
+
+	/*
+	 * If there are no more extents on this line, all remaining
+	 * extents in the previous line are finished blobs. Store them.
+	 */
+	for (; st.le < st.le_end; st.le++) {
+		if (st.le->index < max_labels)
+			finish_blob(st.le, y, done);
+	}
+
+	if (y == height - 1) {
+		/* All extents of the last line are finished blobs, too. */
+		for (extent = el->extents; extent < el->extents + el->num;
+		     extent++) {
+			if (extent->index < max_labels)
+				finish_blob(extent, y, done);
+		}
+	}
+
+	return st.index;
+}
+
+#define DEFINE_SCANLINE(name, union_find, hysteresis, moments)		\
+static int name(struct blobwatch *bw, uint8_t *line,			\
+		const struct roi_span *spans, int num_spans, int height,	\
+		int y, struct extent_line *el, struct extent_line *prev_el,	\
+		int index, int max_labels, struct extent *done, int *parent,	\
+		const struct rle_frame *rle)					\
+{									\
+	return process_scanline(bw, line, spans, num_spans, height, y,	\
+				el, prev_el, index, max_labels, done,	\
+				parent, rle, union_find, hysteresis,	\
+				moments);				\
+}
+
+DEFINE_SCANLINE(process_scanline_plain, false, false, false)
+DEFINE_SCANLINE(process_scanline_moments, false, false, true)
+DEFINE_SCANLINE(process_scanline_hysteresis, false, true, false)
+DEFINE_SCANLINE(process_scanline_hysteresis_moments, false, true, true)
+DEFINE_SCANLINE(label_scanline_plain, true, false, false)
+DEFINE_SCANLINE(label_scanline_moments, true, false, true)
+DEFINE_SCANLINE(label_scanline_hysteresis, true, true, false)
+DEFINE_SCANLINE(label_scanline_hysteresis_moments, true, true, true)
+
+/* Indexed by labeling, hysteresis and moments */
+static const scanline_func scanline_funcs[2][2][2] = {
+	[BLOBWATCH_LABELING_UNION_FIND] = {
+		{ label_scanline_plain, label_scanline_moments },
+		{ label_scanline_hysteresis, label_scanline_hysteresis_moments },
+	},
+	[BLOBWATCH_LABELING_OVERLAP] = {
+		{ process_scanline_plain, process_scanline_moments },
+		{ process_scanline_hysteresis,
+		  process_scanline_hysteresis_moments },
+	},
+};
+
+/*
+ * Returns the spans of scanline y to search, either the scan windows that
+ * cover it or the whole line.
+ */
+static inline const struct roi_span *row_spans(struct blobwatch *bw, int y,
+					       int *num_spans)
+{
+	if (!bw->roi_active) {
+		*num_spans = 1;
+		return &bw->full_span;
+	}
+
+	*num_spans = bw->roi_num[y];
+	return &bw->roi_spans[bw->roi_start[y]];
+}
+
+static int compare_windows(const void *a, const void *b)
+{
+	const struct roi_window *w1 = a;
+	const struct roi_window *w2 = b;
+
+	return (w1->x0 > w2->x0) - (w1->x0 < w2->x0);
+}
+
+/*
+ * Places scan windows around the predicted bounding boxes of the blobs in the
+ * last observation and merges them into sorted, disjoint spans per scanline.
+ *
+ * Returns the number of pixels covered, or -1 if there are more window rows
+ * than fit into the span array.
+ */
+static int build_roi(struct blobwatch *bw, struct blobservation *last_ob,
+		     int width, int height)
+{
+	struct roi_window *w = bw->roi_windows;
+	struct roi_span *spans = bw->roi_spans;
+	int num_windows = 0, num_spans = 0, pixels = 0;
+	int i, j, k, y;
+
+	for (i = 0; i < last_ob->num_blobs; i++) {
+		struct blob *b = &last_ob->blobs[i];
+		int x = bw->predicted[i].x;
+		int rx = b->width / 2 + abs(x - b->x) + ROI_MARGIN;
+		int ry;
+
+		y = bw->predicted[i].y;
+		ry = b->height / 2 + abs(y - b->y) + ROI_MARGIN;
+		w[num_windows].x0 = max(x - rx, 0);
+		w[num_windows].x1 = min(x + rx + 1, width);
+		w[num_windows].y0 = max(y - ry, 0);
+		w[num_windows].y1 = min(y + ry + 1, height);
+
+		/* Skip blobs predicted to leave the frame */
+		if (w[num_windows].x0 >= w[num_windows].x1 ||
+		    w[num_windows].y0 >= w[num_windows].y1)
+			continue;
+
+		num_spans += w[num_windows].y1 - w[num_windows].y0;
+		num_windows++;
+	}
+
+	if (num_spans > bw->max_roi_spans)
+		return -1;
+
+	qsort(w, num_windows, sizeof(*w), compare_windows);
+
+	memset(bw->roi_num, 0, height * sizeof(int));
+	for (i = 0; i < num_windows; i++)
+		for (y = w[i].y0; y < w[i].y1; y++)
+			bw->roi_num[y]++;
+
+	bw->roi_start[0] = 0;
+	for (y = 0; y < height; y++) {
+		bw->roi_start[y + 1] = bw->roi_start[y] + bw->roi_num[y];
+		bw->roi_num[y] = 0;
+	}
+
+	/* Windows are sorted by left edge, so the spans of each row are too */
+	for (i = 0; i < num_windows; i++) {
+		for (y = w[i].y0; y < w[i].y1; y++) {
+			struct roi_span *sp = &spans[bw->roi_start[y] +
+						     bw->roi_num[y]++];
+
+			sp->start = w[i].x0;
+			sp->end = w[i].x1;
+		}
+	}
+
+	/* Merge overlapping and adjacent spans */
+	for (y = 0; y < height; y++) {
+		struct roi_span *sp = &spans[bw->roi_start[y]];
+
+		for (j = 0, k = 0; j < bw->roi_num[y]; j++) {
+			if (k > 0 && sp[j].start <= sp[k - 1].end) {
+				sp[k - 1].end = max(sp[k - 1].end, sp[j].end);
+				continue;
+			}
+			sp[k++] = sp[j];
+		}
+		bw->roi_num[y] = k;
+
+		for (j = 0; j < k; j++)
+			pixels += sp[j].end - sp[j].start;
+	}
 
-//void blobwatch_set_flicker(bool enable)
-//{
-//	rift_flicker = enable;
-//}
+	return pixels;
+}
 
 /*
- * Allocates and initializes blobwatch structure.
- *
- * Returns the newly allocated blobwatch structure.
+ * Collects extents from all scanlines of a horizontal strip of the frame,
+ * encoding the strip's rows into runs first if enabled.
+ * Blob indices are local to the strip, blobs that are still open at the
+ * bottom of the strip are left in the strip's last extent line to be stitched
+ * to the next strip.
  */
-struct blobwatch *blobwatch_new(int width, int height)
+static void process_strip(void *arg)
 {
-	struct blobwatch *bw = malloc(sizeof(*bw));
+	struct blobwatch_strip *s = arg;
+	struct blobwatch *bw = s->bw;
+	struct extent_line *el = &s->el[0];
+	struct extent_line *prev_el;
+	uint8_t *line = s->lines + s->y0 * s->width;
+	const struct roi_span *spans;
+	int num_spans;
+	int index;
+	int y;
 
-	if (!bw)
-		return NULL;
+	spans = row_spans(bw, s->y0, &num_spans);
+	s->rle = NULL;
+	if (bw->rle_active &&
+	    rle_encode_rows(bw->rle, s->lines, s->y0, s->y1, s - bw->strips,
+			    bw->num_strips) == 0)
+		s->rle = bw->rle;
 
-	memset(bw, 0, sizeof(*bw));
-	bw->width = width;
-	bw->height = height;
-	bw->last_observation = -1;
-	bw->debug = true;
-	//bw->fl = flicker_new();
+	index = bw->process_scanline(bw, line, spans, num_spans, s->height,
+				     s->y0, el, NULL, 0, s->max_labels, s->done,
+				     s->parent, s->rle);
 
-	return bw;
+	for (y = s->y0 + 1; y < s->y1; y++) {
+		prev_el = el;
+		el = &s->el[1 + ((y - s->y0 - 1) & 1)];
+		line += s->width;
+		spans = row_spans(bw, y, &num_spans);
+		index = bw->process_scanline(bw, line, spans, num_spans,
+					     s->height, y, el, prev_el, index,
+					     s->max_labels, s->done, s->parent,
+					     s->rle);
+	}
+
+	s->last_el = el;
+	s->num_blobs = index;
 }
 
 /*
- * Stores blob information collected in the last extent e into the blob
- * array b at index e->index.
+ * Merges the properties of a blob's top part p, accumulated in the strip
+ * above, into extent e.
  */
-static inline void store_blob(struct extent *e, int y, struct blob *b)
+static inline void merge_extent(struct extent *e, const struct extent *p)
 {
-	b += e->index;
-	b->x = (e->left + e->right) / 2;
-	b->y = (e->top + y) / 2;
-	b->vx = 0;
-	b->vy = 0;
-	b->width = e->right - e->left + 1;
-	b->height = y - e->top + 1;
-	b->area = e->area;
-	b->age = 0;
-	b->track_index = -1;
-	b->pattern = 0;
-	b->led_id = -1;
+	e->top = p->top;
+	e->left = min(e->left, p->left);
+	e->right = max(e->right, p->right);
+	e->area += p->area;
+	add_moments(&e->m, &p->m);
+	e->seeded |= p->seeded;
 }
 
 /*
- * Collects contiguous ranges of pixels with values larger than a threshold of
- * 0x9f in a given scanline and stores them in extents. Processing stops after
- * num_extents.
- * Extents are marked with the same index as overlapping extents of the previous
- * scanline, and properties of the formed blobs are accumulated.
+ * Stitches the blobs found in strip s to those of the strip above, prev, whose
+ * open extents in the boundary extent_line already carry global blob indices
+ * and accumulated properties. This repeats the extent matching
+ * process_scanline() would have done between the two boundary lines.
+ * Finished blobs are stored in the global done array, open extents at the
+ * bottom of the strip are updated to global indices.
  *
- * Returns the number of extents found.
+ * Returns the new number of global blob indices, including those over
+ * capacity.
  */
-static int process_scanline(uint8_t *line, int width, int height, int y,
-			    struct extent_line *el, struct extent_line *prev_el,
-			    int index, struct blobservation *ob)
+static int stitch_strip(struct blobwatch *bw, struct blobwatch_strip *s,
+			struct blobwatch_strip *prev, int num_global)
 {
-	struct extent *le_end = prev_el->extents;
-	struct extent *le = prev_el->extents;
-	struct extent *extent = el->extents;
-	struct blob *blobs = ob->blobs;
-	int num_extents = MAX_EXTENTS_PER_LINE;
-	int num_blobs = MAX_BLOBS_PER_FRAME;
-	int center;
-	int x, e = 0;
+	int num_local = min(s->num_blobs, s->max_labels);
+	struct extent_line *el = &s->el[0];
+	struct extent *e;
+	int i;
 
-	if (prev_el)
-		le_end += prev_el->num;
+	memset(s->link, 0, num_local * sizeof(*s->link));
 
-	for (x = 0; x < width; x++) {
-		int start, end;
+	if (prev) {
+		struct extent *le = prev->last_el->extents;
+		struct extent *le_end = le + prev->last_el->num;
 
-		/* Loop until pixel value exceeds threshold */
-		if (line[x] <= THRESHOLD)
-			continue;
+		for (e = el->extents; e < el->extents + el->num; e++) {
+			int center = (e->start + e->end) / 2;
+
+			while (le < le_end && le->end < center) {
+				if (le->index < bw->max_labels)
+					finish_blob(le, s->y0, bw->done);
+				le++;
+			}
+
+			if (le < le_end &&
+			    le->start <= center && le->end > center) {
+				if (e->index < s->max_labels)
+					s->link[e->index] = le;
+				le++;
+			}
+		}
 
-		start = x++;
+		for (; le < le_end; le++) {
+			if (le->index < bw->max_labels)
+				finish_blob(le, s->y0, bw->done);
+		}
+	}
+
+	/*
+	 * Blobs continued from the strip above keep their global index, new
+	 * blobs are numbered in the order in which they were found.
+	 */
+	for (i = 0; i < num_local; i++) {
+		struct extent *d = &s->done[i];
+		struct extent *link = s->link[i];
 
-		/* Loop until pixel value falls below threshold */
-		while (x < width && line[x] > THRESHOLD)
-			x++;
+		if (link) {
+			s->map[i] = link->index;
+		} else {
+			s->map[i] = min(num_global, bw->max_labels);
+			num_global++;
+		}
 
-		end = x - 1;
-		/* Filter out single pixel and two-pixel extents */
-		if (end < start + 2)
+		/* Blobs still open at the bottom of the strip are not done */
+		if (d->bottom == 0)
 			continue;
 
-		center = (start + end) / 2;
+		if (link)
+			merge_extent(d, link);
+		d->index = s->map[i];
+		if (d->index < bw->max_labels)
+			bw->done[d->index] = *d;
+		d->bottom = 0;
+	}
+	/* Local blobs over capacity are all new, never continued */
+	num_global += s->num_blobs - num_local;
 
-		extent->start = start;
-		extent->end = end;
-		extent->index = index;
-		extent->area = x - start;
+	if (s->y1 < s->height) {
+		el = s->last_el;
+		for (e = el->extents; e < el->extents + el->num; e++) {
+			if (e->index >= s->max_labels) {
+				e->index = bw->max_labels;
+				continue;
+			}
+			if (s->link[e->index])
+				merge_extent(e, s->link[e->index]);
+			e->index = s->map[e->index];
+		}
+	}
 
-		if (prev_el && index < num_blobs) {
-			/*
-			 * Previous extents without significant overlap are the
-			 * bottom of finished blobs. Store them into an array.
-			 */
-			while (le < le_end && le->end < center &&
-			       le->index < num_blobs)
-				store_blob(le++, y, blobs);
+	return num_global;
+}
 
-			/*
-			 * A previous extent with significant overlap is
-			 * considered to be part of the same blob.
-			 */
-			if (le < le_end &&
-			    le->start <= center && le->end > center) {
-				extent->top = le->top;
-				extent->left = min(extent->start, le->left);
-				extent->right = max(extent->end, le->right);
-				extent->area += le->area;
-				extent->index = le->index;
+/*
+ * Stitches the labels of strip s to those of the strip above, prev, whose
+ * open extents in the boundary extent_line already carry global labels. Local
+ * labels touching them join their global classes, the other local classes
+ * get new global labels in the order in which they were found. Properties are
+ * accumulated in the global done array, open extents at the bottom of the
+ * strip are updated to global labels.
+ *
+ * Returns the new number of global labels, including those over budget.
+ */
+static int stitch_strip_labels(struct blobwatch *bw, struct blobwatch_strip *s,
+			       struct blobwatch_strip *prev, int num_global)
+{
+	int num_local = min(s->num_blobs, s->max_labels);
+	struct extent_line *el;
+	struct extent *e;
+	int i;
+
+	for (i = 0; i < num_local; i++)
+		s->map[i] = -1;
+
+	if (prev) {
+		struct extent *le = prev->last_el->extents;
+		struct extent *le_end = le + prev->last_el->num;
+
+		el = &s->el[0];
+		for (e = el->extents; e < el->extents + el->num; e++) {
+			int l = find_label(s->parent, e->index, s->max_labels);
+			struct extent *p;
+
+			while (le < le_end && le->end + 1 < e->start)
 				le++;
+			if (l >= s->max_labels)
+				continue;
+
+			for (p = le; p < le_end && p->start <= e->end + 1; p++) {
+				s->map[l] = s->map[l] < 0 ?
+					find_label(bw->parent, p->index,
+						   bw->max_labels) :
+					union_labels(bw->parent, bw->done,
+						     s->map[l], p->index,
+						     bw->max_labels);
 			}
 		}
+	}
 
-		/*
-		 * If this extent is not part of a previous blob, increment the
-		 * blob index.
-		 */
-		if (extent->index == index) {
-			extent->top = y;
-			extent->left = extent->start;
-			extent->right = extent->end;
-			index++;
-		}
+	for (i = 0; i < num_local; i++) {
+		int g;
 
-		if (++e == num_extents)
-			break;
-		extent++;
-	}
+		if (s->parent[i] != i) {
+			/* stitch_strip() takes a set bottom as finished */
+			s->done[i].bottom = 0;
+			continue;
+		}
 
-	if (prev_el) {
-		/*
-		 * If there are no more extents on this line, all remaining
-		 * extents in the previous line are finished blobs. Store them.
-		 */
-		while (le < le_end && le->index < num_blobs)
-			store_blob(le++, y, blobs);
+		if (s->map[i] < 0) {
+			g = min(num_global, bw->max_labels);
+			num_global++;
+			if (g < bw->max_labels) {
+				bw->parent[g] = g;
+				bw->done[g] = s->done[i];
+			}
+		} else {
+			g = find_label(bw->parent, s->map[i], bw->max_labels);
+			if (g < bw->max_labels)
+				merge_label(&bw->done[g], &s->done[i]);
+		}
+		s->map[i] = g;
+		s->done[i].bottom = 0;
 	}
+	/* Local labels over capacity are counted as new blobs */
+	num_global += s->num_blobs - num_local;
 
-	el->num = e;
+	if (s->y1 < s->height) {
+		el = s->last_el;
+		for (e = el->extents; e < el->extents + el->num; e++) {
+			int l = find_label(s->parent, e->index, s->max_labels);
 
-	if (y == height - 1) {
-		/* All extents of the last line are finished blobs, too. */
-		for (extent = el->extents; extent < el->extents + el->num;
-		     extent++) {
-			if (extent->index < num_blobs)
-				store_blob(extent, y, blobs);
+			e->index = l < s->max_labels ? s->map[l] : bw->max_labels;
 		}
 	}
 
-	return index;
+	return num_global;
 }
 
 /*
- * Collects extents from all scanlines in a frame and stores them in
- * the extent_line array el.
+ * Collects extents from all scanlines in a frame and stores the finished
+ * blobs in the observation. The frame is split into horizontal strips that
+ * are processed in parallel on the thread pool, if one is configured, and
+ * stitched together afterwards.
  */
-static void process_frame(uint8_t *lines, int width, int height,
-			  struct extent_line *el, struct blobservation *ob)
+static void process_frame(struct blobwatch *bw,
+			  uint8_t *lines, int width, int height,
+			  struct blobservation *ob)
 {
-	struct extent_line *last_el;
+	int num_strips = min(bw->num_strips, height);
 	int index = 0;
-	int y;
+	int i;
+
+	bw->full_span.start = 0;
+	bw->full_span.end = width;
+
+	/* Runs of windows only would leave the rest of the frame black */
+	bw->rle_active = bw->rle && !bw->roi_active && width == bw->width &&
+			 height == bw->height;
+	if (bw->rle_active)
+		bw->rle->threshold = bw->low;
+
+	for (i = 0; i < num_strips; i++) {
+		struct blobwatch_strip *s = &bw->strips[i];
+
+		s->lines = lines;
+		s->width = width;
+		s->height = height;
+		s->y0 = height * i / num_strips;
+		s->y1 = height * (i + 1) / num_strips;
+	}
+
+	threadpool_run(bw->tp, process_strip, bw->strips, sizeof(*bw->strips),
+		       num_strips);
+
+	if (bw->rle_active) {
+		bw->rle->complete = true;
+		for (i = 0; i < num_strips; i++)
+			bw->rle->complete &= bw->strips[i].rle != NULL;
+		rle_count(bw->rle);
+	}
+
+	for (i = 0; i < num_strips; i++) {
+		struct blobwatch_strip *prev = i ? &bw->strips[i - 1] : NULL;
 
+		if (bw->labeling == BLOBWATCH_LABELING_UNION_FIND)
+			index = stitch_strip_labels(bw, &bw->strips[i], prev,
+						    index);
+		else
+			index = stitch_strip(bw, &bw->strips[i], prev, index);
+	}
+
+	/*
+	 * Only whole blobs with a seed pixel count against the budget,
+	 * labels merged into another one have no blob of their own. Runs
+	 * that got no label of their own share one and cannot be told
+	 * apart, so they are counted separately from the dropped blobs.
+	 */
 	ob->num_blobs = 0;
+	ob->dropped_blobs = 0;
+	ob->dropped_labels = max(index - bw->max_labels, 0);
+
+	for (i = 0; i < min(bw->max_labels, index); i++) {
+		struct extent *d = &bw->done[i];
+
+		if (!d->seeded)
+			continue;
+		if (bw->labeling == BLOBWATCH_LABELING_UNION_FIND) {
+			if (bw->parent[i] != i)
+				continue;
+			d->bottom = min(d->bottom + 1, height - 1);
+		}
+		if (ob->num_blobs == bw->max_blobs) {
+			ob->dropped_blobs++;
+			continue;
+		}
+		store_blob(d, &ob->blobs[ob->num_blobs++]);
+	}
+}
+
+/*
+ * Updates the histogram over a subset of the frame's rows. Consecutive pixels
+ * go to separate partial histograms, so that increments of the same bin do
+ * not wait for each other.
+ */
+static void update_histogram(struct blobwatch *bw, const uint8_t *frame,
+			     int width, int height)
+{
+	uint32_t h[4][256];
+	int x, y, i;
+
+	memset(h, 0, sizeof(h));
+
+	for (y = bw->histogram_phase; y < height; y += HISTOGRAM_ROW_STEP) {
+		const uint8_t *line = frame + y * width;
+
+		for (x = 0; x + 4 * HISTOGRAM_COL_STEP <= width;
+		     x += 4 * HISTOGRAM_COL_STEP) {
+			h[0][line[x]]++;
+			h[1][line[x + HISTOGRAM_COL_STEP]]++;
+			h[2][line[x + 2 * HISTOGRAM_COL_STEP]]++;
+			h[3][line[x + 3 * HISTOGRAM_COL_STEP]]++;
+		}
+	}
+	bw->histogram_phase = (bw->histogram_phase + 1) % HISTOGRAM_ROW_STEP;
+
+	for (i = 0; i < 256; i++)
+		bw->histogram[i] = h[0][i] + h[1][i] + h[2][i] + h[3][i];
+}
 
-	index = process_scanline(lines, width, height, 0, el, NULL, 0, ob);
+/*
+ * Returns the threshold that maximizes the between-class variance of the
+ * pixels from first up to and above it (Otsu's method), or -1 if there are
+ * no such pixels. The dark background would dominate the statistics, so it
+ * is left out by starting at first.
+ */
+static int otsu_threshold(const uint32_t *hist, int first)
+{
+	double sum = 0, sum0 = 0, best = -1;
+	uint64_t total = 0, n0 = 0;
+	int t, threshold = -1;
+
+	for (t = first; t < 256; t++) {
+		total += hist[t];
+		sum += (double)t * hist[t];
+	}
+
+	for (t = first; t < 255; t++) {
+		double mu0, mu1, var;
+		uint64_t n1;
+
+		n0 += hist[t];
+		sum0 += (double)t * hist[t];
+		n1 = total - n0;
+		if (n0 == 0)
+			continue;
+		if (n1 == 0)
+			break;
 
-	for (y = 1; y < height-1; y++) {
-		last_el = el++;
-		lines += width;
-		index = process_scanline(lines, width, height, y, el, last_el,
-					 index, ob);
+		mu0 = sum0 / n0;
+		mu1 = (sum - sum0) / n1;
+		var = (double)n0 * n1 * (mu1 - mu0) * (mu1 - mu0);
+		if (var > best) {
+			best = var;
+			threshold = t;
+		}
 	}
 
-	ob->num_blobs = min(MAX_BLOBS_PER_FRAME, index);
+	return threshold;
+}
+
+/*
+ * Picks the thresholds and the scanline detector for the next frame.
+ */
+static void select_thresholds(struct blobwatch *bw)
+{
+	int high = bw->adaptive ? bw->adaptive_threshold : bw->threshold;
+	int low = high;
+
+	if (bw->hysteresis && bw->hysteresis < bw->threshold)
+		low = high * bw->hysteresis / bw->threshold;
+
+	bw->high = high;
+	bw->low = low;
+	bw->process_scanline = scanline_funcs[bw->labeling][low < high]
+					     [bw->moments];
+}
+
+/*
+ * Moves the adaptive threshold a quarter of the way towards the Otsu
+ * threshold of the frame's bright pixels, within the allowed range.
+ */
+static void adapt_threshold(struct blobwatch *bw, const uint8_t *frame,
+			    int width, int height)
+{
+	int t;
+
+	update_histogram(bw, frame, width, height);
+	t = otsu_threshold(bw->histogram, ADAPTIVE_MIN);
+	if (t < 0)
+		return;
+	t = (3 * bw->adaptive_threshold + t + 2) / 4;
+	bw->adaptive_threshold = min(max(t, ADAPTIVE_MIN), ADAPTIVE_MAX);
 }
 
 /*
- * Finds the first free tracking slot.
+ * Finds the first free tracking slot at or after *cursor and advances the
+ * cursor past it.
  */
-static int find_free_track(uint8_t *tracked)
+static int find_free_track(uint16_t *tracked, int max_blobs, int *cursor)
 {
 	int i;
 
-	for (i = 0; i < MAX_BLOBS_PER_FRAME; i++) {
-		if (tracked[i] == 0)
+	/* Tracks are only taken while associating a frame, never released */
+	for (i = *cursor; i < max_blobs; i++) {
+		if (tracked[i] == 0) {
+			*cursor = i + 1;
 			return i;
+		}
 	}
 
+	*cursor = max_blobs;
 	return -1;
 }
 
+/*
+ * Returns the grid column or row containing pixel coordinate v, clamped to
+ * the grid. Predictions outside the frame end up in the border cells.
+ */
+static inline int grid_coord(int v, int n)
+{
+	if (v < 0)
+		return 0;
+	return min(v >> GRID_SHIFT, n - 1);
+}
+
+/*
+ * Sorts the previous blobs into grid cells by their predicted position.
+ * The blobs of cell c are grid_blobs[grid_start[c]] to
+ * grid_blobs[grid_start[c + 1] - 1], in ascending order.
+ */
+static void build_grid(struct blobwatch *bw, struct blobservation *last_ob)
+{
+	int num_cells = bw->grid_width * bw->grid_height;
+	int *start = bw->grid_start;
+	int i;
+
+	memset(start, 0, (num_cells + 1) * sizeof(int));
+
+	for (i = 0; i < last_ob->num_blobs; i++) {
+		int cx = grid_coord(bw->predicted[i].x, bw->grid_width);
+		int cy = grid_coord(bw->predicted[i].y, bw->grid_height);
+
+		bw->grid_cell[i] = cy * bw->grid_width + cx;
+		start[bw->grid_cell[i]]++;
+	}
+
+	/* Turn counts into end offsets, then fill back to front */
+	for (i = 1; i < num_cells; i++)
+		start[i] += start[i - 1];
+	start[num_cells] = last_ob->num_blobs;
+
+	for (i = last_ob->num_blobs - 1; i >= 0; i--)
+		bw->grid_blobs[--start[bw->grid_cell[i]]] = i;
+}
+
+/*
+ * Looks up all previous blobs whose predicted position falls into the
+ * bounding box of blob b2 and appends the nearest MAX_CANDIDATES of them
+ * to the candidate list.
+ *
+ * Returns the number of candidates added.
+ */
+static int find_candidates(struct blobwatch *bw, int index, struct blob *b2,
+			   struct track_candidate *c)
+{
+	int x0 = grid_coord(b2->x - b2->width / 2, bw->grid_width);
+	int x1 = grid_coord(b2->x + b2->width / 2, bw->grid_width);
+	int y0 = grid_coord(b2->y - b2->height / 2, bw->grid_height);
+	int y1 = grid_coord(b2->y + b2->height / 2, bw->grid_height);
+	int cx, cy, k, n = 0;
+
+	for (cy = y0; cy <= y1; cy++) {
+		int *start = &bw->grid_start[cy * bw->grid_width];
+
+		for (cx = x0; cx <= x1; cx++) {
+			for (k = start[cx]; k < start[cx + 1]; k++) {
+				int j = bw->grid_blobs[k];
+				int x, y, dx, dy, m;
+				uint32_t cost;
+
+				/* Previous blob j's predicted position */
+				x = bw->predicted[j].x;
+				y = bw->predicted[j].y;
+
+				/* Absolute distance */
+				dx = abs(x - b2->x);
+				dy = abs(y - b2->y);
+
+				/*
+				 * Check if b1's estimated next position falls
+				 * into b2's bounding box.
+				 */
+				if (2 * dx > b2->width ||
+				    2 * dy > b2->height)
+					continue;
+
+				/* Insert into the list sorted by cost */
+				cost = dx * dx + dy * dy;
+				m = n < MAX_CANDIDATES ? n++ : n;
+				while (m > 0 && (c[m - 1].cost > cost ||
+						 (c[m - 1].cost == cost &&
+						  c[m - 1].prev > j))) {
+					if (m < MAX_CANDIDATES)
+						c[m] = c[m - 1];
+					m--;
+				}
+				if (m < MAX_CANDIDATES) {
+					c[m].cost = cost;
+					c[m].blob = index;
+					c[m].prev = j;
+				}
+			}
+		}
+	}
+
+	return n;
+}
+
+static int compare_candidates(const void *a, const void *b)
+{
+	const struct track_candidate *c1 = a;
+	const struct track_candidate *c2 = b;
+
+	if (c1->cost != c2->cost)
+		return c1->cost < c2->cost ? -1 : 1;
+	if (c1->blob != c2->blob)
+		return c1->blob < c2->blob ? -1 : 1;
+	return (c1->prev > c2->prev) - (c1->prev < c2->prev);
+}
+
+/*
+ * Predicts the centroids and bounding box centers of the blobs of the last
+ * observation steps frame intervals later. The Kalman filter tracks the
+ * centroid, the bounding box is assumed to keep its offset from it.
+ */
+static void predict_blobs(struct blobwatch *bw, struct blobservation *last_ob,
+			  int steps)
+{
+	int i;
+
+	for (i = 0; i < last_ob->num_blobs; i++) {
+		struct blob *b = &last_ob->blobs[i];
+		struct blob_prediction *p = &bw->predicted[i];
+
+		if (bw->predictor == BLOBWATCH_PREDICTOR_KALMAN) {
+			p->cx = b->filter.x + b->filter.vx * steps;
+			p->cy = b->filter.y + b->filter.vy * steps;
+			p->x = lroundf(p->cx + b->x - b->cx);
+			p->y = lroundf(p->cy + b->y - b->cy);
+		} else {
+			p->x = b->x + b->vx * steps;
+			p->y = b->y + b->vy * steps;
+			p->cx = b->cx + b->vx * steps;
+			p->cy = b->cy + b->vy * steps;
+		}
+	}
+}
+
+/*
+ * Continues the track of blob b1 with blob b2, which was captured steps frame
+ * intervals later: updates the filter and predicts the motion of b2 until the
+ * next frame.
+ */
+static void continue_track(struct blobwatch *bw, const struct blob *b1,
+			   struct blob *b2, int steps)
+{
+	struct blob_filter *f = &b2->filter;
+
+	*f = b1->filter;
+	filter_predict(f, steps);
+	filter_update(f, b2->cx, b2->cy);
+
+	if (bw->predictor == BLOBWATCH_PREDICTOR_KALMAN) {
+		b2->vx = lroundf(f->x + f->vx - b2->cx);
+		b2->vy = lroundf(f->y + f->vy - b2->cy);
+	} else {
+		b2->vx = lroundf((float)(b2->x - b1->x) / steps);
+		b2->vy = lroundf((float)(b2->y - b1->y) / steps);
+	}
+}
+
+/*
+ * Estimates the interval between frames from the timestamps, which may
+ * include skipped frames.
+ */
+static void update_frame_interval(struct blobwatch *bw, uint64_t timestamp,
+				  int skipped)
+{
+	if (bw->last_timestamp && timestamp > bw->last_timestamp) {
+		uint64_t dt = (timestamp - bw->last_timestamp) / (skipped + 1);
+
+		if (bw->frame_interval)
+			bw->frame_interval = (7 * bw->frame_interval + dt) / 8;
+		else
+			bw->frame_interval = dt;
+	}
+	bw->last_timestamp = timestamp;
+}
+
 /*
  * Detects blobs in the current frame and compares them with the observation
- * history.
+ * history. skipped is the number of frames lost since the last call, the
+ * blobs are expected to have moved that many frame intervals further.
+ * timestamp is the capture time of the frame in any unit, usually
+ * nanoseconds, see blob_extrapolate().
  */
 void blobwatch_process(struct blobwatch *bw, uint8_t *frame,
-		       int width, int height, int skipped, struct leds *leds,
-		       struct blobservation **output)
+		       int width, int height, int skipped, uint64_t timestamp,
+		       struct leds *leds, struct blobservation **output)
 {
 	int last = bw->last_observation;
 	int current = (last + 1) % NUM_FRAMES_HISTORY;
 	struct blobservation *ob = &bw->history[current];
-	struct blobservation *last_ob = &bw->history[last];
-	struct extent_line *el = bw->el;
-	int i, j;
+	struct blobservation *last_ob = last >= 0 ? &bw->history[last] : NULL;
+	int steps = min(max(skipped, 0), MAX_FRAME_STEPS - 1) + 1;
+	int num_candidates, next_track = 0;
+	int i;
+
+	bw->timings.start = clock_now_ns();
+
+	if (width > bw->width || height > bw->height) {
+		fprintf(stderr, "Frame size %dx%d exceeds detector size %dx%d\n",
+			width, height, bw->width, bw->height);
+		if (output)
+			*output = NULL;
+		return;
+	}
+
+	if (last_ob)
+		predict_blobs(bw, last_ob, steps);
+
+	/*
+	 * Scan only windows around the predicted blob positions, unless a
+	 * full scan is due to find new blobs.
+	 */
+	bw->roi_active = false;
+	ob->scanned_pixels = width * height;
+	if (bw->roi_interval && last_ob && last_ob->num_blobs &&
+	    !bw->roi_lost && ++bw->roi_age < bw->roi_interval) {
+		int pixels = build_roi(bw, last_ob, width, height);
+
+		if (pixels >= 0 && pixels < width * height / 2) {
+			bw->roi_active = true;
+			ob->scanned_pixels = pixels;
+		}
+	}
+	if (!bw->roi_active)
+		bw->roi_age = 0;
+
+	select_thresholds(bw);
+	process_frame(bw, frame, width, height, ob);
+	if (bw->adaptive)
+		adapt_threshold(bw, frame, width, height);
+
+	bw->timings.detected = clock_now_ns();
 
-	process_frame(frame, width, height, el, ob);
+	update_frame_interval(bw, timestamp, skipped);
+	ob->timestamp = timestamp;
+	ob->frame_interval = bw->frame_interval;
+	ob->lost_tracks = 0;
+	ob->prediction_error = 0;
+	ob->max_prediction_error = 0;
 
 	/* If there is no previous observation, our work is done here */
 	if (bw->last_observation == -1) {
+		bw->timings.tracked = bw->timings.detected;
 		bw->last_observation = current;
 		if (output)
 			*output = NULL;
@@ -267,12 +2198,18 @@ void blobwatch_process(struct blobwatch *bw, uint8_t *frame,
 	}
 
 	/* Otherwise track blobs over time */
-	memset(ob->tracked, 0, sizeof(uint8_t) * MAX_BLOBS_PER_FRAME);
+	memset(ob->tracked, 0, sizeof(uint16_t) * bw->max_blobs);
 
 	/*
 	 * Associate blobs found at a previous blobs' estimated next
-	 * positions with their predecessors.
+	 * positions with their predecessors. Candidate pairs are looked up
+	 * in a grid over the predicted positions and assigned globally,
+	 * closest pairs first, so that each previous blob is continued by
+	 * at most one blob.
 	 */
+	build_grid(bw, last_ob);
+
+	num_candidates = 0;
 	for (i = 0; i < ob->num_blobs; i++) {
 		struct blob *b2 = &ob->blobs[i];
 
@@ -281,41 +2218,51 @@ void blobwatch_process(struct blobwatch *bw, uint8_t *frame,
 		    b2->width >= 2 * b2->height)
 			continue;
 
-		for (j = 0; j < last_ob->num_blobs; j++) {
-			struct blob *b1 = &last_ob->blobs[j];
-			int x, y, dx, dy;
+		num_candidates += find_candidates(bw, i, b2,
+						  &bw->candidates[num_candidates]);
+	}
 
-			/* Estimate b1's next position */
-			x = b1->x + b1->vx;
-			y = b1->y + b1->vy;
+	qsort(bw->candidates, num_candidates, sizeof(*bw->candidates),
+	      compare_candidates);
 
-			/* Absolute distance */
-			dx = abs(x - b2->x);
-			dy = abs(y - b2->y);
+	memset(bw->prev_matched, 0, last_ob->num_blobs);
+	for (i = 0; i < num_candidates; i++) {
+		struct track_candidate *c = &bw->candidates[i];
+		struct blob *b1 = &last_ob->blobs[c->prev];
+		struct blob *b2 = &ob->blobs[c->blob];
+		float error;
 
-			/*
-			 * Check if b1's estimated next position falls
-			 * into b2's bounding box.
-			 */
-			if (2 * dx > b2->width ||
-			    2 * dy > b2->height)
-				continue;
+		/* Matched blobs have a nonzero age */
+		if (b2->age > 0 || bw->prev_matched[c->prev])
+			continue;
+		bw->prev_matched[c->prev] = 1;
 
-			b2->age = b1->age + 1;
-			if (b1->track_index >= 0 &&
-			    ob->tracked[b1->track_index] == 0) {
-				/* Only overwrite tracks that are not already set */
-				b2->track_index = b1->track_index;
-				ob->tracked[b2->track_index] = i + 1;
-				b2->pattern = b1->pattern;
-				b2->led_id = b1->led_id;
-			}
-			b2->vx = b2->x - b1->x;
-			b2->vy = b2->y - b1->y;
-			b2->last_area = b1->area;
-			break;
+		b2->age = b1->age + 1;
+		if (b1->track_index >= 0 &&
+		    ob->tracked[b1->track_index] == 0) {
+			/* Only overwrite tracks that are not already set */
+			b2->track_index = b1->track_index;
+			ob->tracked[b2->track_index] = c->blob + 1;
+			b2->pattern = b1->pattern;
+			b2->led_id = b1->led_id;
 		}
+		b2->last_area = b1->area;
+
+		error = hypotf(bw->predicted[c->prev].cx - b2->cx,
+			       bw->predicted[c->prev].cy - b2->cy);
+		ob->prediction_error += error;
+		if (error > ob->max_prediction_error)
+			ob->max_prediction_error = error;
+
+		continue_track(bw, b1, b2, steps);
+	}
+
+	for (i = 0; i < last_ob->num_blobs; i++) {
+		if (last_ob->blobs[i].track_index >= 0 &&
+		    !bw->prev_matched[i])
+			ob->lost_tracks++;
 	}
+	bw->roi_lost = ob->lost_tracks > 0;
 
 	/*
 	 * Associate newly tracked blobs with a free space in the
@@ -325,7 +2272,9 @@ void blobwatch_process(struct blobwatch *bw, uint8_t *frame,
 		struct blob *b2 = &ob->blobs[i];
 
 		if (b2->age > 0 && b2->track_index < 0)
-			b2->track_index = find_free_track(ob->tracked);
+			b2->track_index = find_free_track(ob->tracked,
+							  bw->max_blobs,
+							  &next_track);
 		if (b2->track_index >= 0)
 			ob->tracked[b2->track_index] = i + 1;
 	}
@@ -336,20 +2285,73 @@ void blobwatch_process(struct blobwatch *bw, uint8_t *frame,
 
 		if (b->track_index >= 0 &&
 		    ob->tracked[b->track_index] != i + 1) {
-			printf("Inconsistency! %d != %d\n",
-			       ob->tracked[b->track_index], i + 1);
+			struct binlog_inconsistency in = {
+				.tracked = ob->tracked[b->track_index],
+				.index = i + 1,
+			};
+
+			if (binlog_enabled())
+				binlog_write(BINLOG_INCONSISTENCY, &in,
+					     sizeof(in));
+			else
+				printf("Inconsistency! %d != %d\n",
+				       in.tracked, in.index);
 		}
 	}
 
-//	if (rift_flicker) {
-//		/* Identify blobs by their blinking pattern */
-//		flicker_process(bw->fl, ob->blobs, ob->num_blobs, skipped,
-//				leds);
-//	}
+	if (bw->fl) {
+		/* Identify blobs by their blinking pattern */
+		flicker_process(bw->fl, ob->blobs, ob->num_blobs, skipped,
+				leds);
+	}
 
 	/* Return observed blobs */
 	if (output)
 		*output = ob;
 
 	bw->last_observation = current;
+	bw->timings.tracked = clock_now_ns();
+}
+
+/*
+ * Extrapolates the centroid of blob b of observation ob to a different time,
+ * usually the time the next frame is displayed, to hide the latency of the
+ * pipeline. The time is converted to frames with the estimated frame
+ * interval, without one the filtered centroid is returned.
+ */
+void blob_extrapolate(const struct blob *b, const struct blobservation *ob,
+		      uint64_t timestamp, float *x, float *y)
+{
+	float frames = 0;
+
+	if (ob->frame_interval)
+		frames = (double)(int64_t)(timestamp - ob->timestamp) /
+			 ob->frame_interval;
+
+	*x = b->filter.x + b->filter.vx * frames;
+	*y = b->filter.y + b->filter.vy * frames;
+}
+
+/*
+ * Computes the axes of the ellipse with the blob's covariance, as standard
+ * deviations, and the angle of the major axis to the x axis in radians.
+ */
+void blob_ellipse(const struct blob *b, float *major, float *minor,
+		  float *angle)
+{
+	double mean = 0.5 * (b->cxx + b->cyy);
+	double diff = 0.5 * (b->cxx - b->cyy);
+	double d = sqrt(diff * diff + (double)b->cxy * b->cxy);
+
+	*major = sqrt(max(mean + d, 0.0));
+	*minor = sqrt(max(mean - d, 0.0));
+	*angle = 0.5 * atan2(2.0 * b->cxy, b->cxx - b->cyy);
+}
+
+/*
+ * Returns the timestamps taken while processing the last frame.
+ */
+void blobwatch_get_timings(struct blobwatch *bw, struct blobwatch_timings *t)
+{
+	*t = bw->timings;
 }
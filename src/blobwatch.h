@@ -9,10 +9,27 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+struct flicker_stats;
 struct leds;
+struct rle_frame;
+struct threadpool;
 
-#define MAX_EXTENTS_PER_LINE 11
-#define MAX_BLOBS_PER_FRAME  42
+#define BLOBWATCH_DEFAULT_MAX_BLOBS	256
+#define BLOBWATCH_MAX_BLOBS		INT16_MAX
+
+/*
+ * Intensity weighted sums over the pixels of a blob, with pixel centers at
+ * integer coordinates.
+ */
+struct blob_moments {
+	uint64_t sw;
+	uint64_t sx;
+	uint64_t sy;
+	uint64_t sxx;
+	uint64_t syy;
+	uint64_t sxy;
+	uint8_t peak;
+};
 
 struct extent {
 	uint16_t start;
@@ -21,50 +38,173 @@ struct extent {
 	uint16_t top;
 	uint16_t left;
 	uint16_t right;
-	uint8_t index;
+	uint16_t index;
 	uint32_t area;
+	/* line below the last extent, set when the blob is finished */
+	uint16_t bottom;
+	/* set if a pixel of the blob exceeds the high threshold */
+	uint8_t seeded;
+	struct blob_moments m;
 };
 
 struct extent_line {
-	struct extent extents[MAX_EXTENTS_PER_LINE];
-	uint16_t num;
-	uint16_t padding[3];
+	struct extent *extents;
+	int num;
+};
+
+/*
+ * Constant velocity Kalman filter of a blob's intensity weighted centroid, in
+ * pixels and pixels per frame. Both axes have the same noise model and are
+ * updated together, so they share one covariance.
+ */
+struct blob_filter {
+	float x;
+	float y;
+	float vx;
+	float vy;
+	/* variances of position and velocity, and their covariance */
+	float pxx;
+	float pvv;
+	float pxv;
 };
 
 struct blob {
 	/* center of bounding box */
 	uint16_t x;
 	uint16_t y;
+	/* predicted motion of the center until the next frame */
 	int16_t vx;
 	int16_t vy;
 	/* bounding box */
 	uint16_t width;
 	uint16_t height;
+	/* intensity weighted centroid and covariance, peak intensity */
+	float cx;
+	float cy;
+	float cxx;
+	float cyy;
+	float cxy;
+	uint8_t peak;
 	uint32_t area;
 	uint32_t last_area;
 	uint32_t age;
 	int16_t track_index;
 	uint16_t pattern;
 	int8_t led_id;
+	struct blob_filter filter;
 };
 
 /*
- * Stores all blobs observed in a single frame.
+ * Stores all blobs observed in a single frame. The blobs and tracked arrays
+ * have room for the blob budget given to blobwatch_new(), blobs found beyond
+ * that are counted in dropped_blobs. dropped_labels counts the new labels
+ * needed once the label capacity ran out; some of these belong to blobs that
+ * were found after all, so it is an upper bound on the blobs lost that way.
+ * scanned_pixels is less than the frame size if only windows around the
+ * predicted blob positions were scanned, lost_tracks counts the tracked blobs
+ * of the previous frame that were not found again. prediction_error is the
+ * sum of the distances in pixels between predicted and found centroids of all
+ * continued blobs. timestamp is the one passed to blobwatch_process(),
+ * frame_interval the estimated time between frames in the same unit, 0 while
+ * unknown.
  */
 struct blobservation {
 	int num_blobs;
-	struct blob blobs[MAX_BLOBS_PER_FRAME];
+	int dropped_blobs;
+	int dropped_labels;
+	uint32_t scanned_pixels;
+	int lost_tracks;
+	float prediction_error;
+	float max_prediction_error;
+	uint64_t timestamp;
+	uint64_t frame_interval;
+	struct blob *blobs;
 	int tracked_blobs;
-	uint8_t tracked[MAX_BLOBS_PER_FRAME];
+	uint16_t *tracked;
 };
 
 struct blobwatch;
 
-struct blobwatch *blobwatch_new(int width, int height);
+/*
+ * Monotonic timestamps in nanoseconds, taken while processing the last frame:
+ * on entry to blobwatch_process(), after blob detection, and after tracking.
+ */
+struct blobwatch_timings {
+	uint64_t start;
+	uint64_t detected;
+	uint64_t tracked;
+};
+
+/*
+ * Implementations of the thresholded run search in the scanline detector.
+ * All variants produce identical results.
+ */
+enum blobwatch_scanner {
+	BLOBWATCH_SCANNER_AUTO,
+	BLOBWATCH_SCANNER_SCALAR,
+	BLOBWATCH_SCANNER_SSE2,
+	BLOBWATCH_SCANNER_AVX2,
+};
+
+/*
+ * Connected component labeling of the runs found by the scanner. Union-find
+ * joins all 8-connected runs into one blob, even if the parts of a U-shaped
+ * or diagonally smeared blob are only joined further down. Overlap labeling
+ * continues a blob only with the run below the center of its last run, and
+ * is kept for comparison.
+ */
+enum blobwatch_labeling {
+	BLOBWATCH_LABELING_UNION_FIND,
+	BLOBWATCH_LABELING_OVERLAP,
+};
+
+/*
+ * Prediction of the blob centers in the next frame, which the blobs found
+ * there are matched against. The Kalman filter smooths the velocity over
+ * several frames, the difference predictor continues the motion between the
+ * last two frames and is kept for comparison.
+ */
+enum blobwatch_predictor {
+	BLOBWATCH_PREDICTOR_KALMAN,
+	BLOBWATCH_PREDICTOR_DIFFERENCE,
+};
+
+struct blobwatch *blobwatch_new(int width, int height, int max_blobs);
+void blobwatch_free(struct blobwatch *bw);
+int blobwatch_get_max_blobs(struct blobwatch *bw);
+int blobwatch_set_threads(struct blobwatch *bw, int num_threads);
+int blobwatch_get_threads(struct blobwatch *bw);
+int blobwatch_set_threadpool(struct blobwatch *bw, struct threadpool *tp,
+			     int num_strips);
+int blobwatch_set_scanner(struct blobwatch *bw, enum blobwatch_scanner scanner);
+enum blobwatch_scanner blobwatch_get_scanner(struct blobwatch *bw);
+int blobwatch_set_roi(struct blobwatch *bw, int interval);
+int blobwatch_set_threshold(struct blobwatch *bw, int threshold);
+int blobwatch_get_threshold(struct blobwatch *bw);
+int blobwatch_set_hysteresis(struct blobwatch *bw, int low);
+void blobwatch_set_adaptive(struct blobwatch *bw, bool enable);
+void blobwatch_set_moments(struct blobwatch *bw, bool enable);
+bool blobwatch_get_moments(struct blobwatch *bw);
+int blobwatch_set_labeling(struct blobwatch *bw,
+			   enum blobwatch_labeling labeling);
+enum blobwatch_labeling blobwatch_get_labeling(struct blobwatch *bw);
+int blobwatch_set_predictor(struct blobwatch *bw,
+			    enum blobwatch_predictor predictor);
+enum blobwatch_predictor blobwatch_get_predictor(struct blobwatch *bw);
+int blobwatch_set_rle(struct blobwatch *bw, bool enable);
+const struct rle_frame *blobwatch_get_rle(struct blobwatch *bw);
+int blobwatch_get_roi(struct blobwatch *bw);
 void blobwatch_process(struct blobwatch *bw, uint8_t *frame,
-		       int width, int height, int skipped,
+		       int width, int height, int skipped, uint64_t timestamp,
 		       struct leds *leds,
 		       struct blobservation **output);
-void blobwatch_set_flicker(bool enable);
+void blobwatch_get_timings(struct blobwatch *bw, struct blobwatch_timings *t);
+void blob_extrapolate(const struct blob *b, const struct blobservation *ob,
+		      uint64_t timestamp, float *x, float *y);
+void blob_ellipse(const struct blob *b, float *major, float *minor,
+		  float *angle);
+int blobwatch_set_flicker(struct blobwatch *bw, bool enable);
+void blobwatch_get_flicker_stats(struct blobwatch *bw,
+				 struct flicker_stats *stats);
 
 #endif /* __BLOBWATCH_H__*/
@@ -0,0 +1,351 @@
+/*
+ * Raw frame capture files
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "rle.h"
+
+#define ALIGN(x) (((x) + CAPTURE_ALIGN - 1) & ~(uint64_t)(CAPTURE_ALIGN - 1))
+
+struct capture_writer {
+	FILE *f;
+	struct capture_header header;
+	uint64_t offset;
+	struct capture_record *index;
+	uint64_t index_size;
+};
+
+struct capture {
+	uint8_t *map;
+	size_t map_size;
+	const struct capture_header *header;
+	const struct capture_record *index;
+	struct capture_record *walked_index;
+	int num_frames;
+	/* RLE frames are unpacked and decoded here */
+	struct rle_frame *rle;
+	uint8_t *decoded;
+};
+
+static int pad_to(FILE *f, uint64_t *offset, uint64_t target)
+{
+	static const uint8_t zeros[CAPTURE_ALIGN];
+
+	if (target > *offset &&
+	    fwrite(zeros, target - *offset, 1, f) != 1)
+		return -EIO;
+	*offset = target;
+
+	return 0;
+}
+
+/*
+ * Creates a capture file for frames of the given size, stored as Y8 pixels or
+ * as packed runs.
+ *
+ * Returns the newly allocated capture writer.
+ */
+struct capture_writer *capture_writer_open(const char *path, int width,
+					   int height, uint32_t format)
+{
+	struct capture_writer *cw;
+
+	if (format != CAPTURE_FORMAT_Y8 && format != CAPTURE_FORMAT_RLE)
+		return NULL;
+
+	cw = calloc(1, sizeof(*cw));
+	if (!cw)
+		return NULL;
+
+	cw->f = fopen(path, "wb");
+	if (!cw->f) {
+		free(cw);
+		return NULL;
+	}
+
+	memcpy(cw->header.magic, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC));
+	cw->header.version = CAPTURE_VERSION;
+	cw->header.format = format;
+	cw->header.width = width;
+	cw->header.height = height;
+
+	if (fwrite(&cw->header, sizeof(cw->header), 1, cw->f) != 1) {
+		fclose(cw->f);
+		free(cw);
+		return NULL;
+	}
+	cw->offset = sizeof(cw->header);
+
+	return cw;
+}
+
+/*
+ * Appends a frame with its UVC sequence number and timestamp in nanoseconds.
+ *
+ * Returns 0 on success or a negative error code.
+ */
+int capture_writer_add(struct capture_writer *cw, const uint8_t *data,
+		       uint32_t size, uint32_t sequence, uint64_t timestamp)
+{
+	struct capture_record rec;
+	uint64_t n = cw->header.num_frames;
+	int ret;
+
+	if (n == cw->index_size) {
+		uint64_t index_size = cw->index_size ? 2 * cw->index_size : 256;
+		struct capture_record *index;
+
+		index = realloc(cw->index, index_size * sizeof(*index));
+		if (!index)
+			return -ENOMEM;
+		cw->index = index;
+		cw->index_size = index_size;
+	}
+
+	ret = pad_to(cw->f, &cw->offset, ALIGN(cw->offset));
+	if (ret < 0)
+		return ret;
+
+	rec.offset = ALIGN(cw->offset + sizeof(rec));
+	rec.timestamp = timestamp;
+	rec.sequence = sequence;
+	rec.size = size;
+
+	if (fwrite(&rec, sizeof(rec), 1, cw->f) != 1)
+		return -EIO;
+	cw->offset += sizeof(rec);
+
+	ret = pad_to(cw->f, &cw->offset, rec.offset);
+	if (ret < 0)
+		return ret;
+	if (size && fwrite(data, size, 1, cw->f) != 1)
+		return -EIO;
+	cw->offset += size;
+
+	cw->index[n] = rec;
+	cw->header.num_frames++;
+
+	return 0;
+}
+
+/*
+ * Appends the frame index, finalizes the header and closes the file.
+ *
+ * Returns 0 on success or a negative error code.
+ */
+int capture_writer_close(struct capture_writer *cw)
+{
+	int ret;
+
+	if (!cw)
+		return 0;
+
+	ret = pad_to(cw->f, &cw->offset, ALIGN(cw->offset));
+	if (ret == 0) {
+		cw->header.index_offset = cw->offset;
+		if (cw->header.num_frames &&
+		    fwrite(cw->index, sizeof(*cw->index),
+			   cw->header.num_frames, cw->f) !=
+		    cw->header.num_frames)
+			ret = -EIO;
+	}
+	if (ret == 0 && (fseek(cw->f, 0, SEEK_SET) < 0 ||
+	    fwrite(&cw->header, sizeof(cw->header), 1, cw->f) != 1))
+		ret = -EIO;
+	if (fclose(cw->f) != 0 && ret == 0)
+		ret = -EIO;
+
+	free(cw->index);
+	free(cw);
+
+	return ret;
+}
+
+/*
+ * Rebuilds the index of a capture file that was not closed properly by
+ * walking the frame records.
+ */
+static int capture_walk_index(struct capture *c)
+{
+	uint64_t offset = ALIGN(sizeof(*c->header));
+	int num_frames = 0;
+	int size = 0;
+
+	while (offset + sizeof(struct capture_record) <= c->map_size) {
+		struct capture_record rec;
+
+		memcpy(&rec, c->map + offset, sizeof(rec));
+		if (rec.offset != ALIGN(offset + sizeof(rec)) ||
+		    rec.offset + rec.size > c->map_size)
+			break;
+
+		if (num_frames == size) {
+			struct capture_record *index;
+
+			size = size ? 2 * size : 256;
+			index = realloc(c->walked_index, size * sizeof(*index));
+			if (!index)
+				return -ENOMEM;
+			c->walked_index = index;
+		}
+		c->walked_index[num_frames++] = rec;
+
+		offset = ALIGN(rec.offset + rec.size);
+	}
+
+	c->index = c->walked_index;
+	c->num_frames = num_frames;
+
+	return 0;
+}
+
+/*
+ * Maps a capture file into memory.
+ *
+ * Returns the newly allocated capture or NULL on error.
+ */
+struct capture *capture_open(const char *path)
+{
+	const struct capture_header *h;
+	struct capture *c;
+	struct stat st;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) < 0 || st.st_size < sizeof(*h)) {
+		close(fd);
+		return NULL;
+	}
+
+	c = calloc(1, sizeof(*c));
+	if (!c) {
+		close(fd);
+		return NULL;
+	}
+
+	c->map_size = st.st_size;
+	c->map = mmap(NULL, c->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (c->map == MAP_FAILED) {
+		free(c);
+		return NULL;
+	}
+	madvise(c->map, c->map_size, MADV_SEQUENTIAL);
+
+	h = c->header = (const struct capture_header *)c->map;
+	if (memcmp(h->magic, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC)) != 0 ||
+	    h->version != CAPTURE_VERSION ||
+	    (h->format != CAPTURE_FORMAT_Y8 &&
+	     h->format != CAPTURE_FORMAT_RLE)) {
+		fprintf(stderr, "%s: not a supported capture file\n", path);
+		capture_close(c);
+		return NULL;
+	}
+
+	if (h->format == CAPTURE_FORMAT_RLE) {
+		c->rle = rle_frame_new(h->width, h->height,
+				       RLE_DEFAULT_MAX_RUNS,
+				       RLE_DEFAULT_MAX_PIXELS);
+		c->decoded = malloc((size_t)h->width * h->height);
+		if (!c->rle || !c->decoded) {
+			capture_close(c);
+			return NULL;
+		}
+	}
+
+	if (h->index_offset &&
+	    h->index_offset + h->num_frames * sizeof(*c->index) <=
+	    c->map_size) {
+		c->index = (const struct capture_record *)
+			   (c->map + h->index_offset);
+		c->num_frames = h->num_frames;
+	} else if (capture_walk_index(c) < 0) {
+		capture_close(c);
+		return NULL;
+	}
+
+	return c;
+}
+
+/*
+ * Unmaps the capture file and frees the capture.
+ */
+void capture_close(struct capture *c)
+{
+	if (!c)
+		return;
+
+	munmap(c->map, c->map_size);
+	free(c->walked_index);
+	rle_frame_free(c->rle);
+	free(c->decoded);
+	free(c);
+}
+
+int capture_width(struct capture *c)
+{
+	return c->header->width;
+}
+
+int capture_height(struct capture *c)
+{
+	return c->header->height;
+}
+
+uint32_t capture_format(struct capture *c)
+{
+	return c->header->format;
+}
+
+int capture_num_frames(struct capture *c)
+{
+	return c->num_frames;
+}
+
+/*
+ * Looks up frame i in the index and decodes it if it is stored as runs.
+ *
+ * Returns 0 on success or a negative error code.
+ */
+int capture_get_frame(struct capture *c, int i, struct capture_frame *frame)
+{
+	const struct capture_record *rec;
+	size_t frame_size = (size_t)c->header->width * c->header->height;
+	int ret;
+
+	if (i < 0 || i >= c->num_frames)
+		return -EINVAL;
+
+	rec = &c->index[i];
+	if (rec->offset + rec->size > c->map_size)
+		return -EINVAL;
+
+	frame->data = c->map + rec->offset;
+	frame->size = rec->size;
+	if (c->rle && rec->size != frame_size) {
+		ret = rle_unpack(c->rle, frame->data, rec->size);
+		if (ret < 0)
+			return ret;
+		rle_decode(c->rle, c->decoded);
+		frame->data = c->decoded;
+		frame->size = frame_size;
+	}
+	frame->sequence = rec->sequence;
+	frame->timestamp = rec->timestamp;
+
+	return 0;
+}
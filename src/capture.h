@@ -0,0 +1,76 @@
+/*
+ * Raw frame capture files
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ */
+#ifndef __CAPTURE_H__
+#define __CAPTURE_H__
+
+#include <stdint.h>
+
+/*
+ * A capture file starts with a struct capture_header, followed by frame
+ * records, each made of a struct capture_record and the frame data. Records
+ * and frame data start at CAPTURE_ALIGN byte boundaries, so that mapped frames
+ * can be passed to the detector directly. When the file is closed, an index
+ * of struct capture_record entries is appended and referenced from the
+ * header. Files without index, left behind by an interrupted recording, are
+ * indexed by walking the records. All fields are stored in host byte order.
+ *
+ * Frames of CAPTURE_FORMAT_RLE files are runs above threshold as stored by
+ * rle_pack(). Frames that could not be encoded are stored as raw Y8 pixels,
+ * these are the only records of exactly width * height bytes.
+ */
+#define CAPTURE_MAGIC		"RIFTCAP"
+#define CAPTURE_VERSION		1
+#define CAPTURE_ALIGN		64
+
+#define CAPTURE_FORMAT_Y8	0
+#define CAPTURE_FORMAT_RLE	1
+
+struct capture_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t format;
+	uint32_t width;
+	uint32_t height;
+	uint64_t num_frames;
+	uint64_t index_offset;
+};
+
+struct capture_record {
+	uint64_t offset;
+	uint64_t timestamp;
+	uint32_t sequence;
+	uint32_t size;
+};
+
+/*
+ * A single frame of a capture file, data points into the mapped file. Frames
+ * of RLE files are decoded to Y8 into a buffer that is reused by the next
+ * capture_get_frame() call.
+ */
+struct capture_frame {
+	const uint8_t *data;
+	uint32_t size;
+	uint32_t sequence;
+	uint64_t timestamp;
+};
+
+struct capture_writer;
+struct capture;
+
+struct capture_writer *capture_writer_open(const char *path, int width,
+					   int height, uint32_t format);
+int capture_writer_add(struct capture_writer *cw, const uint8_t *data,
+		       uint32_t size, uint32_t sequence, uint64_t timestamp);
+int capture_writer_close(struct capture_writer *cw);
+
+struct capture *capture_open(const char *path);
+void capture_close(struct capture *c);
+int capture_width(struct capture *c);
+int capture_height(struct capture *c);
+uint32_t capture_format(struct capture *c);
+int capture_num_frames(struct capture *c);
+int capture_get_frame(struct capture *c, int i, struct capture_frame *frame);
+
+#endif /* __CAPTURE_H__ */
@@ -0,0 +1,88 @@
+/*
+ * Monotonic timestamps
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ */
+#ifndef __CLOCK_H__
+#define __CLOCK_H__
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+/*
+ * Returns the monotonic clock in nanoseconds.
+ */
+static inline uint64_t clock_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Returns the CPU time consumed by the calling thread in nanoseconds.
+ */
+static inline uint64_t clock_thread_cpu_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Returns the CPU time consumed by all threads of the process in nanoseconds.
+ */
+static inline uint64_t clock_process_cpu_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Sleeps until the monotonic clock reaches the absolute time t in nanoseconds.
+ * A signal does not cut the sleep short.
+ */
+static inline void clock_sleep_until_ns(uint64_t t)
+{
+	struct timespec ts = {
+		.tv_sec = t / 1000000000,
+		.tv_nsec = t % 1000000000,
+	};
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+	       EINTR)
+		;
+}
+
+static inline int clock_compare_ns(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+/*
+ * Sorts n time samples in place, for clock_percentile_ns().
+ */
+static inline void clock_sort_ns(uint64_t *samples, int n)
+{
+	qsort(samples, n, sizeof(*samples), clock_compare_ns);
+}
+
+/*
+ * Returns the smallest of n sorted samples that is at least as large as
+ * per_mille thousandths of them, e.g. the median for 500. n must not be 0.
+ */
+static inline uint64_t clock_percentile_ns(const uint64_t *sorted, int n,
+					   int per_mille)
+{
+	return sorted[((int64_t)n * per_mille + 999) / 1000 - 1];
+}
+
+#endif /* __CLOCK_H__ */
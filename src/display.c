@@ -0,0 +1,181 @@
+/*
+ * Streaming texture display of greyscale frames
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ */
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "display.h"
+
+/*
+ * A persistent streaming texture. If the renderer supports a planar YUV
+ * format, the Y8 frame is uploaded as the luma plane, with constant neutral
+ * chroma planes. Otherwise the frame is expanded to ARGB8888 directly into
+ * the locked texture.
+ */
+struct display_texture {
+	SDL_Texture *texture;
+	int width;
+	int height;
+	bool yuv;
+	uint8_t *chroma;
+};
+
+static bool renderer_supports(SDL_Renderer *renderer, Uint32 format)
+{
+	SDL_RendererInfo info;
+	Uint32 i;
+
+	if (SDL_GetRendererInfo(renderer, &info) < 0)
+		return false;
+
+	for (i = 0; i < info.num_texture_formats; i++) {
+		if (info.texture_formats[i] == format)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Creates the streaming texture for frames of the given size.
+ *
+ * Returns the newly allocated display texture or NULL on error.
+ */
+struct display_texture *display_texture_new(SDL_Renderer *renderer,
+					    int width, int height)
+{
+	struct display_texture *dt = calloc(1, sizeof(*dt));
+
+	if (!dt)
+		return NULL;
+
+	dt->width = width;
+	dt->height = height;
+
+	if (renderer_supports(renderer, SDL_PIXELFORMAT_IYUV)) {
+		size_t chroma_size = ((width + 1) / 2) * ((height + 1) / 2);
+
+		dt->chroma = malloc(chroma_size);
+		if (dt->chroma) {
+			memset(dt->chroma, 0x80, chroma_size);
+#if SDL_VERSION_ATLEAST(2, 0, 8)
+			/* Full range luma, so grey values are not compressed */
+			SDL_SetYUVConversionMode(SDL_YUV_CONVERSION_JPEG);
+#endif
+			dt->texture = SDL_CreateTexture(renderer,
+						SDL_PIXELFORMAT_IYUV,
+						SDL_TEXTUREACCESS_STREAMING,
+						width, height);
+			dt->yuv = dt->texture != NULL;
+		}
+	}
+
+	if (!dt->texture) {
+		dt->texture = SDL_CreateTexture(renderer,
+						SDL_PIXELFORMAT_ARGB8888,
+						SDL_TEXTUREACCESS_STREAMING,
+						width, height);
+	}
+
+	if (!dt->texture) {
+		display_texture_free(dt);
+		return NULL;
+	}
+
+	return dt;
+}
+
+void display_texture_free(struct display_texture *dt)
+{
+	if (!dt)
+		return;
+
+	if (dt->texture)
+		SDL_DestroyTexture(dt->texture);
+	free(dt->chroma);
+	free(dt);
+}
+
+/*
+ * Expands a line of greyscale pixels to opaque ARGB8888.
+ */
+static void expand_line(uint32_t *dst, const uint8_t *src, int width)
+{
+	int x = 0;
+
+#ifdef __SSE2__
+	const __m128i alpha = _mm_set1_epi32(0xff000000);
+
+	for (; x + 16 <= width; x += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + x));
+		__m128i lo = _mm_unpacklo_epi8(v, v);
+		__m128i hi = _mm_unpackhi_epi8(v, v);
+		__m128i *d = (__m128i *)(dst + x);
+
+		_mm_storeu_si128(d + 0, _mm_or_si128(_mm_unpacklo_epi16(lo, lo),
+						     alpha));
+		_mm_storeu_si128(d + 1, _mm_or_si128(_mm_unpackhi_epi16(lo, lo),
+						     alpha));
+		_mm_storeu_si128(d + 2, _mm_or_si128(_mm_unpacklo_epi16(hi, hi),
+						     alpha));
+		_mm_storeu_si128(d + 3, _mm_or_si128(_mm_unpackhi_epi16(hi, hi),
+						     alpha));
+	}
+#endif
+
+	for (; x < width; x++)
+		dst[x] = 0xff000000 | src[x] * 0x010101;
+}
+
+/*
+ * Uploads a Y8 frame into the texture, with a single copy of the frame.
+ *
+ * Returns 0 on success or a negative SDL error code.
+ */
+int display_texture_update(struct display_texture *dt, const uint8_t *frame)
+{
+	void *pixels;
+	int pitch;
+	int y, ret;
+
+	if (dt->yuv) {
+		int chroma_pitch = (dt->width + 1) / 2;
+
+		return SDL_UpdateYUVTexture(dt->texture, NULL,
+					    frame, dt->width,
+					    dt->chroma, chroma_pitch,
+					    dt->chroma, chroma_pitch);
+	}
+
+	ret = SDL_LockTexture(dt->texture, NULL, &pixels, &pitch);
+	if (ret < 0)
+		return ret;
+
+	for (y = 0; y < dt->height; y++) {
+		expand_line((uint32_t *)((uint8_t *)pixels + y * pitch),
+			    frame + y * dt->width, dt->width);
+	}
+
+	SDL_UnlockTexture(dt->texture);
+
+	return 0;
+}
+
+SDL_Texture *display_texture_get(struct display_texture *dt)
+{
+	return dt->texture;
+}
+
+/*
+ * Returns a description of the upload path, for diagnostics.
+ */
+const char *display_texture_format_name(struct display_texture *dt)
+{
+	return dt->yuv ? "IYUV luma plane" : "ARGB8888 expansion";
+}
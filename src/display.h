@@ -0,0 +1,20 @@
+/*
+ * Streaming texture display of greyscale frames
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ */
+#ifndef __DISPLAY_H__
+#define __DISPLAY_H__
+
+#include <stdint.h>
+#include <SDL.h>
+
+struct display_texture;
+
+struct display_texture *display_texture_new(SDL_Renderer *renderer,
+					    int width, int height);
+void display_texture_free(struct display_texture *dt);
+int display_texture_update(struct display_texture *dt, const uint8_t *frame);
+SDL_Texture *display_texture_get(struct display_texture *dt);
+const char *display_texture_format_name(struct display_texture *dt);
+
+#endif /* __DISPLAY_H__ */
@@ -0,0 +1,767 @@
+/*
+ * eSP770U camera bridge, AR0134 sensor and radio setup
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ *
+ * Every register access is a SET_CUR on an extension unit selector followed
+ * by a GET_CUR that returns the result. All of them are queued, and the
+ * setup sequences only flush where a value read decides what to write next,
+ * or where a write must not reach the device if an earlier one failed.
+ *
+ * Register values that were read or written are kept in a shadow cache, so
+ * that reading them again and writing the value they already have costs no
+ * transfer. The setup sequences are tables executed against the cache.
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp770u.h"
+
+/* Settle time of the radio after each step of a command */
+#define RADIO_DELAY_US	20000
+
+#define NUM_SENSOR_REGS	65536
+/* Reads waiting for a flush */
+#define MAX_PENDING	64
+
+enum esp770u_target {
+	BRIDGE,
+	SENSOR,
+};
+
+struct pending_read {
+	struct esp770u *cam;
+	uint8_t *val8;
+	uint16_t *val16;
+};
+
+struct esp770u {
+	struct usbctl *usbctl;
+	bool cache;
+	uint8_t bridge[256];
+	uint8_t bridge_valid[256 / 8];
+	uint16_t *sensor;
+	uint8_t *sensor_valid;
+	struct pending_read pending[MAX_PENDING];
+	int num_pending;
+	/* error of an implicit flush, returned by the next one */
+	int error;
+	struct esp770u_stats stats;
+};
+
+static inline bool test_bit(const uint8_t *map, int n)
+{
+	return map[n / 8] & (1 << (n % 8));
+}
+
+static inline void set_bit(uint8_t *map, int n)
+{
+	map[n / 8] |= 1 << (n % 8);
+}
+
+static inline void clear_bit(uint8_t *map, int n)
+{
+	map[n / 8] &= ~(1 << (n % 8));
+}
+
+/*
+ * Sensor registers that change by themselves and are never cached.
+ */
+static bool ar0134_volatile(uint16_t reg)
+{
+	switch (reg) {
+	case 0x30b2:	/* temperature */
+	case 0x30b4:	/* temperature sensor control, conversion start bit */
+		return true;
+	default:
+		return false;
+	}
+}
+
+/*
+ * Allocates the register cache of a camera, all registers unknown.
+ *
+ * Returns the newly allocated camera, with the cache enabled.
+ */
+struct esp770u *esp770u_new(struct usbctl *q)
+{
+	struct esp770u *cam;
+
+	cam = calloc(1, sizeof(*cam));
+	if (!cam)
+		return NULL;
+
+	cam->sensor = calloc(NUM_SENSOR_REGS, sizeof(*cam->sensor));
+	cam->sensor_valid = calloc(NUM_SENSOR_REGS / 8, 1);
+	if (!cam->sensor || !cam->sensor_valid) {
+		esp770u_free(cam);
+		return NULL;
+	}
+
+	cam->usbctl = q;
+	cam->cache = true;
+
+	return cam;
+}
+
+void esp770u_free(struct esp770u *cam)
+{
+	if (!cam)
+		return;
+
+	free(cam->sensor);
+	free(cam->sensor_valid);
+	free(cam);
+}
+
+/*
+ * Without the cache every read and write is a transfer, as a reference for
+ * the transfer counts.
+ */
+void esp770u_set_cache(struct esp770u *cam, bool enable)
+{
+	cam->cache = enable;
+	esp770u_invalidate(cam);
+}
+
+static void ar0134_invalidate(struct esp770u *cam)
+{
+	memset(cam->sensor_valid, 0, NUM_SENSOR_REGS / 8);
+}
+
+/*
+ * Forgets all cached register values, for when the device may have been
+ * reset behind our back.
+ */
+void esp770u_invalidate(struct esp770u *cam)
+{
+	memset(cam->bridge_valid, 0, sizeof cam->bridge_valid);
+	ar0134_invalidate(cam);
+}
+
+/*
+ * Executes all queued transfers. Afterwards the values of all queued reads
+ * are stored.
+ *
+ * Returns 0 or a negative error code, see usbctl_flush().
+ */
+int esp770u_flush(struct esp770u *cam)
+{
+	int ret = usbctl_flush(cam->usbctl);
+
+	if (cam->error && ret >= 0)
+		ret = cam->error;
+	cam->error = 0;
+	cam->num_pending = 0;
+
+	return ret;
+}
+
+void esp770u_get_stats(struct esp770u *cam, struct esp770u_stats *st)
+{
+	*st = cam->stats;
+}
+
+static struct pending_read *add_pending(struct esp770u *cam)
+{
+	struct pending_read *p;
+
+	if (cam->num_pending == MAX_PENDING) {
+		int ret = esp770u_flush(cam);
+
+		if (ret < 0)
+			cam->error = ret;
+	}
+
+	p = &cam->pending[cam->num_pending++];
+	p->cam = cam;
+	p->val8 = NULL;
+	p->val16 = NULL;
+
+	return p;
+}
+
+static int esp770u_read_done(const uint8_t *buf, int len, void *priv,
+			     uint32_t reg)
+{
+	struct pending_read *p = priv;
+	struct esp770u *cam = p->cam;
+
+	if (buf[0] != 0x82 || buf[2] != 0x00) {
+		fprintf(stderr, "read_reg(0x%x): %02x %02x %02x\n",
+			reg, buf[0], buf[1], buf[2]);
+	} else if (cam->cache && reg < 256 && !test_bit(cam->bridge_valid, reg)) {
+		/* Unless a write was queued after this read */
+		cam->bridge[reg] = buf[1];
+		set_bit(cam->bridge_valid, reg);
+	}
+	if (p->val8)
+		*p->val8 = buf[1];
+	if (p->val16)
+		*p->val16 = buf[1];
+	return 0;
+}
+
+/*
+ * Queues a read of a bridge register in bank 0xf0, or 0xf1 which is not
+ * cached. reg is passed to the completion with 0x100 set for bank 0xf1.
+ */
+static int esp770u_queue_read(struct esp770u *cam, uint8_t bank, uint8_t reg,
+			      uint8_t *val8, uint16_t *val16)
+{
+	uint8_t buf[4] = { 0x82, bank, reg };
+	struct pending_read *p;
+	int ret;
+
+	if (bank == 0xf0 && cam->cache && test_bit(cam->bridge_valid, reg)) {
+		if (val8)
+			*val8 = cam->bridge[reg];
+		if (val16)
+			*val16 = cam->bridge[reg];
+		cam->stats.cached_reads++;
+		return 0;
+	}
+
+	cam->stats.reads++;
+	ret = usbctl_set_cur(cam->usbctl, XU_ENTITY, REG_SEL, buf, sizeof buf);
+	if (ret < 0)
+		return ret;
+	p = add_pending(cam);
+	p->val8 = val8;
+	p->val16 = val16;
+	return usbctl_get_cur(cam->usbctl, XU_ENTITY, REG_SEL, 3,
+			      esp770u_read_done, p,
+			      bank == 0xf0 ? reg : reg | 0x100);
+}
+
+int esp770u_read_reg(struct esp770u *cam, uint8_t reg, uint8_t *val)
+{
+	return esp770u_queue_read(cam, 0xf0, reg, val, NULL);
+}
+
+int esp770u_read_reg_f1(struct esp770u *cam, uint8_t reg, uint8_t *val)
+{
+	return esp770u_queue_read(cam, 0xf1, reg, val, NULL);
+}
+
+static int esp770u_write_done(const uint8_t *buf, int len, void *priv,
+			      uint32_t arg)
+{
+	struct esp770u *cam = priv;
+	uint8_t reg = arg >> 8;
+	uint8_t val = arg & 0xff;
+
+	if (buf[0] != 0x02 || buf[1] != 0xf0 || buf[2] != reg || buf[3] != val) {
+		fprintf(stderr, "write_reg(0x%x,0x%x): %02x %02x %02x %02x\n",
+			reg, val, buf[0], buf[1], buf[2], buf[3]);
+		clear_bit(cam->bridge_valid, reg);
+	}
+	return 0;
+}
+
+int esp770u_write_reg(struct esp770u *cam, uint8_t reg, uint8_t val)
+{
+	uint8_t buf[4] = { 0x02, 0xf0, reg, val };
+	int ret;
+
+	if (cam->cache && test_bit(cam->bridge_valid, reg) &&
+	    cam->bridge[reg] == val) {
+		cam->stats.skipped_writes++;
+		return 0;
+	}
+
+	cam->stats.writes++;
+	ret = usbctl_set_cur(cam->usbctl, XU_ENTITY, REG_SEL, buf, sizeof buf);
+	if (ret < 0)
+		return ret;
+	if (cam->cache) {
+		cam->bridge[reg] = val;
+		set_bit(cam->bridge_valid, reg);
+	}
+	return usbctl_get_cur(cam->usbctl, XU_ENTITY, REG_SEL, sizeof buf,
+			      esp770u_write_done, cam, reg << 8 | val);
+}
+
+static int ar0134_read_done(const uint8_t *buf, int len, void *priv,
+			    uint32_t reg)
+{
+	struct pending_read *p = priv;
+	struct esp770u *cam = p->cam;
+	uint16_t val = (buf[2] << 8) | buf[1];
+
+	if (buf[0] != 0x86) {
+		fprintf(stderr, "ar0134_read_reg(0x%x): %02x %02x %02x\n",
+			reg, buf[0], buf[1], buf[2]);
+	} else if (cam->cache && !ar0134_volatile(reg) &&
+		   !test_bit(cam->sensor_valid, reg)) {
+		/* Unless a write was queued after this read */
+		cam->sensor[reg] = val;
+		set_bit(cam->sensor_valid, reg);
+	}
+	if (p->val16)
+		*p->val16 = val;
+	return 0;
+}
+
+int ar0134_read_reg(struct esp770u *cam, uint16_t reg, uint16_t *val)
+{
+	uint8_t buf[6] = { 0x86, 0x20, reg >> 8, reg & 0xff, 0x00, 0x00 };
+	struct pending_read *p;
+	int ret;
+
+	if (cam->cache && test_bit(cam->sensor_valid, reg)) {
+		*val = cam->sensor[reg];
+		cam->stats.cached_reads++;
+		return 0;
+	}
+
+	cam->stats.reads++;
+	ret = usbctl_set_cur(cam->usbctl, XU_ENTITY, SENSOR_REG_SEL, buf,
+			     sizeof buf);
+	if (ret < 0)
+		return ret;
+	p = add_pending(cam);
+	p->val16 = val;
+	return usbctl_get_cur(cam->usbctl, XU_ENTITY, SENSOR_REG_SEL, 3,
+			      ar0134_read_done, p, reg);
+}
+
+static int ar0134_write_done(const uint8_t *buf, int len, void *priv,
+			     uint32_t arg)
+{
+	struct esp770u *cam = priv;
+	uint16_t reg = arg >> 16;
+	uint16_t val = arg & 0xffff;
+
+	if (buf[0] != 0x06 || buf[1] != 0x20 ||
+	    buf[2] != (reg >> 8) || buf[3] != (reg & 0xff) ||
+	    buf[4] != (val >> 8) || buf[5] != (val & 0xff)) {
+		fprintf(stderr, "ar0134_write_reg(0x%04x, 0x%04x): %02x %02x %02x %02x %02x %02x\n",
+			reg, val, buf[0], buf[1], buf[2], buf[3],
+			buf[4], buf[5]);
+		clear_bit(cam->sensor_valid, reg);
+	}
+	return 0;
+}
+
+int ar0134_write_reg(struct esp770u *cam, uint16_t reg, uint16_t val)
+{
+	uint8_t buf[6] = { 0x06, 0x20, reg >> 8, reg & 0xff, val >> 8, val & 0xff };
+	int ret;
+
+	if (cam->cache && test_bit(cam->sensor_valid, reg) &&
+	    cam->sensor[reg] == val) {
+		cam->stats.skipped_writes++;
+		return 0;
+	}
+
+	cam->stats.writes++;
+	ret = usbctl_set_cur(cam->usbctl, XU_ENTITY, SENSOR_REG_SEL, buf,
+			     sizeof buf);
+	if (ret < 0)
+		return ret;
+	if (cam->cache && !ar0134_volatile(reg)) {
+		cam->sensor[reg] = val;
+		set_bit(cam->sensor_valid, reg);
+	}
+	return usbctl_get_cur(cam->usbctl, XU_ENTITY, SENSOR_REG_SEL, 64,
+			      ar0134_write_done, cam,
+			      (uint32_t)reg << 16 | val);
+}
+
+static int check_a0(const uint8_t *buf, int len, void *priv, uint32_t retval)
+{
+	if (buf[0] != 0xa0 || buf[1] != retval || buf[2] != 0x00) {
+		fprintf(stderr, "response, should be a0 %02x 00: %02x %02x %02x\n",
+			retval, buf[0], buf[1], buf[2]);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int set_get_verify_a0(struct esp770u *cam, uint8_t val, uint8_t retval)
+{
+	uint8_t buf[4] = { 0xa0, val, 0x00, 0x00 };
+	int ret;
+
+	ret = usbctl_set_cur(cam->usbctl, XU_ENTITY, REG_SEL, buf, sizeof buf);
+	if (ret < 0)
+		return ret;
+	return usbctl_get_cur(cam->usbctl, XU_ENTITY, REG_SEL, sizeof buf,
+			      check_a0, NULL, retval);
+}
+
+/*
+ * A step of a register setup sequence. READ values are not used, the read
+ * itself is part of the sequence. CHECK prints msg if the bits in mask do not
+ * have the expected value, REQUIRE also aborts the sequence before anything
+ * is written. UPDATE sets the bits in val and clears those in mask. SYNC
+ * waits for everything before it, and aborts the sequence if that failed.
+ */
+enum init_op_type {
+	OP_READ,
+	OP_WRITE,
+	OP_UPDATE,
+	OP_CHECK,
+	OP_REQUIRE,
+	OP_SYNC,
+};
+
+struct init_op {
+	uint8_t type;
+	uint16_t reg;
+	uint16_t val;
+	uint16_t mask;
+	const char *msg;
+};
+
+#define READ(r)			{ OP_READ, r, 0, 0, NULL }
+#define WRITE(r, v)		{ OP_WRITE, r, v, 0, NULL }
+#define UPDATE(r, set, clr)	{ OP_UPDATE, r, set, clr, NULL }
+#define CHECK(r, v, msg)	{ OP_CHECK, r, v, 0xffff, msg }
+#define CHECK_BITS(r, v, m, msg) { OP_CHECK, r, v, m, msg }
+#define REQUIRE(r, v, msg)	{ OP_REQUIRE, r, v, 0xffff, msg }
+#define SYNC()			{ OP_SYNC, 0, 0, 0, NULL }
+
+/* Initial register setup, only after camera plugin */
+static const struct init_op esp770u_init_table[] = {
+	CHECK_BITS(0x5a, 0x01, 0xfd, "unexpected 5a value"), /* 01 or 03 */
+	WRITE(0x5a, 0x01),		/* &= 0x02? */
+	CHECK(0x5a, 0x01, "unexpected 5a value"),
+	READ(0x18),			/* |= 0x01 ? */
+	WRITE(0x18, 0x0f),
+	/* Only toggle 0x17 if 0x18 was set up for it */
+	SYNC(),
+	READ(0x17),
+	WRITE(0x17, 0xed),		/* |= 0x01 ? */
+	WRITE(0x17, 0xec),		/* &= ~0x01 ? */
+	WRITE(0x18, 0x0e),		/* &= ~0x01 ? */
+	READ(0x14),
+};
+
+/* Sensor setup after stream start */
+static const struct init_op ar0134_init_table[] = {
+	/* Read chip version and revision number registers */
+	REQUIRE(0x3000, 0x2406, "This is not an AR0134 sensor"),
+	REQUIRE(0x300e, 0x1300, "Unexpected revision number"),
+	CHECK(0x30b0, 0x0080, "Expected monochrome mode instead of"),
+#if 0
+	/* Enable embedded register data and statistics. For now we can't use
+	 * this anyway. */
+	CHECK_BITS(0x3064, 0x1882, 0xfeff, "Unexpected embedded data control"),
+	UPDATE(0x3064, 0x0180, 0),
+#endif
+	/* Set data pedestal (black level) to zero */
+	WRITE(0x301e, 0),
+	/* Disable binning */
+	WRITE(0x3032, 0x0000),
+	/* Set all gain values to the default, in USB2 mode 0x0007 is used
+	 * instead. */
+	WRITE(0x305e, 0x0020),
+	/* This changes nothing, probably clear some already cleared bits. */
+	WRITE(0x30b0, 0x0080),
+	/* Set vertical and horizontal capture ranges to maximum (0-959,
+	 * 0-1279). */
+	WRITE(0x3002, 0),
+	WRITE(0x3006, 959),
+	WRITE(0x3004, 0),
+	WRITE(0x3008, 1279),
+#if 0
+	/* Set minimum supported pixel clocks per line, causes hsync loss. */
+	WRITE(0x300c, 1388),
+#endif
+	/* Set a short line bit, needed for the 1388 pclk line length above. */
+	UPDATE(0x30b0, 1 << 10, 0),
+	/* Set total number of lines, 37 lines vertical blanking */
+	WRITE(0x300a, 997),
+	/* Read number of pixel clocks per line, should be changed above. */
+	CHECK(0x300c, 1388, "Too many pixel clocks per line"),
+	/* Set coarse integration time (in multiples of lines) and
+	 * fine integration time (in multiples of the pixel clock). */
+	WRITE(0x3012, 26), /* 26 lines */
+	WRITE(0x3014, 646),
+	CHECK(0x3012, 26, "Failed to set coarse integration time"),
+	CHECK(0x3014, 646, "Failed to set fine integration time"),
+	/* Only switch to triggered mode with all of the above applied */
+	SYNC(),
+	/* Stop streaming, trigger external exposure from nRF51288 */
+	CHECK(0x301a, 0x10dc, "Unexpected reset register value"),
+	/* Force PLL always enabled, enable trigger input pin, disable
+	 * streaming (switch to externally triggered mode) */
+	UPDATE(0x301a, 1 << 11 | 1 << 8, 1 << 2),
+	/* Enable junction temperature sensor: power, start conversion */
+	UPDATE(0x30b4, 1 << 0 | 1 << 4, 0),
+};
+
+static int reg_read(struct esp770u *cam, enum esp770u_target target,
+		    uint16_t reg, uint16_t *val)
+{
+	if (target == BRIDGE)
+		return esp770u_queue_read(cam, 0xf0, reg, NULL, val);
+	return ar0134_read_reg(cam, reg, val);
+}
+
+static int reg_write(struct esp770u *cam, enum esp770u_target target,
+		     uint16_t reg, uint16_t val)
+{
+	if (target == BRIDGE)
+		return esp770u_write_reg(cam, reg, val);
+	return ar0134_write_reg(cam, reg, val);
+}
+
+/*
+ * Flushes the queue and reports the checks in ops[*checked..end), whose
+ * values have all arrived now.
+ *
+ * Returns 0, a negative error code of the flush, or -ENODEV if a REQUIRE
+ * failed.
+ */
+static int flush_checks(struct esp770u *cam, const struct init_op *ops,
+			const uint16_t *vals, int *checked, int end)
+{
+	int ret = esp770u_flush(cam);
+
+	if (ret < 0)
+		return ret;
+
+	for (; *checked < end; (*checked)++) {
+		const struct init_op *op = &ops[*checked];
+		uint16_t val = vals[*checked];
+
+		if (op->type != OP_CHECK && op->type != OP_REQUIRE)
+			continue;
+		if ((val & op->mask) == op->val)
+			continue;
+
+		fprintf(stderr, "%s: 0x%04x\n", op->msg, val);
+		if (op->type == OP_REQUIRE)
+			ret = -ENODEV;
+	}
+
+	return ret;
+}
+
+/*
+ * Executes a setup table. Reads are only waited for when an UPDATE needs a
+ * value that is not cached, a REQUIRE must pass before the next write, or at
+ * a SYNC.
+ *
+ * Returns 0 or a negative error code.
+ */
+static int run_table(struct esp770u *cam, enum esp770u_target target,
+		     const struct init_op *ops, int n)
+{
+	uint16_t vals[n];
+	bool required = false;
+	int checked = 0;
+	int i, pending, ret;
+
+	for (i = 0; i < n; i++) {
+		const struct init_op *op = &ops[i];
+
+		switch (op->type) {
+		case OP_REQUIRE:
+			required = true;
+			/* fall through */
+		case OP_READ:
+		case OP_CHECK:
+			reg_read(cam, target, op->reg, &vals[i]);
+			break;
+		case OP_SYNC:
+			ret = flush_checks(cam, ops, vals, &checked, i);
+			if (ret < 0)
+				return ret;
+			required = false;
+			break;
+		case OP_WRITE:
+		case OP_UPDATE:
+			if (required) {
+				ret = flush_checks(cam, ops, vals, &checked, i);
+				if (ret < 0)
+					return ret;
+				required = false;
+			}
+			if (op->type == OP_WRITE) {
+				reg_write(cam, target, op->reg, op->val);
+				break;
+			}
+			pending = cam->num_pending;
+			reg_read(cam, target, op->reg, &vals[i]);
+			if (cam->num_pending != pending) {
+				ret = flush_checks(cam, ops, vals, &checked, i);
+				if (ret < 0)
+					return ret;
+			}
+			reg_write(cam, target, op->reg,
+				  (vals[i] & ~op->mask) | op->val);
+			break;
+		}
+	}
+
+	return flush_checks(cam, ops, vals, &checked, n);
+}
+
+int esp770u_init_regs(struct esp770u *cam)
+{
+	int ret;
+
+	/* The camera was just plugged in */
+	esp770u_invalidate(cam);
+
+	set_get_verify_a0(cam, 0x03, 0xb2);
+
+	ret = run_table(cam, BRIDGE, esp770u_init_table,
+			sizeof(esp770u_init_table) / sizeof(esp770u_init_table[0]));
+	if (ret < 0)
+		return ret;
+
+#if 0
+	uint8_t regs[2][256];
+
+	for (int i = 0; i < 256; i++) {
+		esp770u_read_reg(cam, i, &regs[0][i]);
+		esp770u_read_reg_f1(cam, i, &regs[1][i]);
+	}
+	ret = esp770u_flush(cam);
+	if (ret < 0) return ret;
+
+	for (int bank = 0; bank < 2; bank++) {
+		for (int i = 0; i < 256; i++) {
+			if (i % 16 == 0)
+				printf("%02x: ", i);
+			printf("%02x ", regs[bank][i]);
+			if (i % 16 == 15)
+				printf("\n");
+		}
+		if (bank == 0)
+			printf("--------------------------------------\n");
+	}
+#endif
+
+	return 0;
+}
+
+int ar0134_init(struct esp770u *cam)
+{
+	uint16_t calib_70c, calib_50c, val;
+	int ret;
+
+	/* Starting the stream may have reprogrammed the sensor */
+	ar0134_invalidate(cam);
+
+	ret = run_table(cam, SENSOR, ar0134_init_table,
+			sizeof(ar0134_init_table) / sizeof(ar0134_init_table[0]));
+	if (ret < 0)
+		return ret;
+
+	/* Read 70 °C and 50 °C calibration points and the temperature sensor */
+	ar0134_read_reg(cam, 0x30c6, &calib_70c);
+	ar0134_read_reg(cam, 0x30c8, &calib_50c);
+	ar0134_read_reg(cam, 0x30b2, &val);
+	ret = esp770u_flush(cam);
+	if (ret < 0)
+		return ret;
+
+	printf("Temperature: %.1f °C\n", 50.0 + 20.0 * (val - calib_50c) /
+	       (calib_70c - calib_50c));
+
+	return 0;
+}
+
+static int radio_setup_control(struct usbctl *q, uint8_t a, size_t len)
+{
+	uint8_t control[16];
+	int ret;
+
+	/* prepare */
+	memset(control, 0, sizeof control);
+	control[1] = a; /* alternating, 0x81 or 0x41 */
+	control[2] = 0x80;
+	control[3] = 0x01;
+	control[9] = len;
+	ret = usbctl_set_cur(q, XU_ENTITY, CONTROL_SEL, control, sizeof control);
+	if (ret < 0)
+		return ret;
+
+	return usbctl_delay(q, RADIO_DELAY_US);
+}
+
+static int radio_check_read(const uint8_t *data, int len, void *priv,
+			    uint32_t arg)
+{
+	if (data[0] != (arg & 0xff) || data[1] != (arg >> 8)) {
+		printf("unexpected read\n");
+		for (int i = 0; i < 127; i++)
+			printf("%02x ", data[i]);
+		printf("\n");
+	}
+	return 0;
+}
+
+/*
+ * Queues a radio command: send it, read back the (unchecked, all zero) reply
+ * buffer, clear it, and read the response. The radio needs a pause after
+ * every step, so only the host side round trips are saved here.
+ */
+static int radio_write(struct usbctl *q, const uint8_t *buf, size_t len)
+{
+	uint8_t data[127];
+	size_t i;
+
+	if (len > 126)
+		return -EINVAL;
+
+	memset(data, 0, sizeof data);
+	for (i = 0; i < len; i++) {
+		data[i] = buf[i];
+		data[126] -= buf[i]; /* calculate checksum */
+	}
+
+	/* send data */
+	radio_setup_control(q, 0x81, sizeof data);
+	usbctl_set_cur(q, XU_ENTITY, DATA_SEL, data, sizeof data);
+	usbctl_delay(q, RADIO_DELAY_US);
+
+	/* expect all zeros */
+	radio_setup_control(q, 0x41, sizeof data);
+	usbctl_get_cur(q, XU_ENTITY, DATA_SEL, sizeof data, NULL, NULL, 0);
+	usbctl_delay(q, RADIO_DELAY_US);
+
+	/* clear */
+	memset(data, 0, sizeof data);
+	radio_setup_control(q, 0x81, sizeof data);
+	usbctl_set_cur(q, XU_ENTITY, DATA_SEL, data, sizeof data);
+	usbctl_delay(q, RADIO_DELAY_US);
+
+	radio_setup_control(q, 0x41, sizeof data);
+	return usbctl_get_cur(q, XU_ENTITY, DATA_SEL, sizeof data,
+			      radio_check_read, NULL, buf[0] | buf[1] << 8);
+}
+
+int esp770u_setup_radio(struct esp770u *cam, uint32_t radio_id)
+{
+	struct usbctl *q = cam->usbctl;
+
+	const uint8_t buf1[7] = { 0x40, 0x10, radio_id & 0xff,
+				  (radio_id >> 8) & 0xff,
+				  (radio_id >> 16) & 0xff,
+				  (radio_id >> 24) & 0xff, 0x8c };
+	radio_write(q, buf1, sizeof buf1);
+
+	const uint8_t buf2[10] = { 0x50, 0x11, 0xf4, 0x01, 0x00, 0x00,
+				   0x67, 0xff, 0xff, 0xff };
+	radio_write(q, buf2, sizeof buf2);
+
+	const uint8_t buf3[2] = { 0x61, 0x12 };
+	radio_write(q, buf3, sizeof buf3);
+
+	const uint8_t buf4[2] = { 0x71, 0x85 };
+	radio_write(q, buf4, sizeof buf4);
+
+	const uint8_t buf5[2] = { 0x81, 0x86 };
+	radio_write(q, buf5, sizeof buf5);
+
+	return esp770u_flush(cam);
+}
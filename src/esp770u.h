@@ -0,0 +1,50 @@
+/*
+ * eSP770U camera bridge, AR0134 sensor and radio setup
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ */
+#ifndef __ESP770U_H__
+#define __ESP770U_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "usbctl.h"
+
+/* Extension unit and its selectors */
+#define XU_ENTITY		4
+#define SENSOR_REG_SEL		2
+#define REG_SEL			3
+#define CONTROL_SEL		11
+#define DATA_SEL		12
+
+struct esp770u_stats {
+	uint64_t reads;
+	uint64_t cached_reads;
+	uint64_t writes;
+	uint64_t skipped_writes;
+};
+
+struct esp770u;
+
+struct esp770u *esp770u_new(struct usbctl *q);
+void esp770u_free(struct esp770u *cam);
+void esp770u_set_cache(struct esp770u *cam, bool enable);
+void esp770u_invalidate(struct esp770u *cam);
+int esp770u_flush(struct esp770u *cam);
+void esp770u_get_stats(struct esp770u *cam, struct esp770u_stats *st);
+
+/*
+ * The register accessors only queue transfers. Values not in the cache are
+ * stored, and writes are verified, when the queue is flushed.
+ */
+int esp770u_read_reg(struct esp770u *cam, uint8_t reg, uint8_t *val);
+int esp770u_read_reg_f1(struct esp770u *cam, uint8_t reg, uint8_t *val);
+int esp770u_write_reg(struct esp770u *cam, uint8_t reg, uint8_t val);
+int ar0134_read_reg(struct esp770u *cam, uint16_t reg, uint16_t *val);
+int ar0134_write_reg(struct esp770u *cam, uint16_t reg, uint16_t val);
+
+int esp770u_init_regs(struct esp770u *cam);
+int ar0134_init(struct esp770u *cam);
+int esp770u_setup_radio(struct esp770u *cam, uint32_t radio_id);
+
+#endif /* __ESP770U_H__ */
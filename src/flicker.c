@@ -0,0 +1,319 @@
+/*
+ * LED identification by blink pattern
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ *
+ * Every tracked blob accumulates one bit per frame, set if the blob is in its
+ * bright state. Once a full pattern length of bits is known, the window is
+ * looked up in a table of all rotations of all LED patterns, which yields the
+ * LED and the phase of its pattern. Identified blobs are then checked against
+ * the expected pattern each frame.
+ *
+ * Skipped frames leave unknown bits in the window. Windows with up to two
+ * unknown bits are identified if the known bits match a single rotation of a
+ * single pattern. Since all LEDs blink in phase, the phase found by most
+ * identifications allows to match windows with more unknown bits against one
+ * rotation per pattern.
+ */
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "blobwatch.h"
+#include "flicker.h"
+#include "leds.h"
+
+/* Number of LEDs in the pattern table used if none is given */
+#define FLICKER_DEFAULT_LEDS	40
+
+/*
+ * The area envelope decays towards the current area by 1/2^ENVELOPE_SHIFT
+ * per frame, bright and dim areas must differ by at least 1/CONTRAST.
+ */
+#define ENVELOPE_SHIFT		4
+#define CONTRAST		3
+
+/*
+ * Blink state of the blob in a track slot. age and frame tell whether the
+ * track slot was continued by the same blob since the last frame.
+ */
+struct flicker_track {
+	uint32_t age;
+	uint32_t frame;
+	/* frames since the start of the track, including skipped ones */
+	uint32_t frames;
+	/* slowly decaying minimum and maximum area */
+	uint32_t lo;
+	uint32_t hi;
+	/* the last pattern_bits bits, newest in bit 0, and which are known */
+	uint16_t bits;
+	uint16_t mask;
+	int8_t led_id;
+	uint8_t phase;
+};
+
+struct flicker {
+	struct flicker_track *tracks;
+	int max_tracks;
+	/* processed frames, and all frames including skipped ones */
+	uint32_t frame;
+	uint32_t count;
+	/* full window identifications per pattern phase at count 0 */
+	uint32_t phase_votes[LEDS_MAX_PATTERN_BITS];
+	int phase;
+	/* pattern table the lookup table was built from */
+	const struct leds *leds;
+	struct leds *default_leds;
+	/* LED * pattern_bits + phase for each window, or -1 */
+	int16_t *lookup;
+	struct flicker_stats stats;
+};
+
+static inline unsigned int rotl(unsigned int x, int n, int bits)
+{
+	unsigned int mask = (1u << bits) - 1;
+
+	n %= bits;
+	return ((x << n) | (x >> (bits - n))) & mask;
+}
+
+/*
+ * Allocates a flicker decoder for blobs with track indices below max_tracks.
+ *
+ * Returns the newly allocated decoder, or NULL on error.
+ */
+struct flicker *flicker_new(int max_tracks)
+{
+	struct flicker *fl = calloc(1, sizeof(*fl));
+
+	if (!fl)
+		return NULL;
+
+	fl->tracks = calloc(max_tracks, sizeof(*fl->tracks));
+	fl->lookup = malloc(sizeof(*fl->lookup) << LEDS_MAX_PATTERN_BITS);
+	fl->default_leds = leds_new(FLICKER_DEFAULT_LEDS, LEDS_PATTERN_BITS);
+	if (!fl->tracks || !fl->lookup || !fl->default_leds) {
+		flicker_free(fl);
+		return NULL;
+	}
+	fl->max_tracks = max_tracks;
+	/* No track slot may look updated in the previous frame */
+	fl->frame = 2;
+	fl->phase = -1;
+
+	return fl;
+}
+
+void flicker_free(struct flicker *fl)
+{
+	if (!fl)
+		return;
+
+	leds_free(fl->default_leds);
+	free(fl->lookup);
+	free(fl->tracks);
+	free(fl);
+}
+
+/*
+ * Fills the lookup table from window to LED and phase. Windows that are no
+ * rotation of any pattern, or of more than one, are marked invalid.
+ */
+static void build_lookup(struct flicker *fl, const struct leds *leds)
+{
+	int bits = leds->pattern_bits;
+	int i, n;
+
+	for (i = 0; i < 1 << bits; i++)
+		fl->lookup[i] = -1;
+
+	for (i = 0; i < leds->num; i++) {
+		for (n = 0; n < bits; n++) {
+			unsigned int w = rotl(leds->patterns[i], n, bits);
+
+			fl->lookup[w] = fl->lookup[w] == -1 ? i * bits + n : -2;
+		}
+	}
+	for (i = 0; i < 1 << bits; i++) {
+		if (fl->lookup[i] == -2)
+			fl->lookup[i] = -1;
+	}
+
+	fl->leds = leds;
+	fl->phase = -1;
+	memset(fl->phase_votes, 0, sizeof(fl->phase_votes));
+	for (i = 0; i < fl->max_tracks; i++)
+		fl->tracks[i].led_id = -1;
+}
+
+/*
+ * Counts a full window identification towards the common phase of all LEDs.
+ */
+static void vote_phase(struct flicker *fl, int phase)
+{
+	fl->phase_votes[phase]++;
+	if (fl->phase < 0 ||
+	    fl->phase_votes[phase] > fl->phase_votes[fl->phase])
+		fl->phase = phase;
+}
+
+static void reset_track(struct flicker_track *t, const struct blob *b)
+{
+	t->frames = 0;
+	t->lo = b->area;
+	t->hi = b->area;
+	t->bits = 0;
+	t->mask = 0;
+	t->led_id = -1;
+	t->phase = 0;
+}
+
+/*
+ * Appends the bright or dim state of the blob to its track, after as many
+ * unknown bits as frames were skipped.
+ */
+static void update_bits(struct flicker_track *t, const struct blob *b,
+			int shift, unsigned int full)
+{
+	uint32_t area = b->area;
+	int known;
+
+	if (area > t->hi)
+		t->hi = area;
+	else
+		t->hi -= (t->hi - area) >> ENVELOPE_SHIFT;
+	if (area < t->lo)
+		t->lo = area;
+	else
+		t->lo += (area - t->lo) >> ENVELOPE_SHIFT;
+
+	known = (t->hi - t->lo) * CONTRAST >= t->hi;
+
+	t->bits = ((t->bits << shift) | (known && 2 * area > t->lo + t->hi)) &
+		  full;
+	t->mask = ((t->mask << shift) | known) & full;
+}
+
+/*
+ * Returns LED * pattern_bits + phase of the only pattern rotation that agrees
+ * with the known bits of the track, or -1. Full windows are looked up
+ * directly, others need all but two bits known, or two thirds of the bits
+ * and the common phase.
+ */
+static int match_pattern(struct flicker *fl, const struct leds *leds,
+			 const struct flicker_track *t, unsigned int full)
+{
+	int known = __builtin_popcount(t->mask);
+	int bits = leds->pattern_bits;
+	int match = -1;
+	int i, n;
+
+	if (t->mask == full) {
+		match = fl->lookup[t->bits];
+	} else if (known >= bits - 2 ||
+		   (fl->phase >= 0 && 3 * known >= 2 * bits)) {
+		int first = 0, last = bits - 1;
+
+		if (fl->phase >= 0)
+			first = last = (fl->phase + fl->count) % bits;
+
+		for (i = 0; i < leds->num; i++) {
+			for (n = first; n <= last; n++) {
+				unsigned int w = rotl(leds->patterns[i], n,
+						      bits);
+
+				if ((w ^ t->bits) & t->mask)
+					continue;
+				if (match >= 0)
+					return -1;
+				match = i * bits + n;
+			}
+		}
+	}
+
+	if (match >= 0)
+		vote_phase(fl, (match + bits - fl->count % bits) % bits);
+
+	return match;
+}
+
+/*
+ * Identifies tracked blobs by their blinking pattern and stores the pattern
+ * window and LED in the blobs. skipped is the number of frames lost since the
+ * last call. If leds is NULL, the table leds_new() generates is used. That is
+ * the table synthetic frames blink with, not the headset's LED codes.
+ */
+void flicker_process(struct flicker *fl, struct blob *blobs, int num_blobs,
+		     int skipped, const struct leds *leds)
+{
+	int bits, shift, i;
+	unsigned int full;
+
+	if (!leds)
+		leds = fl->default_leds;
+	if (leds != fl->leds)
+		build_lookup(fl, leds);
+
+	bits = leds->pattern_bits;
+	full = (1u << bits) - 1;
+	shift = skipped < bits ? skipped + 1 : bits;
+	fl->count += skipped + 1;
+
+	for (i = 0; i < num_blobs; i++) {
+		struct blob *b = &blobs[i];
+		struct flicker_track *t;
+		int id;
+
+		if (b->track_index < 0 || b->track_index >= fl->max_tracks) {
+			b->pattern = 0;
+			b->led_id = -1;
+			continue;
+		}
+
+		t = &fl->tracks[b->track_index];
+		if (t->frame != fl->frame - 1 || b->age != t->age + 1)
+			reset_track(t, b);
+		t->age = b->age;
+		t->frame = fl->frame;
+		t->frames += skipped + 1;
+
+		update_bits(t, b, shift, full);
+
+		/* Allow a single misread bit in the expected pattern */
+		if (t->led_id >= 0) {
+			unsigned int expected;
+
+			t->phase = (t->phase + skipped + 1) % bits;
+			expected = rotl(leds->patterns[t->led_id], t->phase,
+					bits);
+			if (__builtin_popcount((t->bits ^ expected) &
+					       t->mask) > 1) {
+				t->led_id = -1;
+				fl->stats.unlocks++;
+			}
+		}
+
+		if (t->led_id < 0) {
+			id = match_pattern(fl, leds, t, full);
+			if (id >= 0) {
+				t->led_id = id / bits;
+				t->phase = id % bits;
+				fl->stats.locks++;
+				fl->stats.lock_frames += t->frames;
+			}
+		}
+
+		b->pattern = t->bits;
+		b->led_id = t->led_id;
+	}
+
+	fl->frame++;
+}
+
+/*
+ * Returns the identification counts accumulated since the decoder was
+ * allocated.
+ */
+void flicker_get_stats(struct flicker *fl, struct flicker_stats *stats)
+{
+	*stats = fl->stats;
+}
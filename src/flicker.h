@@ -0,0 +1,32 @@
+/*
+ * LED identification by blink pattern
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ */
+#ifndef __FLICKER_H__
+#define __FLICKER_H__
+
+#include <stdint.h>
+
+struct blob;
+struct leds;
+
+/*
+ * Counts of tracks identified as an LED, the frames it took from the start
+ * of the track until then, and identifications dropped again because the
+ * blob stopped following the pattern.
+ */
+struct flicker_stats {
+	uint64_t locks;
+	uint64_t lock_frames;
+	uint64_t unlocks;
+};
+
+struct flicker;
+
+struct flicker *flicker_new(int max_tracks);
+void flicker_free(struct flicker *fl);
+void flicker_process(struct flicker *fl, struct blob *blobs, int num_blobs,
+		     int skipped, const struct leds *leds);
+void flicker_get_stats(struct flicker *fl, struct flicker_stats *stats);
+
+#endif /* __FLICKER_H__ */
@@ -0,0 +1,188 @@
+/*
+ * Bounded frame queue with a preallocated frame pool
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ */
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "framequeue.h"
+
+#define FRAME_ALIGN	64
+
+/*
+ * The pool holds depth + 2 frames: up to depth queued frames, one being filled
+ * by the producer, and one being processed by the consumer. So the free list
+ * only runs empty when the queue is full, and the producer never waits.
+ */
+struct framequeue {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	enum framequeue_policy policy;
+	int depth;
+	int head;
+	int count;
+	struct frame **queue;
+	struct frame **free_list;
+	int num_free;
+	int num_frames;
+	struct frame *frames;
+	uint8_t *data;
+	bool closed;
+	struct framequeue_stats stats;
+};
+
+/*
+ * Allocates a queue of the given depth and its frame pool.
+ *
+ * Returns the newly allocated frame queue.
+ */
+struct framequeue *framequeue_new(int depth, size_t frame_size,
+				  enum framequeue_policy policy)
+{
+	size_t stride = (frame_size + FRAME_ALIGN - 1) & ~(FRAME_ALIGN - 1);
+	struct framequeue *fq;
+	int i;
+
+	if (depth < 1)
+		return NULL;
+
+	fq = calloc(1, sizeof(*fq));
+	if (!fq)
+		return NULL;
+
+	pthread_mutex_init(&fq->lock, NULL);
+	pthread_cond_init(&fq->cond, NULL);
+
+	fq->policy = policy;
+	fq->depth = depth;
+	fq->num_frames = depth + 2;
+	fq->queue = calloc(depth, sizeof(*fq->queue));
+	fq->free_list = calloc(fq->num_frames, sizeof(*fq->free_list));
+	fq->frames = calloc(fq->num_frames, sizeof(*fq->frames));
+	if (posix_memalign((void **)&fq->data, FRAME_ALIGN,
+			   fq->num_frames * stride) != 0)
+		fq->data = NULL;
+	if (!fq->queue || !fq->free_list || !fq->frames || !fq->data) {
+		framequeue_free(fq);
+		return NULL;
+	}
+
+	/* Touch the pool now, not in the capture callback */
+	memset(fq->data, 0, fq->num_frames * stride);
+
+	for (i = 0; i < fq->num_frames; i++) {
+		fq->frames[i].data = fq->data + i * stride;
+		fq->free_list[fq->num_free++] = &fq->frames[i];
+	}
+
+	return fq;
+}
+
+void framequeue_free(struct framequeue *fq)
+{
+	if (!fq)
+		return;
+
+	pthread_cond_destroy(&fq->cond);
+	pthread_mutex_destroy(&fq->lock);
+	free(fq->data);
+	free(fq->frames);
+	free(fq->free_list);
+	free(fq->queue);
+	free(fq);
+}
+
+/*
+ * Returns a frame for the producer to fill. If the queue is full, the oldest
+ * queued frame is reclaimed or NULL is returned, depending on the policy.
+ * Never blocks for longer than it takes to update the lists.
+ */
+struct frame *framequeue_get_free(struct framequeue *fq)
+{
+	struct frame *f = NULL;
+
+	pthread_mutex_lock(&fq->lock);
+	if (fq->count < fq->depth) {
+		f = fq->free_list[--fq->num_free];
+	} else if (fq->policy == FRAMEQUEUE_DROP_OLDEST) {
+		f = fq->queue[fq->head];
+		fq->head = (fq->head + 1) % fq->depth;
+		fq->count--;
+		fq->stats.dropped_oldest++;
+	} else {
+		fq->stats.dropped_newest++;
+	}
+	pthread_mutex_unlock(&fq->lock);
+
+	return f;
+}
+
+/*
+ * Queues a filled frame and wakes up the consumer.
+ */
+void framequeue_push(struct framequeue *fq, struct frame *f)
+{
+	pthread_mutex_lock(&fq->lock);
+	fq->queue[(fq->head + fq->count) % fq->depth] = f;
+	fq->count++;
+	fq->stats.queued++;
+	if (fq->count > fq->stats.max_depth)
+		fq->stats.max_depth = fq->count;
+	pthread_cond_signal(&fq->cond);
+	pthread_mutex_unlock(&fq->lock);
+}
+
+/*
+ * Waits for the oldest queued frame and dequeues it. The consumer must return
+ * it with framequeue_release() when done.
+ *
+ * Returns the frame, or NULL once the queue is closed.
+ */
+struct frame *framequeue_pop(struct framequeue *fq)
+{
+	struct frame *f = NULL;
+
+	pthread_mutex_lock(&fq->lock);
+	while (!fq->count && !fq->closed)
+		pthread_cond_wait(&fq->cond, &fq->lock);
+	if (fq->count) {
+		f = fq->queue[fq->head];
+		fq->head = (fq->head + 1) % fq->depth;
+		fq->count--;
+	}
+	pthread_mutex_unlock(&fq->lock);
+
+	return f;
+}
+
+/*
+ * Returns a processed frame to the pool.
+ */
+void framequeue_release(struct framequeue *fq, struct frame *f)
+{
+	pthread_mutex_lock(&fq->lock);
+	fq->free_list[fq->num_free++] = f;
+	fq->stats.processed++;
+	pthread_mutex_unlock(&fq->lock);
+}
+
+/*
+ * Makes framequeue_pop() return NULL once the queue is drained.
+ */
+void framequeue_close(struct framequeue *fq)
+{
+	pthread_mutex_lock(&fq->lock);
+	fq->closed = true;
+	pthread_cond_broadcast(&fq->cond);
+	pthread_mutex_unlock(&fq->lock);
+}
+
+void framequeue_get_stats(struct framequeue *fq, struct framequeue_stats *st)
+{
+	pthread_mutex_lock(&fq->lock);
+	*st = fq->stats;
+	pthread_mutex_unlock(&fq->lock);
+}
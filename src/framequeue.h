@@ -0,0 +1,56 @@
+/*
+ * Bounded frame queue with a preallocated frame pool
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ */
+#ifndef __FRAMEQUEUE_H__
+#define __FRAMEQUEUE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A frame buffer from the pool, data is aligned to a cache line.
+ */
+struct frame {
+	uint8_t *data;
+	uint32_t size;
+	uint32_t sequence;
+	/* frames since streaming started, including lost ones */
+	uint32_t number;
+	/* capture timestamp in nanoseconds */
+	uint64_t timestamp;
+	/* monotonic arrival timestamp, and copy timestamp if latency is measured */
+	uint64_t arrived;
+	uint64_t copied;
+};
+
+/*
+ * What to do with a new frame when the queue is full: replace the oldest
+ * queued frame, or discard the new one.
+ */
+enum framequeue_policy {
+	FRAMEQUEUE_DROP_OLDEST,
+	FRAMEQUEUE_DROP_NEWEST,
+};
+
+struct framequeue_stats {
+	uint64_t queued;
+	uint64_t processed;
+	uint64_t dropped_oldest;
+	uint64_t dropped_newest;
+	int max_depth;
+};
+
+struct framequeue;
+
+struct framequeue *framequeue_new(int depth, size_t frame_size,
+				  enum framequeue_policy policy);
+void framequeue_free(struct framequeue *fq);
+struct frame *framequeue_get_free(struct framequeue *fq);
+void framequeue_push(struct framequeue *fq, struct frame *f);
+struct frame *framequeue_pop(struct framequeue *fq);
+void framequeue_release(struct framequeue *fq, struct frame *f);
+void framequeue_close(struct framequeue *fq);
+void framequeue_get_stats(struct framequeue *fq, struct framequeue_stats *st);
+
+#endif /* __FRAMEQUEUE_H__ */
@@ -0,0 +1,132 @@
+/*
+ * Per-frame latency instrumentation
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+
+#include "clock.h"
+#include "latency.h"
+
+/* Holds 17 s of frames at 60 Hz, a power of two */
+#define LATENCY_RING_SIZE	1024
+
+/*
+ * Single producer ring of latency samples. The producer never waits: it
+ * overwrites the oldest samples, and the reader detects that by checking the
+ * head again after copying.
+ */
+struct latency_ring {
+	struct latency_sample samples[LATENCY_RING_SIZE];
+	uint64_t head;
+	/* reader state */
+	uint64_t tail;
+	struct latency_sample snapshot[LATENCY_RING_SIZE];
+	uint64_t deltas[LATENCY_RING_SIZE];
+};
+
+static const char *stage_names[] = {
+	"copy",
+	"queue",
+	"detect",
+	"track",
+	"display",
+};
+
+struct latency_ring *latency_new(void)
+{
+	return calloc(1, sizeof(struct latency_ring));
+}
+
+void latency_free(struct latency_ring *r)
+{
+	free(r);
+}
+
+/*
+ * Stores a completed sample. Must only be called from one thread.
+ */
+void latency_push(struct latency_ring *r, const struct latency_sample *s)
+{
+	uint64_t head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+
+	r->samples[head & (LATENCY_RING_SIZE - 1)] = *s;
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Sorts n deltas and prints their median, 99th percentile and maximum.
+ */
+static void print_stage(FILE *out, const char *name, uint64_t *d, int n)
+{
+	clock_sort_ns(d, n);
+	fprintf(out, "  %-8s p50 %8.3f  p99 %8.3f  max %8.3f ms\n", name,
+		clock_percentile_ns(d, n, 500) * 1e-6,
+		clock_percentile_ns(d, n, 990) * 1e-6, d[n - 1] * 1e-6);
+}
+
+/*
+ * Prints per-stage and end-to-end latency statistics over the samples pushed
+ * since the last report, and appends them to csv if given. Samples that were
+ * overwritten before they could be read are skipped. Must only be called from
+ * one thread.
+ *
+ * Returns the number of samples reported.
+ */
+int latency_report(struct latency_ring *r, FILE *out, FILE *csv)
+{
+	uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	uint64_t first, i;
+	int n = 0, stage, j;
+
+	first = r->tail;
+	if (head - first > LATENCY_RING_SIZE)
+		first = head - LATENCY_RING_SIZE;
+
+	for (i = first; i < head; i++)
+		r->snapshot[n++] = r->samples[i & (LATENCY_RING_SIZE - 1)];
+
+	/*
+	 * Drop the samples the producer overwrote while we were copying,
+	 * including the one it may be writing right now.
+	 */
+	i = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) + 1;
+	if (i - first > LATENCY_RING_SIZE) {
+		int lost = i - first - LATENCY_RING_SIZE;
+
+		lost = lost < n ? lost : n;
+		memmove(r->snapshot, r->snapshot + lost,
+			(n - lost) * sizeof(*r->snapshot));
+		n -= lost;
+	}
+	r->tail = head;
+
+	if (n == 0)
+		return 0;
+
+	if (csv) {
+		for (j = 0; j < n; j++) {
+			fprintf(csv, "%u", r->snapshot[j].sequence);
+			for (stage = 0; stage < LATENCY_NUM_STAMPS; stage++)
+				fprintf(csv, ",%llu", (unsigned long long)
+					r->snapshot[j].t[stage]);
+			fputc('\n', csv);
+		}
+		fflush(csv);
+	}
+
+	fprintf(out, "Latency over %d frames:\n", n);
+	for (stage = 0; stage < LATENCY_NUM_STAMPS - 1; stage++) {
+		for (j = 0; j < n; j++)
+			r->deltas[j] = r->snapshot[j].t[stage + 1] -
+				       r->snapshot[j].t[stage];
+		print_stage(out, stage_names[stage], r->deltas, n);
+	}
+	for (j = 0; j < n; j++)
+		r->deltas[j] = r->snapshot[j].t[LATENCY_PRESENTED] -
+			       r->snapshot[j].t[LATENCY_ARRIVAL];
+	print_stage(out, "total", r->deltas, n);
+
+	return n;
+}
@@ -0,0 +1,42 @@
+/*
+ * Per-frame latency instrumentation
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ */
+#ifndef __LATENCY_H__
+#define __LATENCY_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Points in the life of a frame at which a monotonic timestamp is taken.
+ */
+enum latency_stamp {
+	/* entry to the libuvc frame callback */
+	LATENCY_ARRIVAL,
+	/* frame copied into the frame queue */
+	LATENCY_COPIED,
+	/* frame taken off the queue, blob detection started */
+	LATENCY_DEQUEUED,
+	/* blob detection done */
+	LATENCY_DETECTED,
+	/* blob tracking done */
+	LATENCY_TRACKED,
+	/* rendered frame presented, or blobs reported when headless */
+	LATENCY_PRESENTED,
+	LATENCY_NUM_STAMPS,
+};
+
+struct latency_sample {
+	uint32_t sequence;
+	uint64_t t[LATENCY_NUM_STAMPS];
+};
+
+struct latency_ring;
+
+struct latency_ring *latency_new(void);
+void latency_free(struct latency_ring *r);
+void latency_push(struct latency_ring *r, const struct latency_sample *s);
+int latency_report(struct latency_ring *r, FILE *out, FILE *csv);
+
+#endif /* __LATENCY_H__ */
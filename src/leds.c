@@ -0,0 +1,96 @@
+/*
+ * LED blink pattern table
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ */
+#include <stdlib.h>
+
+#include "leds.h"
+
+static inline unsigned int rotl(unsigned int x, int n, int bits)
+{
+	unsigned int mask = (1u << bits) - 1;
+
+	return ((x << n) | (x >> (bits - n))) & mask;
+}
+
+/*
+ * Returns whether x is the smallest of its rotations and differs from all of
+ * them, so that every window of bits consecutive frames identifies both the
+ * pattern and its phase.
+ */
+static int is_aperiodic_necklace(unsigned int x, int bits)
+{
+	int n;
+
+	for (n = 1; n < bits; n++) {
+		if (rotl(x, n, bits) <= x)
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * Generates a table of num blink patterns of the given length. Only patterns
+ * with an even number of bright frames are used, so any two windows of
+ * pattern_bits frames, of the same or of different LEDs, differ in at least
+ * two bits and a single misread bit never yields a valid pattern. Patterns
+ * with a balanced number of bright and dim frames are picked first.
+ *
+ * Returns the newly allocated table, or NULL if there are not enough
+ * patterns of that length.
+ */
+struct leds *leds_new(int num, int pattern_bits)
+{
+	struct leds *leds;
+	int distance, n = 0;
+
+	if (num < 1 || pattern_bits < 2 || pattern_bits > LEDS_MAX_PATTERN_BITS)
+		return NULL;
+
+	leds = calloc(1, sizeof(*leds));
+	if (!leds)
+		return NULL;
+	leds->patterns = calloc(num, sizeof(*leds->patterns));
+	if (!leds->patterns) {
+		free(leds);
+		return NULL;
+	}
+	leds->num = num;
+	leds->pattern_bits = pattern_bits;
+
+	for (distance = 0; distance < pattern_bits / 2 && n < num; distance++) {
+		int weights[2] = {
+			pattern_bits / 2 - distance,
+			(pattern_bits + 1) / 2 + distance,
+		};
+		unsigned int x;
+		int i;
+
+		for (i = 0; i < 2 && n < num; i++) {
+			if (weights[i] % 2 || (i && weights[1] == weights[0]))
+				continue;
+
+			for (x = 0; x < 1u << pattern_bits && n < num; x++) {
+				if (__builtin_popcount(x) == weights[i] &&
+				    is_aperiodic_necklace(x, pattern_bits))
+					leds->patterns[n++] = x;
+			}
+		}
+	}
+
+	if (n < num) {
+		leds_free(leds);
+		return NULL;
+	}
+
+	return leds;
+}
+
+void leds_free(struct leds *leds)
+{
+	if (!leds)
+		return;
+
+	free(leds->patterns);
+	free(leds);
+}
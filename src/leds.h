@@ -0,0 +1,37 @@
+/*
+ * LED blink pattern table
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ */
+#ifndef __LEDS_H__
+#define __LEDS_H__
+
+#include <stdint.h>
+
+#define LEDS_PATTERN_BITS	10
+#define LEDS_MAX_PATTERN_BITS	16
+
+/*
+ * Blink patterns of a set of LEDs. Every LED repeats its pattern_bits long
+ * pattern, most significant bit first, one bit per camera frame: a set bit
+ * is a bright frame, a cleared bit a dim frame. All LEDs run in phase.
+ */
+struct leds {
+	int num;
+	int pattern_bits;
+	uint16_t *patterns;
+};
+
+struct leds *leds_new(int num, int pattern_bits);
+void leds_free(struct leds *leds);
+
+/*
+ * Returns whether LED id is bright in the given frame.
+ */
+static inline int leds_bit(const struct leds *leds, int id, unsigned int frame)
+{
+	int bit = leds->pattern_bits - 1 - frame % leds->pattern_bits;
+
+	return (leds->patterns[id] >> bit) & 1;
+}
+
+#endif /* __LEDS_H__ */
@@ -1,594 +1,724 @@
+#define _GNU_SOURCE
 #include <errno.h>
 #include <libusb.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <SDL.h>
 
 #include "libuvc/libuvc.h"
+#include "bench.h"
+#include "binlog.h"
+#include "blobstream.h"
 #include "blobwatch.h"
+#include "capture.h"
+#include "clock.h"
+#include "display.h"
+#include "esp770u.h"
+#include "framequeue.h"
+#include "latency.h"
+#include "mockcam.h"
+#include "preview.h"
+#include "replay.h"
+#include "rle.h"
+#include "rtsched.h"
+#include "sensors.h"
+#include "threadpool.h"
+#include "triplebuf.h"
+#include "usbctl.h"
 
 #define ASSERT_MSG(_v, ...) if(!(_v)){ fprintf(stderr, __VA_ARGS__); exit(1); }
 #define WIDTH  1280
 #define HEIGHT  720
 #define FPS      55
-
-#define SET_CUR 0x01
-#define GET_CUR 0x81
-#define TIMEOUT 1000
+#define FRAME_NS (1000000000ULL / FPS)
+/* Capture files replayed at once as separate sensors */
+#define MAX_REPLAY_FILES 8
+/* Cameras streamed at once as separate sensors */
+#define MAX_CAMERAS 4
 
 /* change this to the Rift HMD's radio id */
 #define RIFT_RADIO_ID 0x12345678
 
-#define CONTROL_IFACE   0
-
-static int uvc_set_cur(libusb_device_handle *dev, uint8_t entity,
-		       uint8_t selector, unsigned char *data, uint16_t wLength)
+/*
+ * A frame and its blobs, handed from the detection thread to the render loop.
+ * The frame is handed over as runs above threshold if has_rle is set, as
+ * pixels otherwise.
+ */
+struct display_frame
 {
-	uint8_t bmRequestType = LIBUSB_REQUEST_TYPE_CLASS |
-		LIBUSB_RECIPIENT_INTERFACE;
-	uint8_t bRequest = SET_CUR;
-	uint16_t wValue = selector << 8;
-	uint16_t wIndex = entity << 8 | CONTROL_IFACE;
-	unsigned int timeout = TIMEOUT;
-	int ret;
-
-	ret = libusb_control_transfer(dev, bmRequestType, bRequest, wValue,
-			wIndex, data, wLength, timeout);
-	if (ret < 0) {
-		fprintf(stderr, "failed to transfer SET CUR %u %u: %d %d %m\n",
-			entity, selector, ret, errno);
-	}
-	return ret;
-}
-
-static int uvc_get_cur(libusb_device_handle *dev, uint8_t entity,
-		       uint8_t selector, unsigned char *data, uint16_t wLength)
-{
-	uint8_t bmRequestType = 0x80 | LIBUSB_REQUEST_TYPE_CLASS |
-		LIBUSB_RECIPIENT_INTERFACE;
-	uint8_t bRequest = GET_CUR;
-	uint16_t wValue = selector << 8;
-	uint16_t wIndex = entity << 8 | CONTROL_IFACE;
-	unsigned int timeout = TIMEOUT;
-	int ret;
-
-	ret = libusb_control_transfer(dev, bmRequestType, bRequest, wValue,
-			wIndex, data, wLength, timeout);
-	if (ret < 0) {
-		fprintf(stderr, "failed to transfer GET CUR %u %u: %d %d %m\n",
-			entity, selector, ret, errno);
-	}
-	return ret;
-}
+	uint8_t* pixels;
+	struct rle_frame* rle;
+	bool has_rle;
+	struct blob* blobs;
+	int num_blobs;
+	/* arrival time of the frame and frame interval, see blob_extrapolate() */
+	uint64_t timestamp;
+	uint64_t frame_interval;
+	uint32_t sequence;
+	struct latency_sample latency;
+};
 
 typedef struct
 {
-	SDL_Surface* target;
-	SDL_mutex* mutex;
-	struct blobservation* bwobs;
-	libusb_device_handle *usb_devh;
+	struct framequeue* queue;
+	uint64_t bad_frames;
+	/* last frame seen by the callback, and frames lost before it */
+	bool have_last;
+	uint32_t last_sequence;
+	uint64_t last_timestamp;
+	uint32_t frame_number;
+	uint64_t lost_frames;
+	struct triplebuf display;
+	struct display_frame frames[3];
+	struct capture_writer *writer;
+	/* detector runs are displayed and recorded instead of raw frames */
+	bool rle;
+	uint8_t *record_buf;
+	size_t record_size;
+	struct latency_ring *latency;
+	struct blobstream *stream;
+	/* time spent reporting blobs, to compare printf and binary logging */
+	uint64_t report_ns;
+	uint64_t report_frames;
+	/* without a window only every preview_interval-th frame is displayed */
+	bool headless;
+	int preview_interval;
+	/* applied by the libuvc callback thread to itself on the first frame */
+	struct rtsched rt_capture;
+	bool rt_capture_applied;
 } cb_data;
 
 struct blobwatch* bw;
 
 #define min(a,b) ((a) < (b) ? (a) : (b))
 
-void cb(uvc_frame_t *frame, void *ptr)
+/*
+ * Counts the frames lost between the previous callback and this one. libuvc
+ * numbers the frames it completes, so the sequence only shows frames it
+ * dropped itself. Frames lost earlier, on the bus or in the camera, show up
+ * as a longer gap between capture times, so that gap in 1/FPS steps decides.
+ * The sequence only wins if it reports exactly one more lost frame, which the
+ * capture time jitter can hide, or if there is no capture time. Both counts
+ * are capped at FPS, a second of frames, to survive clock steps and sequence
+ * resets.
+ */
+static uint32_t lost_frames(cb_data* data, uint32_t sequence,
+			    uint64_t timestamp)
 {
-	if(frame->data_bytes != WIDTH * HEIGHT){
-		printf("bad frame: %d\n", (int)frame->data_bytes);
-	//	return;
+	uint32_t lost = 0;
+
+	if (data->have_last)
+	{
+		uint32_t by_sequence = min(sequence - data->last_sequence - 1,
+					   FPS);
+
+		lost = by_sequence;
+		if (timestamp > data->last_timestamp)
+		{
+			uint64_t n = (timestamp - data->last_timestamp +
+				      FRAME_NS / 2) / FRAME_NS;
+			uint32_t by_time = n > FPS ? FPS : n ? n - 1 : 0;
+
+			if (by_sequence != by_time + 1)
+				lost = by_time;
+		}
 	}
 
+	data->have_last = true;
+	data->last_sequence = sequence;
+	data->last_timestamp = timestamp;
+
+	return lost;
+}
+
+/*
+ * Runs on the libuvc callback thread. Only copies the frame into the pool and
+ * queues it for the detection thread, so that a slow frame does not hold up
+ * USB transfer processing.
+ */
+void cb(uvc_frame_t *frame, void *ptr)
+{
 	cb_data* data = (cb_data*)ptr;
-			
-	SDL_LockMutex(data->mutex);
-	SDL_LockSurface(data->target);
+	uint64_t arrived = clock_now_ns();
+	size_t size = min(frame->data_bytes, WIDTH * HEIGHT);
+	uint64_t timestamp = frame->capture_time.tv_sec * 1000000000ULL +
+			     frame->capture_time.tv_usec * 1000ULL;
+	uint32_t lost;
+
+	/* libuvc starts the callback thread, it can only be set up from here */
+	if (!data->rt_capture_applied)
+	{
+		rtsched_apply(pthread_self(), &data->rt_capture, "capture");
+		data->rt_capture_applied = true;
+	}
+
+	if (frame->data_bytes != WIDTH * HEIGHT)
+		__atomic_add_fetch(&data->bad_frames, 1, __ATOMIC_RELAXED);
+
+	/* Numbered before queueing, so that queue drops leave gaps too */
+	lost = lost_frames(data, frame->sequence, timestamp);
+	data->lost_frames += lost;
+	data->frame_number += lost + 1;
+
+	struct frame* f = framequeue_get_free(data->queue);
+	if (!f)
+		return;
+
+	memcpy(f->data, frame->data, size);
+	if (size < WIDTH * HEIGHT)
+		memset(f->data + size, 0, WIDTH * HEIGHT - size);
+	f->size = size;
+	f->sequence = frame->sequence;
+	f->number = data->frame_number;
+	f->timestamp = timestamp;
+	f->arrived = arrived;
+	if (data->latency)
+		f->copied = clock_now_ns();
+
+	framequeue_push(data->queue, f);
+}
 
-	unsigned char* spx = frame->data;
-	unsigned char* tpx = data->target->pixels;
+/*
+ * Records a frame, as packed runs if the detector encoded all of it and as
+ * raw pixels otherwise.
+ */
+static void record_frame(cb_data* data, struct frame* f,
+			 const struct rle_frame* rf)
+{
+	const uint8_t* buf = f->data;
+	size_t size = data->rle ? WIDTH * HEIGHT : f->size;
 
-	for(int i = 0; i < min(frame->data_bytes, WIDTH * HEIGHT); i++)
+	if (rf)
 	{
-		(*tpx++) = *spx;
-		(*tpx++) = *spx;
-		(*tpx++) = *spx;
-		(*tpx++) = *(spx++);
+		size_t packed = rle_pack(rf, data->record_buf,
+					 data->record_size);
+
+		if (packed)
+		{
+			buf = data->record_buf;
+			size = packed;
+		}
 	}
 
-	blobwatch_process(bw, frame->data, WIDTH, HEIGHT, 0, NULL, &data->bwobs);
+	if (capture_writer_add(data->writer, buf, size, f->sequence,
+			       f->timestamp) < 0)
+		fprintf(stderr, "failed to record frame %u\n", f->sequence);
+}
 
-	if (data->bwobs)
+/*
+ * Consumes queued frames: records them, detects and tracks blobs, and hands
+ * the results to the render loop.
+ */
+static void* detect_thread(void* ptr)
+{
+	cb_data* data = (cb_data*)ptr;
+	struct frame* f;
+	uint32_t last_number = 0;
+
+	while ((f = framequeue_pop(data->queue)))
 	{
-		if (data->bwobs->num_blobs > 0)
+		struct display_frame* df = triplebuf_back(&data->display);
+		struct blobservation* ob;
+		const struct rle_frame* rf;
+		/* Headless, frames nobody will look at are not copied */
+		bool display = !data->headless ||
+			(data->preview_interval &&
+			 f->sequence % data->preview_interval == 0);
+
+		/* Raw frames are recorded before detection to save time */
+		if (data->writer && !data->rle)
+			record_frame(data, f, NULL);
+
+		/* Frames lost on the way or dropped from the queue */
+		int skipped = last_number ? f->number - last_number - 1 : 0;
+		last_number = f->number;
+
+		/* Stamped on arrival, to extrapolate against the monotonic clock */
+		blobwatch_process(bw, f->data, WIDTH, HEIGHT, skipped, f->arrived,
+				  NULL, &ob);
+
+		rf = data->rle ? blobwatch_get_rle(bw) : NULL;
+		if (data->writer && data->rle)
+			record_frame(data, f, rf);
+
+		/* Hand the blobs to other processes before anything else */
+		if (data->stream && ob)
+			blobstream_publish(data->stream, f->sequence,
+					   f->timestamp, ob);
+
+		if (display)
 		{
-			printf("Blobs: %d\n", data->bwobs->num_blobs);
+			/* The runs are usually a few KB instead of 1.2 MB */
+			df->has_rle = rf && rle_copy(df->rle, rf) == 0;
+			if (!df->has_rle)
+				memcpy(df->pixels, f->data, WIDTH * HEIGHT);
+		}
+		df->num_blobs = 0;
+		df->sequence = f->sequence;
 
-			for (int index = 0; index < data->bwobs->num_blobs; index++)
+		if (data->latency)
+		{
+			struct blobwatch_timings t;
+
+			blobwatch_get_timings(bw, &t);
+			df->latency.sequence = f->sequence;
+			df->latency.t[LATENCY_ARRIVAL] = f->arrived;
+			df->latency.t[LATENCY_COPIED] = f->copied;
+			df->latency.t[LATENCY_DEQUEUED] = t.start;
+			df->latency.t[LATENCY_DETECTED] = t.detected;
+			df->latency.t[LATENCY_TRACKED] = t.tracked;
+		}
+
+		framequeue_release(data->queue, f);
+
+		if (ob)
+		{
+			uint64_t report_start = clock_now_ns();
+
+			if (binlog_enabled())
 			{
-				printf("Blob[%d]: %d,%d\n",
-					index,
-					data->bwobs->blobs[index].x,
-					data->bwobs->blobs[index].y);
+				binlog_observation(df->sequence, ob);
+			}
+			else if (ob->num_blobs > 0)
+			{
+				printf("Blobs: %d\n", ob->num_blobs);
+				if (ob->dropped_blobs > 0)
+					printf("Dropped blobs: %d\n",
+					       ob->dropped_blobs);
+
+				for (int index = 0; index < ob->num_blobs; index++)
+				{
+					printf("Blob[%d]: %d,%d\n",
+						index,
+						ob->blobs[index].x,
+						ob->blobs[index].y);
+				}
 			}
-		}
-	}
 
-	SDL_UnlockSurface(data->target);
-	SDL_UnlockMutex(data->mutex);
-}
+			data->report_ns += clock_now_ns() - report_start;
+			data->report_frames++;
 
-#define XU_ENTITY       4
+			/* The observation is overwritten by the next frame, copy it */
+			memcpy(df->blobs, ob->blobs,
+			       ob->num_blobs * sizeof(*df->blobs));
+			df->num_blobs = ob->num_blobs;
+			df->timestamp = ob->timestamp;
+			df->frame_interval = ob->frame_interval;
+		}
 
-#define REG_SEL         3
+		/* With nothing presented, the frame is done once it is reported */
+		if (data->headless && data->latency)
+		{
+			df->latency.t[LATENCY_PRESENTED] = clock_now_ns();
+			latency_push(data->latency, &df->latency);
+		}
 
-int esp770u_read_reg(libusb_device_handle *dev, uint8_t reg, uint8_t *val)
-{
-	unsigned char buf[4] = { 0x82, 0xf0, reg };
-	int ret;
-
-	ret = uvc_set_cur(dev, XU_ENTITY, REG_SEL, buf, sizeof buf);
-	if (ret < 0)
-		return ret;
-	ret = uvc_get_cur(dev, XU_ENTITY, REG_SEL, buf, 3);
-	if (ret < 0)
-		return ret;
-	if (buf[0] != 0x82 || buf[2] != 0x00)
-		fprintf(stderr, "read_reg(0x%x): %02x %02x %02x\n",
-			reg, buf[0], buf[1], buf[2]);
-	*val = buf[1];
-	return ret;
-}
+		if (display)
+			triplebuf_publish(&data->display);
+	}
 
-int esp770u_read_reg_f1(libusb_device_handle *dev, uint8_t reg, uint8_t *val)
-{
-	unsigned char buf[4] = { 0x82, 0xf1, reg };
-	int ret;
-
-	ret = uvc_set_cur(dev, XU_ENTITY, REG_SEL, buf, sizeof buf);
-	if (ret < 0)
-		return ret;
-	ret = uvc_get_cur(dev, XU_ENTITY, REG_SEL, buf, 3);
-	if (ret < 0)
-		return ret;
-	if (buf[0] != 0x82 || buf[2] != 0x00)
-		fprintf(stderr, "read_reg(0x%x): %02x %02x %02x\n",
-			reg, buf[0], buf[1], buf[2]);
-	*val = buf[1];
-	return ret;
+	return NULL;
 }
 
-int esp770u_write_reg(libusb_device_handle *dev, uint8_t reg, uint8_t val)
+/*
+ * The frame last drawn from runs, so that only its runs have to be cleared
+ * before drawing the next one.
+ */
+struct display_canvas
+{
+    uint8_t* pixels;
+    struct rle_frame* drawn;
+};
+
+/*
+ * Returns the pixels of a display frame, drawing frames handed over as runs
+ * into the canvas.
+ */
+static const uint8_t* display_frame_pixels(struct display_frame* df,
+                                           struct display_canvas* canvas)
 {
-	unsigned char buf[4] = { 0x02, 0xf0, reg, val };
-	int ret;
-
-	ret = uvc_set_cur(dev, XU_ENTITY, REG_SEL, buf, sizeof buf);
-	if (ret < 0)
-		return ret;
-	ret = uvc_get_cur(dev, XU_ENTITY, REG_SEL, buf, sizeof buf);
-	if (ret < 0)
-		return ret;
-	if (buf[0] != 0x02 || buf[1] != 0xf0 || buf[2] != reg || buf[3] != val)
-		fprintf(stderr, "write_reg(0x%x,0x%x): %02x %02x %02x %02x\n",
-			reg, val, buf[0], buf[1], buf[2], buf[3]);
-	return ret;
+    if (!df->has_rle)
+        return df->pixels;
+
+    if (canvas->drawn->complete)
+        rle_clear(canvas->drawn, canvas->pixels);
+    else
+        memset(canvas->pixels, 0, WIDTH * HEIGHT);
+    rle_draw(df->rle, canvas->pixels);
+    if (rle_copy(canvas->drawn, df->rle) < 0)
+        canvas->drawn->complete = false;
+
+    return canvas->pixels;
 }
 
-#define SENSOR_REG_SEL 2
-
-int ar0134_read_reg(libusb_device_handle *dev, uint16_t reg, uint16_t *val)
+/*
+ * Sensor and radio setup after stream start. The radio needs a pause after
+ * every step of a command, so this takes a while even when pipelined.
+ */
+static int camera_setup(struct esp770u* cam, struct usbctl* usbctl)
 {
-	unsigned char buf[6] = { 0x86, 0x20, reg >> 8, reg & 0xff, 0x00, 0x00 };
-	int ret;
-
-	ret = uvc_set_cur(dev, XU_ENTITY, SENSOR_REG_SEL, buf, sizeof buf);
-	if (ret < 0)
-		return ret;
-	ret = uvc_get_cur(dev, XU_ENTITY, SENSOR_REG_SEL, buf, 3);
-	if (ret < 0)
-		return ret;
-	if (buf[0] != 0x86)
-		fprintf(stderr, "%s(0x%x): %02x %02x %02x\n", __func__,
-			reg, buf[0], buf[1], buf[2]);
-	*val = (buf[2] << 8) | buf[1];
-	return ret;
+    uint64_t start = clock_now_ns();
+    struct esp770u_stats cache_stats;
+    struct usbctl_stats st;
+    int ret;
+
+    ret = ar0134_init(cam);
+    if (ret >= 0)
+        ret = esp770u_setup_radio(cam, RIFT_RADIO_ID);
+
+    usbctl_get_stats(usbctl, &st);
+    esp770u_get_stats(cam, &cache_stats);
+    printf("Camera setup: %.1f ms, %llu control transfers in %llu round trips, "
+           "%llu reads and %llu writes skipped\n",
+           (clock_now_ns() - start) * 1e-6,
+           (unsigned long long)st.transfers,
+           (unsigned long long)st.round_trips,
+           (unsigned long long)cache_stats.cached_reads,
+           (unsigned long long)cache_stats.skipped_writes);
+    return ret;
 }
 
-int ar0134_write_reg(libusb_device_handle *dev, uint16_t reg, uint16_t val)
+/*
+ * Runs camera_setup() off the render loop, so that the window keeps
+ * responding during it.
+ */
+struct setup_thread
 {
-	unsigned char buf[64] = { 0x06, 0x20, reg >> 8, reg & 0xff, val >> 8, val & 0xff };
-	int ret;
-
-	ret = uvc_set_cur(dev, XU_ENTITY, SENSOR_REG_SEL, buf, 6);
-	if (ret < 0)
-		return ret;
-	ret = uvc_get_cur(dev, XU_ENTITY, SENSOR_REG_SEL, buf, sizeof buf);
-	if (ret < 0)
-		return ret;
-	if (buf[0] != 0x06 || buf[1] != 0x20 ||
-	    buf[2] != (reg >> 8) || buf[3] != (reg & 0xff) ||
-	    buf[4] != (val >> 8) || buf[5] != (val & 0xff))
-		fprintf(stderr, "%s(0x%04x, 0x%04x): %02x %02x %02x %02x %02x %02x\n",
-			__func__, reg, val, buf[0], buf[1], buf[2], buf[3],
-			buf[4], buf[5]);
-	return ret;
-}
+    struct usbctl* usbctl;
+    struct esp770u* cam;
+    pthread_t tid;
+    bool running;
+    int finished;
+    int ret;
+};
 
-static int set_get_verify_a0(libusb_device_handle *dev, uint8_t val,
-			     uint8_t retval)
+static void* camera_setup_thread(void* ptr)
 {
-	uint8_t buf[4] = { 0xa0, val, 0x00, 0x00 };
-	int ret;
-
-	ret = uvc_set_cur(dev, XU_ENTITY, REG_SEL, buf, sizeof buf);
-	if (ret < 0)
-		return ret;
-	memset(buf, 0, sizeof buf);
-	ret = uvc_get_cur(dev, XU_ENTITY, REG_SEL, buf, sizeof buf);
-	if (ret < 0)
-		return ret;
-	if (buf[0] != 0xa0 || buf[1] != retval || buf[2] != 0x00) {
-		fprintf(stderr, "response, should be a0 %02x 00: %02x %02x %02x\n",
-			retval, buf[0], buf[1], buf[2]);
-		return -1;
-	}
+    struct setup_thread* st = ptr;
 
-	return 0;
+    st->ret = camera_setup(st->cam, st->usbctl);
+    __atomic_store_n(&st->finished, 1, __ATOMIC_RELEASE);
+    return NULL;
 }
 
-#define CONTROL_SEL	11
-#define DATA_SEL	12
+static volatile sig_atomic_t quit;
 
-static int setup_control(libusb_device_handle *devhandle, uint8_t a, size_t len)
+static void handle_quit(int sig)
 {
-	unsigned char control[16];
-	int ret;
-
-	/* prepare */
-	memset(control, 0, sizeof control);
-	control[1] = a; /* alternating, 0x81 or 0x41 */
-	control[2] = 0x80;
-	control[3] = 0x01;
-	control[9] = len;
-	ret = uvc_set_cur(devhandle, XU_ENTITY, CONTROL_SEL, control,
-			  sizeof control);
-	if (ret < 0)
-		return ret;
-
-	usleep(20000);
+    (void)sig;
+    quit = 1;
 }
 
-static int radio_write(libusb_device_handle *devhandle, const uint8_t *buf, size_t len)
+/*
+ * Stands in for the render loop when running without a window. Wakes up ten
+ * times a second to write the newest preview frame, and reports throughput
+ * and CPU usage every five seconds until SIGINT or SIGTERM.
+ */
+static void headless_loop(cb_data* data, struct display_canvas* canvas,
+                          const char* preview_path, FILE* latency_csv)
 {
-	unsigned char data[127];
-	int ret;
-	int i;
+    struct sigaction sa = { .sa_handler = handle_quit };
+    struct framequeue_stats queue_stats;
+    uint64_t report = clock_now_ns();
+    uint64_t report_cpu = clock_process_cpu_ns();
+    uint64_t report_processed = 0;
 
-	if (len > 126)
-		return -EINVAL;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
 
-	memset(data, 0, sizeof data);
-	for (i = 0; i < len; i++) {
-		data[i] = buf[i];
-		data[126] -= buf[i]; /* calculate checksum */
-	}
+    while (!quit)
+    {
+        clock_sleep_until_ns(clock_now_ns() + 100000000ULL);
 
-	ret = setup_control(devhandle, 0x81, sizeof data);
-	if (ret < 0) return ret;
-
-	/* send data */
-	ret = uvc_set_cur(devhandle, XU_ENTITY, DATA_SEL, data,
-			  sizeof data);
-	if (ret < 0)
-		return ret;
-
-	usleep(20000);
-
-	ret = setup_control(devhandle, 0x41, sizeof data);
-	if (ret < 0) return ret;
-
-	/* expect all zeros */
-	ret = uvc_get_cur(devhandle, XU_ENTITY, DATA_SEL, data,
-			  sizeof data);
-	if (ret < 0)
-		return ret;
-#if 0
-	for (i = 0; i < 127; i++)
-		if (data[i])
-			break;
-	if (i != 127) {
-		printf("not clear\n");
-		for (i = 0; i < 127; i++)
-			printf("%02x ", data[i]);
-		printf("\n");
-	}
-#endif
-
-	usleep(20000);
-
-	ret = setup_control(devhandle, 0x81, sizeof data);
-	if (ret < 0) return ret;
-
-	/* clear */
-	memset(data, 0, sizeof data);
-	ret = uvc_set_cur(devhandle, XU_ENTITY, DATA_SEL, data, sizeof data);
-	if (ret < 0)
-		return ret;
-
-	usleep(20000);
-
-	ret = setup_control(devhandle, 0x41, sizeof data);
-	if (ret < 0) return ret;
-
-	ret = uvc_get_cur(devhandle, XU_ENTITY, DATA_SEL, data, sizeof data);
-	if (ret < 0)
-		return ret;
-	for (i = 2; i < 126; i++)
-		if (data[i])
-			break;
-	uint8_t chksum = 0 - data[0] - data[1];
-	if (data[0] != buf[0] || data[1] != buf[1] /* || i != 126 ||
-	    data[126] != chksum*/) {
-		printf("unexpected read\n");
-		for (i = 0; i < 127; i++)
-			printf("%02x ", data[i]);
-		printf("\n");
-	}
+        struct display_frame* df = triplebuf_consume(&data->display);
+        if (df && preview_path &&
+            preview_write_pgm(preview_path, display_frame_pixels(df, canvas),
+                              WIDTH, HEIGHT, df->blobs, df->num_blobs) < 0)
+            fprintf(stderr, "could not write preview %s: %m\n", preview_path);
 
-	return 0;
+        uint64_t now = clock_now_ns();
+        if (now - report >= 5000000000ULL)
+        {
+            uint64_t cpu = clock_process_cpu_ns();
+
+            framequeue_get_stats(data->queue, &queue_stats);
+            printf("Headless: %llu frames processed, %.1f%% CPU\n",
+                   (unsigned long long)(queue_stats.processed - report_processed),
+                   (cpu - report_cpu) * 100.0 / (now - report));
+            report_processed = queue_stats.processed;
+            report_cpu = cpu;
+            report = now;
+
+            if (data->latency)
+                latency_report(data->latency, stdout, latency_csv);
+        }
+    }
 }
 
-static int setup_radio(libusb_device_handle *devhandle)
+/*
+ * Detector options from the command line, applied to every detector.
+ */
+struct detector_options
+{
+    int roi_interval;
+    int threshold;
+    int hysteresis;
+    bool adaptive;
+    enum blobwatch_predictor predictor;
+    bool rle;
+};
+
+static void setup_detector(struct blobwatch* det,
+                           const struct detector_options* o)
 {
-	int ret;
-
-	const uint8_t buf1[7] = { 0x40, 0x10, RIFT_RADIO_ID & 0xff,
-				  (RIFT_RADIO_ID >> 8) & 0xff,
-				  (RIFT_RADIO_ID >> 16) & 0xff,
-				  (RIFT_RADIO_ID >> 24) & 0xff, 0x8c };
-	ret = radio_write(devhandle, buf1, sizeof buf1);
-	if (ret < 0)
-		return ret;
-
-	const uint8_t buf2[10] = { 0x50, 0x11, 0xf4, 0x01, 0x00, 0x00,
-					       0x67, 0xff, 0xff, 0xff };
-	ret = radio_write(devhandle, buf2, sizeof buf2);
-	if (ret < 0)
-		return ret;
-
-	const uint8_t buf3[2] = { 0x61, 0x12 };
-	ret = radio_write(devhandle, buf3, sizeof buf3);
-	if (ret < 0)
-		return ret;
-
-	const uint8_t buf4[2] = { 0x71, 0x85 };
-	ret = radio_write(devhandle, buf4, sizeof buf4);
-	if (ret < 0)
-		return ret;
-
-	const uint8_t buf5[2] = { 0x81, 0x86 };
-	ret = radio_write(devhandle, buf5, sizeof buf5);
-	if (ret < 0)
-		return ret;
+    int ret;
+
+    ret = blobwatch_set_roi(det, o->roi_interval);
+    ASSERT_MSG(ret >= 0, "could not enable region of interest scanning\n");
+
+    if (o->threshold)
+    {
+        ret = blobwatch_set_threshold(det, o->threshold);
+        ASSERT_MSG(ret >= 0, "invalid threshold %d\n", o->threshold);
+    }
+    ret = blobwatch_set_hysteresis(det, o->hysteresis);
+    ASSERT_MSG(ret >= 0, "invalid hysteresis threshold %d\n", o->hysteresis);
+    blobwatch_set_adaptive(det, o->adaptive);
+    blobwatch_set_predictor(det, o->predictor);
+    ret = blobwatch_set_rle(det, o->rle);
+    ASSERT_MSG(ret >= 0, "could not enable run-length encoding\n");
 }
 
-/* Initial register setup, only after camera plugin */
-int esp770u_init_regs(libusb_device_handle *devhandle)
+/*
+ * One of several cameras streamed at once. Each one has its own control
+ * transfers, frame callback and queue, and is a sensor of the group.
+ */
+struct camera
 {
-	int ret;
-	uint8_t val;
-
-	ret = set_get_verify_a0(devhandle, 0x03, 0xb2);
-	if (ret < 0) return ret;
-
-	ret = esp770u_read_reg(devhandle, 0x5a, &val);
-	if (ret < 0) return ret;
-	if (val != 0x01 && val != 0x03) printf("unexpected 5a value: %02x\n", val);
-
-	ret = esp770u_write_reg(devhandle, 0x5a, 0x01); /* &= 0x02? */
-	if (ret < 0) return ret;
-        ret = esp770u_read_reg(devhandle, 0x5a, &val);
-	if (ret < 0) return ret;
-	if (val != 0x01) printf("unexpected 5a value: %02x\n", val);
-
-	ret = esp770u_read_reg(devhandle, 0x18, &val); /* |= 0x01 ? */
-	if (ret < 0) return ret;
-	ret = esp770u_write_reg(devhandle, 0x18, 0x0f);
-	if (ret < 0) return ret;
-	ret = esp770u_read_reg(devhandle, 0x17, &val);
-	if (ret < 0) return ret;
-	ret = esp770u_write_reg(devhandle, 0x17, 0xed); /* |= 0x01 ? */
-	if (ret < 0) return ret;
-	ret = esp770u_write_reg(devhandle, 0x17, 0xec); /* &= ~0x01 ? */
-	if (ret < 0) return ret;
-	ret = esp770u_write_reg(devhandle, 0x18, 0x0e); /* &= ~0x01 ? */
-	if (ret < 0) return ret;
-	ret = esp770u_read_reg(devhandle, 0x14, &val);
-	if (ret < 0) return ret;
-
-#if 0
-	for (int i = 0; i < 256; i += 1) {
-		uint8_t rval;
-		if (i % 16 == 0)
-			printf("%02x: ", i);
-		ret = esp770u_read_reg(devhandle, i, &rval);
-		if (ret < 0) return ret;
-		printf("%02x ", rval);
-		if (i % 16 == 15)
-			printf("\n");
-	}
+    uvc_device_handle_t* devh;
+    uvc_stream_ctrl_t ctrl;
+    struct usbctl* usbctl;
+    struct esp770u* cam;
+    bool streaming;
+    cb_data data;
+};
 
-	printf("--------------------------------------\n");
-
-	for (int i = 0; i < 256; i += 1) {
-		uint8_t rval;
-		if (i % 16 == 0)
-			printf("%02x: ", i);
-		ret = esp770u_read_reg_f1(devhandle, i, &rval);
-		if (ret < 0) return ret;
-		printf("%02x ", rval);
-		if (i % 16 == 15)
-			printf("\n");
-	}
-#endif
+struct camera_rig
+{
+    struct camera* cameras;
+    int num_cameras;
+    struct sensor_group* sg;
+};
+
+/*
+ * Takes the next frame of every camera and processes them as one round of
+ * the sensor group. The cameras run at the same frame rate, so a round waits
+ * for the slowest one, and the drop policy of the queues keeps the others from
+ * falling behind.
+ */
+static void* rig_detect_thread(void* ptr)
+{
+    struct camera_rig* rig = ptr;
+    int n = rig->num_cameras;
+    struct frame* f[MAX_CAMERAS];
+    uint8_t* frames[MAX_CAMERAS];
+    int skipped[MAX_CAMERAS];
+    uint64_t timestamps[MAX_CAMERAS];
+    uint32_t last_number[MAX_CAMERAS] = { 0 };
+    struct blobservation* obs[MAX_CAMERAS];
+
+    for (;;)
+    {
+        int got = 0;
+
+        while (got < n && (f[got] = framequeue_pop(rig->cameras[got].data.queue)))
+            got++;
+        if (got < n)
+        {
+            /* A queue was closed, hand back the frames of this round */
+            for (int i = 0; i < got; i++)
+                framequeue_release(rig->cameras[i].data.queue, f[i]);
+            break;
+        }
+
+        for (int i = 0; i < n; i++)
+        {
+            frames[i] = f[i]->data;
+            skipped[i] = last_number[i] ? f[i]->number - last_number[i] - 1 : 0;
+            last_number[i] = f[i]->number;
+            /* Stamped on arrival, like the single camera detection thread */
+            timestamps[i] = f[i]->arrived;
+        }
+
+        sensor_group_process(rig->sg, frames, skipped, timestamps, obs);
+
+        for (int i = 0; i < n; i++)
+            framequeue_release(rig->cameras[i].data.queue, f[i]);
+    }
 
-	return ret;
+    return NULL;
 }
 
-/* Sensor setup after stream start */
-int ar0134_init(libusb_device_handle *devh, cb_data *data)
+/*
+ * Streams num_cameras cameras at once without a window, detecting the blobs
+ * of all of them on one sensor group with num_threads threads, and reports
+ * per camera statistics until SIGINT or SIGTERM. Every camera is set up and
+ * paired with the headset like the single one.
+ *
+ * Returns 0 on success, or 1 on error.
+ */
+static int run_cameras(int num_cameras, int num_threads, int max_blobs,
+                       const struct detector_options* dopts,
+                       int queue_depth, enum framequeue_policy queue_policy,
+                       const struct rtsched* rt_capture,
+                       const struct rtsched* rt_detect, bool sync_control)
 {
-	uint16_t val;
-	int ret;
-
-#if 0
-	SDL_LockMutex(data->mutex);
-	for (int i = 0x3000; i < 0x3100; i += 2) {
-		if (i % 16 == 0)
-			printf("%04x: ", i);
-		ret = ar0134_read_reg(devh, i, &val);
-		if (ret < 0) return ret;
-		printf("%04x ", val);
-		if (i % 16 == 14)
-			printf("\n");
-	}
-	SDL_UnlockMutex(data->mutex);
-#endif
-
-	/* Read chip version and revision number registers */
-	ret = ar0134_read_reg(devh, 0x3000, &val);
-	if (ret < 0) return ret;
-	ASSERT_MSG(val == 0x2406, "This is not an AR0134 sensor: 0x%04x\n", val);
-
-	ret = ar0134_read_reg(devh, 0x300e, &val);
-	if (ret < 0) return ret;
-	ASSERT_MSG(val == 0x1300, "Unexpected revision number: 0x%04x\n", val);
-
-	ret = ar0134_read_reg(devh, 0x30b0, &val);
-	if (ret < 0) return ret;
-	if (val != 0x0080)
-		fprintf(stderr, "Expected monochrome mode instead of 0x%04x\n", val);
-
-#if 0
-	/* Enable embedded register data and statistics. For now we can't use
-	 * this anyway. */
-	ret = ar0134_read_reg(devh, 0x3064, &val);
-	if (ret < 0) return ret;
-	if (val != 0x1882 && val != 0x1982)
-		printf("Unexpected embedded data control: %04x\n", val);
-	ret = ar0134_write_reg(devh, 0x3064, val | 0x0180);
-	if (ret < 0) return ret;
-#endif
-
-	/* Set data pedestal (black level) to zero */
-	ret = ar0134_write_reg(devh, 0x301e, 0);
-	if (ret < 0) return ret;
-
-	/* Disable binning */
-	ret = ar0134_write_reg(devh, 0x3032, 0x0000);
-	if (ret < 0) return ret;
-
-	/* Set all gain values to the default, in USB2 mode 0x0007 is used
- 	 * instead. */
-	ret = ar0134_write_reg(devh, 0x305e, 0x0020);
-	if (ret < 0) return ret;
-
-	/* This changes nothing, probably clear some already cleared bits. */
-	ret = ar0134_read_reg(devh, 0x30b0, &val);
-	if (ret < 0) return ret;
-	val = 0x0080; /* val &= ~(?); */
-	ret = ar0134_write_reg(devh, 0x30b0, val);
-	if (ret < 0) return ret;
-
-	/* Set vertical and horizontal capture ranges to maximum (0-959,
-	 * 0-1279). */
-	ret = ar0134_write_reg(devh, 0x3002, 0);
-	if (ret < 0) return ret;
-	ret = ar0134_write_reg(devh, 0x3006, 959);
-	if (ret < 0) return ret;
-	ret = ar0134_write_reg(devh, 0x3004, 0);
-	if (ret < 0) return ret;
-	ret = ar0134_write_reg(devh, 0x3008, 1279);
-	if (ret < 0) return ret;
-
-#if 0
-	/* Set minimum supported pixel clocks per line, causes hsync loss. */
-	ret = ar0134_write_reg(devh, 0x300c, 1388);
-	if (ret < 0) return ret;
-#endif
-
-	/* Set a short line bit, needed for the 1388 pclk line length above. */
-	ret = ar0134_read_reg(devh, 0x30b0, &val);
-	if (ret < 0) return ret;
-	val |= (1 << 10);
-	ret = ar0134_write_reg(devh, 0x30b0, val);
-	if (ret < 0) return ret;
-
-	/* Set total number of lines, 37 lines vertical blanking */
-	ret = ar0134_write_reg(devh, 0x300a, 997);
-	if (ret < 0) return ret;
-
-	/* Read number of pixel clocks per line, should be changed above. */
-	ret = ar0134_read_reg(devh, 0x300c, &val);
-	if (ret < 0) return ret;
-	if (val != 1388)
-		fprintf(stderr, "Too many pixel clocks per line: %u\n", val);
-
-	/* Set coarse integration time (in multiples of lines) and
-	 * fine integration time (in multiples of the pixel clock). */
-	ret = ar0134_write_reg(devh, 0x3012, 26); /* 26 lines */
-	if (ret < 0) return ret;
-	ret = ar0134_write_reg(devh, 0x3014, 646);
-	if (ret < 0) return ret;
-	ret = ar0134_read_reg(devh, 0x3012, &val);
-	if (ret < 0) return ret;
-	if (val != 26)
-		fprintf(stderr, "Failed to set coarse integration time: %u\n", val);
-	ret = ar0134_read_reg(devh, 0x3014, &val);
-	if (ret < 0) return ret;
-	if (val != 646)
-		fprintf(stderr, "Failed to set fine integration time: %u\n", val);
-
-	/* Stop streaming, trigger external exposure from nRF51288 */
-	ret = ar0134_read_reg(devh, 0x301a, &val);
-	if (ret < 0) return ret;
-	if (val != 0x10dc)
-		fprintf(stderr, "Unexpected reset register value: 0x%04x\n", val);
-	/* Force PLL always enabled */
-	val |= 1 << 11;
-	/* Enable trigger input pin */
-	val |= 1 << 8;
-	/* Disable streaming (switch to externally triggered mode) */
-	val &= ~(1 << 2);
-	ret = ar0134_write_reg(devh, 0x301a, val);
-	if (ret < 0) return ret;
-
-	/* Enable junction temperature sensor */
-	ret = ar0134_read_reg(devh, 0x30b4, &val);
-	if (ret < 0) return ret;
-	/* Temperature sensor power */
-	val |= 1 << 0;
-	/* Start conversion */
-	val |= 1 << 4;
-	ret = ar0134_write_reg(devh, 0x30b4, val);
-	if (ret < 0) return ret;
-
-	/* Read 70 °C calibration point */
-	uint16_t calib_70c;
-	ret = ar0134_read_reg(devh, 0x30c6, &calib_70c);
-	if (ret < 0) return ret;
-
-	/* Read 50 °C calibration point */
-	uint16_t calib_50c;
-	ret = ar0134_read_reg(devh, 0x30c8, &calib_50c);
-	if (ret < 0) return ret;
-
-	/* Read temperature sensor */
-	ret = ar0134_read_reg(devh, 0x30b2, &val);
-	if (ret < 0) return ret;
-	printf("Temperature: %.1f °C\n", 50.0 + 20.0 * (val - calib_50c) /
-	       (calib_70c - calib_50c));
+    struct sigaction sa = { .sa_handler = handle_quit };
+    struct camera cameras[MAX_CAMERAS] = { 0 };
+    struct camera_rig rig = { cameras, num_cameras, NULL };
+    uvc_context_t* ctx;
+    uvc_device_t** devs;
+    pthread_t detect_tid;
+    int status = 0;
+    int found = 0;
+    int ret;
+
+    rig.sg = sensor_group_new(num_cameras, WIDTH, HEIGHT, max_blobs,
+                              num_threads);
+    ASSERT_MSG(rig.sg, "could not allocate detectors for %d cameras\n",
+               num_cameras);
+    for (int i = 0; i < num_cameras; i++)
+        setup_detector(sensor_group_detector(rig.sg, i), dopts);
+
+    ret = uvc_init(&ctx, NULL);
+    ASSERT_MSG(ret >= 0, "could not initalize libuvc\n");
+
+    ret = uvc_find_devices(ctx, &devs, 0x2833, 0, NULL);
+    ASSERT_MSG(ret >= 0, "could not find the cameras\n");
+    while (devs[found])
+        found++;
+    ASSERT_MSG(found >= num_cameras, "found %d cameras, %d requested\n",
+               found, num_cameras);
+
+    for (int i = 0; i < num_cameras; i++)
+    {
+        struct camera* c = &cameras[i];
+
+        ret = uvc_open(devs[i], &c->devh);
+        ASSERT_MSG(ret >= 0, "could not open camera %d\n", i);
+        ret = uvc_get_stream_ctrl_format_size(c->devh, &c->ctrl,
+                UVC_FRAME_FORMAT_ANY, WIDTH / 2, HEIGHT, FPS);
+        ASSERT_MSG(ret >= 0, "could not get format size of camera %d\n", i);
+
+        c->usbctl = usbctl_new(uvc_get_libusb_handle(c->devh));
+        ASSERT_MSG(c->usbctl, "could not allocate control transfer queue\n");
+        usbctl_set_pipelined(c->usbctl, !sync_control);
+        c->cam = esp770u_new(c->usbctl);
+        ASSERT_MSG(c->cam, "could not allocate register cache\n");
+        ret = esp770u_init_regs(c->cam);
+        ASSERT_MSG(ret >= 0, "could not init eSP770u of camera %d\n", i);
+
+        c->data.headless = true;
+        c->data.rt_capture = *rt_capture;
+        c->data.queue = framequeue_new(queue_depth, WIDTH * HEIGHT,
+                                       queue_policy);
+        ASSERT_MSG(c->data.queue, "could not allocate frame queue of depth %d\n",
+                   queue_depth);
+    }
+    /* The opened cameras hold their own references */
+    uvc_free_device_list(devs, 1);
+
+    ret = pthread_create(&detect_tid, NULL, rig_detect_thread, &rig);
+    ASSERT_MSG(ret == 0, "could not start detection thread\n");
+    rtsched_apply(detect_tid, rt_detect, "detection");
+
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    for (int i = 0; i < num_cameras && status == 0; i++)
+    {
+        struct camera* c = &cameras[i];
+
+        ret = uvc_start_streaming(c->devh, &c->ctrl, cb, &c->data, 0);
+        if (ret < 0)
+        {
+            fprintf(stderr, "could not start streaming camera %d\n", i);
+            status = 1;
+            break;
+        }
+        c->streaming = true;
+
+        ret = camera_setup(c->cam, c->usbctl);
+        if (ret < 0)
+        {
+            fprintf(stderr, "camera %d setup failed: %d\n", i, ret);
+            status = 1;
+        }
+    }
+
+    uint64_t report = clock_now_ns();
+    while (status == 0 && !quit)
+    {
+        clock_sleep_until_ns(clock_now_ns() + 100000000ULL);
+        if (clock_now_ns() - report < 5000000000ULL)
+            continue;
+        report = clock_now_ns();
+
+        for (int i = 0; i < num_cameras; i++)
+        {
+            struct sensor_stats st;
+
+            sensor_group_get_stats(rig.sg, i, &st);
+            printf("Camera %d: %llu frames, %.2f blobs/frame, "
+                   "%llu lost before queueing\n", i,
+                   (unsigned long long)st.frames,
+                   st.frames ? (double)st.blobs / st.frames : 0.0,
+                   (unsigned long long)cameras[i].data.lost_frames);
+        }
+    }
+
+    for (int i = 0; i < num_cameras; i++)
+    {
+        if (cameras[i].streaming)
+            uvc_stop_streaming(cameras[i].devh);
+        framequeue_close(cameras[i].data.queue);
+    }
+    pthread_join(detect_tid, NULL);
+
+    for (int i = 0; i < num_cameras; i++)
+    {
+        struct camera* c = &cameras[i];
+        struct framequeue_stats queue_stats;
+        struct sensor_stats st;
+
+        framequeue_get_stats(c->data.queue, &queue_stats);
+        sensor_group_get_stats(rig.sg, i, &st);
+        printf("Camera %d: %llu frames processed, %llu blobs dropped, "
+               "mean %.1f max %.1f us, queue dropped %llu oldest %llu newest, "
+               "bad frames: %llu\n", i,
+               (unsigned long long)st.frames,
+               (unsigned long long)st.dropped_blobs,
+               st.frames ? st.busy_ns * 1e-3 / st.frames : 0.0,
+               st.max_ns * 1e-3,
+               (unsigned long long)queue_stats.dropped_oldest,
+               (unsigned long long)queue_stats.dropped_newest,
+               (unsigned long long)c->data.bad_frames);
+
+        framequeue_free(c->data.queue);
+        esp770u_free(c->cam);
+        usbctl_free(c->usbctl);
+        uvc_close(c->devh);
+    }
+    uvc_exit(ctx);
+    sensor_group_free(rig.sg);
+
+    return status;
 }
 
 int main(int argc, char** argv)
@@ -599,13 +729,249 @@ int main(int argc, char** argv)
     uvc_stream_ctrl_t ctrl;
     uvc_device_handle_t *devh;
     struct libusb_device_handle *usb_devh;
+    struct replay_options replay_opts = { .num_threads = 1 };
+    const char *record_path = NULL;
+    const char *latency_path = NULL;
+    const char *log_path = NULL;
+    const char *publish_name = NULL;
+    const char *preview_path = NULL;
+    int preview_interval = 10;
+    bool headless = false;
+    bool sync_control = false;
+    FILE *latency_csv = NULL;
+    bool latency = false;
+    const char *replay_paths[MAX_REPLAY_FILES];
+    int num_replay_paths = 0;
+    int num_cameras = 0;
+    bool check_scanners = false;
+    int num_threads = 1;
+    int max_blobs = 0;
+    int roi_interval = 0;
+    int threshold = 0;
+    int hysteresis = 0;
+    bool adaptive = false;
+    bool flicker = false;
+    bool rle = false;
+    bool extrapolate = false;
+    enum blobwatch_predictor predictor = BLOBWATCH_PREDICTOR_KALMAN;
+    struct rtsched rt_capture = { 0 }, rt_detect = { 0 }, rt_output = { 0 };
+    int queue_depth = 2;
+    enum framequeue_policy queue_policy = FRAMEQUEUE_DROP_OLDEST;
     int ret;
 
-    bw = blobwatch_new(WIDTH, HEIGHT);
+    if (argc > 1 && strcmp(argv[1], "bench") == 0)
+        return bench_main(argc - 1, argv + 1);
+    if (argc > 1 && strcmp(argv[1], "shmtest") == 0)
+        return blobstream_latency_test(argc - 1, argv + 1);
+    if (argc > 1 && strcmp(argv[1], "bringup") == 0)
+        return mockcam_bringup_test(argc - 1, argv + 1);
+    if (argc > 1 && strcmp(argv[1], "rtjitter") == 0)
+        return rtsched_jitter_test(argc - 1, argv + 1);
+    if (argc == 3 && strcmp(argv[1], "logdump") == 0)
+    {
+        ret = binlog_dump(argv[2], stdout);
+        if (ret < 0)
+            fprintf(stderr, "could not read log %s: %s\n", argv[2], strerror(-ret));
+        return ret < 0 ? 1 : 0;
+    }
 
-    SDL_Init(SDL_INIT_EVERYTHING);
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+            num_threads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--max-blobs") == 0 && i + 1 < argc)
+            max_blobs = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--threshold") == 0 && i + 1 < argc)
+            threshold = strtol(argv[++i], NULL, 0);
+        else if (strcmp(argv[i], "--hysteresis") == 0 && i + 1 < argc)
+            hysteresis = strtol(argv[++i], NULL, 0);
+        else if (strcmp(argv[i], "--adaptive") == 0)
+            adaptive = true;
+        else if (strcmp(argv[i], "--flicker") == 0)
+            flicker = true;
+        else if (strcmp(argv[i], "--rle") == 0)
+            rle = true;
+        else if (strcmp(argv[i], "--predictor") == 0 && i + 1 < argc &&
+                 (strcmp(argv[i + 1], "kalman") == 0 ||
+                  strcmp(argv[i + 1], "difference") == 0))
+            predictor = strcmp(argv[++i], "kalman") == 0 ?
+                        BLOBWATCH_PREDICTOR_KALMAN :
+                        BLOBWATCH_PREDICTOR_DIFFERENCE;
+        else if (strcmp(argv[i], "--extrapolate") == 0)
+            extrapolate = true;
+        else if (strcmp(argv[i], "--roi") == 0 && i + 1 < argc)
+            roi_interval = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--queue-depth") == 0 && i + 1 < argc)
+            queue_depth = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--drop-oldest") == 0)
+            queue_policy = FRAMEQUEUE_DROP_OLDEST;
+        else if (strcmp(argv[i], "--drop-newest") == 0)
+            queue_policy = FRAMEQUEUE_DROP_NEWEST;
+        else if (strcmp(argv[i], "--log") == 0 && i + 1 < argc)
+            log_path = argv[++i];
+        else if (strcmp(argv[i], "--publish") == 0 && i + 1 < argc)
+            publish_name = argv[++i];
+        else if (strcmp(argv[i], "--headless") == 0)
+            headless = true;
+        else if (strcmp(argv[i], "--cameras") == 0 && i + 1 < argc &&
+                 atoi(argv[i + 1]) > 0)
+            num_cameras = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--preview") == 0 && i + 1 < argc)
+            preview_path = argv[++i];
+        else if (strcmp(argv[i], "--preview-interval") == 0 && i + 1 < argc)
+            preview_interval = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--sync-control") == 0)
+            sync_control = true;
+        else if (strcmp(argv[i], "--latency") == 0)
+            latency = true;
+        else if (strcmp(argv[i], "--latency-csv") == 0 && i + 1 < argc)
+            latency_path = argv[++i];
+        else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc)
+            record_path = argv[++i];
+        else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc &&
+                 num_replay_paths < MAX_REPLAY_FILES)
+            replay_paths[num_replay_paths++] = argv[++i];
+        else if (strcmp(argv[i], "--rt-capture") == 0 && i + 1 < argc &&
+                 rtsched_parse(argv[i + 1], &rt_capture) == 0)
+            i++;
+        else if (strcmp(argv[i], "--rt-detect") == 0 && i + 1 < argc &&
+                 rtsched_parse(argv[i + 1], &rt_detect) == 0)
+            i++;
+        else if (strcmp(argv[i], "--rt-output") == 0 && i + 1 < argc &&
+                 rtsched_parse(argv[i + 1], &rt_output) == 0)
+            i++;
+        else if (strcmp(argv[i], "--realtime") == 0)
+            replay_opts.realtime = true;
+        else if (strcmp(argv[i], "--compare-roi") == 0)
+            replay_opts.compare_roi = true;
+        else if (strcmp(argv[i], "--check-scanners") == 0)
+            check_scanners = true;
+        else if (strcmp(argv[i], "--drop") == 0 && i + 1 < argc)
+            replay_opts.drop_interval = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-v") == 0)
+            replay_opts.verbose = true;
+        else
+        {
+            fprintf(stderr, "usage: %s [detector options] [--record file] [--rle]\n"
+                    "          [--queue-depth n] [--drop-oldest|--drop-newest]\n"
+                    "          [--latency] [--latency-csv file] [--log file]\n"
+                    "          [--publish shm-name]\n"
+                    "          [--headless [--preview file] [--preview-interval n]]\n"
+                    "          [--sync-control] [--extrapolate]\n"
+                    "          [--rt-capture spec] [--rt-detect spec] [--rt-output spec]\n"
+                    "       %s [detector options] --cameras n [--queue-depth n]\n"
+                    "          [--drop-oldest|--drop-newest] [--sync-control]\n"
+                    "          [--rt-capture spec] [--rt-detect spec]\n"
+                    "       %s [detector options] --replay file [--realtime] [--compare-roi] [-v]\n"
+                    "          [--publish shm-name] [--drop n] [--flicker]\n"
+                    "       %s [detector options] --replay file --check-scanners\n"
+                    "       %s [detector options] --replay file --replay file... [--drop n]\n"
+                    "       %s bench [options]\n"
+                    "       %s logdump file\n"
+                    "       %s shmtest [--frames n] [--blobs n] [--rate hz]\n"
+                    "       %s bringup [--script file] [--sync|--pipelined] [--no-cache] [--no-radio]\n"
+                    "       %s rtjitter [--rt spec] [--load threads] [--period us] [--seconds s]\n"
+                    "detector options: [-j threads] [--max-blobs n] [--roi frames]\n"
+                    "          [--threshold n] [--hysteresis low] [--adaptive]\n"
+                    "          [--predictor kalman|difference]\n"
+                    "--flicker identifies LEDs by generated test patterns, not the headset's\n"
+                    "          codes, so it needs --replay of frames blinking with them\n"
+                    "scheduling spec: [fifo|rr|other][:priority][@cpus], e.g. fifo:80@2\n",
+                    argv[0], argv[0], argv[0], argv[0], argv[0], argv[0],
+                    argv[0], argv[0],
+                    argv[0], argv[0]);
+            return 1;
+        }
+    }
+
+    if (num_replay_paths)
+    {
+        replay_opts.num_threads = num_threads;
+        replay_opts.max_blobs = max_blobs;
+        replay_opts.roi_interval = roi_interval;
+        replay_opts.threshold = threshold;
+        replay_opts.hysteresis = hysteresis;
+        replay_opts.adaptive = adaptive;
+        replay_opts.flicker = flicker;
+        replay_opts.predictor = predictor;
+        replay_opts.publish = publish_name;
+        /* Compare against a full scan every 30 frames by default */
+        if (replay_opts.compare_roi && roi_interval < 2)
+            replay_opts.roi_interval = 30;
+        if (check_scanners)
+        {
+            /* Each file is checked on its own */
+            ret = 0;
+            for (int i = 0; i < num_replay_paths && ret >= 0; i++)
+                ret = replay_check_scanners(replay_paths[i], &replay_opts);
+        }
+        /* Several files are replayed as multiple sensors */
+        else if (num_replay_paths > 1)
+            ret = replay_run_sensors(replay_paths, num_replay_paths,
+                                     &replay_opts);
+        else
+            ret = replay_run(replay_paths[0], &replay_opts);
+        return ret < 0 ? 1 : 0;
+    }
+
+    /*
+     * The headset's blink codes are not read from the device, and the
+     * generated table would give real LEDs arbitrary ids.
+     */
+    if (flicker)
+    {
+        fprintf(stderr, "--flicker is only supported with --replay\n");
+        return 1;
+    }
 
-    SDL_mutex* mutex = SDL_CreateMutex();
+    struct detector_options detector_opts = {
+        .roi_interval = roi_interval,
+        .threshold = threshold,
+        .hysteresis = hysteresis,
+        .adaptive = adaptive,
+        .predictor = predictor,
+        .rle = rle,
+    };
+
+    if (num_cameras)
+    {
+        /* Only detection runs per camera, there is one window and one log */
+        if (num_cameras > MAX_CAMERAS || record_path || rle || log_path ||
+            publish_name || latency || latency_path || preview_path ||
+            extrapolate)
+        {
+            fprintf(stderr, "--cameras takes 1 to %d cameras and no recording, "
+                    "logging, publishing, latency or preview options\n",
+                    MAX_CAMERAS);
+            return 1;
+        }
+        return run_cameras(num_cameras, num_threads, max_blobs,
+                           &detector_opts, queue_depth, queue_policy,
+                           &rt_capture, &rt_detect, sync_control);
+    }
+
+    bw = blobwatch_new(WIDTH, HEIGHT, max_blobs);
+    ASSERT_MSG(bw, "could not allocate blob detector\n");
+
+    /* The pool is created here to place its threads with the detection thread */
+    struct threadpool* tp = NULL;
+    if (num_threads > 1)
+    {
+        tp = threadpool_new(num_threads - 1);
+        ASSERT_MSG(tp, "could not start %d detection threads\n", num_threads);
+        for (int i = 0; i < threadpool_num_threads(tp); i++)
+            rtsched_apply(threadpool_thread(tp, i), &rt_detect, "detection worker");
+    }
+    ret = blobwatch_set_threadpool(bw, tp, num_threads);
+    ASSERT_MSG(ret >= 0, "could not start %d detection threads\n", num_threads);
+
+    setup_detector(bw, &detector_opts);
+
+    if (preview_interval < 1)
+        preview_interval = 1;
+
+    if (!headless)
+        SDL_Init(SDL_INIT_EVERYTHING);
 
     res = uvc_init(&ctx, NULL);
     ASSERT_MSG(res >= 0, "could not initalize libuvc\n");
@@ -618,11 +984,27 @@ int main(int argc, char** argv)
 
     usb_devh = uvc_get_libusb_handle(devh);
 
-    SDL_Window* window = SDL_CreateWindow("Playground", SDL_WINDOWPOS_UNDEFINED,
-            SDL_WINDOWPOS_UNDEFINED, WIDTH, HEIGHT, 0);
+    SDL_Renderer* renderer = NULL;
+    struct display_texture* dt = NULL;
+
+    if (!headless)
+    {
+        SDL_Window* window = SDL_CreateWindow("Playground",
+                SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
+                WIDTH, HEIGHT, 0);
+
+        ASSERT_MSG(window, "could not create window: %s\n", SDL_GetError());
 
-    SDL_Renderer* renderer = SDL_CreateRenderer(window, -1,
-            SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
+        renderer = SDL_CreateRenderer(window, -1,
+                SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
+        if (!renderer)
+            renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_SOFTWARE);
+        ASSERT_MSG(renderer, "could not create renderer: %s\n", SDL_GetError());
+
+        dt = display_texture_new(renderer, WIDTH, HEIGHT);
+        ASSERT_MSG(dt, "could not create texture: %s\n", SDL_GetError());
+        printf("Display: %s\n", display_texture_format_name(dt));
+    }
 
     res = uvc_get_stream_ctrl_format_size(devh, &ctrl, UVC_FRAME_FORMAT_ANY,
             WIDTH / 2, HEIGHT, FPS);
@@ -630,18 +1012,132 @@ int main(int argc, char** argv)
 
     uvc_print_diag(devh, stderr);
 
-    SDL_Surface* target = SDL_CreateRGBSurface(
-            SDL_SWSURFACE, WIDTH, HEIGHT, 32, 0xff, 0xff00, 0xff0000, 0);
+    cb_data data = {
+        .headless = headless,
+        .preview_interval = preview_path ? preview_interval : 0,
+        .rle = rle,
+        .rt_capture = rt_capture,
+    };
+    struct display_canvas canvas = { NULL, NULL };
 
-    cb_data data = { target, mutex, NULL, usb_devh };
+    for (int i = 0; i < 3; i++)
+    {
+        struct display_frame* df = &data.frames[i];
+
+        if (posix_memalign((void**)&df->pixels, 64, WIDTH * HEIGHT) != 0)
+            df->pixels = NULL;
+        df->blobs = calloc(blobwatch_get_max_blobs(bw), sizeof(*df->blobs));
+        ASSERT_MSG(df->pixels && df->blobs, "could not allocate display frames\n");
+        memset(df->pixels, 0, WIDTH * HEIGHT);
+        if (rle)
+        {
+            df->rle = rle_frame_new(WIDTH, HEIGHT, 0, 0);
+            ASSERT_MSG(df->rle, "could not allocate display runs\n");
+        }
+    }
 
-    ret = esp770u_init_regs(usb_devh);
+    if (rle)
+    {
+        canvas.pixels = calloc(1, WIDTH * HEIGHT);
+        canvas.drawn = rle_frame_new(WIDTH, HEIGHT, 0, 0);
+        ASSERT_MSG(canvas.pixels && canvas.drawn,
+                   "could not allocate display canvas\n");
+    }
+    triplebuf_init(&data.display, &data.frames[0], &data.frames[1],
+                   &data.frames[2]);
+
+    data.queue = framequeue_new(queue_depth, WIDTH * HEIGHT, queue_policy);
+    ASSERT_MSG(data.queue, "could not allocate frame queue of depth %d\n",
+               queue_depth);
+
+    pthread_t detect_tid;
+    ret = pthread_create(&detect_tid, NULL, detect_thread, &data);
+    ASSERT_MSG(ret == 0, "could not start detection thread\n");
+    rtsched_apply(detect_tid, &rt_detect, "detection");
+
+    struct display_frame* current = NULL;
+    uint64_t display_cpu_ns = 0;
+    uint64_t display_frames = 0;
+    uint64_t display_report = clock_now_ns();
+    /* end of the last present and interval between presents, to extrapolate */
+    uint64_t last_present = 0;
+    uint64_t present_interval = 0;
+
+    if (record_path)
+    {
+        data.writer = capture_writer_open(record_path, WIDTH, HEIGHT,
+                                          rle ? CAPTURE_FORMAT_RLE :
+                                                CAPTURE_FORMAT_Y8);
+        ASSERT_MSG(data.writer, "could not create %s\n", record_path);
+        if (rle)
+        {
+            data.record_size = rle_pack_max(canvas.drawn);
+            data.record_buf = malloc(data.record_size);
+            ASSERT_MSG(data.record_buf, "could not allocate record buffer\n");
+        }
+    }
+
+    if (log_path)
+    {
+        ret = binlog_open(log_path);
+        ASSERT_MSG(ret >= 0, "could not create %s\n", log_path);
+    }
+
+    if (publish_name)
+    {
+        data.stream = blobstream_create(publish_name,
+                                        blobwatch_get_max_blobs(bw));
+        ASSERT_MSG(data.stream, "could not create shared memory %s\n",
+                   publish_name);
+    }
+
+    if (latency || latency_path)
+    {
+        data.latency = latency_new();
+        ASSERT_MSG(data.latency, "could not allocate latency ring\n");
+    }
+    if (latency_path)
+    {
+        latency_csv = fopen(latency_path, "w");
+        ASSERT_MSG(latency_csv, "could not create %s\n", latency_path);
+        fprintf(latency_csv, "sequence,arrival,copied,dequeued,detected,tracked,presented\n");
+    }
+
+    struct setup_thread setup = { .usbctl = usbctl_new(usb_devh) };
+    ASSERT_MSG(setup.usbctl, "could not allocate control transfer queue\n");
+    usbctl_set_pipelined(setup.usbctl, !sync_control);
+    setup.cam = esp770u_new(setup.usbctl);
+    ASSERT_MSG(setup.cam, "could not allocate register cache\n");
+
+    uint64_t init_start = clock_now_ns();
+    ret = esp770u_init_regs(setup.cam);
     ASSERT_MSG(ret >= 0, "could not init eSP770u\n");
+    printf("eSP770u setup: %.1f ms\n", (clock_now_ns() - init_start) * 1e-6);
+
+    uint64_t run_start = clock_now_ns();
+    uint64_t run_cpu = clock_process_cpu_ns();
 
     res = uvc_start_streaming(devh, &ctrl, cb, &data, 0);
     ASSERT_MSG(res >= 0, "could not start streaming\n");
 
-    bool done = false;
+    /* Only now, so that the threads started above do not inherit it */
+    rtsched_apply(pthread_self(), &rt_output, "output");
+
+    /*
+     * A failed setup, headless or from the window, leaves setup.ret
+     * negative and still goes through the teardown below.
+     */
+    if (headless)
+    {
+        /* There is no window to press space in, set up the sensor now */
+        setup.ret = camera_setup(setup.cam, setup.usbctl);
+        if (setup.ret < 0)
+            fprintf(stderr, "camera setup failed: %d\n", setup.ret);
+        else
+            headless_loop(&data, &canvas, preview_path, latency_csv);
+    }
+
+    bool done = headless;
 
     while(!done)
     {
@@ -653,44 +1149,183 @@ int main(int argc, char** argv)
             {
                 done = true;
             }
-            if(event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_SPACE)
+            if(event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_SPACE &&
+               !setup.running)
             {
-                ret = ar0134_init(usb_devh, &data);
-                if (ret < 0)
-                    return ret;
+                setup.finished = 0;
+                setup.running = pthread_create(&setup.tid, NULL, camera_setup_thread,
+                                               &setup) == 0;
+            }
+        }
 
-                ret = setup_radio(usb_devh);
-                if (ret < 0)
-                    return ret;
+        if (setup.running && __atomic_load_n(&setup.finished, __ATOMIC_ACQUIRE))
+        {
+            pthread_join(setup.tid, NULL);
+            setup.running = false;
+            if (setup.ret < 0)
+            {
+                fprintf(stderr, "camera setup failed: %d\n", setup.ret);
+                done = true;
             }
         }
 
-        SDL_RenderClear(renderer);
+        uint64_t cpu_start = clock_thread_cpu_ns();
+
+        /*
+         * Take the newest complete frame and upload it, or keep showing
+         * the texture of the last one.
+         */
+        struct display_frame* df = triplebuf_consume(&data.display);
+        if (df)
+        {
+            current = df;
+            const uint8_t* pixels = display_frame_pixels(current, &canvas);
 
-        SDL_LockMutex(mutex);
-        SDL_Texture* tex = SDL_CreateTextureFromSurface(renderer, target);
-        SDL_UnlockMutex(mutex);
+            if (display_texture_update(dt, pixels) < 0)
+                fprintf(stderr, "texture update failed: %s\n", SDL_GetError());
+        }
 
-        SDL_RenderCopy(renderer, tex, NULL, NULL);
+        SDL_RenderClear(renderer);
 
-        if (data.bwobs)
+        if (current)
         {
-            for (int index = 0; index < data.bwobs->num_blobs; index++)
+            SDL_RenderCopy(renderer, display_texture_get(dt), NULL, NULL);
+
+            /* Blobs where they are expected at the next vsync */
+            struct blobservation view = {
+                .timestamp = current->timestamp,
+                .frame_interval = current->frame_interval,
+            };
+            uint64_t next_present = last_present + present_interval;
+
+            for (int index = 0; index < current->num_blobs; index++)
             {
-                struct blob* blob = &data.bwobs->blobs[index];
+                struct blob* blob = &current->blobs[index];
                 SDL_Rect rect = {blob->x - 10, blob->y - 10, 20, 20};
                 SDL_SetRenderDrawColor(renderer, 255, 0, 0, 128);
                 SDL_RenderDrawRect(renderer, &rect);
+
+                if (extrapolate && present_interval)
+                {
+                    float x, y;
+
+                    blob_extrapolate(blob, &view, next_present, &x, &y);
+                    SDL_Rect predicted = {x - 10, y - 10, 20, 20};
+                    SDL_SetRenderDrawColor(renderer, 0, 255, 0, 128);
+                    SDL_RenderDrawRect(renderer, &predicted);
+                }
             }
         }
 
-        SDL_DestroyTexture(tex);
-
         SDL_RenderPresent(renderer);
+
+        uint64_t presented = clock_now_ns();
+        if (last_present)
+            present_interval = present_interval ?
+                (7 * present_interval + presented - last_present) / 8 :
+                presented - last_present;
+        last_present = presented;
+
+        /* CPU time spent on new frames, the vsync wait is not included */
+        if (df)
+        {
+            display_cpu_ns += clock_thread_cpu_ns() - cpu_start;
+            display_frames++;
+
+            if (data.latency)
+            {
+                df->latency.t[LATENCY_PRESENTED] = clock_now_ns();
+                latency_push(data.latency, &df->latency);
+            }
+        }
+
+        if (clock_now_ns() - display_report >= 5000000000ULL && display_frames)
+        {
+            printf("Display: %.3f ms CPU per frame over %llu frames\n",
+                   display_cpu_ns * 1e-6 / display_frames,
+                   (unsigned long long)display_frames);
+            display_cpu_ns = 0;
+            display_frames = 0;
+            display_report = clock_now_ns();
+
+            if (data.latency)
+                latency_report(data.latency, stdout, latency_csv);
+        }
     }
 
-    SDL_DestroyMutex(mutex);
-    SDL_Quit();
+    if (setup.running)
+        pthread_join(setup.tid, NULL);
+
+    uvc_stop_streaming(devh);
+    esp770u_free(setup.cam);
+    usbctl_free(setup.usbctl);
+
+    uint64_t run_ns = clock_now_ns() - run_start;
+    printf("CPU usage (%s): %.1f%% over %.1f s\n",
+           headless ? "headless" : "windowed",
+           (clock_process_cpu_ns() - run_cpu) * 100.0 / run_ns, run_ns * 1e-9);
+
+    framequeue_close(data.queue);
+    pthread_join(detect_tid, NULL);
+
+    ret = capture_writer_close(data.writer);
+    if (ret < 0)
+        fprintf(stderr, "failed to finish %s: %d\n", record_path, ret);
+
+    struct framequeue_stats queue_stats;
+    framequeue_get_stats(data.queue, &queue_stats);
+    printf("Frames queued: %llu, processed: %llu, dropped oldest: %llu, "
+           "dropped newest: %llu, max queue depth %d, bad frames: %llu, "
+           "lost before queueing: %llu\n",
+           (unsigned long long)queue_stats.queued,
+           (unsigned long long)queue_stats.processed,
+           (unsigned long long)queue_stats.dropped_oldest,
+           (unsigned long long)queue_stats.dropped_newest,
+           queue_stats.max_depth,
+           (unsigned long long)data.bad_frames,
+           (unsigned long long)data.lost_frames);
+
+    struct triplebuf_stats stats;
+    triplebuf_get_stats(&data.display, &stats);
+    printf("Frames produced: %llu, displayed: %llu, overwritten: %llu\n",
+           (unsigned long long)stats.produced,
+           (unsigned long long)stats.consumed,
+           (unsigned long long)stats.overwritten);
+
+    framequeue_free(data.queue);
+
+    if (data.report_frames)
+        printf("Blob reports (%s): %.1f us per frame\n",
+               binlog_enabled() ? "binary log" : "printf",
+               data.report_ns * 1e-3 / data.report_frames);
+    binlog_close();
+    blobstream_destroy(data.stream);
+
+    if (data.latency)
+    {
+        latency_report(data.latency, stdout, latency_csv);
+        latency_free(data.latency);
+    }
+    if (latency_csv)
+        fclose(latency_csv);
+
+    for (int i = 0; i < 3; i++)
+    {
+        free(data.frames[i].pixels);
+        free(data.frames[i].blobs);
+        rle_frame_free(data.frames[i].rle);
+    }
+    free(canvas.pixels);
+    rle_frame_free(canvas.drawn);
+    free(data.record_buf);
+
+    display_texture_free(dt);
+
+    if (!headless)
+        SDL_Quit();
+
+    blobwatch_free(bw);
+    threadpool_free(tp);
 
-    return 0;
+    return setup.ret < 0 ? 1 : 0;
 }
@@ -0,0 +1,393 @@
+/*
+ * Simulated camera bridge for testing control transfers without hardware
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ *
+ * Models the extension unit protocol of the eSP770U: each SET_CUR on a
+ * selector prepares the reply of the next GET_CUR. Bridge and sensor
+ * registers are plain arrays, the radio answers a command with its first two
+ * bytes once its reply buffer is cleared. Every transfer takes service_us on
+ * the bus, and every wait for completion adds turnaround_us on the host, so
+ * a synchronous transfer costs both and a pipelined batch only one
+ * turnaround.
+ *
+ * A script can preset registers, change the timing and make a transfer fail.
+ * One directive per line, '#' starts a comment:
+ *
+ *   latency <service us> <turnaround us>
+ *   bridge <reg> <val>
+ *   sensor <reg> <val>
+ *   a0 <val> <reply>
+ *   fail <transfer number>
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "clock.h"
+#include "esp770u.h"
+#include "mockcam.h"
+
+#define NUM_SELECTORS	16
+
+struct mockcam {
+	uint8_t bridge[2][256];
+	uint16_t *sensor;
+	uint8_t a0[256];
+	/* reply of the next GET_CUR per selector */
+	uint8_t reply[NUM_SELECTORS][USBCTL_MAX_DATA];
+	uint8_t radio_response[USBCTL_MAX_DATA];
+	unsigned int service_us;
+	unsigned int turnaround_us;
+	uint64_t transfers;
+	int64_t fail_at;
+};
+
+struct mockcam *mockcam_new(void)
+{
+	struct mockcam *m;
+
+	m = calloc(1, sizeof(*m));
+	if (!m)
+		return NULL;
+
+	m->sensor = calloc(65536, sizeof(*m->sensor));
+	if (!m->sensor) {
+		free(m);
+		return NULL;
+	}
+
+	/* Full speed control transfers, and a typical host round trip */
+	m->service_us = 125;
+	m->turnaround_us = 500;
+	m->fail_at = -1;
+
+	m->bridge[0][0x5a] = 0x01;
+	m->a0[0x03] = 0xb2;
+
+	/* Power-on state of the registers checked by ar0134_init() */
+	m->sensor[0x3000] = 0x2406;
+	m->sensor[0x300e] = 0x1300;
+	m->sensor[0x30b0] = 0x0080;
+	m->sensor[0x300c] = 1388;
+	m->sensor[0x301a] = 0x10dc;
+	m->sensor[0x30c6] = 0x0280;
+	m->sensor[0x30c8] = 0x0200;
+	m->sensor[0x30b2] = 0x0240;
+
+	return m;
+}
+
+void mockcam_free(struct mockcam *m)
+{
+	if (!m)
+		return;
+
+	free(m->sensor);
+	free(m);
+}
+
+void mockcam_set_latency(struct mockcam *m, unsigned int service_us,
+			 unsigned int turnaround_us)
+{
+	m->service_us = service_us;
+	m->turnaround_us = turnaround_us;
+}
+
+uint16_t mockcam_sensor_reg(struct mockcam *m, uint16_t reg)
+{
+	return m->sensor[reg];
+}
+
+uint8_t mockcam_bridge_reg(struct mockcam *m, uint8_t reg)
+{
+	return m->bridge[0][reg];
+}
+
+/*
+ * Reads a script of register presets, timing and failures.
+ *
+ * Returns 0 on success, or a negative error code.
+ */
+int mockcam_load_script(struct mockcam *m, const char *path)
+{
+	char line[256], cmd[32];
+	long a, b;
+	int n = 0;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f)
+		return -errno;
+
+	while (fgets(line, sizeof line, f)) {
+		char *comment = strchr(line, '#');
+		char sa[32], sb[32];
+		int fields;
+
+		n++;
+		if (comment)
+			*comment = '\0';
+		fields = sscanf(line, "%31s %31s %31s", cmd, sa, sb);
+		if (fields <= 0)
+			continue;
+		a = fields > 1 ? strtol(sa, NULL, 0) : 0;
+		b = fields > 2 ? strtol(sb, NULL, 0) : 0;
+
+		if (strcmp(cmd, "latency") == 0 && fields == 3)
+			mockcam_set_latency(m, a, b);
+		else if (strcmp(cmd, "bridge") == 0 && fields == 3)
+			m->bridge[0][a & 0xff] = b;
+		else if (strcmp(cmd, "sensor") == 0 && fields == 3)
+			m->sensor[a & 0xffff] = b;
+		else if (strcmp(cmd, "a0") == 0 && fields == 3)
+			m->a0[a & 0xff] = b;
+		else if (strcmp(cmd, "fail") == 0 && fields == 2)
+			m->fail_at = a;
+		else {
+			fprintf(stderr, "%s:%d: invalid directive\n", path, n);
+			fclose(f);
+			return -EINVAL;
+		}
+	}
+
+	fclose(f);
+	return 0;
+}
+
+static void set_cur(struct mockcam *m, uint8_t selector, const uint8_t *buf,
+		    int len)
+{
+	uint8_t *reply = m->reply[selector];
+	uint16_t reg = buf[2] << 8 | buf[3];
+
+	switch (selector) {
+	case REG_SEL:
+		memset(reply, 0, USBCTL_MAX_DATA);
+		if (buf[0] == 0x82) {
+			reply[0] = 0x82;
+			reply[1] = m->bridge[buf[1] == 0xf1][buf[2]];
+		} else if (buf[0] == 0x02) {
+			m->bridge[0][buf[2]] = buf[3];
+			memcpy(reply, buf, 4);
+		} else if (buf[0] == 0xa0) {
+			reply[0] = 0xa0;
+			reply[1] = m->a0[buf[1]];
+		}
+		break;
+	case SENSOR_REG_SEL:
+		memset(reply, 0, USBCTL_MAX_DATA);
+		if (buf[0] == 0x86) {
+			reply[0] = 0x86;
+			reply[1] = m->sensor[reg] & 0xff;
+			reply[2] = m->sensor[reg] >> 8;
+		} else if (buf[0] == 0x06) {
+			m->sensor[reg] = buf[4] << 8 | buf[5];
+			memcpy(reply, buf, 6);
+		}
+		break;
+	case DATA_SEL:
+		/* A command leaves the reply empty, clearing returns it */
+		if (buf[0]) {
+			memset(m->radio_response, 0, USBCTL_MAX_DATA);
+			m->radio_response[0] = buf[0];
+			m->radio_response[1] = buf[1];
+			m->radio_response[126] = 0 - buf[0] - buf[1];
+			memset(reply, 0, USBCTL_MAX_DATA);
+		} else {
+			memcpy(reply, m->radio_response, USBCTL_MAX_DATA);
+		}
+		break;
+	}
+}
+
+static int mockcam_run(void *priv, struct usbctl_xfer *x, int n,
+		       bool pipelined)
+{
+	struct mockcam *m = priv;
+	uint64_t t = clock_now_ns();
+	int i;
+
+	for (i = 0; i < n; i++) {
+		uint8_t *buf = x[i].data + LIBUSB_CONTROL_SETUP_SIZE;
+		uint8_t selector = x[i].value >> 8;
+
+		if (!pipelined || i == 0)
+			t += m->turnaround_us * 1000ULL;
+		t += m->service_us * 1000ULL;
+
+		/* A pipelined batch is submitted at once and runs to its end */
+		if ((int64_t)m->transfers++ == m->fail_at || selector >= NUM_SELECTORS) {
+			x[i].status = LIBUSB_ERROR_PIPE;
+			if (pipelined)
+				continue;
+			i++;
+			break;
+		}
+
+		if (x[i].request_type & 0x80)
+			memcpy(buf, m->reply[selector], x[i].length);
+		else
+			set_cur(m, selector, buf, x[i].length);
+		x[i].status = x[i].length;
+	}
+
+	clock_sleep_until_ns(t);
+
+	return i;
+}
+
+/*
+ * Returns a transfer queue talking to the simulated device.
+ */
+struct usbctl *mockcam_usbctl(struct mockcam *m)
+{
+	struct usbctl_backend backend = {
+		.run = mockcam_run,
+		.priv = m,
+	};
+
+	return usbctl_new_backend(&backend);
+}
+
+static double ms_since(uint64_t *t)
+{
+	uint64_t now = clock_now_ns();
+	double ms = (now - *t) * 1e-6;
+
+	*t = now;
+	return ms;
+}
+
+/*
+ * Runs the full bring-up against a fresh simulated device and checks the
+ * registers it leaves behind.
+ *
+ * Returns 0 on success, or a negative error code.
+ */
+static int bringup(const char *script, bool pipelined, bool cache, bool radio)
+{
+	struct esp770u_stats cache_stats;
+	struct usbctl_stats st;
+	struct esp770u *cam = NULL;
+	struct usbctl *q = NULL;
+	struct mockcam *m;
+	double bridge_ms, sensor_ms, radio_ms = 0;
+	uint64_t t;
+	int ret;
+
+	m = mockcam_new();
+	if (!m)
+		return -ENOMEM;
+	if (script) {
+		ret = mockcam_load_script(m, script);
+		if (ret < 0) {
+			fprintf(stderr, "could not load %s: %s\n", script,
+				strerror(-ret));
+			goto out;
+		}
+	}
+	ret = -ENOMEM;
+	q = mockcam_usbctl(m);
+	if (!q)
+		goto out;
+	usbctl_set_pipelined(q, pipelined);
+	cam = esp770u_new(q);
+	if (!cam)
+		goto out;
+	esp770u_set_cache(cam, cache);
+
+	t = clock_now_ns();
+	ret = esp770u_init_regs(cam);
+	bridge_ms = ms_since(&t);
+	if (ret < 0)
+		goto out;
+	ret = ar0134_init(cam);
+	sensor_ms = ms_since(&t);
+	if (ret < 0)
+		goto out;
+	if (radio) {
+		ret = esp770u_setup_radio(cam, 0x12345678);
+		radio_ms = ms_since(&t);
+		if (ret < 0)
+			goto out;
+	}
+
+	usbctl_get_stats(q, &st);
+	esp770u_get_stats(cam, &cache_stats);
+	printf("%s%s: bridge %.2f ms, sensor %.2f ms, radio %.1f ms, "
+	       "%llu transfers in %llu round trips, %llu mismatches\n",
+	       pipelined ? "pipelined" : "synchronous",
+	       cache ? ", cached" : "", bridge_ms, sensor_ms,
+	       radio_ms, (unsigned long long)st.transfers,
+	       (unsigned long long)st.round_trips,
+	       (unsigned long long)st.mismatches);
+	printf("  register reads %llu, from cache %llu, writes %llu, skipped %llu\n",
+	       (unsigned long long)cache_stats.reads,
+	       (unsigned long long)cache_stats.cached_reads,
+	       (unsigned long long)cache_stats.writes,
+	       (unsigned long long)cache_stats.skipped_writes);
+
+	if (mockcam_bridge_reg(m, 0x17) != 0xec ||
+	    mockcam_bridge_reg(m, 0x18) != 0x0e ||
+	    mockcam_sensor_reg(m, 0x30b0) != 0x0480 ||
+	    mockcam_sensor_reg(m, 0x3012) != 26 ||
+	    mockcam_sensor_reg(m, 0x3014) != 646 ||
+	    (mockcam_sensor_reg(m, 0x301a) & 0x0904) != 0x0900 ||
+	    (mockcam_sensor_reg(m, 0x30b4) & 0x0011) != 0x0011) {
+		fprintf(stderr, "unexpected register state after bring-up\n");
+		ret = -EIO;
+	}
+
+out:
+	esp770u_free(cam);
+	usbctl_free(q);
+	mockcam_free(m);
+	return ret;
+}
+
+/*
+ * Entry point of the "bringup" subcommand: runs the camera setup sequences
+ * against the simulated device, synchronously and pipelined, and reports how
+ * long each part takes.
+ *
+ * Returns 0 on success, or 1 on error.
+ */
+int mockcam_bringup_test(int argc, char **argv)
+{
+	const char *script = NULL;
+	bool sync = true, pipelined = true, cache = true, radio = true;
+	int i, ret = 0;
+
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--script") == 0 && i + 1 < argc)
+			script = argv[++i];
+		else if (strcmp(argv[i], "--sync") == 0)
+			pipelined = false;
+		else if (strcmp(argv[i], "--pipelined") == 0)
+			sync = false;
+		else if (strcmp(argv[i], "--no-cache") == 0)
+			cache = false;
+		else if (strcmp(argv[i], "--no-radio") == 0)
+			radio = false;
+		else
+			break;
+	}
+	if (i < argc || (!sync && !pipelined)) {
+		fprintf(stderr, "usage: %s [--script file] [--sync|--pipelined] [--no-cache]\n"
+			"          [--no-radio]\n",
+			argv[0]);
+		return 1;
+	}
+
+	if (sync)
+		ret = bringup(script, false, cache, radio);
+	if (pipelined && ret >= 0)
+		ret = bringup(script, true, cache, radio);
+	if (ret < 0)
+		fprintf(stderr, "bring-up failed: %d\n", ret);
+
+	return ret < 0 ? 1 : 0;
+}
@@ -0,0 +1,24 @@
+/*
+ * Simulated camera bridge for testing control transfers without hardware
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ */
+#ifndef __MOCKCAM_H__
+#define __MOCKCAM_H__
+
+#include <stdint.h>
+
+#include "usbctl.h"
+
+struct mockcam;
+
+struct mockcam *mockcam_new(void);
+void mockcam_free(struct mockcam *m);
+int mockcam_load_script(struct mockcam *m, const char *path);
+void mockcam_set_latency(struct mockcam *m, unsigned int service_us,
+			 unsigned int turnaround_us);
+uint16_t mockcam_sensor_reg(struct mockcam *m, uint16_t reg);
+uint8_t mockcam_bridge_reg(struct mockcam *m, uint8_t reg);
+struct usbctl *mockcam_usbctl(struct mockcam *m);
+int mockcam_bringup_test(int argc, char **argv);
+
+#endif /* __MOCKCAM_H__ */
@@ -0,0 +1,82 @@
+/*
+ * Still image previews for headless operation
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "preview.h"
+
+/* Half size of the box drawn around each blob, as in the display window */
+#define BOX 10
+
+static void draw_box(uint8_t *img, int width, int height, int cx, int cy)
+{
+	int x0 = cx - BOX, x1 = cx + BOX - 1;
+	int y0 = cy - BOX, y1 = cy + BOX - 1;
+
+	for (int x = x0; x <= x1; x++) {
+		if (x < 0 || x >= width)
+			continue;
+		if (y0 >= 0)
+			img[y0 * width + x] = 255;
+		if (y1 < height)
+			img[y1 * width + x] = 255;
+	}
+	for (int y = y0; y <= y1; y++) {
+		if (y < 0 || y >= height)
+			continue;
+		if (x0 >= 0)
+			img[y * width + x0] = 255;
+		if (x1 < width)
+			img[y * width + x1] = 255;
+	}
+}
+
+/*
+ * Writes a frame as a binary PGM image with a box around each blob. The image
+ * is written to a temporary file first and renamed over path, so that a
+ * viewer polling the file never sees a partial image.
+ */
+int preview_write_pgm(const char *path, const uint8_t *pixels, int width,
+		      int height, const struct blob *blobs, int num_blobs)
+{
+	size_t size = (size_t)width * height;
+	size_t len = strlen(path);
+	char *tmp;
+	uint8_t *img;
+	FILE *f;
+	int ret = -1;
+
+	tmp = malloc(len + 5);
+	img = malloc(size);
+	if (!tmp || !img)
+		goto out;
+
+	memcpy(img, pixels, size);
+	for (int i = 0; i < num_blobs; i++)
+		draw_box(img, width, height, blobs[i].x, blobs[i].y);
+
+	memcpy(tmp, path, len);
+	memcpy(tmp + len, ".tmp", 5);
+
+	f = fopen(tmp, "wb");
+	if (!f)
+		goto out;
+	if (fprintf(f, "P5\n%d %d\n255\n", width, height) < 0 ||
+	    fwrite(img, 1, size, f) != size) {
+		fclose(f);
+		remove(tmp);
+		goto out;
+	}
+	if (fclose(f) != 0 || rename(tmp, path) != 0) {
+		remove(tmp);
+		goto out;
+	}
+	ret = 0;
+out:
+	free(img);
+	free(tmp);
+	return ret;
+}
@@ -0,0 +1,15 @@
+/*
+ * Still image previews for headless operation
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ */
+#ifndef __PREVIEW_H__
+#define __PREVIEW_H__
+
+#include <stdint.h>
+
+#include "blobwatch.h"
+
+int preview_write_pgm(const char *path, const uint8_t *pixels, int width,
+		      int height, const struct blob *blobs, int num_blobs);
+
+#endif /* __PREVIEW_H__ */
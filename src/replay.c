@@ -0,0 +1,634 @@
+/*
+ * Headless replay of capture files
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "blobstream.h"
+#include "blobwatch.h"
+#include "capture.h"
+#include "clock.h"
+#include "flicker.h"
+#include "replay.h"
+#include "sensors.h"
+
+/* Larger gaps between recorded sequence numbers are taken as resets */
+#define REPLAY_MAX_GAP	60
+
+static const char *scanner_names[] = {
+	[BLOBWATCH_SCANNER_SCALAR] = "scalar",
+	[BLOBWATCH_SCANNER_SSE2] = "sse2",
+	[BLOBWATCH_SCANNER_AVX2] = "avx2",
+};
+
+struct replay_stats {
+	uint64_t blobs;
+	uint64_t dropped_blobs;
+	uint64_t dropped_labels;
+	uint64_t tracked_blobs;
+	uint64_t identified_blobs;
+	uint64_t lost_tracks;
+	uint64_t scanned_pixels;
+	uint64_t full_scans;
+	uint64_t continued_blobs;
+	double prediction_error;
+	float max_prediction_error;
+};
+
+static void replay_account(struct replay_stats *st,
+			   const struct blobservation *ob, uint32_t frame_size)
+{
+	int i;
+
+	st->blobs += ob->num_blobs;
+	st->dropped_blobs += ob->dropped_blobs;
+	st->dropped_labels += ob->dropped_labels;
+	st->lost_tracks += ob->lost_tracks;
+	st->scanned_pixels += ob->scanned_pixels;
+	if (ob->scanned_pixels == frame_size)
+		st->full_scans++;
+	st->prediction_error += ob->prediction_error;
+	if (ob->max_prediction_error > st->max_prediction_error)
+		st->max_prediction_error = ob->max_prediction_error;
+	for (i = 0; i < ob->num_blobs; i++) {
+		if (ob->blobs[i].age > 0)
+			st->continued_blobs++;
+		if (ob->blobs[i].track_index >= 0)
+			st->tracked_blobs++;
+		if (ob->blobs[i].led_id >= 0)
+			st->identified_blobs++;
+	}
+}
+
+static void replay_print(const char *name, const struct replay_stats *st,
+			 int num_frames, uint32_t frame_size)
+{
+	double n = num_frames ? num_frames : 1;
+
+	printf("%s: %.2f blobs/frame, %.2f tracked/frame, %llu tracks lost, "
+	       "%.1f%% of pixels scanned, %llu full scans\n",
+	       name, st->blobs / n, st->tracked_blobs / n,
+	       (unsigned long long)st->lost_tracks,
+	       100.0 * st->scanned_pixels / (n * frame_size),
+	       (unsigned long long)st->full_scans);
+}
+
+/*
+ * Prints how often tracks were lost, relative to the tracked blobs, and how
+ * far the predicted centers were off for the blobs that were continued.
+ */
+static void replay_print_tracking(const char *name,
+				  const struct replay_stats *st)
+{
+	printf("%s: %.3f%% of tracks lost per frame, prediction error mean "
+	       "%.2f max %.2f px over %llu continued blobs\n", name,
+	       st->tracked_blobs ? 100.0 * st->lost_tracks /
+				   st->tracked_blobs : 0.0,
+	       st->continued_blobs ? st->prediction_error /
+				     st->continued_blobs : 0.0,
+	       st->max_prediction_error,
+	       (unsigned long long)st->continued_blobs);
+}
+
+/*
+ * Counts the frames missing between the last frame fed to the detectors and
+ * frame i: those lost during recording, as shown by the sequence numbers, or
+ * those left out of the replay, whichever are more.
+ */
+static int replay_skipped(int last, int i, uint32_t last_sequence,
+			  uint32_t sequence)
+{
+	uint32_t gap = sequence - last_sequence - 1;
+	int skipped = i - last - 1;
+
+	if (gap < REPLAY_MAX_GAP && (int)gap > skipped)
+		skipped = gap;
+
+	return skipped;
+}
+
+/*
+ * Returns true if frame i is not fed to the detectors, see drop_interval.
+ */
+static bool replay_dropped(const struct replay_options *opts, int i)
+{
+	return opts->drop_interval > 1 &&
+	       i % opts->drop_interval == opts->drop_interval - 1;
+}
+
+/*
+ * Returns the number of blobs in b that were also found, with the same
+ * bounding box, in a.
+ */
+static int count_matches(const struct blobservation *a,
+			 const struct blobservation *b)
+{
+	int i, j, n = 0;
+
+	for (i = 0; i < b->num_blobs; i++) {
+		const struct blob *b2 = &b->blobs[i];
+
+		for (j = 0; j < a->num_blobs; j++) {
+			const struct blob *b1 = &a->blobs[j];
+
+			if (b1->x == b2->x && b1->y == b2->y &&
+			    b1->width == b2->width &&
+			    b1->height == b2->height) {
+				n++;
+				break;
+			}
+		}
+	}
+
+	return n;
+}
+
+/*
+ * Applies the detector options.
+ *
+ * Returns 0 on success or a negative error code.
+ */
+static int replay_setup(struct blobwatch *bw, const struct replay_options *opts)
+{
+	int ret;
+
+	if (opts->threshold) {
+		ret = blobwatch_set_threshold(bw, opts->threshold);
+		if (ret < 0)
+			return ret;
+	}
+	ret = blobwatch_set_hysteresis(bw, opts->hysteresis);
+	if (ret < 0)
+		return ret;
+	blobwatch_set_adaptive(bw, opts->adaptive);
+	ret = blobwatch_set_predictor(bw, opts->predictor);
+	if (ret < 0)
+		return ret;
+
+	return blobwatch_set_flicker(bw, opts->flicker);
+}
+
+/*
+ * Feeds all frames of a capture file into a blob detector, either as fast as
+ * possible or paced by the recorded timestamps, and prints a summary.
+ * To compare region of interest scanning with full scanning, the frames are
+ * fed into a second detector with region of interest scanning enabled.
+ *
+ * Returns 0 on success or a negative error code.
+ */
+int replay_run(const char *path, const struct replay_options *opts)
+{
+	struct replay_stats stats = { 0 }, roi_stats = { 0 };
+	struct blobservation *ob, *roi_ob;
+	struct blobwatch *bw, *roi_bw = NULL;
+	struct blobstream *stream = NULL;
+	struct capture *c;
+	uint64_t first_ts = 0, start, elapsed;
+	uint64_t matched_blobs = 0, skipped_frames = 0;
+	uint32_t frame_size, last_sequence = 0;
+	int width, height;
+	int num_frames, num_observed = 0, last_fed = -1;
+	int i, ret;
+
+	c = capture_open(path);
+	if (!c) {
+		fprintf(stderr, "could not open capture file %s\n", path);
+		return -ENOENT;
+	}
+
+	width = capture_width(c);
+	height = capture_height(c);
+	num_frames = capture_num_frames(c);
+	frame_size = width * height;
+
+	bw = blobwatch_new(width, height, opts->max_blobs);
+	if (opts->compare_roi)
+		roi_bw = blobwatch_new(width, height, opts->max_blobs);
+	if (!bw || (opts->compare_roi && !roi_bw)) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	ret = blobwatch_set_threads(bw, opts->num_threads);
+	if (ret < 0)
+		goto out;
+	ret = replay_setup(bw, opts);
+	if (ret < 0)
+		goto out;
+	if (opts->publish) {
+		stream = blobstream_create(opts->publish,
+					   blobwatch_get_max_blobs(bw));
+		if (!stream) {
+			fprintf(stderr, "could not create shared memory %s\n",
+				opts->publish);
+			ret = -EIO;
+			goto out;
+		}
+	}
+	if (roi_bw) {
+		ret = blobwatch_set_threads(roi_bw, opts->num_threads);
+		if (ret < 0)
+			goto out;
+		ret = replay_setup(roi_bw, opts);
+		if (ret < 0)
+			goto out;
+		ret = blobwatch_set_roi(roi_bw, opts->roi_interval);
+	} else {
+		ret = blobwatch_set_roi(bw, opts->roi_interval);
+	}
+	if (ret < 0)
+		goto out;
+
+	start = clock_now_ns();
+
+	for (i = 0; i < num_frames; i++) {
+		struct capture_frame frame;
+		int skipped;
+
+		if (replay_dropped(opts, i))
+			continue;
+
+		ret = capture_get_frame(c, i, &frame);
+		if (ret < 0)
+			goto out;
+		if (frame.size < frame_size) {
+			fprintf(stderr, "frame %d: short frame (%u bytes)\n",
+				i, frame.size);
+			continue;
+		}
+
+		/* Paced from the first frame fed, which need not be frame 0 */
+		if (opts->realtime) {
+			if (last_fed < 0)
+				first_ts = frame.timestamp;
+			else
+				clock_sleep_until_ns(start + frame.timestamp -
+						     first_ts);
+		}
+
+		skipped = last_fed >= 0 ? replay_skipped(last_fed, i,
+							 last_sequence,
+							 frame.sequence) : 0;
+		last_fed = i;
+		last_sequence = frame.sequence;
+		skipped_frames += skipped;
+
+		blobwatch_process(bw, (uint8_t *)frame.data, width, height,
+				  skipped, frame.timestamp, NULL, &ob);
+		if (roi_bw)
+			blobwatch_process(roi_bw, (uint8_t *)frame.data, width,
+					  height, skipped, frame.timestamp, NULL,
+					  &roi_ob);
+		if (!ob)
+			continue;
+
+		if (stream)
+			blobstream_publish(stream, frame.sequence,
+					   frame.timestamp, ob);
+
+		num_observed++;
+		replay_account(&stats, ob, frame_size);
+		if (roi_bw) {
+			replay_account(&roi_stats, roi_ob, frame_size);
+			matched_blobs += count_matches(ob, roi_ob);
+		}
+
+		if (opts->verbose) {
+			int j;
+
+			printf("Frame %u: %d blobs\n", frame.sequence,
+			       ob->num_blobs);
+			for (j = 0; j < ob->num_blobs; j++)
+				printf("Blob[%d]: %d,%d (%.2f,%.2f) led %d\n", j,
+				       ob->blobs[j].x, ob->blobs[j].y,
+				       ob->blobs[j].cx, ob->blobs[j].cy,
+				       ob->blobs[j].led_id);
+		}
+	}
+
+	elapsed = clock_now_ns() - start;
+
+	printf("%s: %d frames of %dx%d in %.3f s, %.1f frames/s, %.2f blobs/frame\n",
+	       path, num_frames, width, height, elapsed * 1e-9,
+	       elapsed ? num_frames * 1e9 / elapsed : 0.0,
+	       num_observed ? (double)stats.blobs / num_observed : 0.0);
+	if (stats.dropped_blobs)
+		printf("%s: %llu blobs dropped, budget is %d per frame\n",
+		       path, (unsigned long long)stats.dropped_blobs,
+		       blobwatch_get_max_blobs(bw));
+	if (stats.dropped_labels)
+		printf("%s: %llu labels over capacity, "
+		       "up to as many blobs lost\n",
+		       path, (unsigned long long)stats.dropped_labels);
+	if (roi_bw) {
+		replay_print("full", &stats, num_observed, frame_size);
+		replay_print("roi", &roi_stats, num_observed, frame_size);
+		printf("roi: %.2f%% of blobs found by full scans found too\n",
+		       stats.blobs ? 100.0 * matched_blobs / stats.blobs : 100.0);
+	} else if (opts->roi_interval > 1) {
+		replay_print("roi", &stats, num_observed, frame_size);
+	}
+	replay_print_tracking(opts->predictor == BLOBWATCH_PREDICTOR_KALMAN ?
+			      "kalman" : "difference", &stats);
+	if (skipped_frames)
+		printf("%s: %llu frames skipped\n",
+		       path, (unsigned long long)skipped_frames);
+	if (opts->flicker) {
+		struct flicker_stats fs;
+
+		blobwatch_get_flicker_stats(bw, &fs);
+		printf("flicker: %.1f%% of tracked blobs identified, %llu locks "
+		       "after %.1f frames, %llu lost\n",
+		       stats.tracked_blobs ? 100.0 * stats.identified_blobs /
+					     stats.tracked_blobs : 0.0,
+		       (unsigned long long)fs.locks,
+		       fs.locks ? (double)fs.lock_frames / fs.locks : 0.0,
+		       (unsigned long long)fs.unlocks);
+	}
+	ret = 0;
+
+out:
+	blobstream_destroy(stream);
+	blobwatch_free(roi_bw);
+	blobwatch_free(bw);
+	capture_close(c);
+
+	return ret;
+}
+
+/*
+ * Replays several capture files of the same frame size at once, as if they
+ * came from multiple sensors, each with its own detector, sharing one thread
+ * pool of opts->num_threads threads. Frames are fed in rounds of one frame
+ * per capture, as fast as possible, and per-sensor statistics are printed.
+ *
+ * Returns 0 on success or a negative error code.
+ */
+int replay_run_sensors(const char **paths, int num_paths,
+		       const struct replay_options *opts)
+{
+	struct capture **c = calloc(num_paths, sizeof(*c));
+	uint8_t **frames = calloc(num_paths, sizeof(*frames));
+	uint64_t *timestamps = calloc(num_paths, sizeof(*timestamps));
+	uint32_t *sequences = calloc(num_paths, sizeof(*sequences));
+	int *last_fed = calloc(num_paths, sizeof(*last_fed));
+	int *skipped = calloc(num_paths, sizeof(*skipped));
+	struct blobservation **obs = calloc(num_paths, sizeof(*obs));
+	struct sensor_group *sg = NULL;
+	int width = 0, height = 0, max_frames = 0;
+	uint64_t start, elapsed, total_frames = 0;
+	int i, j, ret = -ENOMEM;
+
+	if (!c || !frames || !timestamps || !sequences || !last_fed ||
+	    !skipped || !obs)
+		goto out;
+
+	for (j = 0; j < num_paths; j++)
+		last_fed[j] = -1;
+
+	for (j = 0; j < num_paths; j++) {
+		c[j] = capture_open(paths[j]);
+		if (!c[j]) {
+			fprintf(stderr, "could not open capture file %s\n",
+				paths[j]);
+			ret = -ENOENT;
+			goto out;
+		}
+		if (j == 0) {
+			width = capture_width(c[j]);
+			height = capture_height(c[j]);
+		} else if (capture_width(c[j]) != width ||
+			   capture_height(c[j]) != height) {
+			fprintf(stderr, "%s: frame size differs from %s\n",
+				paths[j], paths[0]);
+			ret = -EINVAL;
+			goto out;
+		}
+		if (capture_num_frames(c[j]) > max_frames)
+			max_frames = capture_num_frames(c[j]);
+	}
+
+	sg = sensor_group_new(num_paths, width, height, opts->max_blobs,
+			      opts->num_threads);
+	if (!sg)
+		goto out;
+	for (j = 0; j < num_paths; j++) {
+		struct blobwatch *bw = sensor_group_detector(sg, j);
+
+		ret = replay_setup(bw, opts);
+		if (ret < 0)
+			goto out;
+		ret = blobwatch_set_roi(bw, opts->roi_interval);
+		if (ret < 0)
+			goto out;
+	}
+
+	start = clock_now_ns();
+
+	for (i = 0; i < max_frames; i++) {
+		if (replay_dropped(opts, i))
+			continue;
+
+		for (j = 0; j < num_paths; j++) {
+			struct capture_frame frame;
+
+			frames[j] = NULL;
+			if (i >= capture_num_frames(c[j]))
+				continue;
+			ret = capture_get_frame(c[j], i, &frame);
+			if (ret < 0)
+				goto out;
+			if (frame.size < (uint32_t)(width * height))
+				continue;
+			/* The detector does not write to the frame */
+			frames[j] = (uint8_t *)frame.data;
+			skipped[j] = last_fed[j] >= 0 ?
+				     replay_skipped(last_fed[j], i,
+						    sequences[j],
+						    frame.sequence) : 0;
+			last_fed[j] = i;
+			sequences[j] = frame.sequence;
+			timestamps[j] = frame.timestamp;
+			total_frames++;
+		}
+
+		sensor_group_process(sg, frames, skipped, timestamps, obs);
+	}
+
+	elapsed = clock_now_ns() - start;
+
+	printf("%d sensors of %dx%d: %llu frames in %.3f s, %.1f frames/s\n",
+	       num_paths, width, height, (unsigned long long)total_frames,
+	       elapsed * 1e-9, elapsed ? total_frames * 1e9 / elapsed : 0.0);
+	for (j = 0; j < num_paths; j++) {
+		struct sensor_stats st;
+
+		sensor_group_get_stats(sg, j, &st);
+		printf("%s: %llu frames, %.2f blobs/frame, %llu dropped, "
+		       "mean %.1f max %.1f us\n", paths[j],
+		       (unsigned long long)st.frames,
+		       st.frames ? (double)st.blobs / st.frames : 0.0,
+		       (unsigned long long)st.dropped_blobs,
+		       st.frames ? st.busy_ns * 1e-3 / st.frames : 0.0,
+		       st.max_ns * 1e-3);
+	}
+	ret = 0;
+
+out:
+	sensor_group_free(sg);
+	for (j = 0; c && j < num_paths; j++)
+		capture_close(c[j]);
+	free(obs);
+	free(skipped);
+	free(last_fed);
+	free(sequences);
+	free(timestamps);
+	free(frames);
+	free(c);
+
+	return ret;
+}
+
+/*
+ * Returns true if two observations of the same frame contain the same blobs,
+ * down to the bits of their centroids and covariances.
+ */
+static bool same_blobs(const struct blobservation *a,
+		       const struct blobservation *b)
+{
+	int i;
+
+	if (a->num_blobs != b->num_blobs ||
+	    a->dropped_blobs != b->dropped_blobs ||
+	    a->dropped_labels != b->dropped_labels)
+		return false;
+
+	for (i = 0; i < a->num_blobs; i++) {
+		const struct blob *b1 = &a->blobs[i];
+		const struct blob *b2 = &b->blobs[i];
+
+		if (b1->x != b2->x || b1->y != b2->y ||
+		    b1->width != b2->width || b1->height != b2->height ||
+		    b1->area != b2->area || b1->peak != b2->peak ||
+		    memcmp(&b1->cx, &b2->cx, sizeof(float)) ||
+		    memcmp(&b1->cy, &b2->cy, sizeof(float)) ||
+		    memcmp(&b1->cxx, &b2->cxx, sizeof(float)) ||
+		    memcmp(&b1->cyy, &b2->cyy, sizeof(float)) ||
+		    memcmp(&b1->cxy, &b2->cxy, sizeof(float)))
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Feeds every frame of a capture file to one detector per run finder the CPU
+ * supports, configured by opts, and checks that the SIMD run finders find
+ * exactly the blobs the scalar one finds. Differing frames are reported.
+ *
+ * Returns 0 if all run finders agree, -EIO if one differs, or another
+ * negative error code.
+ */
+int replay_check_scanners(const char *path, const struct replay_options *opts)
+{
+	struct blobwatch *bw[BLOBWATCH_SCANNER_AVX2 + 1] = { NULL };
+	int differing[BLOBWATCH_SCANNER_AVX2 + 1] = { 0 };
+	struct capture *c;
+	uint32_t frame_size;
+	int width, height;
+	int num_frames, num_checked = 0;
+	int i, s, ret;
+
+	c = capture_open(path);
+	if (!c) {
+		fprintf(stderr, "could not open capture file %s\n", path);
+		return -ENOENT;
+	}
+
+	width = capture_width(c);
+	height = capture_height(c);
+	num_frames = capture_num_frames(c);
+	frame_size = width * height;
+
+	for (s = BLOBWATCH_SCANNER_SCALAR; s <= BLOBWATCH_SCANNER_AVX2; s++) {
+		bw[s] = blobwatch_new(width, height, opts->max_blobs);
+		if (!bw[s]) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		ret = blobwatch_set_scanner(bw[s], s);
+		if (ret == -ENOTSUP) {
+			/* not supported by this CPU */
+			blobwatch_free(bw[s]);
+			bw[s] = NULL;
+			continue;
+		}
+		if (ret == 0)
+			ret = blobwatch_set_threads(bw[s], opts->num_threads);
+		if (ret == 0)
+			ret = replay_setup(bw[s], opts);
+		if (ret == 0)
+			ret = blobwatch_set_roi(bw[s], opts->roi_interval);
+		if (ret < 0)
+			goto out;
+	}
+
+	for (i = 0; i < num_frames; i++) {
+		struct blobservation *ob[BLOBWATCH_SCANNER_AVX2 + 1];
+		struct capture_frame frame;
+
+		ret = capture_get_frame(c, i, &frame);
+		if (ret < 0)
+			goto out;
+		if (frame.size < frame_size)
+			continue;
+
+		for (s = BLOBWATCH_SCANNER_SCALAR;
+		     s <= BLOBWATCH_SCANNER_AVX2; s++) {
+			if (bw[s])
+				blobwatch_process(bw[s], (uint8_t *)frame.data,
+						  width, height, 0,
+						  frame.timestamp, NULL,
+						  &ob[s]);
+		}
+		num_checked++;
+
+		/* The first frame only starts the tracking history */
+		if (!ob[BLOBWATCH_SCANNER_SCALAR])
+			continue;
+
+		for (s = BLOBWATCH_SCANNER_SSE2;
+		     s <= BLOBWATCH_SCANNER_AVX2; s++) {
+			if (!bw[s] ||
+			    same_blobs(ob[BLOBWATCH_SCANNER_SCALAR], ob[s]))
+				continue;
+			if (!differing[s]++)
+				fprintf(stderr, "%s: frame %u: %s blobs differ "
+					"from scalar\n", path, frame.sequence,
+					scanner_names[s]);
+		}
+	}
+
+	ret = 0;
+	for (s = BLOBWATCH_SCANNER_SSE2; s <= BLOBWATCH_SCANNER_AVX2; s++) {
+		if (!bw[s])
+			continue;
+		printf("%s: %s %s scalar in %d of %d frames\n", path,
+		       scanner_names[s],
+		       differing[s] ? "differs from" : "matches",
+		       differing[s] ? differing[s] : num_checked, num_checked);
+		if (differing[s])
+			ret = -EIO;
+	}
+
+out:
+	for (s = BLOBWATCH_SCANNER_SCALAR; s <= BLOBWATCH_SCANNER_AVX2; s++)
+		blobwatch_free(bw[s]);
+	capture_close(c);
+
+	return ret;
+}
@@ -0,0 +1,46 @@
+/*
+ * Headless replay of capture files
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ */
+#ifndef __REPLAY_H__
+#define __REPLAY_H__
+
+#include <stdbool.h>
+
+#include "blobwatch.h"
+
+struct replay_options {
+	/* feed frames at their recorded pace instead of as fast as possible */
+	bool realtime;
+	/* number of blob detection threads */
+	int num_threads;
+	/* blob budget per frame, 0 for the default */
+	int max_blobs;
+	/* pixel threshold, 0 for the default */
+	int threshold;
+	/* low threshold for hysteresis segmentation, 0 to disable */
+	int hysteresis;
+	/* choose the threshold from the frame histogram */
+	bool adaptive;
+	/* print the blobs of each frame */
+	bool verbose;
+	/* full scan interval of region of interest scanning, 0 to disable */
+	int roi_interval;
+	/* identify blobs by the blink patterns of the default LED table */
+	bool flicker;
+	/* prediction of blob positions for tracking */
+	enum blobwatch_predictor predictor;
+	/* skip every drop_interval-th frame to test tracking, 0 to disable */
+	int drop_interval;
+	/* compare region of interest scanning against full scanning */
+	bool compare_roi;
+	/* shared memory object to publish blobs to, or NULL */
+	const char *publish;
+};
+
+int replay_run(const char *path, const struct replay_options *opts);
+int replay_run_sensors(const char **paths, int num_paths,
+		       const struct replay_options *opts);
+int replay_check_scanners(const char *path, const struct replay_options *opts);
+
+#endif /* __REPLAY_H__ */
@@ -0,0 +1,526 @@
+/*
+ * Run-length encoded thresholded frames
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+#include "rle.h"
+
+/*
+ * Row encoders store the runs of pixels above threshold into runs and return
+ * their number, or -1 if there are more than max_runs.
+ */
+typedef int (*rle_row_func)(const uint8_t *line, int width, uint8_t threshold,
+			    struct rle_run *runs, int max_runs);
+
+static rle_row_func encode_row;
+
+/*
+ * Turns the set bits of edges, the positions where a row switches between
+ * dark and bright relative to x, into runs. *start is the beginning of the run
+ * that is still open, or -1.
+ */
+static inline __attribute__((always_inline))
+int emit_edges(uint32_t edges, int x, int *start, struct rle_run *runs,
+	       int n, int max_runs)
+{
+	while (edges) {
+		int pos = x + __builtin_ctz(edges);
+
+		edges &= edges - 1;
+		if (*start < 0) {
+			*start = pos;
+			continue;
+		}
+		if (n == max_runs)
+			return -1;
+		runs[n].start = *start;
+		runs[n].end = pos - 1;
+		n++;
+		*start = -1;
+	}
+
+	return n;
+}
+
+/*
+ * Finishes a row from x on pixel by pixel, including a run still open at
+ * its end.
+ */
+static int encode_tail(const uint8_t *line, int x, int width,
+		       uint8_t threshold, int start, struct rle_run *runs,
+		       int n, int max_runs)
+{
+	for (; x < width; x++) {
+		int bright = line[x] > threshold;
+
+		if (bright == (start >= 0))
+			continue;
+		if (bright) {
+			start = x;
+			continue;
+		}
+		if (n == max_runs)
+			return -1;
+		runs[n].start = start;
+		runs[n].end = x - 1;
+		n++;
+		start = -1;
+	}
+
+	if (start >= 0) {
+		if (n == max_runs)
+			return -1;
+		runs[n].start = start;
+		runs[n].end = width - 1;
+		n++;
+	}
+
+	return n;
+}
+
+static int encode_row_scalar(const uint8_t *line, int width,
+			     uint8_t threshold, struct rle_run *runs,
+			     int max_runs)
+{
+	return encode_tail(line, 0, width, threshold, -1, runs, 0, max_runs);
+}
+
+#ifdef HAVE_X86_SIMD
+/*
+ * Like the run finders of the detector, these compare pixels biased by 0x80
+ * as signed bytes. Each bit of the mask of bright pixels that differs from
+ * the bit before it starts or ends a run, so whole blocks of pixels are
+ * encoded with a shift, an xor and a count of trailing zeros per run edge.
+ */
+__attribute__((target("sse2")))
+static int encode_row_sse2(const uint8_t *line, int width, uint8_t threshold,
+			   struct rle_run *runs, int max_runs)
+{
+	const __m128i bias = _mm_set1_epi8((char)0x80);
+	const __m128i thr = _mm_set1_epi8((char)(threshold ^ 0x80));
+	uint32_t carry = 0;
+	int start = -1;
+	int x, n = 0;
+
+	for (x = 0; x + 16 <= width; x += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(line + x));
+		uint32_t m = _mm_movemask_epi8(_mm_cmpgt_epi8(
+				_mm_xor_si128(v, bias), thr));
+		uint32_t edges = (m ^ ((m << 1) | carry)) & 0xffff;
+
+		carry = m >> 15;
+		if (!edges)
+			continue;
+		n = emit_edges(edges, x, &start, runs, n, max_runs);
+		if (n < 0)
+			return -1;
+	}
+
+	return encode_tail(line, x, width, threshold, start, runs, n,
+			   max_runs);
+}
+
+__attribute__((target("avx2")))
+static int encode_row_avx2(const uint8_t *line, int width, uint8_t threshold,
+			   struct rle_run *runs, int max_runs)
+{
+	const __m256i bias = _mm256_set1_epi8((char)0x80);
+	const __m256i thr = _mm256_set1_epi8((char)(threshold ^ 0x80));
+	uint32_t carry = 0;
+	int start = -1;
+	int x, n = 0;
+
+	for (x = 0; x + 32 <= width; x += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(line + x));
+		uint32_t m, edges;
+
+		/* Skip dark stretches 64 pixels at a time outside of runs */
+		if (!carry && x + 64 <= width) {
+			__m256i w = _mm256_loadu_si256((const __m256i *)
+						       (line + x + 32));
+
+			if (_mm256_testz_si256(_mm256_cmpgt_epi8(
+				_mm256_xor_si256(_mm256_max_epu8(v, w), bias),
+				thr), _mm256_set1_epi8(-1))) {
+				x += 32;
+				continue;
+			}
+		}
+
+		m = _mm256_movemask_epi8(_mm256_cmpgt_epi8(
+				_mm256_xor_si256(v, bias), thr));
+		edges = m ^ ((m << 1) | carry);
+		carry = m >> 31;
+		if (!edges)
+			continue;
+		n = emit_edges(edges, x, &start, runs, n, max_runs);
+		if (n < 0)
+			return -1;
+	}
+
+	return encode_tail(line, x, width, threshold, start, runs, n,
+			   max_runs);
+}
+#endif /* HAVE_X86_SIMD */
+
+static rle_row_func select_encoder(void)
+{
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return encode_row_avx2;
+	if (__builtin_cpu_supports("sse2"))
+		return encode_row_sse2;
+#endif
+	return encode_row_scalar;
+}
+
+/*
+ * Allocates an empty frame with room for max_runs runs and max_pixels pixel
+ * values, or the defaults if they are 0. The fastest row encoder supported by
+ * the CPU is picked on first use.
+ *
+ * Returns the newly allocated frame or NULL on error.
+ */
+struct rle_frame *rle_frame_new(int width, int height, int max_runs,
+				int max_pixels)
+{
+	struct rle_frame *rf;
+
+	if (width < 1 || width > UINT16_MAX || height < 1 || max_runs < 0 ||
+	    max_pixels < 0)
+		return NULL;
+
+	if (!__atomic_load_n(&encode_row, __ATOMIC_RELAXED))
+		__atomic_store_n(&encode_row, select_encoder(),
+				 __ATOMIC_RELAXED);
+
+	rf = calloc(1, sizeof(*rf));
+	if (!rf)
+		return NULL;
+
+	rf->width = width;
+	rf->height = height;
+	rf->max_runs = max_runs ? max_runs : RLE_DEFAULT_MAX_RUNS;
+	rf->max_pixels = max_pixels ? max_pixels : RLE_DEFAULT_MAX_PIXELS;
+	rf->rows = calloc(height, sizeof(*rf->rows));
+	rf->runs = malloc(rf->max_runs * sizeof(*rf->runs));
+	rf->pixels = malloc(rf->max_pixels);
+	if (!rf->rows || !rf->runs || !rf->pixels) {
+		rle_frame_free(rf);
+		return NULL;
+	}
+	rf->complete = true;
+
+	return rf;
+}
+
+void rle_frame_free(struct rle_frame *rf)
+{
+	if (!rf)
+		return;
+
+	free(rf->pixels);
+	free(rf->runs);
+	free(rf->rows);
+	free(rf);
+}
+
+/*
+ * Encodes rows y0 to y1 - 1 of frame at the frame's threshold, into part
+ * number part of num_parts equal parts of the run and pixel storage, so that
+ * horizontal strips can be encoded concurrently. Rows that do not fit are
+ * left empty. num_runs and num_pixels are not updated, see rle_count().
+ *
+ * Returns 0 on success or -ENOSPC if runs were left out.
+ */
+int rle_encode_rows(struct rle_frame *rf, const uint8_t *frame, int y0,
+		    int y1, int part, int num_parts)
+{
+	rle_row_func encode = __atomic_load_n(&encode_row, __ATOMIC_RELAXED);
+	uint32_t run = (int64_t)rf->max_runs * part / num_parts;
+	uint32_t max_run = (int64_t)rf->max_runs * (part + 1) / num_parts;
+	uint32_t pix = (uint64_t)rf->max_pixels * part / num_parts;
+	uint32_t max_pix = (uint64_t)rf->max_pixels * (part + 1) / num_parts;
+	const uint8_t *line = frame + (size_t)y0 * rf->width;
+	int y, i;
+
+	for (y = y0; y < y1; y++, line += rf->width) {
+		struct rle_run *runs = rf->runs + run;
+		int n = encode(line, rf->width, rf->threshold, runs,
+			       max_run - run);
+
+		rf->rows[y].first = run;
+		rf->rows[y].num = 0;
+		if (n < 0)
+			goto full;
+
+		for (i = 0; i < n; i++) {
+			uint32_t len = runs[i].end - runs[i].start + 1;
+
+			if (len > max_pix - pix)
+				goto full;
+			runs[i].offset = pix;
+			memcpy(rf->pixels + pix, line + runs[i].start, len);
+			pix += len;
+		}
+		rf->rows[y].num = n;
+		run += n;
+	}
+
+	return 0;
+
+full:
+	for (; y < y1; y++) {
+		rf->rows[y].first = run;
+		rf->rows[y].num = 0;
+	}
+
+	return -ENOSPC;
+}
+
+/*
+ * Updates num_runs and num_pixels after encoding rows.
+ */
+void rle_count(struct rle_frame *rf)
+{
+	int y, i;
+
+	rf->num_runs = 0;
+	rf->num_pixels = 0;
+	for (y = 0; y < rf->height; y++) {
+		const struct rle_run *r = rf->runs + rf->rows[y].first;
+
+		rf->num_runs += rf->rows[y].num;
+		for (i = 0; i < rf->rows[y].num; i++)
+			rf->num_pixels += r[i].end - r[i].start + 1;
+	}
+}
+
+/*
+ * Encodes the pixels of frame above threshold.
+ *
+ * Returns 0 on success or -ENOSPC if the frame is incomplete.
+ */
+int rle_encode(struct rle_frame *rf, const uint8_t *frame, uint8_t threshold)
+{
+	int ret;
+
+	rf->threshold = threshold;
+	ret = rle_encode_rows(rf, frame, 0, rf->height, 0, 1);
+	rf->complete = ret == 0;
+	rle_count(rf);
+
+	return ret;
+}
+
+/*
+ * Copies the runs of src into dst, which must be of the same size and have
+ * room for the runs and pixels in use. The copy is compacted.
+ *
+ * Returns 0 on success or a negative error code.
+ */
+int rle_copy(struct rle_frame *dst, const struct rle_frame *src)
+{
+	uint32_t run = 0, pix = 0;
+	int y, i;
+
+	if (dst->width != src->width || dst->height != src->height)
+		return -EINVAL;
+	if (src->num_runs > dst->max_runs || src->num_pixels > dst->max_pixels)
+		return -ENOSPC;
+
+	for (y = 0; y < src->height; y++) {
+		const struct rle_run *r = src->runs + src->rows[y].first;
+
+		dst->rows[y].first = run;
+		dst->rows[y].num = src->rows[y].num;
+		for (i = 0; i < src->rows[y].num; i++) {
+			uint32_t len = r[i].end - r[i].start + 1;
+
+			dst->runs[run] = r[i];
+			dst->runs[run].offset = pix;
+			memcpy(dst->pixels + pix, src->pixels + r[i].offset,
+			       len);
+			pix += len;
+			run++;
+		}
+	}
+
+	dst->threshold = src->threshold;
+	dst->complete = src->complete;
+	dst->num_runs = run;
+	dst->num_pixels = pix;
+
+	return 0;
+}
+
+/*
+ * Writes the run pixels of rf into frame, leaving the others untouched.
+ */
+void rle_draw(const struct rle_frame *rf, uint8_t *frame)
+{
+	int y, i;
+
+	for (y = 0; y < rf->height; y++, frame += rf->width) {
+		const struct rle_run *r = rf->runs + rf->rows[y].first;
+
+		for (i = 0; i < rf->rows[y].num; i++)
+			memcpy(frame + r[i].start, rf->pixels + r[i].offset,
+			       r[i].end - r[i].start + 1);
+	}
+}
+
+/*
+ * Blacks out the run pixels of rf in frame, undoing rle_draw().
+ */
+void rle_clear(const struct rle_frame *rf, uint8_t *frame)
+{
+	int y, i;
+
+	for (y = 0; y < rf->height; y++, frame += rf->width) {
+		const struct rle_run *r = rf->runs + rf->rows[y].first;
+
+		for (i = 0; i < rf->rows[y].num; i++)
+			memset(frame + r[i].start, 0, r[i].end - r[i].start + 1);
+	}
+}
+
+/*
+ * Expands rf into a full frame.
+ */
+void rle_decode(const struct rle_frame *rf, uint8_t *frame)
+{
+	memset(frame, 0, (size_t)rf->width * rf->height);
+	rle_draw(rf, frame);
+}
+
+/*
+ * Returns the number of bytes of the row table, runs and pixels in use.
+ */
+size_t rle_footprint(const struct rle_frame *rf)
+{
+	return rf->height * sizeof(*rf->rows) +
+	       rf->num_runs * sizeof(*rf->runs) + rf->num_pixels;
+}
+
+/*
+ * The packed format is the threshold, the number of runs of each row as
+ * 16-bit values, the start and end of each run as 16-bit values, and the pixel
+ * values of all runs, in host byte order without alignment.
+ */
+size_t rle_pack_max(const struct rle_frame *rf)
+{
+	return 1 + rf->height * sizeof(uint16_t) +
+	       rf->max_runs * 2 * sizeof(uint16_t) + rf->max_pixels;
+}
+
+/*
+ * Packs the runs in use into buf for storage.
+ *
+ * Returns the packed size, or 0 if buf is too small.
+ */
+size_t rle_pack(const struct rle_frame *rf, uint8_t *buf, size_t size)
+{
+	size_t runs_size = rf->num_runs * 2 * sizeof(uint16_t);
+	size_t total = 1 + rf->height * sizeof(uint16_t) + runs_size +
+		       rf->num_pixels;
+	uint8_t *p = buf + 1 + rf->height * sizeof(uint16_t);
+	uint8_t *pix = p + runs_size;
+	int y, i;
+
+	if (total > size)
+		return 0;
+
+	buf[0] = rf->threshold;
+	for (y = 0; y < rf->height; y++) {
+		const struct rle_run *r = rf->runs + rf->rows[y].first;
+		uint16_t num = rf->rows[y].num;
+
+		memcpy(buf + 1 + y * sizeof(num), &num, sizeof(num));
+		for (i = 0; i < num; i++) {
+			uint16_t v[2] = { r[i].start, r[i].end };
+
+			memcpy(p, v, sizeof(v));
+			p += sizeof(v);
+			memcpy(pix, rf->pixels + r[i].offset,
+			       r[i].end - r[i].start + 1);
+			pix += r[i].end - r[i].start + 1;
+		}
+	}
+
+	return total;
+}
+
+/*
+ * Unpacks runs stored by rle_pack() into rf, checking that they are sorted
+ * and lie within the frame.
+ *
+ * Returns 0 on success or a negative error code.
+ */
+int rle_unpack(struct rle_frame *rf, const uint8_t *buf, size_t size)
+{
+	size_t rows_size = 1 + rf->height * sizeof(uint16_t);
+	const uint8_t *p = buf + rows_size;
+	uint32_t run = 0, pix = 0;
+	size_t runs_size;
+	int y, i;
+
+	if (size < rows_size)
+		return -EINVAL;
+
+	for (y = 0; y < rf->height; y++) {
+		uint16_t num;
+
+		memcpy(&num, buf + 1 + y * sizeof(num), sizeof(num));
+		rf->rows[y].first = run;
+		rf->rows[y].num = num;
+		run += num;
+	}
+	if (run > rf->max_runs)
+		return -ENOSPC;
+	runs_size = run * 2 * sizeof(uint16_t);
+	if (size < rows_size + runs_size)
+		return -EINVAL;
+
+	for (y = 0; y < rf->height; y++) {
+		struct rle_run *r = rf->runs + rf->rows[y].first;
+		int prev_end = -2;
+
+		for (i = 0; i < rf->rows[y].num; i++) {
+			uint16_t v[2];
+
+			memcpy(v, p, sizeof(v));
+			p += sizeof(v);
+			if (v[0] <= prev_end + 1 || v[1] < v[0] ||
+			    v[1] >= rf->width)
+				return -EINVAL;
+			prev_end = v[1];
+			r[i].start = v[0];
+			r[i].end = v[1];
+			r[i].offset = pix;
+			pix += v[1] - v[0] + 1;
+		}
+	}
+	if (pix > rf->max_pixels)
+		return -ENOSPC;
+	if (size < rows_size + runs_size + pix)
+		return -EINVAL;
+
+	memcpy(rf->pixels, buf + rows_size + runs_size, pix);
+	rf->threshold = buf[0];
+	rf->complete = true;
+	rf->num_runs = run;
+	rf->num_pixels = pix;
+
+	return 0;
+}
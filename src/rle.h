@@ -0,0 +1,75 @@
+/*
+ * Run-length encoded thresholded frames
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ */
+#ifndef __RLE_H__
+#define __RLE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Default capacity of a frame, enough for a few hundred blobs. Frames with
+ * more runs or run pixels are not encoded completely, their consumers fall
+ * back to the raw frame.
+ */
+#define RLE_DEFAULT_MAX_RUNS	16384
+#define RLE_DEFAULT_MAX_PIXELS	131072
+
+/*
+ * Run of pixels [start, end] above the threshold, whose values are stored at
+ * offset in the pixel array of the frame.
+ */
+struct rle_run {
+	uint16_t start;
+	uint16_t end;
+	uint32_t offset;
+};
+
+/*
+ * Runs of row y are runs[rows[y].first] to runs[rows[y].first + num - 1],
+ * sorted by position.
+ */
+struct rle_row {
+	uint32_t first;
+	uint32_t num;
+};
+
+/*
+ * A frame reduced to the runs of pixels above threshold in each row, with the
+ * values of those pixels. Everything else is black. complete is cleared if
+ * the runs or pixels did not fit.
+ */
+struct rle_frame {
+	int width;
+	int height;
+	uint8_t threshold;
+	bool complete;
+	int max_runs;
+	uint32_t max_pixels;
+	struct rle_row *rows;
+	struct rle_run *runs;
+	uint8_t *pixels;
+	/* number of runs and pixels in use, see rle_count() */
+	int num_runs;
+	uint32_t num_pixels;
+};
+
+struct rle_frame *rle_frame_new(int width, int height, int max_runs,
+				int max_pixels);
+void rle_frame_free(struct rle_frame *rf);
+int rle_encode(struct rle_frame *rf, const uint8_t *frame, uint8_t threshold);
+int rle_encode_rows(struct rle_frame *rf, const uint8_t *frame, int y0,
+		    int y1, int part, int num_parts);
+void rle_count(struct rle_frame *rf);
+int rle_copy(struct rle_frame *dst, const struct rle_frame *src);
+void rle_decode(const struct rle_frame *rf, uint8_t *frame);
+void rle_clear(const struct rle_frame *rf, uint8_t *frame);
+void rle_draw(const struct rle_frame *rf, uint8_t *frame);
+size_t rle_footprint(const struct rle_frame *rf);
+size_t rle_pack_max(const struct rle_frame *rf);
+size_t rle_pack(const struct rle_frame *rf, uint8_t *buf, size_t size);
+int rle_unpack(struct rle_frame *rf, const uint8_t *buf, size_t size);
+
+#endif /* __RLE_H__ */
@@ -0,0 +1,284 @@
+/*
+ * Real-time scheduling and CPU placement of threads
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "clock.h"
+#include "rtsched.h"
+
+/* Priority used when a real-time policy is given without one */
+#define RTSCHED_DEFAULT_PRIORITY	50
+
+static int parse_cpus(const char *s, uint64_t *cpus)
+{
+	char *end;
+
+	*cpus = 0;
+	do {
+		long first = strtol(s, &end, 10);
+		long last = first;
+
+		if (end == s)
+			return -EINVAL;
+		if (*end == '-') {
+			s = end + 1;
+			last = strtol(s, &end, 10);
+			if (end == s)
+				return -EINVAL;
+		}
+		if (first < 0 || last < first || last > 63)
+			return -EINVAL;
+		for (; first <= last; first++)
+			*cpus |= 1ULL << first;
+		s = end + 1;
+	} while (*end == ',');
+
+	return *end ? -EINVAL : 0;
+}
+
+/*
+ * Parses a scheduling spec of the form [fifo|rr|other][:priority][@cpus],
+ * where cpus is a list of CPU numbers and ranges like 2,4-5. For example
+ * "fifo:80@2" runs at SCHED_FIFO priority 80 on CPU 2, and "@3" only pins.
+ *
+ * Returns 0 on success or a negative error code.
+ */
+int rtsched_parse(const char *spec, struct rtsched *rs)
+{
+	size_t len = strcspn(spec, ":@");
+	const char *p = spec + len;
+
+	memset(rs, 0, sizeof(*rs));
+
+	if (len == 4 && strncmp(spec, "fifo", len) == 0)
+		rs->policy = RTSCHED_FIFO;
+	else if (len == 2 && strncmp(spec, "rr", len) == 0)
+		rs->policy = RTSCHED_RR;
+	else if (len && !(len == 5 && strncmp(spec, "other", len) == 0))
+		return -EINVAL;
+
+	if (*p == ':') {
+		char *end;
+
+		if (rs->policy == RTSCHED_DEFAULT)
+			return -EINVAL;
+		rs->priority = strtol(p + 1, &end, 10);
+		if (end == p + 1 || rs->priority < 1 || rs->priority > 99)
+			return -EINVAL;
+		p = end;
+	} else if (rs->policy != RTSCHED_DEFAULT) {
+		rs->priority = RTSCHED_DEFAULT_PRIORITY;
+	}
+
+	if (*p == '@')
+		return parse_cpus(p + 1, &rs->cpus);
+
+	return *p ? -EINVAL : 0;
+}
+
+/*
+ * Applies rs to thread. Whatever cannot be applied, usually a real-time
+ * policy without CAP_SYS_NICE, is reported on stderr and left at its previous
+ * setting. The priority is lowered to RLIMIT_RTPRIO if that allows the policy.
+ *
+ * Returns 0 on success or a negative error code.
+ */
+int rtsched_apply(pthread_t thread, const struct rtsched *rs,
+		  const char *name)
+{
+	int ret = 0, err, i;
+
+	if (rs->cpus) {
+		cpu_set_t set;
+
+		CPU_ZERO(&set);
+		for (i = 0; i < 64; i++) {
+			if (rs->cpus & (1ULL << i))
+				CPU_SET(i, &set);
+		}
+		err = pthread_setaffinity_np(thread, sizeof(set), &set);
+		if (err) {
+			fprintf(stderr, "%s: could not pin to CPUs 0x%llx: %s\n",
+				name, (unsigned long long)rs->cpus,
+				strerror(err));
+			ret = -err;
+		}
+	}
+
+	if (rs->policy != RTSCHED_DEFAULT) {
+		int policy = rs->policy == RTSCHED_FIFO ? SCHED_FIFO : SCHED_RR;
+		struct sched_param sp = { .sched_priority = rs->priority };
+		struct rlimit rl;
+
+		err = pthread_setschedparam(thread, policy, &sp);
+		if (err == EPERM && getrlimit(RLIMIT_RTPRIO, &rl) == 0 &&
+		    rl.rlim_cur > 0 && rl.rlim_cur < (rlim_t)sp.sched_priority) {
+			sp.sched_priority = rl.rlim_cur;
+			err = pthread_setschedparam(thread, policy, &sp);
+			if (!err)
+				fprintf(stderr, "%s: priority lowered to %d by RLIMIT_RTPRIO\n",
+					name, sp.sched_priority);
+		}
+		if (err) {
+			fprintf(stderr, "%s: could not set %s priority %d: %s, keeping default scheduling\n",
+				name, policy == SCHED_FIFO ? "SCHED_FIFO" :
+				"SCHED_RR", rs->priority, strerror(err));
+			ret = -err;
+		}
+	}
+
+	return ret;
+}
+
+/*
+ * Background load for the jitter test: touches a buffer larger than most L2
+ * caches until stopped.
+ */
+static void *load_thread(void *arg)
+{
+	const int *stop = arg;
+	size_t size = 4 << 20;
+	char *buf = malloc(size);
+	unsigned int n = 0;
+
+	if (!buf)
+		return NULL;
+	while (!__atomic_load_n(stop, __ATOMIC_RELAXED))
+		memset(buf, n++, size);
+	free(buf);
+
+	return NULL;
+}
+
+struct jitter_run {
+	const struct rtsched *rs;
+	uint64_t period;
+	uint64_t *lat;
+	int n;
+	int ret;
+};
+
+/*
+ * Wakes up at every period and records how late the wake-up was.
+ */
+static void *jitter_thread(void *arg)
+{
+	struct jitter_run *run = arg;
+	uint64_t next;
+	int i;
+
+	if (run->rs)
+		run->ret = rtsched_apply(pthread_self(), run->rs, "jitter");
+
+	next = clock_now_ns() + run->period;
+	for (i = 0; i < run->n; i++) {
+		clock_sleep_until_ns(next);
+		run->lat[i] = clock_now_ns() - next;
+		next += run->period;
+	}
+
+	return NULL;
+}
+
+static int jitter_phase(const char *label, const struct rtsched *rs,
+			int num_load, uint64_t period, int n)
+{
+	struct jitter_run run = { rs, period, calloc(n, sizeof(uint64_t)), n, 0 };
+	pthread_t *load = calloc(num_load, sizeof(*load));
+	pthread_t tid;
+	int stop = 0;
+	int i, started = 0;
+
+	if (!run.lat || !load) {
+		free(run.lat);
+		free(load);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < num_load; i++) {
+		if (pthread_create(&load[i], NULL, load_thread, &stop) != 0)
+			break;
+		started++;
+	}
+
+	if (pthread_create(&tid, NULL, jitter_thread, &run) == 0)
+		pthread_join(tid, NULL);
+	else
+		n = 0;
+
+	__atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+	for (i = 0; i < started; i++)
+		pthread_join(load[i], NULL);
+
+	if (n) {
+		clock_sort_ns(run.lat, n);
+		printf("%-8s wake-up latency over %d periods, %d load threads: "
+		       "p50 %.1f  p99 %.1f  p99.9 %.1f  max %.1f us\n",
+		       label, n, started,
+		       clock_percentile_ns(run.lat, n, 500) * 1e-3,
+		       clock_percentile_ns(run.lat, n, 990) * 1e-3,
+		       clock_percentile_ns(run.lat, n, 999) * 1e-3,
+		       run.lat[n - 1] * 1e-3);
+		if (run.ret < 0)
+			printf("%-8s was not fully applied\n", label);
+	}
+
+	free(run.lat);
+	free(load);
+
+	return n ? 0 : -EAGAIN;
+}
+
+/*
+ * Entry point of the "rtjitter" subcommand: measures how late a periodic
+ * thread wakes up while other threads keep all CPUs busy, first with default
+ * scheduling and then with the given scheduling spec.
+ *
+ * Returns 0 on success, or 1 on error.
+ */
+int rtsched_jitter_test(int argc, char **argv)
+{
+	const char *spec = "fifo:50";
+	int num_load = sysconf(_SC_NPROCESSORS_ONLN) * 2;
+	int period_us = 1000, seconds = 5;
+	struct rtsched rs;
+	int i, n;
+
+	for (i = 1; i + 1 < argc; i += 2) {
+		if (strcmp(argv[i], "--rt") == 0)
+			spec = argv[i + 1];
+		else if (strcmp(argv[i], "--load") == 0)
+			num_load = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "--period") == 0)
+			period_us = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "--seconds") == 0)
+			seconds = atoi(argv[i + 1]);
+		else
+			break;
+	}
+	if (i < argc || rtsched_parse(spec, &rs) < 0 || num_load < 0 ||
+	    period_us < 1 || seconds < 1) {
+		fprintf(stderr, "usage: %s [--rt spec] [--load threads] [--period us] [--seconds s]\n"
+			"spec: [fifo|rr|other][:priority][@cpus]\n", argv[0]);
+		return 1;
+	}
+
+	n = seconds * 1000000LL / period_us;
+	if (n < 1)
+		n = 1;
+
+	if (jitter_phase("default", NULL, num_load, period_us * 1000ULL, n) < 0 ||
+	    jitter_phase(spec, &rs, num_load, period_us * 1000ULL, n) < 0)
+		return 1;
+
+	return 0;
+}
@@ -0,0 +1,33 @@
+/*
+ * Real-time scheduling and CPU placement of threads
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ */
+#ifndef __RTSCHED_H__
+#define __RTSCHED_H__
+
+#include <pthread.h>
+#include <stdint.h>
+
+enum rtsched_policy {
+	/* keep the inherited policy, usually SCHED_OTHER */
+	RTSCHED_DEFAULT,
+	RTSCHED_FIFO,
+	RTSCHED_RR,
+};
+
+/*
+ * Scheduling policy and priority of a thread, and the mask of CPUs 0 to 63 it
+ * may run on. A zero mask keeps the inherited affinity.
+ */
+struct rtsched {
+	enum rtsched_policy policy;
+	int priority;
+	uint64_t cpus;
+};
+
+int rtsched_parse(const char *spec, struct rtsched *rs);
+int rtsched_apply(pthread_t thread, const struct rtsched *rs,
+		  const char *name);
+int rtsched_jitter_test(int argc, char **argv);
+
+#endif /* __RTSCHED_H__ */
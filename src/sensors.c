@@ -0,0 +1,179 @@
+/*
+ * Blob detection for multiple sensors on a shared thread pool
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ *
+ * Every sensor has its own detector, and with it its own tracking state. A
+ * round of frames, at most one per sensor, is processed with one work item
+ * per sensor on a thread pool shared by all detectors, which also runs the
+ * strips of the individual frames.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdlib.h>
+
+#include "blobwatch.h"
+#include "sensors.h"
+#include "threadpool.h"
+
+struct sensor {
+	struct blobwatch *bw;
+	int width;
+	int height;
+	struct sensor_stats stats;
+	/* input and output of the current round */
+	uint8_t *frame;
+	int skipped;
+	uint64_t timestamp;
+	struct blobservation *ob;
+};
+
+struct sensor_group {
+	struct threadpool *tp;
+	int num_sensors;
+	struct sensor *sensors;
+	/* sensors with a frame in the current round */
+	struct sensor **work;
+};
+
+/*
+ * Allocates detectors for num_sensors sensors of the same frame size, sharing
+ * num_threads threads: the thread that calls sensor_group_process() and
+ * num_threads - 1 workers. Each frame is split into as many strips as there
+ * are threads per sensor.
+ *
+ * Returns the newly allocated sensor group, or NULL on error.
+ */
+struct sensor_group *sensor_group_new(int num_sensors, int width, int height,
+				      int max_blobs, int num_threads)
+{
+	struct sensor_group *sg;
+	int num_strips;
+	int i;
+
+	if (num_sensors < 1 || num_threads < 1)
+		return NULL;
+
+	sg = calloc(1, sizeof(*sg));
+	if (!sg)
+		return NULL;
+	sg->num_sensors = num_sensors;
+	sg->sensors = calloc(num_sensors, sizeof(*sg->sensors));
+	sg->work = calloc(num_sensors, sizeof(*sg->work));
+	if (!sg->sensors || !sg->work)
+		goto err;
+
+	if (num_threads > 1) {
+		sg->tp = threadpool_new(num_threads - 1);
+		if (!sg->tp)
+			goto err;
+	}
+
+	num_strips = (num_threads + num_sensors - 1) / num_sensors;
+	for (i = 0; i < num_sensors; i++) {
+		struct sensor *s = &sg->sensors[i];
+
+		s->width = width;
+		s->height = height;
+		s->bw = blobwatch_new(width, height, max_blobs);
+		if (!s->bw ||
+		    blobwatch_set_threadpool(s->bw, sg->tp, num_strips) < 0)
+			goto err;
+	}
+
+	return sg;
+
+err:
+	sensor_group_free(sg);
+	return NULL;
+}
+
+void sensor_group_free(struct sensor_group *sg)
+{
+	int i;
+
+	if (!sg)
+		return;
+
+	/* The detectors use the pool, free them first */
+	for (i = 0; sg->sensors && i < sg->num_sensors; i++)
+		blobwatch_free(sg->sensors[i].bw);
+	threadpool_free(sg->tp);
+	free(sg->work);
+	free(sg->sensors);
+	free(sg);
+}
+
+int sensor_group_num_sensors(struct sensor_group *sg)
+{
+	return sg->num_sensors;
+}
+
+/*
+ * Returns the detector of a sensor, to be configured before processing.
+ */
+struct blobwatch *sensor_group_detector(struct sensor_group *sg, int sensor)
+{
+	return sg->sensors[sensor].bw;
+}
+
+static void process_sensor(void *arg)
+{
+	struct sensor *s = *(struct sensor **)arg;
+	struct blobwatch_timings t;
+	uint64_t ns;
+
+	blobwatch_process(s->bw, s->frame, s->width, s->height, s->skipped,
+			  s->timestamp, NULL, &s->ob);
+	blobwatch_get_timings(s->bw, &t);
+
+	ns = t.tracked - t.start;
+	s->stats.frames++;
+	s->stats.busy_ns += ns;
+	if (ns > s->stats.max_ns)
+		s->stats.max_ns = ns;
+	if (s->ob) {
+		s->stats.blobs += s->ob->num_blobs;
+		s->stats.dropped_blobs += s->ob->dropped_blobs;
+	}
+}
+
+/*
+ * Processes one round of frames concurrently. frames[i] is the next frame of
+ * sensor i, or NULL if there is none this round, and skipped[i], if skipped
+ * is not NULL, the number of frames it lost since its last one. timestamps
+ * holds the capture times of the frames, or is NULL if there are none. The
+ * observation of each sensor is stored in obs[i], NULL if the sensor had no
+ * frame or no previous frame.
+ */
+void sensor_group_process(struct sensor_group *sg, uint8_t **frames,
+			  int *skipped, uint64_t *timestamps,
+			  struct blobservation **obs)
+{
+	int i, n = 0;
+
+	for (i = 0; i < sg->num_sensors; i++) {
+		struct sensor *s = &sg->sensors[i];
+
+		s->frame = frames[i];
+		s->skipped = skipped ? skipped[i] : 0;
+		s->timestamp = timestamps ? timestamps[i] : 0;
+		s->ob = NULL;
+		if (s->frame)
+			sg->work[n++] = s;
+	}
+
+	threadpool_run(sg->tp, process_sensor, sg->work, sizeof(*sg->work), n);
+
+	for (i = 0; i < sg->num_sensors; i++)
+		obs[i] = sg->sensors[i].ob;
+}
+
+/*
+ * Returns the statistics of a sensor accumulated since the group was
+ * allocated.
+ */
+void sensor_group_get_stats(struct sensor_group *sg, int sensor,
+			    struct sensor_stats *stats)
+{
+	*stats = sg->sensors[sensor].stats;
+}
@@ -0,0 +1,38 @@
+/*
+ * Blob detection for multiple sensors on a shared thread pool
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ */
+#ifndef __SENSORS_H__
+#define __SENSORS_H__
+
+#include <stdint.h>
+
+struct blobservation;
+struct blobwatch;
+
+/*
+ * Per-sensor counts of processed frames and blobs, and the time spent in
+ * detection and tracking.
+ */
+struct sensor_stats {
+	uint64_t frames;
+	uint64_t blobs;
+	uint64_t dropped_blobs;
+	uint64_t busy_ns;
+	uint64_t max_ns;
+};
+
+struct sensor_group;
+
+struct sensor_group *sensor_group_new(int num_sensors, int width, int height,
+				      int max_blobs, int num_threads);
+void sensor_group_free(struct sensor_group *sg);
+int sensor_group_num_sensors(struct sensor_group *sg);
+struct blobwatch *sensor_group_detector(struct sensor_group *sg, int sensor);
+void sensor_group_process(struct sensor_group *sg, uint8_t **frames,
+			  int *skipped, uint64_t *timestamps,
+			  struct blobservation **obs);
+void sensor_group_get_stats(struct sensor_group *sg, int sensor,
+			    struct sensor_stats *stats);
+
+#endif /* __SENSORS_H__ */
@@ -0,0 +1,310 @@
+/*
+ * Synthetic LED frame generator
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ */
+#define _GNU_SOURCE
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "leds.h"
+#include "synth.h"
+
+#define NOISE_SIZE	65536
+
+struct synth_blob {
+	float x;
+	float y;
+	float vx;
+	float vy;
+	/* position in the last rendered frame */
+	float drawn_x;
+	float drawn_y;
+};
+
+struct synth {
+	struct synth_options opts;
+	struct synth_blob *blobs;
+	uint8_t *noise;
+	uint32_t rng;
+	int frame;
+};
+
+/*
+ * xorshift32, good enough for placing blobs and generating noise.
+ */
+static uint32_t synth_random(struct synth *s)
+{
+	uint32_t x = s->rng;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+
+	return s->rng = x;
+}
+
+static float synth_uniform(struct synth *s, float max)
+{
+	return max * (synth_random(s) >> 8) / (float)(1 << 24);
+}
+
+/*
+ * Places the blobs at the integer centers of grid cells with a gap of at
+ * least two pixels between neighbouring shapes, and keeps them still. Blobs
+ * that do not fit into the frame are left out.
+ */
+static void synth_layout_grid(struct synth *s)
+{
+	struct synth_options *o = &s->opts;
+	int cell = 2 * (int)ceilf(o->radius) + 5;
+	int cols = o->width / cell;
+	int rows = o->height / cell;
+	int i;
+
+	if (o->num_blobs > cols * rows)
+		o->num_blobs = cols * rows;
+
+	for (i = 0; i < o->num_blobs; i++) {
+		struct synth_blob *b = &s->blobs[i];
+
+		b->x = (i % cols) * cell + cell / 2;
+		b->y = (i / cols) * cell + cell / 2;
+		b->vx = 0;
+		b->vy = 0;
+	}
+}
+
+/*
+ * Allocates a frame generator and places the blobs at random positions with
+ * random directions of motion, or on a grid for shapes other than discs.
+ *
+ * Returns the newly allocated generator.
+ */
+struct synth *synth_new(const struct synth_options *opts)
+{
+	struct synth *s = calloc(1, sizeof(*s));
+	int i;
+
+	if (!s)
+		return NULL;
+
+	s->opts = *opts;
+	s->rng = opts->seed ? opts->seed : 1;
+	s->blobs = calloc(opts->num_blobs ? opts->num_blobs : 1,
+			  sizeof(*s->blobs));
+	s->noise = malloc(NOISE_SIZE);
+	if (!s->blobs || !s->noise) {
+		synth_free(s);
+		return NULL;
+	}
+
+	if (opts->shape != SYNTH_SHAPE_DISC) {
+		synth_layout_grid(s);
+	} else {
+		for (i = 0; i < opts->num_blobs; i++) {
+			struct synth_blob *b = &s->blobs[i];
+			float angle = synth_uniform(s, 2 * M_PI);
+
+			b->x = synth_uniform(s, opts->width);
+			b->y = synth_uniform(s, opts->height);
+			b->vx = opts->motion * cosf(angle);
+			b->vy = opts->motion * sinf(angle);
+		}
+	}
+
+	/* Precomputed noise, sampled at a random offset for every line */
+	for (i = 0; i < NOISE_SIZE; i++)
+		s->noise[i] = opts->noise ? synth_random(s) % (opts->noise + 1)
+					  : 0;
+
+	return s;
+}
+
+void synth_free(struct synth *s)
+{
+	if (!s)
+		return;
+
+	free(s->noise);
+	free(s->blobs);
+	free(s);
+}
+
+static void synth_draw_blob(struct synth *s, uint8_t *frame,
+			    struct synth_blob *b, float r)
+{
+	const struct synth_options *o = &s->opts;
+	int x0 = floorf(b->x - r), x1 = ceilf(b->x + r);
+	int y0 = floorf(b->y - r), y1 = ceilf(b->y + r);
+	int x, y;
+
+	if (x0 < 0)
+		x0 = 0;
+	if (y0 < 0)
+		y0 = 0;
+	if (x1 > o->width - 1)
+		x1 = o->width - 1;
+	if (y1 > o->height - 1)
+		y1 = o->height - 1;
+
+	for (y = y0; y <= y1; y++) {
+		uint8_t *line = frame + y * o->width;
+		float dy = (y - b->y) / r;
+
+		for (x = x0; x <= x1; x++) {
+			float dx = (x - b->x) / r;
+			float d2 = dx * dx + dy * dy;
+			int val;
+
+			if (d2 > 1.0f)
+				continue;
+
+			val = o->peak * expf(-o->falloff * d2);
+			if (val > line[x])
+				line[x] = val > 255 ? 255 : val;
+		}
+	}
+}
+
+/*
+ * Draws a U-shape open at the top with strokes half the radius wide, or a
+ * diagonal smear three pixels wide, at full intensity.
+ */
+static void synth_draw_shape(struct synth *s, uint8_t *frame,
+			     struct synth_blob *b, float r,
+			     enum synth_shape shape)
+{
+	const struct synth_options *o = &s->opts;
+	int x0 = floorf(b->x - r - 1), x1 = ceilf(b->x + r + 1);
+	int y0 = floorf(b->y - r), y1 = ceilf(b->y + r);
+	int x, y;
+
+	if (x0 < 0)
+		x0 = 0;
+	if (y0 < 0)
+		y0 = 0;
+	if (x1 > o->width - 1)
+		x1 = o->width - 1;
+	if (y1 > o->height - 1)
+		y1 = o->height - 1;
+
+	for (y = y0; y <= y1; y++) {
+		uint8_t *line = frame + y * o->width;
+		float dy = y - b->y;
+
+		for (x = x0; x <= x1; x++) {
+			float dx = x - b->x;
+			bool on;
+
+			if (shape == SYNTH_SHAPE_SMEAR) {
+				on = fabsf(dx - dy) <= 1.0f;
+			} else {
+				float d2 = dx * dx + dy * dy;
+
+				on = dy < 0 ? fabsf(dx) >= 0.5f * r &&
+					      fabsf(dx) <= r :
+					      d2 >= 0.25f * r * r && d2 <= r * r;
+			}
+
+			if (on)
+				line[x] = o->peak > 255 ? 255 : o->peak;
+		}
+	}
+}
+
+/*
+ * Renders the next frame and moves the blobs, which bounce off the frame
+ * borders.
+ */
+void synth_render(struct synth *s, uint8_t *frame)
+{
+	const struct synth_options *o = &s->opts;
+	int i, y;
+
+	for (y = 0; y < o->height; y++) {
+		uint8_t *line = frame + y * o->width;
+		int offset = synth_random(s) % NOISE_SIZE;
+		int n = o->width;
+
+		while (n > 0) {
+			int len = NOISE_SIZE - offset;
+
+			if (len > n)
+				len = n;
+			memcpy(line, s->noise + offset, len);
+			line += len;
+			n -= len;
+			offset = 0;
+		}
+	}
+
+	for (i = 0; i < o->num_blobs; i++) {
+		struct synth_blob *b = &s->blobs[i];
+		struct synth_blob drawn = *b;
+		enum synth_shape shape;
+		float r = o->radius;
+
+		if (o->leds && !leds_bit(o->leds, i % o->leds->num, s->frame))
+			r *= o->dim;
+
+		if (o->jitter) {
+			drawn.x += synth_uniform(s, 2 * o->jitter) - o->jitter;
+			drawn.y += synth_uniform(s, 2 * o->jitter) - o->jitter;
+		}
+
+		shape = o->shape == SYNTH_SHAPE_MIXED ? i % 3 : o->shape;
+		if (shape == SYNTH_SHAPE_DISC)
+			synth_draw_blob(s, frame, &drawn, r);
+		else
+			synth_draw_shape(s, frame, &drawn, r, shape);
+		b->drawn_x = drawn.x;
+		b->drawn_y = drawn.y;
+
+		b->x += b->vx;
+		b->y += b->vy;
+		if (b->x < 0 || b->x >= o->width) {
+			b->vx = -b->vx;
+			b->x += 2 * b->vx;
+		}
+		if (b->y < 0 || b->y >= o->height) {
+			b->vy = -b->vy;
+			b->y += 2 * b->vy;
+		}
+	}
+
+	s->frame++;
+}
+
+/*
+ * Returns the index of the blob closest to x, y in the last rendered frame,
+ * or -1 if there are no blobs.
+ */
+int synth_nearest_blob(struct synth *s, float x, float y)
+{
+	float best = INFINITY;
+	int i, nearest = -1;
+
+	for (i = 0; i < s->opts.num_blobs; i++) {
+		struct synth_blob *b = &s->blobs[i];
+		float dx = b->drawn_x - x;
+		float dy = b->drawn_y - y;
+
+		if (dx * dx + dy * dy < best) {
+			best = dx * dx + dy * dy;
+			nearest = i;
+		}
+	}
+
+	return nearest;
+}
+
+/*
+ * Returns the number of separate connected shapes in every frame, or -1 if
+ * moving discs may touch each other.
+ */
+int synth_components(struct synth *s)
+{
+	return s->opts.shape == SYNTH_SHAPE_DISC ? -1 : s->opts.num_blobs;
+}
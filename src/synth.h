@@ -0,0 +1,58 @@
+/*
+ * Synthetic LED frame generator
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ */
+#ifndef __SYNTH_H__
+#define __SYNTH_H__
+
+#include <stdint.h>
+
+struct leds;
+
+/*
+ * Blob shapes. Discs move around at random, the other shapes are laid out on
+ * a grid without touching each other, so that every shape is exactly one
+ * connected component. U-shapes open upwards, smears are diagonal strokes
+ * three pixels wide, mixed cycles through discs, U-shapes and smears.
+ */
+enum synth_shape {
+	SYNTH_SHAPE_DISC,
+	SYNTH_SHAPE_U,
+	SYNTH_SHAPE_SMEAR,
+	SYNTH_SHAPE_MIXED,
+};
+
+struct synth_options {
+	int width;
+	int height;
+	int num_blobs;
+	/* blob radius in pixels */
+	float radius;
+	/* intensity falls off as exp(-falloff * (d / radius)^2), 0 is flat */
+	float falloff;
+	/* peak intensity of the blobs */
+	int peak;
+	/* maximum amplitude of the background noise */
+	int noise;
+	/* blob speed in pixels per frame */
+	float motion;
+	/* blobs are drawn up to jitter pixels off their path, like noisy
+	 * measurements */
+	float jitter;
+	/* blink patterns, blob i blinks like LED i modulo the number of LEDs */
+	const struct leds *leds;
+	/* radius of dim frames relative to bright ones */
+	float dim;
+	enum synth_shape shape;
+	unsigned int seed;
+};
+
+struct synth;
+
+struct synth *synth_new(const struct synth_options *opts);
+void synth_free(struct synth *s);
+void synth_render(struct synth *s, uint8_t *frame);
+int synth_nearest_blob(struct synth *s, float x, float y);
+int synth_components(struct synth *s);
+
+#endif /* __SYNTH_H__ */
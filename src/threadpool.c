@@ -0,0 +1,205 @@
+/*
+ * Persistent worker thread pool
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ */
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "threadpool.h"
+
+/*
+ * A batch of count work items, func is called once for each element of the
+ * args array. Batches live on the stack of the threadpool_run() caller.
+ */
+struct tp_batch {
+	threadpool_func func;
+	char *args;
+	size_t arg_size;
+	int count;
+	int next;
+	int done;
+	struct tp_batch *next_batch;
+};
+
+struct threadpool {
+	pthread_mutex_t lock;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+	struct tp_batch *head;
+	struct tp_batch *tail;
+	bool quit;
+	int num_threads;
+	pthread_t threads[];
+};
+
+/*
+ * Removes batch b from the queue once all its items are handed out.
+ * Must be called with the lock held.
+ */
+static void tp_dequeue(struct threadpool *tp, struct tp_batch *b)
+{
+	struct tp_batch **pb = &tp->head;
+	struct tp_batch *prev = NULL;
+
+	while (*pb && *pb != b) {
+		prev = *pb;
+		pb = &(*pb)->next_batch;
+	}
+	if (!*pb)
+		return;
+
+	*pb = b->next_batch;
+	if (tp->tail == b)
+		tp->tail = prev;
+}
+
+/*
+ * Takes the next work item from batch b, runs it, and marks it done.
+ * Must be called with the lock held, returns with the lock held.
+ */
+static void tp_run_item(struct threadpool *tp, struct tp_batch *b)
+{
+	int i = b->next++;
+
+	if (b->next == b->count)
+		tp_dequeue(tp, b);
+
+	pthread_mutex_unlock(&tp->lock);
+	b->func(b->args + i * b->arg_size);
+	pthread_mutex_lock(&tp->lock);
+
+	if (++b->done == b->count)
+		pthread_cond_broadcast(&tp->done_cond);
+}
+
+static void *tp_worker(void *arg)
+{
+	struct threadpool *tp = arg;
+
+	pthread_mutex_lock(&tp->lock);
+	for (;;) {
+		while (!tp->quit && !tp->head)
+			pthread_cond_wait(&tp->work_cond, &tp->lock);
+		if (tp->quit)
+			break;
+		tp_run_item(tp, tp->head);
+	}
+	pthread_mutex_unlock(&tp->lock);
+
+	return NULL;
+}
+
+/*
+ * Allocates a thread pool and starts num_threads worker threads.
+ *
+ * Returns the newly allocated thread pool.
+ */
+struct threadpool *threadpool_new(int num_threads)
+{
+	struct threadpool *tp;
+	int i;
+
+	if (num_threads < 0)
+		return NULL;
+
+	tp = calloc(1, sizeof(*tp) + num_threads * sizeof(pthread_t));
+	if (!tp)
+		return NULL;
+
+	pthread_mutex_init(&tp->lock, NULL);
+	pthread_cond_init(&tp->work_cond, NULL);
+	pthread_cond_init(&tp->done_cond, NULL);
+
+	for (i = 0; i < num_threads; i++) {
+		if (pthread_create(&tp->threads[i], NULL, tp_worker, tp) != 0)
+			break;
+	}
+	tp->num_threads = i;
+
+	return tp;
+}
+
+/*
+ * Stops all worker threads and frees the thread pool.
+ */
+void threadpool_free(struct threadpool *tp)
+{
+	int i;
+
+	if (!tp)
+		return;
+
+	pthread_mutex_lock(&tp->lock);
+	tp->quit = true;
+	pthread_cond_broadcast(&tp->work_cond);
+	pthread_mutex_unlock(&tp->lock);
+
+	for (i = 0; i < tp->num_threads; i++)
+		pthread_join(tp->threads[i], NULL);
+
+	pthread_cond_destroy(&tp->done_cond);
+	pthread_cond_destroy(&tp->work_cond);
+	pthread_mutex_destroy(&tp->lock);
+	free(tp);
+}
+
+/*
+ * Returns the number of worker threads.
+ */
+int threadpool_num_threads(struct threadpool *tp)
+{
+	return tp ? tp->num_threads : 0;
+}
+
+/*
+ * Returns worker thread i, to set its scheduling from outside.
+ */
+pthread_t threadpool_thread(struct threadpool *tp, int i)
+{
+	return tp->threads[i];
+}
+
+/*
+ * Calls func for each of the count elements of the args array, which are
+ * arg_size bytes apart, and waits until all calls have returned. The calling
+ * thread takes part in the work, so this also makes progress if all workers
+ * are busy, or if it is called from a worker thread. A NULL pool runs all
+ * items on the calling thread.
+ */
+void threadpool_run(struct threadpool *tp, threadpool_func func, void *args,
+		    size_t arg_size, int count)
+{
+	struct tp_batch b = {
+		.func = func,
+		.args = args,
+		.arg_size = arg_size,
+		.count = count,
+	};
+	int i;
+
+	if (count <= 0)
+		return;
+
+	if (!tp || tp->num_threads == 0 || count == 1) {
+		for (i = 0; i < count; i++)
+			func(b.args + i * arg_size);
+		return;
+	}
+
+	pthread_mutex_lock(&tp->lock);
+	if (tp->tail)
+		tp->tail->next_batch = &b;
+	else
+		tp->head = &b;
+	tp->tail = &b;
+	pthread_cond_broadcast(&tp->work_cond);
+
+	while (b.next < b.count)
+		tp_run_item(tp, &b);
+	while (b.done < b.count)
+		pthread_cond_wait(&tp->done_cond, &tp->lock);
+	pthread_mutex_unlock(&tp->lock);
+}
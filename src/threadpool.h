@@ -0,0 +1,22 @@
+/*
+ * Persistent worker thread pool
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ */
+#ifndef __THREADPOOL_H__
+#define __THREADPOOL_H__
+
+#include <pthread.h>
+#include <stddef.h>
+
+struct threadpool;
+
+typedef void (*threadpool_func)(void *arg);
+
+struct threadpool *threadpool_new(int num_threads);
+void threadpool_free(struct threadpool *tp);
+int threadpool_num_threads(struct threadpool *tp);
+pthread_t threadpool_thread(struct threadpool *tp, int i);
+void threadpool_run(struct threadpool *tp, threadpool_func func, void *args,
+		    size_t arg_size, int count);
+
+#endif /* __THREADPOOL_H__ */
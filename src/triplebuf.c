@@ -0,0 +1,86 @@
+/*
+ * Lock-free triple buffer
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ */
+#include <stddef.h>
+
+#include "triplebuf.h"
+
+/* Set in middle if it holds a buffer that the consumer has not seen yet */
+#define TRIPLEBUF_FRESH		4
+#define TRIPLEBUF_INDEX		3
+
+/*
+ * Initializes the triple buffer with three caller-allocated buffers. b0 is
+ * handed to the producer first.
+ */
+void triplebuf_init(struct triplebuf *tb, void *b0, void *b1, void *b2)
+{
+	tb->buffers[0] = b0;
+	tb->buffers[1] = b1;
+	tb->buffers[2] = b2;
+	tb->back = 0;
+	tb->middle = 1;
+	tb->front = 2;
+	tb->produced = 0;
+	tb->consumed = 0;
+	tb->overwritten = 0;
+}
+
+/*
+ * Returns the buffer the producer may fill. Only called by the producer.
+ */
+void *triplebuf_back(struct triplebuf *tb)
+{
+	return tb->buffers[tb->back];
+}
+
+/*
+ * Publishes the filled back buffer and takes over the previous middle buffer
+ * as new back buffer. Only called by the producer, never blocks.
+ */
+void triplebuf_publish(struct triplebuf *tb)
+{
+	int old = __atomic_exchange_n(&tb->middle, tb->back | TRIPLEBUF_FRESH,
+				      __ATOMIC_ACQ_REL);
+
+	tb->back = old & TRIPLEBUF_INDEX;
+
+	__atomic_store_n(&tb->produced, tb->produced + 1, __ATOMIC_RELAXED);
+	if (old & TRIPLEBUF_FRESH)
+		__atomic_store_n(&tb->overwritten, tb->overwritten + 1,
+				 __ATOMIC_RELAXED);
+}
+
+/*
+ * Takes the most recently published buffer, if there is one the consumer has
+ * not seen yet. Only called by the consumer, never blocks.
+ *
+ * Returns the newest complete buffer, or NULL if nothing new was published.
+ * The returned buffer stays valid until the next call.
+ */
+void *triplebuf_consume(struct triplebuf *tb)
+{
+	int old;
+
+	if (!(__atomic_load_n(&tb->middle, __ATOMIC_ACQUIRE) & TRIPLEBUF_FRESH))
+		return NULL;
+
+	old = __atomic_exchange_n(&tb->middle, tb->front, __ATOMIC_ACQ_REL);
+	tb->front = old & TRIPLEBUF_INDEX;
+
+	__atomic_store_n(&tb->consumed, tb->consumed + 1, __ATOMIC_RELAXED);
+
+	return tb->buffers[tb->front];
+}
+
+/*
+ * Returns the number of buffers produced, consumed, and overwritten before
+ * they could be consumed. May be called from any thread.
+ */
+void triplebuf_get_stats(struct triplebuf *tb, struct triplebuf_stats *st)
+{
+	st->produced = __atomic_load_n(&tb->produced, __ATOMIC_RELAXED);
+	st->consumed = __atomic_load_n(&tb->consumed, __ATOMIC_RELAXED);
+	st->overwritten = __atomic_load_n(&tb->overwritten, __ATOMIC_RELAXED);
+}
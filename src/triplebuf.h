@@ -0,0 +1,39 @@
+/*
+ * Lock-free triple buffer
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ */
+#ifndef __TRIPLEBUF_H__
+#define __TRIPLEBUF_H__
+
+#include <stdint.h>
+
+/*
+ * Hands complete buffers from a single producer to a single consumer without
+ * blocking either side. The producer always owns the back buffer and the
+ * consumer the front buffer, the middle buffer is exchanged atomically with
+ * either of them. A newer buffer published before the consumer picked up the
+ * previous one replaces it, which is counted as overwritten.
+ */
+struct triplebuf {
+	void *buffers[3];
+	int back;
+	int front;
+	int middle;
+	uint64_t produced;
+	uint64_t consumed;
+	uint64_t overwritten;
+};
+
+struct triplebuf_stats {
+	uint64_t produced;
+	uint64_t consumed;
+	uint64_t overwritten;
+};
+
+void triplebuf_init(struct triplebuf *tb, void *b0, void *b1, void *b2);
+void *triplebuf_back(struct triplebuf *tb);
+void triplebuf_publish(struct triplebuf *tb);
+void *triplebuf_consume(struct triplebuf *tb);
+void triplebuf_get_stats(struct triplebuf *tb, struct triplebuf_stats *st);
+
+#endif /* __TRIPLEBUF_H__ */
@@ -0,0 +1,394 @@
+/*
+ * Queue of UVC class-specific control transfers
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ *
+ * The camera bridge is configured through SET_CUR/GET_CUR pairs on extension
+ * unit selectors. Issued one at a time with libusb_control_transfer(), every
+ * transfer costs a full round trip through the kernel and the host controller
+ * schedule. Transfers queued here are submitted asynchronously as one batch
+ * and only waited for in usbctl_flush(). The default control pipe executes
+ * them in order, so a GET_CUR still sees the result of the SET_CUR queued
+ * before it. The data read back is checked by completion callbacks after the
+ * whole batch is done.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "clock.h"
+#include "usbctl.h"
+
+#define SET_CUR		0x01
+#define GET_CUR		0x81
+#define CONTROL_IFACE	0
+#define TIMEOUT		1000
+
+/* Transfers queued before an implicit flush */
+#define USBCTL_QUEUE	64
+
+#ifndef LIBUSB_CALL
+#define LIBUSB_CALL
+#endif
+
+struct usbctl_slot {
+	struct usbctl *q;
+	struct libusb_transfer *transfer;
+	int index;
+};
+
+struct usbctl {
+	struct usbctl_backend backend;
+	libusb_device_handle *devh;
+	bool pipelined;
+	struct usbctl_xfer queue[USBCTL_QUEUE];
+	int count;
+	/* first error of an implicit flush, returned by the next one */
+	int error;
+	struct usbctl_stats stats;
+
+	/* completion of asynchronous transfers, on the libusb event thread */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int in_flight;
+	struct usbctl_slot slots[USBCTL_QUEUE];
+};
+
+static int transfer_error(int status)
+{
+	switch (status) {
+	case LIBUSB_TRANSFER_STALL:
+		return LIBUSB_ERROR_PIPE;
+	case LIBUSB_TRANSFER_TIMED_OUT:
+		return LIBUSB_ERROR_TIMEOUT;
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		return LIBUSB_ERROR_NO_DEVICE;
+	default:
+		return LIBUSB_ERROR_IO;
+	}
+}
+
+static void LIBUSB_CALL transfer_done(struct libusb_transfer *t)
+{
+	struct usbctl_slot *s = t->user_data;
+	struct usbctl *q = s->q;
+
+	pthread_mutex_lock(&q->lock);
+	if (t->status == LIBUSB_TRANSFER_COMPLETED)
+		q->queue[s->index].status = t->actual_length;
+	else
+		q->queue[s->index].status = transfer_error(t->status);
+	q->in_flight--;
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+}
+
+/*
+ * Submits all transfers at once and waits for them to complete. This relies
+ * on another thread handling libusb events, as libuvc does for an open device.
+ */
+static int libusb_run_async(struct usbctl *q, struct usbctl_xfer *x, int n)
+{
+	int first = x - q->queue;
+	int i, ret = 0;
+
+	pthread_mutex_lock(&q->lock);
+	for (i = 0; i < n; i++) {
+		struct usbctl_slot *s = &q->slots[first + i];
+
+		if (!s->transfer) {
+			s->transfer = libusb_alloc_transfer(0);
+			if (!s->transfer) {
+				x[i].status = LIBUSB_ERROR_NO_MEM;
+				break;
+			}
+		}
+		s->q = q;
+		s->index = first + i;
+
+		libusb_fill_control_setup(x[i].data, x[i].request_type,
+					  x[i].request, x[i].value, x[i].index,
+					  x[i].length);
+		libusb_fill_control_transfer(s->transfer, q->devh, x[i].data,
+					     transfer_done, s, TIMEOUT);
+		ret = libusb_submit_transfer(s->transfer);
+		if (ret < 0) {
+			x[i].status = ret;
+			break;
+		}
+		q->in_flight++;
+	}
+	while (q->in_flight)
+		pthread_cond_wait(&q->cond, &q->lock);
+	pthread_mutex_unlock(&q->lock);
+
+	return i < n ? i + 1 : n;
+}
+
+static int libusb_run_sync(struct usbctl *q, struct usbctl_xfer *x, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		x[i].status = libusb_control_transfer(q->devh,
+				x[i].request_type, x[i].request, x[i].value,
+				x[i].index, x[i].data + LIBUSB_CONTROL_SETUP_SIZE,
+				x[i].length, TIMEOUT);
+		if (x[i].status < 0)
+			return i + 1;
+	}
+
+	return n;
+}
+
+static int libusb_run(void *priv, struct usbctl_xfer *x, int n, bool pipelined)
+{
+	struct usbctl *q = priv;
+
+	if (pipelined)
+		return libusb_run_async(q, x, n);
+	return libusb_run_sync(q, x, n);
+}
+
+/*
+ * Allocates a transfer queue with a custom backend, such as a mock device.
+ *
+ * Returns the newly allocated queue, pipelined by default.
+ */
+struct usbctl *usbctl_new_backend(const struct usbctl_backend *backend)
+{
+	struct usbctl *q;
+
+	q = calloc(1, sizeof(*q));
+	if (!q)
+		return NULL;
+
+	q->backend = *backend;
+	q->pipelined = true;
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->cond, NULL);
+
+	return q;
+}
+
+/*
+ * Allocates a transfer queue for a libusb device handle.
+ *
+ * Returns the newly allocated queue, pipelined by default.
+ */
+struct usbctl *usbctl_new(libusb_device_handle *devh)
+{
+	struct usbctl_backend backend = { .run = libusb_run };
+	struct usbctl *q;
+
+	q = usbctl_new_backend(&backend);
+	if (!q)
+		return NULL;
+
+	q->devh = devh;
+	q->backend.priv = q;
+
+	return q;
+}
+
+void usbctl_free(struct usbctl *q)
+{
+	if (!q)
+		return;
+
+	for (int i = 0; i < USBCTL_QUEUE; i++)
+		if (q->slots[i].transfer)
+			libusb_free_transfer(q->slots[i].transfer);
+	pthread_mutex_destroy(&q->lock);
+	pthread_cond_destroy(&q->cond);
+	free(q);
+}
+
+/*
+ * Selects between one asynchronous batch per flush and one synchronous
+ * libusb_control_transfer() per queued transfer, to compare the two.
+ */
+void usbctl_set_pipelined(struct usbctl *q, bool pipelined)
+{
+	q->pipelined = pipelined;
+}
+
+/*
+ * Returns the next free queue entry, flushing a full queue first.
+ */
+static struct usbctl_xfer *queue_add(struct usbctl *q)
+{
+	struct usbctl_xfer *x;
+
+	if (q->count == USBCTL_QUEUE) {
+		int ret = usbctl_flush(q);
+
+		if (ret < 0 && !q->error)
+			q->error = ret;
+	}
+
+	x = &q->queue[q->count++];
+	x->request = 0;
+	x->length = 0;
+	x->delay_us = 0;
+	x->status = 0;
+	x->complete = NULL;
+
+	return x;
+}
+
+/*
+ * Queues a SET_CUR of len bytes on an extension unit selector. The data is
+ * copied. An error here is also returned by the next flush, so that a
+ * sequence of transfers only needs to check the flush.
+ */
+int usbctl_set_cur(struct usbctl *q, uint8_t entity, uint8_t selector,
+		   const uint8_t *data, uint16_t len)
+{
+	struct usbctl_xfer *x;
+
+	if (len > USBCTL_MAX_DATA) {
+		if (!q->error)
+			q->error = -EINVAL;
+		return -EINVAL;
+	}
+
+	x = queue_add(q);
+	x->request_type = LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE;
+	x->request = SET_CUR;
+	x->value = selector << 8;
+	x->index = entity << 8 | CONTROL_IFACE;
+	x->length = len;
+	memcpy(x->data + LIBUSB_CONTROL_SETUP_SIZE, data, len);
+
+	return 0;
+}
+
+/*
+ * Queues a GET_CUR of len bytes on an extension unit selector. complete, if
+ * set, is called with the data read once the queue is flushed.
+ */
+int usbctl_get_cur(struct usbctl *q, uint8_t entity, uint8_t selector,
+		   uint16_t len, usbctl_complete_fn complete, void *priv,
+		   uint32_t arg)
+{
+	struct usbctl_xfer *x;
+
+	if (len > USBCTL_MAX_DATA) {
+		if (!q->error)
+			q->error = -EINVAL;
+		return -EINVAL;
+	}
+
+	x = queue_add(q);
+	x->request_type = 0x80 | LIBUSB_REQUEST_TYPE_CLASS |
+			  LIBUSB_RECIPIENT_INTERFACE;
+	x->request = GET_CUR;
+	x->value = selector << 8;
+	x->index = entity << 8 | CONTROL_IFACE;
+	x->length = len;
+	memset(x->data + LIBUSB_CONTROL_SETUP_SIZE, 0, len);
+	x->complete = complete;
+	x->priv = priv;
+	x->arg = arg;
+
+	return 0;
+}
+
+/*
+ * Queues a pause: the transfers before it complete, then us microseconds pass
+ * before the ones after it are submitted.
+ */
+int usbctl_delay(struct usbctl *q, unsigned int us)
+{
+	struct usbctl_xfer *x = queue_add(q);
+
+	x->delay_us = us;
+
+	return 0;
+}
+
+/*
+ * Executes all queued transfers and pauses, then runs the completion
+ * callbacks in queue order, up to a failed transfer. Nothing after the pause
+ * that follows a failed transfer is executed. Synchronously, neither is the
+ * rest of its batch, but pipelined, the whole batch between two pauses is
+ * already submitted and later transfers may still reach the device. A write
+ * that must only happen if earlier ones succeeded needs a flush before it.
+ *
+ * Returns 0, the first libusb error or the first negative value returned by
+ * a completion callback.
+ */
+int usbctl_flush(struct usbctl *q)
+{
+	uint64_t start = clock_now_ns();
+	int ret = q->error;
+	int done = 0;
+
+	q->error = 0;
+
+	while (done < q->count) {
+		struct usbctl_xfer *x = &q->queue[done];
+		int n, ran, i;
+
+		if (!x->request) {
+			usleep(x->delay_us);
+			done++;
+			continue;
+		}
+
+		for (n = 1; done + n < q->count; n++)
+			if (!x[n].request)
+				break;
+
+		ran = q->backend.run(q->backend.priv, x, n, q->pipelined);
+		q->stats.round_trips += q->pipelined ? 1 : ran;
+
+		for (i = 0; i < ran; i++) {
+			q->stats.transfers++;
+			if (x[i].status < 0)
+				break;
+		}
+		if (i < ran) {
+			fprintf(stderr, "failed to transfer %s %u %u: %d\n",
+				x[i].request == SET_CUR ? "SET CUR" : "GET CUR",
+				x[i].index >> 8, x[i].value >> 8, x[i].status);
+			q->stats.failed++;
+			if (!ret)
+				ret = x[i].status;
+			/* Completion callbacks up to the failed transfer */
+			q->count = done + i;
+			break;
+		}
+		done += n;
+	}
+
+	for (int i = 0; i < q->count; i++) {
+		struct usbctl_xfer *x = &q->queue[i];
+		int r;
+
+		if (!x->complete)
+			continue;
+
+		r = x->complete(x->data + LIBUSB_CONTROL_SETUP_SIZE, x->status,
+				x->priv, x->arg);
+		if (r < 0) {
+			q->stats.mismatches++;
+			if (!ret)
+				ret = r;
+		}
+	}
+
+	q->count = 0;
+	q->stats.busy_ns += clock_now_ns() - start;
+
+	return ret;
+}
+
+void usbctl_get_stats(struct usbctl *q, struct usbctl_stats *st)
+{
+	*st = q->stats;
+}
@@ -0,0 +1,78 @@
+/*
+ * Queue of UVC class-specific control transfers
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ */
+#ifndef __USBCTL_H__
+#define __USBCTL_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <libusb.h>
+
+/* Largest SET_CUR/GET_CUR payload, the radio data selector uses 127 bytes */
+#define USBCTL_MAX_DATA		128
+
+/*
+ * Called in queue order once a transfer has completed, with the data read by
+ * a GET_CUR. Returns a negative value if the data is not what was expected,
+ * which is then returned by usbctl_flush().
+ */
+typedef int (*usbctl_complete_fn)(const uint8_t *data, int len, void *priv,
+				  uint32_t arg);
+
+/*
+ * A queued control transfer, or a pause of delay_us if request is 0. data
+ * leaves room for the setup packet of an asynchronous transfer.
+ */
+struct usbctl_xfer {
+	uint8_t request_type;
+	uint8_t request;
+	uint16_t value;
+	uint16_t index;
+	uint16_t length;
+	unsigned int delay_us;
+	uint8_t data[LIBUSB_CONTROL_SETUP_SIZE + USBCTL_MAX_DATA];
+	/* transferred length or negative libusb error, set by the backend */
+	int status;
+	usbctl_complete_fn complete;
+	void *priv;
+	uint32_t arg;
+};
+
+/*
+ * Executes n transfers in order, storing the result of each in status. The
+ * payload is at data + LIBUSB_CONTROL_SETUP_SIZE. With pipelined set, all n
+ * may be in flight at once, otherwise each is finished before the next.
+ * Returns the number of transfers executed, up to the first failed one.
+ */
+struct usbctl_backend {
+	int (*run)(void *priv, struct usbctl_xfer *x, int n, bool pipelined);
+	void *priv;
+};
+
+struct usbctl_stats {
+	uint64_t transfers;
+	uint64_t failed;
+	uint64_t mismatches;
+	/* times the caller waited for the device */
+	uint64_t round_trips;
+	uint64_t busy_ns;
+};
+
+struct usbctl;
+
+struct usbctl *usbctl_new(libusb_device_handle *devh);
+struct usbctl *usbctl_new_backend(const struct usbctl_backend *backend);
+void usbctl_free(struct usbctl *q);
+void usbctl_set_pipelined(struct usbctl *q, bool pipelined);
+int usbctl_set_cur(struct usbctl *q, uint8_t entity, uint8_t selector,
+		   const uint8_t *data, uint16_t len);
+int usbctl_get_cur(struct usbctl *q, uint8_t entity, uint8_t selector,
+		   uint16_t len, usbctl_complete_fn complete, void *priv,
+		   uint32_t arg);
+int usbctl_delay(struct usbctl *q, unsigned int us);
+int usbctl_flush(struct usbctl *q);
+void usbctl_get_stats(struct usbctl *q, struct usbctl_stats *st);
+
+#endif /* __USBCTL_H__ */